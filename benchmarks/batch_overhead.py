@@ -0,0 +1,36 @@
+# Python time spent per frame reading a FrameStream one frame at a time,
+# against one captureBatch call for the same number of frames. The camera
+# time per frame (1/framerate) is printed beside them for scale.
+#
+#   python benchmarks/batch_overhead.py [frames] [width] [height] [framerate]
+import struct
+import sys
+import time
+import picam
+
+frames = int(sys.argv[1]) if len(sys.argv) > 1 else 300
+width = int(sys.argv[2]) if len(sys.argv) > 2 else 320
+height = int(sys.argv[3]) if len(sys.argv) > 3 else 240
+framerate = int(sys.argv[4]) if len(sys.argv) > 4 else 60
+format = picam.PICAM_FORMAT_LUMA
+
+# CPU time of the whole process, so both include the callbacks copying the
+# frames and the difference is what Python costs per frame
+stream = picam.FrameStream(width, height, framerate, format)
+cpu = time.clock()
+count = 0
+for frame in stream:
+    count += 1
+    if count == frames:
+        break
+cpu = time.clock() - cpu
+stream.stop()
+print "stream %4d frames  %8.1f us CPU/frame" % (count, cpu * 1000000 / count)
+
+cpu = time.clock()
+batch = picam.captureBatch(frames, format, width, height, framerate)
+records = [struct.unpack_from("qII", batch.metadata, i * 16) for i in range(len(batch))]
+cpu = time.clock() - cpu
+print "batch  %4d frames  %8.1f us CPU/frame  %d bytes in one buffer  %d dropped" % (
+    len(batch), cpu * 1000000 / len(batch), len(memoryview(batch)), batch.dropped)
+print "camera frame period %8.1f us" % (1000000.0 / framerate)
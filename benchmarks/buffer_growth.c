@@ -0,0 +1,95 @@
+/*
+ * Feeds synthetic encoder chunk sequences through the old grow-by-copy
+ * strategy and through PICAM_BUFFER, no camera needed.
+ *
+ *   gcc -O2 -Isrc benchmarks/buffer_growth.c src/picambuffer.c -o buffer_growth
+ *   ./buffer_growth
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#include "picambuffer.h"
+
+static double now_ms(void)
+{
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+/// What encoder_buffer_callback used to do: a new allocation and a full copy per chunk
+static long grow_by_copy(const uint8_t *chunk, long chunk_size, long total)
+{
+   uint8_t *filedata = NULL;
+   long stored = 0;
+
+   while (stored < total) {
+      long length = total - stored < chunk_size ? total - stored : chunk_size;
+      uint8_t *new_buffer = malloc(stored + length);
+      if (stored)
+         memcpy(new_buffer, filedata, stored);
+      memcpy(new_buffer + stored, chunk, length);
+      free(filedata);
+      filedata = new_buffer;
+      stored += length;
+   }
+   free(filedata);
+   return stored;
+}
+
+static long grow_amortized(const uint8_t *chunk, long chunk_size, long total, long reserve)
+{
+   PICAM_BUFFER buffer;
+   uint8_t *data;
+   long stored;
+
+   picam_buffer_init(&buffer);
+   picam_buffer_reserve(&buffer, reserve);
+   while (buffer.length < total) {
+      long length = total - buffer.length < chunk_size ? total - buffer.length : chunk_size;
+      picam_buffer_append(&buffer, chunk, length);
+   }
+   data = picam_buffer_detach(&buffer, &stored);
+   free(data);
+   return stored;
+}
+
+static void run(const char *label, long chunk_size, long total, long reserve, int repeats)
+{
+   uint8_t *chunk = malloc(chunk_size);
+   double start, copy_ms, amortized_ms;
+   int i;
+
+   memset(chunk, 0x5a, chunk_size);
+
+   start = now_ms();
+   for (i = 0; i < repeats; i++)
+      grow_by_copy(chunk, chunk_size, total);
+   copy_ms = (now_ms() - start) / repeats;
+
+   start = now_ms();
+   for (i = 0; i < repeats; i++)
+      grow_amortized(chunk, chunk_size, total, reserve);
+   amortized_ms = (now_ms() - start) / repeats;
+
+   printf("%-34s %9ld bytes in %6ld byte chunks: copy %8.2f ms  amortized %6.2f ms\n",
+          label, total, chunk_size, copy_ms, amortized_ms);
+   free(chunk);
+}
+
+int main(void)
+{
+   long bmp_full = 54 + (long)2592 * 3 * 1944;
+   long bmp_vga = 54 + (long)640 * 3 * 480;
+   long jpeg_full = 2592L * 1944 / 2;
+
+   run("BMP 2592x1944, reserved", 81920, bmp_full, bmp_full, 3);
+   run("BMP 2592x1944, unreserved", 81920, bmp_full, 0, 3);
+   run("BMP 640x480, reserved", 81920, bmp_vga, bmp_vga, 20);
+   run("JPEG 2592x1944 (~1.2MB), reserved", 81920, jpeg_full / 2, jpeg_full, 10);
+   run("JPEG 2592x1944, small chunks", 4096, jpeg_full / 2, jpeg_full, 3);
+   return 0;
+}
@@ -0,0 +1,31 @@
+# Frames per second for N stills taken with the one shot function, a warm
+# CameraSession and burst mode.
+#
+#   python benchmarks/burst_fps.py [count] [width] [height]
+import sys
+import time
+import picam
+
+def measure(label, capture, count):
+    start = time.time()
+    frames = capture()
+    elapsed = time.time() - start
+    print "%-8s %3d frames in %6.2f s  %6.2f fps" % (label, len(frames), elapsed, len(frames) / elapsed)
+    return frames
+
+count = int(sys.argv[1]) if len(sys.argv) > 1 else 10
+width = int(sys.argv[2]) if len(sys.argv) > 2 else 1280
+height = int(sys.argv[3]) if len(sys.argv) > 3 else 960
+
+measure("oneshot", lambda: [picam._picam.takePhotoWithDetails(width, height, 85) for i in range(count)], count)
+
+session = picam._picam.CameraSession()
+session.takePhotoWithDetails(width, height, 85)   # builds the graph
+measure("session", lambda: [session.takePhotoWithDetails(width, height, 85) for i in range(count)], count)
+frames = measure("burst", lambda: session.takeBurst(count, width, height, 85), count)
+session.close()
+
+stamps = [t for (f, t) in frames]
+if len(stamps) > 1:
+    gaps = [(b - a) / 1000.0 for (a, b) in zip(stamps, stamps[1:])]
+    print "burst frame spacing: mean %.1f ms  max %.1f ms" % (sum(gaps) / len(gaps), max(gaps))
@@ -0,0 +1,121 @@
+/*
+ * Changes one camera setting at a time on a live camera component, once by
+ * sending every setting with raspicamcontrol_set_all_parameters and once by
+ * sending only the ones raspicamcontrol_changed_parameters finds changed, as
+ * a running CameraSession or Recorder now does. Reports the time per update
+ * and the number of parameter sets that went to the camera's ports, counted
+ * by wrapping the MMAL calls RaspiCamControl makes.
+ *
+ *   gcc -O2 -Isrc -I/opt/vc/include benchmarks/camera_settings.c src/RaspiCamControl.c \
+ *       -L/opt/vc/lib -lmmal_core -lmmal_util -lmmal_vc_client -lvcos -lbcm_host \
+ *       -Wl,--wrap=mmal_port_parameter_set,--wrap=mmal_port_parameter_set_boolean \
+ *       -Wl,--wrap=mmal_port_parameter_set_uint32,--wrap=mmal_port_parameter_set_int32 \
+ *       -Wl,--wrap=mmal_port_parameter_set_rational -o camera_settings
+ *   ./camera_settings [updates]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "bcm_host.h"
+#include "interface/mmal/mmal.h"
+#include "interface/mmal/util/mmal_util_params.h"
+#include "interface/mmal/util/mmal_default_components.h"
+#include "RaspiCamControl.h"
+
+static unsigned long round_trips;
+
+MMAL_STATUS_T __real_mmal_port_parameter_set(MMAL_PORT_T *port, const MMAL_PARAMETER_HEADER_T *param);
+MMAL_STATUS_T __real_mmal_port_parameter_set_boolean(MMAL_PORT_T *port, uint32_t id, MMAL_BOOL_T value);
+MMAL_STATUS_T __real_mmal_port_parameter_set_uint32(MMAL_PORT_T *port, uint32_t id, uint32_t value);
+MMAL_STATUS_T __real_mmal_port_parameter_set_int32(MMAL_PORT_T *port, uint32_t id, int32_t value);
+MMAL_STATUS_T __real_mmal_port_parameter_set_rational(MMAL_PORT_T *port, uint32_t id, MMAL_RATIONAL_T value);
+
+MMAL_STATUS_T __wrap_mmal_port_parameter_set(MMAL_PORT_T *port, const MMAL_PARAMETER_HEADER_T *param)
+{
+   round_trips++;
+   return __real_mmal_port_parameter_set(port, param);
+}
+
+MMAL_STATUS_T __wrap_mmal_port_parameter_set_boolean(MMAL_PORT_T *port, uint32_t id, MMAL_BOOL_T value)
+{
+   round_trips++;
+   return __real_mmal_port_parameter_set_boolean(port, id, value);
+}
+
+MMAL_STATUS_T __wrap_mmal_port_parameter_set_uint32(MMAL_PORT_T *port, uint32_t id, uint32_t value)
+{
+   round_trips++;
+   return __real_mmal_port_parameter_set_uint32(port, id, value);
+}
+
+MMAL_STATUS_T __wrap_mmal_port_parameter_set_int32(MMAL_PORT_T *port, uint32_t id, int32_t value)
+{
+   round_trips++;
+   return __real_mmal_port_parameter_set_int32(port, id, value);
+}
+
+MMAL_STATUS_T __wrap_mmal_port_parameter_set_rational(MMAL_PORT_T *port, uint32_t id, MMAL_RATIONAL_T value)
+{
+   round_trips++;
+   return __real_mmal_port_parameter_set_rational(port, id, value);
+}
+
+static double now_us(void)
+{
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+/// The setting changed by each update, as someone adjusting a live picture would
+static void change(RASPICAM_CAMERA_PARAMETERS *params, int i)
+{
+   switch (i % 4) {
+   case 0: params->brightness = 40 + i % 20; break;
+   case 1: params->contrast = i % 20; break;
+   case 2: params->exposureCompensation = i % 5; break;
+   case 3: params->awbMode = i % 8 == 3 ? MMAL_PARAM_AWBMODE_SUNLIGHT : MMAL_PARAM_AWBMODE_AUTO; break;
+   }
+}
+
+static void run(MMAL_COMPONENT_T *camera, int updates, int incremental)
+{
+   RASPICAM_CAMERA_PARAMETERS applied, wanted;
+   double start, total;
+   int i;
+
+   raspicamcontrol_set_defaults(&applied);
+   raspicamcontrol_set_all_parameters(camera, &applied);
+   wanted = applied;
+   round_trips = 0;
+   start = now_us();
+   for (i = 0; i < updates; i++) {
+      change(&wanted, i);
+      if (incremental)
+         raspicamcontrol_set_parameters(camera, &wanted, raspicamcontrol_changed_parameters(&applied, &wanted));
+      else
+         raspicamcontrol_set_all_parameters(camera, &wanted);
+      applied = wanted;
+   }
+   total = now_us() - start;
+   printf("%-12s %d updates  %7.1f us each  %5.1f parameter sets each\n",
+          incremental ? "changed only" : "all", updates, total / updates, (double)round_trips / updates);
+}
+
+int main(int argc, char **argv)
+{
+   int updates = argc > 1 ? atoi(argv[1]) : 200;
+   MMAL_COMPONENT_T *camera;
+
+   bcm_host_init();
+   if (mmal_component_create(MMAL_COMPONENT_DEFAULT_CAMERA, &camera) != MMAL_SUCCESS ||
+       mmal_component_enable(camera) != MMAL_SUCCESS) {
+      fprintf(stderr, "Failed to start the camera component\n");
+      return 1;
+   }
+   run(camera, updates, 0);
+   run(camera, updates, 1);
+   mmal_component_destroy(camera);
+   return 0;
+}
@@ -0,0 +1,56 @@
+# picam.difference (lists of 0xRRGGBB ints) against picam.differenceBuffers
+# (packed RGB24 and luma) on each SIMD path this CPU has. No camera needed,
+# the frames are synthetic.
+#
+#   python benchmarks/difference_speed.py [repeat]
+import os
+import random
+import sys
+import time
+import picam
+
+THRESHOLD = 15
+repeat = int(sys.argv[1]) if len(sys.argv) > 1 else 5
+
+def best(call, count):
+    times = []
+    for i in range(count):
+        start = time.time()
+        result = call()
+        times.append(time.time() - start)
+    return min(times) * 1000, result
+
+implementations = []
+for name in ["scalar", "sse2", "avx2", "neon"]:
+    try:
+        picam.differenceImplementation(name)
+        implementations.append(name)
+    except ValueError:
+        pass
+picam.differenceImplementation(None)
+
+for width, height in [(100, 100), (640, 480), (1920, 1080)]:
+    rgb1 = bytearray(os.urandom(width * height * 3))
+    rgb2 = bytearray(rgb1)
+    for i in random.sample(xrange(len(rgb2)), len(rgb2) / 10):
+        rgb2[i] = (rgb2[i] + 40) & 0xff
+    luma1 = rgb1[:width * height]
+    luma2 = rgb2[:width * height]
+
+    list1 = [(rgb1[i] << 16) | (rgb1[i + 1] << 8) | rgb1[i + 2] for i in xrange(0, len(rgb1), 3)]
+    list2 = [(rgb2[i] << 16) | (rgb2[i + 1] << 8) | rgb2[i + 2] for i in xrange(0, len(rgb2), 3)]
+    ms, (_, expected) = best(lambda: picam.difference(list1, list2, THRESHOLD), 1 if width > 640 else repeat)
+    print "%4dx%-4d list   rgb            %9.2f ms" % (width, height, ms)
+
+    for name in implementations:
+        picam.differenceImplementation(name)
+        ms, (count, _) = best(lambda: picam.differenceBuffers(rgb1, rgb2, width, height, 0, picam.PICAM_FORMAT_RGB24, THRESHOLD), repeat)
+        assert count == expected
+        print "%4dx%-4d %-6s rgb            %9.2f ms" % (width, height, name, ms)
+        ms, _ = best(lambda: picam.differenceBuffers(rgb1, rgb2, width, height, 0, picam.PICAM_FORMAT_RGB24, THRESHOLD, picam.PICAM_DIFF_MASK_BYTES), repeat)
+        print "%4dx%-4d %-6s rgb  byte mask %9.2f ms" % (width, height, name, ms)
+        ms, _ = best(lambda: picam.differenceBuffers(luma1, luma2, width, height, 0, picam.PICAM_FORMAT_LUMA, THRESHOLD), repeat)
+        print "%4dx%-4d %-6s luma           %9.2f ms" % (width, height, name, ms)
+        ms, _ = best(lambda: picam.differenceBuffers(luma1, luma2, width, height, 0, picam.PICAM_FORMAT_LUMA, THRESHOLD, picam.PICAM_DIFF_MASK_BITS), repeat)
+        print "%4dx%-4d %-6s luma bit mask  %9.2f ms" % (width, height, name, ms)
+    picam.differenceImplementation(None)
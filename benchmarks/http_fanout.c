@@ -0,0 +1,186 @@
+/*
+ * Publishes JPEG sized frames through PICAM_HTTP to several local clients
+ * reading the multipart stream as fast as they can, plus one client that
+ * sends its request and then never reads. Reports what each reader got and
+ * how long publishing took, to show that the stalled client only costs
+ * itself frames. Checks every part the readers receive.
+ *
+ *   gcc -O2 -Isrc benchmarks/http_fanout.c src/picamhttp.c -lpthread -o http_fanout
+ *   ./http_fanout [frames] [readers] [frame kB] [frames/s, 0 for flat out]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "picamhttp.h"
+
+/// Frames each client can fall behind by, as in an MJPEG server
+#define QUEUE_FRAMES 2
+#define MAX_READERS 64
+
+typedef struct
+{
+   int port;
+   unsigned long frames;
+   unsigned long corrupt;
+   unsigned long last;
+   unsigned long skipped;
+} READER;
+
+static double now_us(void)
+{
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+static int connect_local(int port, int receive_buffer)
+{
+   struct sockaddr_in addr;
+   int fd = socket(AF_INET, SOCK_STREAM, 0);
+   const char request[] = "GET /stream HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+   if (receive_buffer)
+      setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &receive_buffer, sizeof(receive_buffer));
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons(port);
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+       write(fd, request, sizeof(request) - 1) != (ssize_t)sizeof(request) - 1) {
+      perror("connect");
+      exit(1);
+   }
+   return fd;
+}
+
+/// Reads the response, then parts: headers, Content-Length bytes of frame number and filler, CRLF
+static void *reader_thread(void *arg)
+{
+   READER *reader = (READER *)arg;
+   int fd = connect_local(reader->port, 0);
+   static __thread char buffer[1 << 20];
+   long have = 0;
+   int header_done = 0;
+
+   for (;;) {
+      ssize_t got = read(fd, buffer + have, sizeof(buffer) - have);
+      char *end;
+
+      if (got <= 0)
+         break;
+      have += got;
+      for (;;) {
+         long length, used;
+         unsigned long number;
+
+         buffer[have < (long)sizeof(buffer) ? have : (long)sizeof(buffer) - 1] = '\0';
+         end = strstr(buffer, "\r\n\r\n");
+         if (!end)
+            break;
+         if (!header_done) {
+            header_done = 1;
+            used = end + 4 - buffer;
+         } else {
+            char *field = strstr(buffer, "Content-Length: ");
+
+            if (!field || field > end || strncmp(buffer, "--picamframe\r\n", 14) != 0) {
+               reader->corrupt++;
+               close(fd);
+               return NULL;
+            }
+            length = atol(field + 16);
+            used = end + 4 - buffer + length + 2;
+            if (have < used)
+               break;
+            memcpy(&number, end + 4, sizeof(number));
+            if (number <= reader->last && reader->frames)
+               reader->corrupt++;
+            if (reader->frames && number != reader->last + 1)
+               reader->skipped += number - reader->last - 1;
+            reader->last = number;
+            reader->frames++;
+         }
+         memmove(buffer, buffer + used, have - used);
+         have -= used;
+      }
+   }
+   close(fd);
+   return NULL;
+}
+
+int main(int argc, char **argv)
+{
+   int frames = argc > 1 ? atoi(argv[1]) : 600;
+   int readers = argc > 2 ? atoi(argv[2]) : 4;
+   long frame_size = (argc > 3 ? atol(argv[3]) : 60) * 1024;
+   int rate = argc > 4 ? atoi(argv[4]) : 120;
+   PICAM_HTTP http;
+   PICAM_HTTP_STATS stats;
+   READER reader[MAX_READERS];
+   pthread_t thread[MAX_READERS];
+   uint8_t *frame = malloc(frame_size);
+   double start, worst = 0, total;
+   unsigned long i;
+   int stalled;
+
+   if (readers > MAX_READERS)
+      readers = MAX_READERS;
+   memset(frame, 0xab, frame_size);
+   if (picam_http_start(&http, "127.0.0.1", 0, readers + 1, QUEUE_FRAMES) != 0) {
+      perror("picam_http_start");
+      return 1;
+   }
+   stalled = connect_local(http.port, 4096);
+   memset(reader, 0, sizeof(reader));
+   for (i = 0; i < (unsigned long)readers; i++) {
+      reader[i].port = http.port;
+      pthread_create(&thread[i], NULL, reader_thread, &reader[i]);
+   }
+   do {
+      usleep(10000);
+      picam_http_stats(&http, &stats);
+   } while (stats.clients < readers + 1);
+
+   start = now_us();
+   for (i = 1; i <= (unsigned long)frames; i++) {
+      double before = now_us(), took;
+
+      memcpy(frame, &i, sizeof(i));
+      picam_http_publish(&http, frame, frame_size);
+      took = now_us() - before;
+      if (took > worst)
+         worst = took;
+      if (rate > 0) {
+         double due = start + i * 1000000.0 / rate - now_us();
+
+         if (due > 0)
+            usleep((useconds_t)due);
+      }
+   }
+   total = now_us() - start;
+   usleep(200000);
+   picam_http_stats(&http, &stats);
+   picam_http_stop(&http);
+   for (i = 0; i < (unsigned long)readers; i++)
+      pthread_join(thread[i], NULL);
+   close(stalled);
+
+   printf("%d frames of %ld kB to %d readers and 1 stalled client in %.0f ms (%.0f frames/s)\n",
+          frames, frame_size / 1024, readers, total / 1000, frames / (total / 1000000));
+   printf("slowest publish %.0f us, %lu frames sent, %lu dropped in all\n", worst, stats.sent, stats.dropped);
+   for (i = 0; i < (unsigned long)readers; i++)
+      printf("reader %lu: %lu frames, %lu skipped, %lu corrupt\n", i, reader[i].frames, reader[i].skipped, reader[i].corrupt);
+   for (i = 0; i < (unsigned long)readers; i++)
+      if (reader[i].corrupt || reader[i].frames == 0)
+         return 1;
+   free(frame);
+   return 0;
+}
@@ -0,0 +1,75 @@
+/*
+ * Writes a synthetic RGB24 frame and its luma plane with picam_image_save in
+ * every file format, at 640x480 and at the sensor's full 2592x1944, and
+ * reports the time per image and the throughput. The files are left in the
+ * directory given so they can be opened to check them.
+ *
+ *   gcc -O2 -Isrc benchmarks/image_write.c src/picamimage.c -lpthread -o image_write
+ *   ./image_write [directory] [repeats]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#include "picamimage.h"
+
+static double now_us(void)
+{
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+int main(int argc, char **argv)
+{
+   static const struct { int width, height; } sizes[] = { { 640, 480 }, { 2592, 1944 } };
+   static const char *extensions[] = { "ppm", "pgm", "bmp", "png" };
+   const char *directory = argc > 1 ? argv[1] : "/tmp";
+   int repeats = argc > 2 ? atoi(argv[2]) : 5;
+   unsigned s, e;
+   int pass, r, x, y;
+
+   for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+      int width = sizes[s].width, height = sizes[s].height;
+      uint8_t *rgb = malloc((size_t)width * height * 3);
+      uint8_t *luma = malloc((size_t)width * height);
+
+      // Gradients that show up a swapped channel or a flipped image
+      for (y = 0; y < height; y++) {
+         for (x = 0; x < width; x++) {
+            uint8_t *p = rgb + ((long)y * width + x) * 3;
+
+            p[0] = (uint8_t)(x * 255 / width);
+            p[1] = (uint8_t)(y * 255 / height);
+            p[2] = (uint8_t)((x + y) & 0xff);
+            luma[(long)y * width + x] = p[1];
+         }
+      }
+      for (pass = 0; pass < 2; pass++) {
+         for (e = 0; e < sizeof(extensions) / sizeof(extensions[0]); e++) {
+            char filename[512];
+            double start, took;
+            int error = 0;
+
+            snprintf(filename, sizeof(filename), "%s/image_write_%dx%d_%s.%s", directory, width, height,
+                     pass ? "luma" : "rgb", extensions[e]);
+            start = now_us();
+            for (r = 0; r < repeats && !error; r++)
+               error = pass ? picam_image_save(filename, -1, luma, width, height, width, PICAM_PIXELS_LUMA)
+                            : picam_image_save(filename, -1, rgb, width, height, (long)width * 3, PICAM_PIXELS_RGB24);
+            took = (now_us() - start) / repeats;
+            if (error) {
+               fprintf(stderr, "%s: %s\n", filename, strerror(error));
+               return 1;
+            }
+            printf("%4dx%-4d %-4s -> %s  %8.1f ms  %7.1f Mpixel/s\n", width, height, pass ? "luma" : "rgb",
+                   extensions[e], took / 1000, (double)width * height / took);
+         }
+      }
+      free(rgb);
+      free(luma);
+   }
+   return 0;
+}
@@ -0,0 +1,387 @@
+/*
+ * Records a synthetic 17Mbit/s, 30fps H264 stream at real time into MP4
+ * segments, cut at IDR frames as the recorder does, through a PICAM_WRITER
+ * whose file writes are throttled to a slow card that stalls now and then.
+ * Both layouts are run. Reports how long the producer (the encoder callback
+ * on a camera) was held up per buffer, what was dropped, how many cuts were
+ * put off to a later IDR frame, and whether every segment parses on its own.
+ * No camera needed, the throttle sits between the writer thread and pwrite.
+ *
+ *   gcc -O2 -Isrc -Wl,--wrap=pwrite benchmarks/mp4_segments.c src/picamwriter.c src/picammp4.c src/picambuffer.c -lpthread -o mp4_segments
+ *   ./mp4_segments /home/pi/segments [seconds] [card kbit/s] [stall ms]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "picammp4.h"
+#include "picamwriter.h"
+
+#define FRAME_RATE 30
+#define BITRATE 17000000
+/// An IDR frame every second, about ten times a P frame
+#define INTRA_PERIOD 30
+#define SEGMENT_SECONDS 5
+/// As the recorder uses
+#define QUEUE_SIZE (4 * 1024 * 1024)
+#define FRAGMENT_MS 1000
+/// How often the card stalls, in seconds of writing
+#define STALL_PERIOD 7
+#define FINISH_WAIT_MS 5000
+
+/// 1920x1080 High profile, as raspivid sends them
+static const uint8_t config[] = {
+   0, 0, 0, 1, 0x27, 0x64, 0x00, 0x28, 0xac, 0x2b, 0x40, 0x3c, 0x01, 0x13, 0xf2, 0xc0, 0x3c, 0x48, 0x9a, 0x80,
+   0, 0, 0, 1, 0x28, 0xee, 0x02, 0x5c, 0xb0
+};
+
+/* Throttle, every pwrite of the writer thread comes through here */
+
+static long card_bytes_per_s;
+static long stall_ms;
+static double next_stall_us;
+
+ssize_t __real_pwrite(int fd, const void *data, size_t length, off_t offset);
+
+static double now_us(void)
+{
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+ssize_t __wrap_pwrite(int fd, const void *data, size_t length, off_t offset)
+{
+   double us = length * 1000000.0 / card_bytes_per_s;
+
+   if (stall_ms > 0 && now_us() >= next_stall_us) {
+      us += stall_ms * 1000.0;
+      next_stall_us = now_us() + us + STALL_PERIOD * 1000000.0;
+   }
+   usleep((useconds_t)us);
+   return __real_pwrite(fd, data, length, offset);
+}
+
+/* Muxer output, the same as the recorder's */
+
+static int output_room(void *user, long length, int pieces)
+{
+   return picam_writer_room((PICAM_WRITER *)user, length, pieces);
+}
+
+static void output_write(void *user, const uint8_t *data, long length)
+{
+   picam_writer_append((PICAM_WRITER *)user, data, length, 1);
+}
+
+static void output_patch(void *user, uint64_t offset, const uint8_t *data, long length)
+{
+   picam_writer_patch((PICAM_WRITER *)user, offset, data, length);
+}
+
+static long frame_size(int frame)
+{
+   long average = BITRATE / 8 / FRAME_RATE;
+   return frame % INTRA_PERIOD == 0 ? average * 10 * INTRA_PERIOD / (INTRA_PERIOD + 9) : average * INTRA_PERIOD / (INTRA_PERIOD + 9);
+}
+
+typedef struct
+{
+   double worst_us;
+   double total_us;
+   int late;                           /// Buffers held up longer than a frame interval
+   int segments;
+   int deferred;                       /// IDR frames a due cut was put off at
+   unsigned long mp4_dropped;
+   PICAM_WRITER_STATS stats;
+   int bad_segments;
+} RESULT;
+
+static void pace(double start, int frame)
+{
+   double due = start + frame * 1000000.0 / FRAME_RATE;
+   double left = due - now_us();
+   if (left > 0)
+      usleep((useconds_t)left);
+}
+
+/* Segment check */
+
+static uint32_t get32(const uint8_t *p)
+{
+   return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint64_t get64(const uint8_t *p)
+{
+   return (uint64_t)get32(p) << 32 | get32(p + 4);
+}
+
+/**
+ * Step over the box at *pos of the range [*pos, end)
+ *
+ * @return 0 if a whole box is there, with its type and payload range set
+ */
+static int next_box(const uint8_t *data, uint64_t *pos, uint64_t end, char type[5], uint64_t *payload, uint64_t *payload_end)
+{
+   uint64_t p = *pos, size, header = 8;
+
+   if (end - p < 8)
+      return 1;
+   size = get32(data + p);
+   memcpy(type, data + p + 4, 4);
+   type[4] = 0;
+   if (size == 1) {
+      if (end - p < 16)
+         return 1;
+      size = get64(data + p + 8);
+      header = 16;
+   } else if (size == 0) {
+      size = end - p;
+   }
+   if (size < header || size > end - p)
+      return 1;
+   *payload = p + header;
+   *payload_end = p + size;
+   *pos = p + size;
+   return 0;
+}
+
+/**
+ * Find the first box of a type among the children of [start, end)
+ *
+ * @return 0 if found
+ */
+static int find_box(const uint8_t *data, uint64_t start, uint64_t end, const char *want, uint64_t *payload, uint64_t *payload_end)
+{
+   char type[5];
+
+   while (next_box(data, &start, end, type, payload, payload_end) == 0)
+      if (strcmp(type, want) == 0)
+         return 0;
+   return 1;
+}
+
+/**
+ * Find a box by its path from the top of the file, such as "moov/trak/mdia"
+ */
+static int find_path(const uint8_t *data, uint64_t length, const char *path, uint64_t *payload, uint64_t *payload_end)
+{
+   uint64_t start = 0, end = length;
+   char want[5];
+
+   for (;;) {
+      memcpy(want, path, 4);
+      want[4] = 0;
+      if (find_box(data, start, end, want, payload, payload_end) != 0)
+         return 1;
+      if (path[4] != '/')
+         return 0;
+      start = *payload;
+      end = *payload_end;
+      path += 5;
+   }
+}
+
+/**
+ * Every sample of a plain file must lie in its mdat, and the first must be an IDR frame
+ */
+static const char *check_plain(const uint8_t *data, uint64_t length, uint64_t mdat, uint64_t mdat_end)
+{
+   uint64_t stsz, stsz_end, co64, co64_end, stss, stss_end;
+   uint32_t count, i;
+
+   if (find_path(data, length, "moov/trak/mdia/minf/stbl/stsz", &stsz, &stsz_end) != 0 ||
+       find_path(data, length, "moov/trak/mdia/minf/stbl/co64", &co64, &co64_end) != 0 ||
+       find_path(data, length, "moov/trak/mdia/minf/stbl/stss", &stss, &stss_end) != 0)
+      return "sample tables missing";
+   count = get32(data + stsz + 8);
+   if (count == 0 || get32(data + co64 + 4) != count ||
+       stsz + 12 + 4 * (uint64_t)count > stsz_end || co64 + 8 + 8 * (uint64_t)count > co64_end)
+      return "sample tables disagree";
+   for (i = 0; i < count; i++) {
+      uint64_t offset = get64(data + co64 + 8 + 8 * i);
+      if (offset < mdat || offset + get32(data + stsz + 12 + 4 * i) > mdat_end)
+         return "sample outside the mdat";
+   }
+   if (stss + 12 > stss_end || get32(data + stss + 4) == 0 || get32(data + stss + 8) != 1)
+      return "first sample not an IDR frame";
+   return NULL;
+}
+
+/**
+ * Walk the top level boxes of a segment
+ *
+ * @return NULL if it parses on its own, else what is wrong
+ */
+static const char *check_segment(const uint8_t *data, uint64_t length, int layout)
+{
+   uint64_t pos = 0, payload, payload_end, mdat = 0, mdat_end = 0, moof_payload = 0, moof_end = 0;
+   uint32_t sequence = 0;
+   int boxes = 0, moov = 0, after_moof = 0;
+   char type[5];
+
+   while (pos < length) {
+      if (next_box(data, &pos, length, type, &payload, &payload_end) != 0)
+         return "truncated box";
+      if (boxes++ == 0 && strcmp(type, "ftyp") != 0)
+         return "does not start with ftyp";
+      if (strcmp(type, "moov") == 0) {
+         moov++;
+      } else if (strcmp(type, "mdat") == 0) {
+         if (layout == PICAM_MP4_FRAGMENTED && !after_moof)
+            return "mdat without a moof";
+         if (layout == PICAM_MP4_PLAIN && (mdat_end || moov))
+            return "mdat out of place";
+         mdat = payload;
+         mdat_end = payload_end;
+         after_moof = 0;
+      } else if (strcmp(type, "moof") == 0) {
+         uint64_t mfhd, mfhd_end;
+
+         if (layout != PICAM_MP4_FRAGMENTED || !moov || after_moof)
+            return "moof out of place";
+         moof_payload = payload;
+         moof_end = payload_end;
+         if (find_box(data, moof_payload, moof_end, "mfhd", &mfhd, &mfhd_end) != 0 || mfhd + 8 > mfhd_end)
+            return "moof without mfhd";
+         if (get32(data + mfhd + 4) != ++sequence)
+            return "fragment sequence broken";
+         after_moof = 1;
+      }
+   }
+   if (moov != 1)
+      return "no single moov";
+   if (layout == PICAM_MP4_FRAGMENTED)
+      return after_moof ? "moof without mdat" : sequence ? NULL : "no fragments";
+   if (!mdat_end)
+      return "no mdat";
+   return check_plain(data, length, mdat, mdat_end);
+}
+
+static int check_file(const char *path, int layout)
+{
+   FILE *file = fopen(path, "rb");
+   const char *problem = "cannot read";
+   uint8_t *data = NULL;
+   long length;
+
+   if (file && fseek(file, 0, SEEK_END) == 0 && (length = ftell(file)) > 0 && fseek(file, 0, SEEK_SET) == 0 &&
+       (data = malloc(length)) != NULL && fread(data, 1, length, file) == (size_t)length)
+      problem = check_segment(data, length, layout);
+   if (file)
+      fclose(file);
+   free(data);
+   if (problem)
+      printf("  %s: %s\n", path, problem);
+   return problem != NULL;
+}
+
+/* Recording */
+
+static void run(const char *dir, const char *name, int layout, int frames, uint8_t *data, RESULT *result)
+{
+   PICAM_WRITER writer;
+   PICAM_MP4 mp4;
+   PICAM_MP4_OUTPUT output = {&writer, output_room, output_write, output_patch};
+   char pattern[4096], path[4096];
+   int64_t frame_us = 1000000 / FRAME_RATE, segment_pts = 0;
+   int cut_due = 0, fd, frame, i, waited;
+   double start;
+
+   snprintf(pattern, sizeof(pattern), "%s/%s-%%03d.mp4", dir, name);
+   snprintf(path, sizeof(path), pattern, 0);
+   fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0 || picam_writer_init(&writer, QUEUE_SIZE, fd, 0, frame_us) != 0 ||
+       picam_mp4_init(&mp4, layout, 1920, 1080, FRAGMENT_MS, FRAME_RATE, &output) != 0) {
+      perror(path);
+      exit(1);
+   }
+   picam_mp4_config(&mp4, config, sizeof(config));
+   next_stall_us = now_us() + STALL_PERIOD * 1000000.0;
+   start = now_us();
+   for (frame = 0; frame < frames; frame++) {
+      int64_t pts = frame * frame_us;
+      long length = frame_size(frame);
+      double before, us;
+
+      pace(start, frame);
+      before = now_us();
+      // As the encoder callback does at the first buffer of an IDR frame
+      if (frame % INTRA_PERIOD == 0 && cut_due) {
+         snprintf(path, sizeof(path), pattern, result->segments + 1);
+         if (picam_mp4_end_file(&mp4, strlen(path), 1) == 0 && picam_writer_open(&writer, path) == 0) {
+            result->segments++;
+            segment_pts = pts;
+            cut_due = 0;
+         } else {
+            result->deferred++;
+         }
+      }
+      data[4] = frame % INTRA_PERIOD == 0 ? 0x65 : 0x41;
+      picam_mp4_add(&mp4, data, length, frame % INTRA_PERIOD == 0, 1, pts);
+      if (pts + frame_us - segment_pts >= SEGMENT_SECONDS * 1000000LL)
+         cut_due = 1;
+
+      us = now_us() - before;
+      result->total_us += us;
+      if (us > result->worst_us)
+         result->worst_us = us;
+      if (us > frame_us)
+         result->late++;
+   }
+   // As teardown does, with the encoder gone
+   for (waited = 0; picam_mp4_finish(&mp4, QUEUE_SIZE / 4) != 0 && waited < FINISH_WAIT_MS; waited++)
+      usleep(1000);
+   result->mp4_dropped = mp4.dropped + (waited == FINISH_WAIT_MS);
+   picam_mp4_free(&mp4);
+   picam_writer_finish(&writer, &result->stats);
+
+   for (i = 0; i <= result->segments; i++) {
+      snprintf(path, sizeof(path), pattern, i);
+      result->bad_segments += check_file(path, layout);
+   }
+}
+
+static void report(const char *name, int frames, const RESULT *result)
+{
+   printf("%-10s %9.1f %9.1f %6d %9d %9d %8lu %8lu %6d\n", name, result->total_us / frames, result->worst_us, result->late,
+          result->segments + 1, result->deferred, result->mp4_dropped, result->stats.dropped, result->bad_segments);
+}
+
+int main(int argc, char **argv)
+{
+   int seconds = argc > 2 ? atoi(argv[2]) : 30;
+   int frames = seconds * FRAME_RATE;
+   uint8_t *data;
+   RESULT plain = {0}, fragmented = {0};
+   long i;
+
+   if (argc < 2) {
+      fprintf(stderr, "usage: %s directory [seconds] [card kbit/s] [stall ms]\n", argv[0]);
+      return 1;
+   }
+   card_bytes_per_s = (argc > 3 ? atol(argv[3]) : 20000) * 1000 / 8;
+   stall_ms = argc > 4 ? atol(argv[4]) : 1500;
+   data = malloc(frame_size(0));
+   // One NAL unit per frame, with no start code inside it
+   memset(data, 0x5a, frame_size(0));
+   for (i = 0; i < 4; i++)
+      data[i] = i == 3;
+
+   run(argv[1], "plain", PICAM_MP4_PLAIN, frames, data, &plain);
+   run(argv[1], "fragmented", PICAM_MP4_FRAGMENTED, frames, data, &fragmented);
+
+   printf("%d frames at %dfps, %d kbit/s, %ds segments, card %ld kbit/s stalling %ldms every %ds\n",
+          frames, FRAME_RATE, BITRATE / 1000, SEGMENT_SECONDS, card_bytes_per_s * 8 / 1000, stall_ms, STALL_PERIOD);
+   printf("%-10s %9s %9s %6s %9s %9s %8s %8s %6s\n", "", "mean us", "worst us", "late", "segments", "deferred",
+          "mp4 drop", "wr drop", "bad");
+   report("plain", frames, &plain);
+   report("fragmented", frames, &fragmented);
+   free(data);
+   return plain.bad_segments || fragmented.bad_segments;
+}
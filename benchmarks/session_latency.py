@@ -0,0 +1,27 @@
+# Per capture latency of the one shot functions (camera set up and torn down
+# for every still) against a CameraSession that keeps the camera running.
+#
+#   python benchmarks/session_latency.py [captures] [width] [height]
+import sys
+import time
+import picam
+
+def measure(label, capture, count):
+    times = []
+    for i in range(count):
+        start = time.time()
+        capture()
+        times.append((time.time() - start) * 1000.0)
+    print "%-6s %4d captures  mean %8.1f ms  min %8.1f ms  max %8.1f ms" % (
+        label, count, sum(times) / len(times), min(times), max(times))
+
+count = int(sys.argv[1]) if len(sys.argv) > 1 else 10
+width = int(sys.argv[2]) if len(sys.argv) > 2 else 640
+height = int(sys.argv[3]) if len(sys.argv) > 3 else 480
+
+measure("cold", lambda: picam._picam.takePhotoWithDetails(width, height, 85), count)
+
+session = picam._picam.CameraSession()
+session.takePhotoWithDetails(width, height, 85)   # builds the graph
+measure("warm", lambda: session.takePhotoWithDetails(width, height, 85), count)
+session.close()
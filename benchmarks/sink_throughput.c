@@ -0,0 +1,113 @@
+/*
+ * Pushes encoder sized buffers through PICAM_SINK into a local UNIX socket
+ * as fast as the reader takes them, the way a recording's sink thread does:
+ * straight from the buffer, no staging copy. Reports the sustained rate
+ * against what a 1080p30 stream needs and how often the sink had to wait
+ * for the reader. Verifies every byte on the reading side.
+ *
+ *   gcc -O2 -Isrc benchmarks/sink_throughput.c src/picamsink.c -lpthread -o sink_throughput
+ *   ./sink_throughput [megabytes] [reader delay us per read]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "picamsink.h"
+
+/// Typical H264 encoder output buffer
+#define BUFFER_SIZE 65536
+/// Encoder output buffers cycled through, as in a recording with a sink
+#define BUFFERS 16
+#define BITRATE 17000000
+
+typedef struct
+{
+   int fd;
+   int delay_us;
+   uint64_t received;
+   int corrupt;
+} READER;
+
+static double now_us(void)
+{
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+static uint8_t pattern(uint64_t offset)
+{
+   return (uint8_t)(offset * 131 >> 3);
+}
+
+static void *reader_thread(void *arg)
+{
+   READER *reader = arg;
+   static uint8_t data[BUFFER_SIZE];
+   ssize_t n, i;
+
+   while ((n = read(reader->fd, data, sizeof(data))) > 0) {
+      for (i = 0; i < n; i++)
+         if (data[i] != pattern(reader->received + i))
+            reader->corrupt = 1;
+      reader->received += n;
+      if (reader->delay_us)
+         usleep(reader->delay_us);
+   }
+   return NULL;
+}
+
+int main(int argc, char **argv)
+{
+   uint64_t total = (uint64_t)(argc > 1 ? atoi(argv[1]) : 256) << 20;
+   READER reader = {0};
+   PICAM_SINK sink;
+   pthread_t thread;
+   uint8_t *buffers[BUFFERS];
+   uint64_t offset = 0;
+   double start, seconds;
+   int sv[2], i;
+
+   reader.delay_us = argc > 2 ? atoi(argv[2]) : 0;
+   if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0 || picam_sink_open(&sink, sv[0]) != 0) {
+      perror("socketpair");
+      return 1;
+   }
+   reader.fd = sv[1];
+   for (i = 0; i < BUFFERS; i++)
+      buffers[i] = malloc(BUFFER_SIZE);
+   pthread_create(&thread, NULL, reader_thread, &reader);
+
+   start = now_us();
+   for (i = 0; offset < total; i = (i + 1) % BUFFERS) {
+      long length = total - offset < BUFFER_SIZE ? (long)(total - offset) : BUFFER_SIZE;
+      long j;
+
+      // Stands in for the encoder filling the buffer
+      for (j = 0; j < length; j++)
+         buffers[i][j] = pattern(offset + j);
+      if (picam_sink_write(&sink, buffers[i], length, NULL) != 0) {
+         perror("sink");
+         return 1;
+      }
+      offset += length;
+   }
+   picam_sink_close(&sink);
+   close(sv[0]);
+   pthread_join(thread, NULL);
+   seconds = (now_us() - start) / 1000000.0;
+
+   printf("%llu MB through a UNIX socket in %.2fs: %.1f MB/s, %.0fx a %d kbit/s stream\n",
+          (unsigned long long)(total >> 20), seconds, total / seconds / 1e6,
+          total * 8 / seconds / BITRATE, BITRATE / 1000);
+   printf("sink waited for the reader %lu times, reader got %llu bytes%s\n", sink.waits,
+          (unsigned long long)reader.received, reader.corrupt ? ", CORRUPT" : ", all intact");
+   for (i = 0; i < BUFFERS; i++)
+      free(buffers[i]);
+   return reader.corrupt || reader.received != total;
+}
@@ -0,0 +1,30 @@
+# Time of one small raw capture through the video port and the GPU resizer,
+# as takeRawPhotoWithDetails takes up to 640x480, which sets the camera and
+# the resizer up from nothing and lets exposure settle every time, against
+# the same captures from a CameraSession, which keeps that graph running
+# between them and only waits for a fresh frame.
+#
+#   python benchmarks/small_frames.py [captures] [format]
+import sys
+import time
+import picam
+
+def measure(label, size, capture, count):
+    times = []
+    for i in range(count):
+        start = time.time()
+        frame = capture()
+        times.append((time.time() - start) * 1000.0)
+    print "%-8s %3dx%-3d %3d captures  mean %8.1f ms  min %8.1f ms  %7d bytes" % (
+        label, size[0], size[1], count, sum(times) / len(times), min(times), len(memoryview(frame)))
+
+count = int(sys.argv[1]) if len(sys.argv) > 1 else 5
+format = int(sys.argv[2]) if len(sys.argv) > 2 else picam.PICAM_FORMAT_RGB24
+
+session = picam._picam.CameraSession()
+for size in ((100, 100), (320, 240), (640, 480)):
+    measure("one shot", size, lambda: picam._picam.takeRawPhotoWithDetails(size[0], size[1], format), count)
+    # The first capture of a size starts the graph, it is left out
+    session.takeRawPhotoWithDetails(size[0], size[1], format)
+    measure("session", size, lambda: session.takeRawPhotoWithDetails(size[0], size[1], format), count)
+session.close()
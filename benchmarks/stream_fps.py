@@ -0,0 +1,31 @@
+# Sustained frame rate of a FrameStream, and how many frames were dropped
+# because the reader or the buffers could not keep up.
+#
+#   python benchmarks/stream_fps.py [seconds] [width] [height] [framerate]
+import sys
+import time
+import picam
+
+seconds = float(sys.argv[1]) if len(sys.argv) > 1 else 10
+width = int(sys.argv[2]) if len(sys.argv) > 2 else 320
+height = int(sys.argv[3]) if len(sys.argv) > 3 else 240
+framerate = int(sys.argv[4]) if len(sys.argv) > 4 else 30
+
+for name, format in [("I420", picam.PICAM_FORMAT_I420), ("RGB24", picam.PICAM_FORMAT_RGB24)]:
+    stream = picam.FrameStream(width, height, framerate, format)
+    count = 0
+    size = 0
+    first = last = None
+    start = time.time()
+    for frame in stream:
+        if first is None:
+            first = frame.timestamp
+        last = frame.timestamp
+        size = len(frame)
+        count += 1
+        if time.time() - start >= seconds:
+            break
+    stream.stop()
+    elapsed = (last - first) / 1000000.0 if count > 1 else 0
+    print "%-6s %4d frames %6.2f fps (camera time)  %d dropped  %d bytes/frame" % (
+        name, count, (count - 1) / elapsed if elapsed else 0, stream.dropped, size)
@@ -0,0 +1,124 @@
+/*
+ * Plays a 17Mbit/s, 30fps stream of encoder buffers at real time into a
+ * file, once with fwrite on the producing thread (as the encoder callback
+ * used to) and once through PICAM_WRITER, and reports how long the producer
+ * was held up per buffer. Run it against the SD card, no camera needed.
+ *
+ *   gcc -O2 -Isrc benchmarks/writer_latency.c src/picamwriter.c -lpthread -o writer_latency
+ *   ./writer_latency /home/pi/bench.h264 [seconds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "picamwriter.h"
+
+#define FRAME_RATE 30
+#define BITRATE 17000000
+/// An IDR frame every second, about ten times a P frame
+#define INTRA_PERIOD 30
+
+static double now_us(void)
+{
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+static long frame_size(int frame)
+{
+   long average = BITRATE / 8 / FRAME_RATE;
+   return frame % INTRA_PERIOD == 0 ? average * 10 * INTRA_PERIOD / (INTRA_PERIOD + 9) : average * INTRA_PERIOD / (INTRA_PERIOD + 9);
+}
+
+typedef struct
+{
+   double worst_us;
+   double total_us;
+   int late;                           /// Buffers held up longer than a frame interval
+} RESULT;
+
+static void account(RESULT *result, double us)
+{
+   result->total_us += us;
+   if (us > result->worst_us)
+      result->worst_us = us;
+   if (us > 1000000.0 / FRAME_RATE)
+      result->late++;
+}
+
+static void pace(double start, int frame)
+{
+   double due = start + frame * 1000000.0 / FRAME_RATE;
+   double left = due - now_us();
+   if (left > 0)
+      usleep((useconds_t)left);
+}
+
+static void run_fwrite(const char *path, int frames, const uint8_t *data, RESULT *result)
+{
+   FILE *file = fopen(path, "wb");
+   double start = now_us();
+   int frame;
+
+   for (frame = 0; frame < frames; frame++) {
+      double before;
+
+      pace(start, frame);
+      before = now_us();
+      fwrite(data, 1, frame_size(frame), file);
+      account(result, now_us() - before);
+   }
+   fclose(file);
+}
+
+static void run_writer(const char *path, int frames, const uint8_t *data, RESULT *result, PICAM_WRITER_STATS *stats)
+{
+   PICAM_WRITER writer;
+   int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   double start = now_us();
+   int frame;
+
+   picam_writer_init(&writer, 4 * 1024 * 1024, fd, (long)BITRATE / 8 * frames / FRAME_RATE, 1000000 / FRAME_RATE);
+   for (frame = 0; frame < frames; frame++) {
+      double before;
+
+      pace(start, frame);
+      before = now_us();
+      picam_writer_append(&writer, data, frame_size(frame), frame % INTRA_PERIOD == 0);
+      account(result, now_us() - before);
+   }
+   picam_writer_finish(&writer, stats);
+}
+
+int main(int argc, char **argv)
+{
+   int seconds = argc > 2 ? atoi(argv[2]) : 20;
+   int frames = seconds * FRAME_RATE;
+   uint8_t *data;
+   RESULT direct = {0}, threaded = {0};
+   PICAM_WRITER_STATS stats;
+
+   if (argc < 2) {
+      fprintf(stderr, "usage: %s file [seconds]\n", argv[0]);
+      return 1;
+   }
+   data = malloc(frame_size(0));
+   memset(data, 0x5a, frame_size(0));
+
+   run_fwrite(argv[1], frames, data, &direct);
+   run_writer(argv[1], frames, data, &threaded, &stats);
+
+   printf("%d frames at %dfps, %d kbit/s\n", frames, FRAME_RATE, BITRATE / 1000);
+   printf("%-8s %12s %12s %14s\n", "", "mean us", "worst us", "late buffers");
+   printf("%-8s %12.1f %12.1f %14d\n", "fwrite", direct.total_us / frames, direct.worst_us, direct.late);
+   printf("%-8s %12.1f %12.1f %14d\n", "writer", threaded.total_us / frames, threaded.worst_us, threaded.late);
+   printf("writer thread: worst write %ldus, peak queue %ld bytes, %lu late frames absorbed, %lu buffers dropped\n",
+          stats.worst_write_us, stats.peak_queued, stats.late_frames, stats.dropped);
+   free(data);
+   return 0;
+}
@@ -0,0 +1,21 @@
+# Stream 720p H264 to a TCP server whose uplink can slow down, e.g.
+#   nc -l 5000 > /dev/null
+# The bitrate starts at 8 Mbit/s and is cut as soon as the socket backs up, so
+# frames are never lost to a full queue; it climbs back once the link keeps up.
+import socket
+import picam
+
+connection = socket.create_connection(("127.0.0.1", 5000))
+
+def report(stats):
+    print "target %.2f Mbit/s, encoder %.2f, link %.2f, backlog %d%%, min QP %d" % (
+        stats["bitrate"] / 1e6, stats["measured"] / 1e6, stats["drained"] / 1e6,
+        stats["backlog"], stats["minQP"])
+
+recorder = picam.startRecording(None, 1280, 720, 60000, sink=connection,
+                                bitrateRange=(1000000, 8000000, 20, 40), rateCallback=report)
+try:
+    recorder.wait()
+finally:
+    recorder.stop()
+    connection.close()
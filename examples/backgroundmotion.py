@@ -0,0 +1,21 @@
+# Motion detection against a running average background rather than the
+# previous frame, so slow movement and lighting flicker are handled and only
+# the detector keeps any pixels around.
+import picam
+
+width = 320
+height = 240
+
+QUANITY_MIN = 50
+
+detector = picam.MotionDetector(width, height, picam.PICAM_FORMAT_LUMA, threshold=15, rate=4, columns=4, rows=3)
+stream = picam.FrameStream(width, height, 30, picam.PICAM_FORMAT_LUMA)
+for frame in stream:
+    q = detector.update(frame)
+    del frame
+    if q > QUANITY_MIN:
+        busiest = max(range(len(detector.cells)), key=lambda i: detector.cells[i])
+        print q, "most activity in cell", busiest % detector.columns, busiest / detector.columns
+        picam.LEDOn()
+    else:
+        picam.LEDOff()
@@ -0,0 +1,19 @@
+# Serve the camera as MJPEG on http://127.0.0.1:8080/ until interrupted.
+# Open it in a browser, or embed it with <img src="http://127.0.0.1:8080/">.
+# Every client gets the same JPEGs; one that cannot keep up loses its oldest
+# frames, the camera and the other clients carry on. Pass address=None to
+# listen on every interface instead of only this machine.
+import time
+import picam
+
+server = picam.MJPEGServer(port=8080, width=640, height=480, quality=80, framerate=15)
+print "serving on port %d" % server.port
+try:
+    while True:
+        time.sleep(5)
+        print "%d clients, %d frames encoded, %d sent, %d dropped" % (
+            server.clients, server.published, server.sent, server.dropped)
+except KeyboardInterrupt:
+    pass
+finally:
+    server.stop()
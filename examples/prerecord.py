@@ -0,0 +1,31 @@
+# Pre-event recording: the encoder output only goes to a memory ring, and the
+# ten seconds before motion are written out when motion is seen. Nothing
+# touches the SD card until then.
+import threading
+import time
+import picam
+
+width = 1280
+height = 720
+PREROLL = 10        # seconds kept before the event
+MOVING_MIN = 20     # macroblocks per region
+
+analyser = picam.VectorAnalyser(columns=4, rows=3, threshold=10)
+# about 17Mbit/s at 1280x720, so 32MB holds a bit more than the pre-roll
+ring = picam.H264Ring(size=32*1024*1024)
+recording = threading.Thread(target=picam.recordVideoWithDetails,
+                             args=(None, width, height, 600000, analyser, ring))
+recording.start()
+
+seen = 0
+while recording.is_alive():
+    if not analyser.wait(seen, 1.0):
+        continue
+    seen = analyser.frames
+    if max(analyser.moving) > MOVING_MIN:
+        filename = "/tmp/event-%s.h264" % time.strftime("%Y%m%d-%H%M%S")
+        written = ring.dump(filename, PREROLL)
+        print "wrote", written, "bytes to", filename, "ring holds %.1fs" % ring.seconds
+        # let the next pre-roll fill up
+        time.sleep(PREROLL)
+recording.join()
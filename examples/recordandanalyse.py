@@ -0,0 +1,18 @@
+# Record 1080p H264 and run a background motion model on 320x240 luma frames
+# from the same camera at the same time. The analysis frames come from the
+# camera preview port with buffers of their own, so when the model is slower
+# than the camera only analysis frames are dropped, the recording loses nothing.
+import picam
+
+recorder = picam.startRecording("/tmp/dual.h264", 1920, 1080, 60000,
+                                analysis=(320, 240, picam.PICAM_FORMAT_LUMA))
+detector = picam.MotionDetector(320, 240, picam.PICAM_FORMAT_LUMA, threshold=15, rate=4, columns=8, rows=6)
+analysis = recorder.analysis
+try:
+    # ends when the recording does
+    for frame in analysis:
+        if detector.update(frame) > 200:
+            print "motion at %.2fs, %d analysis frames dropped, %d video frames recorded" % (
+                frame.timestamp / 1e6, analysis.dropped, recorder.frames)
+finally:
+    recorder.stop()
@@ -0,0 +1,23 @@
+# Record in the background while the main thread carries on, splitting the
+# recording into one file a minute without losing any frames in between.
+import time
+import picam
+
+width = 1280
+height = 720
+PART = 60    # seconds
+
+def partname():
+    return "/tmp/picam-%s.h264" % time.strftime("%Y%m%d-%H%M%S")
+
+# duration 0 records until stop()
+recorder = picam.startRecording(partname(), width, height)
+try:
+    for part in range(10):
+        # wait() returns early if the recording fails or is stopped elsewhere
+        if recorder.wait(PART):
+            break
+        recorder.split(partname())
+        print "%d frames, %.1fs so far" % (recorder.frames, recorder.elapsed)
+finally:
+    recorder.stop()
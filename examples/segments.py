@@ -0,0 +1,23 @@
+# Continuous recording in one minute segments, keeping the last hour on disk.
+# The camera and encoder are set up once, each segment starts on an IDR frame
+# with its own SPS/PPS so it plays on its own, and no frames fall between them.
+# The .mp4 names make each segment a fragmented MP4 with the encoder's
+# timestamps, ready to play or serve without remuxing.
+import glob
+import os
+import picam
+
+PATTERN = "/tmp/cam-%06d.mp4"
+KEEP = 60
+
+recorder = picam.startRecording(PATTERN, 1280, 720, segmentSeconds=60)
+try:
+    last = 0
+    while not recorder.wait(5.0):
+        if recorder.segment != last:
+            last = recorder.segment
+            print "segment", last, "started,", recorder.droppedBuffers, "buffers dropped so far"
+            for old in sorted(glob.glob(PATTERN.replace("%06d", "*")))[:-KEEP]:
+                os.remove(old)
+finally:
+    recorder.stop()
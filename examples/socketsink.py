@@ -0,0 +1,33 @@
+# Stream live H264 to local readers through a UNIX socket, no temporary
+# files. The stream is written straight from the encoder's buffers, so a
+# reader that cannot keep up holds back the encoder instead of filling memory.
+#
+# Watch it with:  socat UNIX-CONNECT:/tmp/picam.sock - | ffplay -f h264 -
+import os
+import socket
+import time
+import picam
+
+PATH = "/tmp/picam.sock"
+
+if os.path.exists(PATH):
+    os.remove(PATH)
+server = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+server.bind(PATH)
+server.listen(1)
+
+while True:
+    print "waiting for a reader on", PATH
+    connection, _ = server.accept()
+    start = time.time()
+    # ends when the reader hangs up, the recording is then aborted
+    recorder = picam.startRecording(None, 1280, 720, sink=connection)
+    try:
+        while not recorder.wait(5.0):
+            seconds = time.time() - start
+            print "%.1f MB/s, encoder held back %d times" % (recorder.sinkBytes / seconds / 1e6, recorder.sinkStalls)
+    except IOError:
+        print "reader went away"
+    finally:
+        recorder.stop()
+        connection.close()
@@ -0,0 +1,22 @@
+# Motion detection on a continuous luma stream from the video port, rather than
+# a full still capture per comparison as in motiontest.py
+import picam
+
+width = 320
+height = 240
+
+THRESHOLD = 15
+QUANITY_MIN = 50
+
+stream = picam.FrameStream(width, height, 30, picam.PICAM_FORMAT_LUMA)
+previous = None
+for frame in stream:
+    if previous is not None:
+        (q, _) = picam.differenceFrames(previous, frame, THRESHOLD)
+        print q, stream.dropped
+        if q > QUANITY_MIN:
+            picam.LEDOn()
+        else:
+            picam.LEDOff()
+    # holds on to one stream buffer until the next frame arrives
+    previous = frame
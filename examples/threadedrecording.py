@@ -0,0 +1,71 @@
+import os
+import threading
+import time
+import picam
+
+# The camera calls release the GIL, and only calls that drive the camera
+# wait for each other. While a recording blocks one thread, a plain Python
+# ticker and picam work that needs no camera both keep running in others.
+# Exits non-zero if they were held up or an output file came out empty.
+VIDEO = "/tmp/threaded.h264"
+IMAGE = "/tmp/threaded.pgm"
+WIDTH, HEIGHT = 320, 240
+
+ticks = []
+work = []
+errors = []
+running = True
+
+def ticker():
+    while running:
+        ticks.append(time.time())
+        time.sleep(0.01)
+
+def worker():
+    # differenceBuffers and saveImage take no camera lock
+    a = bytearray(os.urandom(WIDTH * HEIGHT))
+    b = bytearray(os.urandom(WIDTH * HEIGHT))
+    try:
+        while running:
+            begun = time.time()
+            count, mask = picam.differenceBuffers(a, b, WIDTH, HEIGHT, 0, picam.PICAM_FORMAT_LUMA, 20, picam.PICAM_DIFF_MASK_BYTES)
+            picam.saveImage(mask, IMAGE, WIDTH, HEIGHT, WIDTH, picam.PICAM_FORMAT_LUMA)
+            work.append((begun, time.time()))
+            time.sleep(0.01)
+    except Exception as e:
+        errors.append(e)
+
+def record():
+    try:
+        picam.recordVideoWithDetails(VIDEO, 640, 480, 5000)
+    except Exception as e:
+        errors.append(e)
+
+for path in (VIDEO, IMAGE):
+    if os.path.exists(path):
+        os.remove(path)
+
+threads = [threading.Thread(target=ticker), threading.Thread(target=worker)]
+for t in threads:
+    t.start()
+recording = threading.Thread(target=record)
+start = time.time()
+recording.start()
+recording.join()
+elapsed = time.time() - start
+running = False
+for t in threads:
+    t.join()
+
+during = len([x for x in ticks if start <= x <= start + elapsed])
+overlapping = len([w for w in work if start <= w[0] and w[1] <= start + elapsed])
+print "recorded %.1fs, ticker ran %d times and %d frames were differenced and saved meanwhile" % (elapsed, during, overlapping)
+
+assert not errors, "failed: %s" % errors
+for path in (VIDEO, IMAGE):
+    assert os.path.exists(path) and os.path.getsize(path) > 0, "%s is missing or empty" % path
+assert elapsed >= 4.0, "the recording ended after %.1fs instead of 5s" % elapsed
+# The ticker wakes about 100 times a second, half that leaves room for a busy Pi
+assert during >= elapsed * 50, "other threads were blocked during the recording"
+assert overlapping >= elapsed * 10, "work without the camera waited for the recording"
+print "ok"
@@ -0,0 +1,27 @@
+# Motion detection while recording, from the motion vectors the H264 encoder
+# computes anyway. No pixels are compared on the ARM core.
+import threading
+import picam
+
+width = 1280
+height = 720
+MOVING_MIN = 20     # macroblocks per region
+
+analyser = picam.VectorAnalyser(columns=4, rows=3, threshold=10)
+recording = threading.Thread(target=picam.recordVideoWithDetails,
+                             args=('/tmp/vectors.h264', width, height, 30000, analyser))
+recording.start()
+
+seen = 0
+while recording.is_alive():
+    if not analyser.wait(seen, 1.0):
+        continue
+    seen = analyser.frames
+    moving = analyser.moving
+    busiest = max(range(len(moving)), key=lambda i: moving[i])
+    if moving[busiest] > MOVING_MIN:
+        print analyser.timestamp, "motion in region", busiest, "mean vector %.1f" % analyser.magnitude[busiest]
+        picam.LEDOn()
+    else:
+        picam.LEDOff()
+recording.join()
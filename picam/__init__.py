@@ -1,11 +1,11 @@
 # Copyright (c) 2013 Sean Ashton
 # Licensed under the terms of the MIT License (see LICENSE.txt)
 from _picam import *
-import StringIO
+import cStringIO
 from PIL import Image
-import ImageDraw
 import RPi.GPIO as GPIO
 import os
+import threading
 GPIO_AVAILABLE = True
 
 config = _picam.config
@@ -29,39 +29,116 @@ def LEDOff():
        
 def difference(list1,list2, tolerance):
     return _picam.difference(list1,list2, tolerance)
+
+def differenceFrames(frame1, frame2, tolerance, mask=PICAM_DIFF_MASK_NONE):
+    return _picam.differenceBuffers(frame1, frame2, frame1.width, frame1.height, frame1.stride, frame1.format, tolerance, mask)
    
 def takeRGBPhotoWithDetails(width, height):
     return _picam.takeRGBPhotoWithDetails(width, height)
         
+def _openFrame(frame):
+    # cStringIO reads straight from the frame's buffer, PIL only copies what it decodes
+    return Image.open(cStringIO.StringIO(frame))
+
 def takePhoto():
-    s = _picam.takePhoto()
-    ss = StringIO.StringIO(s)
-    i = Image.open(ss)
-    return i     
+    return _openFrame(_picam.takePhoto())
 
 def takePhotoWithDetails(width, height, quality):
-    s = _picam.takePhotoWithDetails(width, height, quality)
-    ss = StringIO.StringIO(s)
-    i = Image.open(ss)
-    return i 
+    return _openFrame(_picam.takePhotoWithDetails(width, height, quality))
+    
+class CameraSession(object):
+    """Keeps the camera set up between captures. The graph is only rebuilt
+    when the requested size or encoding changes."""
+    def __init__(self):
+        self._session = _picam.CameraSession()
+
+    def takePhoto(self):
+        return _openFrame(self._session.takePhoto())
+
+    def takePhotoWithDetails(self, width, height, quality):
+        return _openFrame(self._session.takePhotoWithDetails(width, height, quality))
+
+    def takeRGBPhotoWithDetails(self, width, height):
+        return self._session.takeRGBPhotoWithDetails(width, height)
+
+    def takeRawPhotoWithDetails(self, width, height, format):
+        return self._session.takeRawPhotoWithDetails(width, height, format)
+
+    def takeBurst(self, count, width, height, quality, interval=0):
+        return self._session.takeBurst(count, width, height, quality, interval)
+
+    def takePhotoWithThumbnail(self, width, height, quality, thumbWidth, thumbHeight, thumbQuality=35):
+        return self._session.takePhotoWithThumbnail(width, height, quality, thumbWidth, thumbHeight, thumbQuality)
+
+    def close(self):
+        self._session.close()
     
-def recordVideoWithDetails(filename, width, height, duration):
-    directory = os.path.dirname(filename)
-    if os.path.exists(directory):
-        _picam.recordVideoWithDetails(filename, width, height, duration)
+def recordVideoWithDetails(filename, width, height, duration, analyser=None, ring=None, sink=None, bitrateRange=None):
+    # filename can be None when only recording into ring or sink (a pipe or socket)
+    # bitrateRange=(min, max) lets the bitrate follow how fast the output is taken
+    directory = os.path.dirname(filename) if filename else None
+    if filename is None or os.path.exists(directory):
+        _picam.recordVideoWithDetails(filename, width, height, duration, analyser, ring, sink, bitrateRange)
     else:
         raise Exception("Path does not exist!")
     
+def _feed(items, callback):
+    # each item goes back to its buffer once the callback lets go of it
+    for item in items:
+        callback(item)
+
+def _rates(recorder):
+    # one dict per bitrate adjustment until the recording ends
+    while True:
+        stats = recorder.nextRate()
+        if stats is None:
+            return
+        yield stats
+
+def _startFeeding(items, callback):
+    feeder = threading.Thread(target=_feed, args=(items, callback))
+    feeder.daemon = True
+    feeder.start()
+
+def startRecording(filename, width, height, duration=0, analyser=None, ring=None, segmentSeconds=0, segmentBytes=0, container=None, sink=None, analysis=None, analysisCallback=None,
+                   bitrateRange=None, rateCallback=None):
+    # returns at once, the Recorder handle has stop(), split(filename), wait([timeout])
+    # and applyConfig() to send changed camera settings to the running camera
+    # with segmentSeconds or segmentBytes, filename is a pattern such as "cam-%05d.h264"
+    # container is a PICAM_CONTAINER_* constant, by default .mp4 names get fragmented MP4
+    # sink gets the raw H264 as well: a descriptor or socket, or a callable given
+    # each chunk on a thread of its own (a slow callable holds back the encoder)
+    # analysis=(width, height[, format]) adds small raw frames from the same camera,
+    # read from recorder.analysis or given to analysisCallback on a thread of its own
+    # (a slow callable only loses analysis frames)
+    # bitrateRange=(min, max[, minQP, maxQP[, interval ms]]) adapts the bitrate to how
+    # fast the file or sink keeps up; rateCallback gets a dict of the target and the
+    # measured rates after every adjustment, on a thread of its own
+    directory = os.path.dirname(filename) if filename else None
+    if filename is None or os.path.exists(directory):
+        chunks = callable(sink) and not hasattr(sink, "fileno")
+        recorder = _picam.Recorder(filename, width, height, duration, analyser, ring, segmentSeconds, segmentBytes, container,
+                                   None if chunks else sink, chunks, analysis, bitrateRange)
+        if chunks:
+            _startFeeding(recorder, sink)
+        if analysisCallback is not None and recorder.analysis is not None:
+            _startFeeding(recorder.analysis, analysisCallback)
+        if rateCallback is not None and bitrateRange is not None:
+            _startFeeding(_rates(recorder), rateCallback)
+        return recorder
+    else:
+        raise Exception("Path does not exist!")
+    
+_NATIVE_IMAGES = (".ppm", ".pgm", ".bmp", ".png")
+
 def saveRGBToImage(rgb_list, filename, width, height):
-    im = Image.new("RGB", (width, height), "white")
-    draw  =  ImageDraw.Draw(im)
-    for i in range(0, len(rgb_list)):
-        rgb = rgb_list[i]
-        r = (rgb>>16) & 0x0ff
-        g = (rgb>>8) & 0x0ff
-        b = (rgb)    & 0x0ff
-        x = i % width
-        y = i / height
-        color = (r,g,b)
-        draw.point((x,(height-1)-y),color)
-    im.save(filename)
\ No newline at end of file
+    # rgb_list is the bottom up list of 0xRRGGBB ints from takeRGBPhotoWithDetails
+    # .ppm, .pgm, .bmp and .png are written natively, other formats through PIL
+    if os.path.splitext(filename)[1].lower() in _NATIVE_IMAGES:
+        _picam.saveImage(rgb_list, filename, width, height)
+    else:
+        Image.frombuffer("RGB", (width, height), _picam.packRGBList(rgb_list, width, height), "raw", "RGB", 0, 1).save(filename)
+
+def saveFrame(frame, filename):
+    # a packed Frame (RGB24, BGR24, LUMA or the Y plane of I420) as .ppm, .pgm, .bmp or .png
+    _picam.saveImage(frame, filename, frame.width, frame.height, frame.stride, frame.format)
\ No newline at end of file
@@ -5,9 +5,9 @@ module1 = Extension('picam._picam',
                     define_macros = [('MAJOR_VERSION', '1'),
                                      ('MINOR_VERSION', '0')],
                     include_dirs = ['/usr/local/include','/opt/vc/include','/opt/vc/include/interface/vcos/pthreads','/opt/vc/include/interface/vmcs_host/linux/'],
-                    libraries = ['mmal','vcos','bcm_host'],
+                    libraries = ['mmal','vcos','bcm_host','pthread','m'],
                     library_dirs = ['/usr/local/lib','/opt/vc/lib'],
-                    sources = ['./src/picammodule.c','./src/picam.c','./src/RaspiCamControl.c'])
+                    sources = ['./src/picammodule.c','./src/picam.c','./src/RaspiCamControl.c','./src/picambuffer.c','./src/picamframequeue.c','./src/picamdiff.c','./src/picammotion.c','./src/picamvectors.c','./src/picamring.c','./src/picamwriter.c','./src/picammp4.c','./src/picamsink.c','./src/picamhttp.c','./src/picamrate.c','./src/picamimage.c','./src/picamexif.c'])
 
 setup (name = 'picam',
        version = '1.0',
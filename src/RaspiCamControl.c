@@ -376,28 +376,106 @@ int raspicamcontrol_get_all_parameters(MMAL_COMPONENT_T *camera, RASPICAM_CAMERA
  */
 int raspicamcontrol_set_all_parameters(MMAL_COMPONENT_T *camera, const RASPICAM_CAMERA_PARAMETERS *params)
 {
-   int result;
-
-   result  = raspicamcontrol_set_saturation(camera, params->saturation);
-   result += raspicamcontrol_set_sharpness(camera, params->sharpness);
-   result += raspicamcontrol_set_contrast(camera, params->contrast);
-   result += raspicamcontrol_set_brightness(camera, params->brightness);
-   result += raspicamcontrol_set_ISO(camera, params->ISO);
-   result += raspicamcontrol_set_video_stabilisation(camera, params->videoStabilisation);
-   result += raspicamcontrol_set_exposure_compensation(camera, params->exposureCompensation);
-   result += raspicamcontrol_set_exposure_mode(camera, params->exposureMode);
-   result += raspicamcontrol_set_metering_mode(camera, params->exposureMeterMode);
-   result += raspicamcontrol_set_awb_mode(camera, params->awbMode);
-   result += raspicamcontrol_set_imageFX(camera, params->imageEffect);
-   result += raspicamcontrol_set_colourFX(camera, &params->colourEffects);
-   //result += raspicamcontrol_set_thumbnail_parameters(camera, &params->thumbnailConfig);  TODO Not working for some reason
-   result += raspicamcontrol_set_rotation(camera, params->rotation);
-   result += raspicamcontrol_set_flips(camera, params->hflip, params->vflip);   
-   result += raspicamcontrol_set_ROI(camera, params->roi);
-   result += raspicamcontrol_set_shutter_speed(camera, params->shutter_speed);   
+   return raspicamcontrol_set_parameters(camera, params, RASPICAM_PARAM_ALL);
+}
+
+/**
+ * Set the specified camera to some of the specified settings, leaving the rest as they are.
+ * Each setting costs at least one round trip to the camera's ports, so a live camera
+ * should only be given the ones that changed, see raspicamcontrol_changed_parameters
+ * @param camera Pointer to camera component
+ * @param params Pointer to parameter block containing parameters
+ * @param which RASPICAM_PARAM_* bits of the settings to apply
+ * @return 0 if successful, none-zero if unsuccessful.
+ */
+int raspicamcontrol_set_parameters(MMAL_COMPONENT_T *camera, const RASPICAM_CAMERA_PARAMETERS *params, unsigned int which)
+{
+   int result = 0;
+
+   if (which & RASPICAM_PARAM_SATURATION)
+      result += raspicamcontrol_set_saturation(camera, params->saturation);
+   if (which & RASPICAM_PARAM_SHARPNESS)
+      result += raspicamcontrol_set_sharpness(camera, params->sharpness);
+   if (which & RASPICAM_PARAM_CONTRAST)
+      result += raspicamcontrol_set_contrast(camera, params->contrast);
+   if (which & RASPICAM_PARAM_BRIGHTNESS)
+      result += raspicamcontrol_set_brightness(camera, params->brightness);
+   if (which & RASPICAM_PARAM_ISO)
+      result += raspicamcontrol_set_ISO(camera, params->ISO);
+   if (which & RASPICAM_PARAM_STABILISATION)
+      result += raspicamcontrol_set_video_stabilisation(camera, params->videoStabilisation);
+   if (which & RASPICAM_PARAM_EXPOSURE_COMP)
+      result += raspicamcontrol_set_exposure_compensation(camera, params->exposureCompensation);
+   if (which & RASPICAM_PARAM_EXPOSURE_MODE)
+      result += raspicamcontrol_set_exposure_mode(camera, params->exposureMode);
+   if (which & RASPICAM_PARAM_METERING_MODE)
+      result += raspicamcontrol_set_metering_mode(camera, params->exposureMeterMode);
+   if (which & RASPICAM_PARAM_AWB_MODE)
+      result += raspicamcontrol_set_awb_mode(camera, params->awbMode);
+   if (which & RASPICAM_PARAM_IMAGEFX)
+      result += raspicamcontrol_set_imageFX(camera, params->imageEffect);
+   if (which & RASPICAM_PARAM_COLOURFX)
+      result += raspicamcontrol_set_colourFX(camera, &params->colourEffects);
+   // Thumbnails belong to the image encoder, not the camera, see set_thumbnail in picam.c
+   if (which & RASPICAM_PARAM_ROTATION)
+      result += raspicamcontrol_set_rotation(camera, params->rotation);
+   if (which & RASPICAM_PARAM_FLIPS)
+      result += raspicamcontrol_set_flips(camera, params->hflip, params->vflip);
+   if (which & RASPICAM_PARAM_ROI)
+      result += raspicamcontrol_set_ROI(camera, params->roi);
+   if (which & RASPICAM_PARAM_SHUTTER_SPEED)
+      result += raspicamcontrol_set_shutter_speed(camera, params->shutter_speed);
    return result;
 }
 
+/**
+ * Work out which settings differ between two parameter blocks
+ * @param from Settings the camera has now
+ * @param to Settings wanted
+ * @return RASPICAM_PARAM_* bits of the settings that differ, 0 if none
+ */
+unsigned int raspicamcontrol_changed_parameters(const RASPICAM_CAMERA_PARAMETERS *from, const RASPICAM_CAMERA_PARAMETERS *to)
+{
+   unsigned int changed = 0;
+
+   if (from->saturation != to->saturation)
+      changed |= RASPICAM_PARAM_SATURATION;
+   if (from->sharpness != to->sharpness)
+      changed |= RASPICAM_PARAM_SHARPNESS;
+   if (from->contrast != to->contrast)
+      changed |= RASPICAM_PARAM_CONTRAST;
+   if (from->brightness != to->brightness)
+      changed |= RASPICAM_PARAM_BRIGHTNESS;
+   if (from->ISO != to->ISO)
+      changed |= RASPICAM_PARAM_ISO;
+   if (from->videoStabilisation != to->videoStabilisation)
+      changed |= RASPICAM_PARAM_STABILISATION;
+   if (from->exposureCompensation != to->exposureCompensation)
+      changed |= RASPICAM_PARAM_EXPOSURE_COMP;
+   if (from->exposureMode != to->exposureMode)
+      changed |= RASPICAM_PARAM_EXPOSURE_MODE;
+   if (from->exposureMeterMode != to->exposureMeterMode)
+      changed |= RASPICAM_PARAM_METERING_MODE;
+   if (from->awbMode != to->awbMode)
+      changed |= RASPICAM_PARAM_AWB_MODE;
+   if (from->imageEffect != to->imageEffect)
+      changed |= RASPICAM_PARAM_IMAGEFX;
+   if (from->colourEffects.enable != to->colourEffects.enable ||
+       from->colourEffects.u != to->colourEffects.u ||
+       from->colourEffects.v != to->colourEffects.v)
+      changed |= RASPICAM_PARAM_COLOURFX;
+   if (from->rotation != to->rotation)
+      changed |= RASPICAM_PARAM_ROTATION;
+   if (from->hflip != to->hflip || from->vflip != to->vflip)
+      changed |= RASPICAM_PARAM_FLIPS;
+   if (from->roi.x != to->roi.x || from->roi.y != to->roi.y ||
+       from->roi.w != to->roi.w || from->roi.h != to->roi.h)
+      changed |= RASPICAM_PARAM_ROI;
+   if (from->shutter_speed != to->shutter_speed)
+      changed |= RASPICAM_PARAM_SHUTTER_SPEED;
+   return changed;
+}
+
 /**
  * Adjust the saturation level for images
  * @param camera Pointer to camera component
@@ -132,6 +132,28 @@ typedef struct
    int shutter_speed;         /// 0 = auto, otherwise the shutter speed in ms
 } RASPICAM_CAMERA_PARAMETERS;
 
+/// One bit per setting applied by raspicamcontrol_set_parameters
+enum
+{
+   RASPICAM_PARAM_SATURATION     = 1 << 0,
+   RASPICAM_PARAM_SHARPNESS      = 1 << 1,
+   RASPICAM_PARAM_CONTRAST       = 1 << 2,
+   RASPICAM_PARAM_BRIGHTNESS     = 1 << 3,
+   RASPICAM_PARAM_ISO            = 1 << 4,
+   RASPICAM_PARAM_STABILISATION  = 1 << 5,
+   RASPICAM_PARAM_EXPOSURE_COMP  = 1 << 6,
+   RASPICAM_PARAM_EXPOSURE_MODE  = 1 << 7,
+   RASPICAM_PARAM_METERING_MODE  = 1 << 8,
+   RASPICAM_PARAM_AWB_MODE       = 1 << 9,
+   RASPICAM_PARAM_IMAGEFX        = 1 << 10,
+   RASPICAM_PARAM_COLOURFX       = 1 << 11,
+   RASPICAM_PARAM_ROTATION       = 1 << 12,   /// Sets all three output ports
+   RASPICAM_PARAM_FLIPS          = 1 << 13,   /// Sets all three output ports
+   RASPICAM_PARAM_ROI            = 1 << 14,
+   RASPICAM_PARAM_SHUTTER_SPEED  = 1 << 15,
+   RASPICAM_PARAM_ALL            = (1 << 16) - 1
+};
+
 
 void raspicamcontrol_check_configuration(int min_gpu_mem);
 
@@ -140,6 +162,8 @@ void raspicamcontrol_display_help();
 int raspicamcontrol_cycle_test(MMAL_COMPONENT_T *camera);
 
 int raspicamcontrol_set_all_parameters(MMAL_COMPONENT_T *camera, const RASPICAM_CAMERA_PARAMETERS *params);
+int raspicamcontrol_set_parameters(MMAL_COMPONENT_T *camera, const RASPICAM_CAMERA_PARAMETERS *params, unsigned int which);
+unsigned int raspicamcontrol_changed_parameters(const RASPICAM_CAMERA_PARAMETERS *from, const RASPICAM_CAMERA_PARAMETERS *to);
 int raspicamcontrol_get_all_parameters(MMAL_COMPONENT_T *camera, RASPICAM_CAMERA_PARAMETERS *params);
 void raspicamcontrol_dump_parameters(const RASPICAM_CAMERA_PARAMETERS *params);
 
@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <memory.h>
 
 #define VERSION_STRING "v1.2"
@@ -22,7 +23,14 @@
 #include "interface/mmal/util/mmal_connection.h"
 
 #include "RaspiCamControl.h"
+#include "picambuffer.h"
+#include "picamframequeue.h"
+#include "picamexif.h"
 #include <semaphore.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
 
 /// Camera number to use - we only have one camera, indexed from 0.
 #define CAMERA_NUMBER 0
@@ -39,14 +47,50 @@
 // Video format information
 #define VIDEO_FRAME_RATE_NUM 30
 #define VIDEO_FRAME_RATE_DEN 1
+/// Encoded video the writer thread can fall behind by, about two seconds at the default bitrate
+#define RECORDER_QUEUE_SIZE (4 * 1024 * 1024)
+/// Length of the fragments of a PICAM_CONTAINER_FMP4 recording, must fit in the writer queue
+#define RECORDER_FRAGMENT_MS 1000
+/// How long stopping an MP4 recording waits for the writer to make room for the moov or the last fragment
+#define RECORDER_FINISH_WAIT_MS 5000
+/// Largest write of the moov of a plain MP4 at the end of a recording, a long one outgrows the queue
+#define RECORDER_MOOV_PIECE (1024 * 1024)
+/// Encoder output buffers of a recording with a sink, how far the sink can fall behind before the encoder waits
+#define RECORDER_SINK_BUFFERS 16
+/// How often threads waiting on the sink queue check whether the recording has ended
+#define RECORDER_SINK_WAIT_MS 100
+/// How long a still taken while recording may take, from the trigger to the video running again
+#define RECORDER_STILL_WAIT_MS 5000
+/// Video frames watched after a still is done, the first frame after the sensor goes back to video shows the gap
+#define RECORDER_STILL_SETTLE_FRAMES 2
+/// Largest analysis frames of a recording, the camera's preview port limit
+#define RECORDER_ANALYSIS_MAX_WIDTH 640
+#define RECORDER_ANALYSIS_MAX_HEIGHT 480
+/// How often the bitrate of a recording is adapted when asked for, unless given
+#define RECORDER_RATE_INTERVAL_MS 500
+/// Largest raw captures taken from the video port and scaled on the GPU, larger ones use the still port
+#define SMALL_FRAME_MAX_WIDTH 640
+#define SMALL_FRAME_MAX_HEIGHT 480
+/// Video port size small frames are scaled from, the sensor's binned mode covering the whole field of view like a still
+#define SMALL_FRAME_SOURCE_WIDTH 1296
+#define SMALL_FRAME_SOURCE_HEIGHT 972
+/// Frame rate of the video port while a small frame is taken
+#define SMALL_FRAME_RATE 30
+/// Frames thrown away before a small frame is kept, while exposure and white balance settle
+#define SMALL_FRAME_SETTLE_FRAMES 8
+/// Frames thrown away by a session graph already running, the resizer may hold one from before the request
+#define SMALL_FRAME_STALE_FRAMES 1
+/// Clients an MJPEG server serves at once, more are refused
+#define MJPEG_MAX_CLIENTS 16
+/// Frames an MJPEG client can fall behind by before its oldest is dropped
+#define MJPEG_CLIENT_FRAMES 2
 
 // Max bitrate we allow for recording
 const int MAX_BITRATE = 25000000; // 25Mbits/s
 
-/// Interval at which we check for an failure abort during capture
-const int ABORT_INTERVAL = 100; // ms
-
 int mmal_status_to_int(MMAL_STATUS_T status);
+static MMAL_STATUS_T stream_attach(FrameStream *stream, MMAL_PORT_T *port, int slots);
+static void stream_detach(FrameStream *stream, MMAL_PORT_T *port);
 
 
 /** Structure containing all state information for the current run
@@ -56,8 +100,9 @@ typedef struct
    int width;                          /// Requested width of image
    int height;                         /// requested height of image
    int quality;                        /// JPEG quality setting (1-100)  
-   uint8_t *filedata;
-   long bytesStored;
+   MMAL_PARAM_THUMBNAIL_CONFIG_T thumbnail; /// Thumbnail the image encoder embeds in a JPEG's EXIF block, left to the encoder unless enable is set
+   PICAM_BUFFER output;                /// Encoded still, grown as the encoder hands over chunks
+   int64_t outputTimestamp;            /// Presentation time of the last completed still (us), MMAL_TIME_UNKNOWN if not given
    
    int videoEncode; 
    /* Video */
@@ -69,19 +114,36 @@ typedef struct
    int profile;                        /// H264 profile to use for encoding
    char *filename;                     /// filename of output file
    int immutableInput; 
+   int videoBuffers;                   /// Encoder output buffers wanted, 0 for the port's recommendation
+   int stillWidth;                     /// Size of the still port beside video, 0 to match width and height
+   int stillHeight;
+   int videoWidth;                     /// Size of the video port when resize_component scales it to width and height, 0 to match
+   int videoHeight;
+   int previewWidth;                   /// Size of packed frames wanted from the preview port, 0 to leave it opaque
+   int previewHeight;
+   MMAL_FOURCC_T previewEncoding;      /// Encoding of those frames
    
    /* End Video */
    MMAL_FOURCC_T encoding;             /// Encoding to use for the output file.   
+   int rawCapture;                     /// Non-zero when the still port hands packed pixels (encoding) straight to us, no image encoder
+   MMAL_POOL_T *still_pool;            /// Pool of buffers used by the still port when rawCapture is set
+   int rawVideo;                       /// Non-zero when the video port streams packed pixels (encoding) instead of opaque buffers
+   PICAM_VECTORS *vectors;             /// Receives the encoder's inline motion vectors, NULL to leave them off
+   PICAM_RING *ring;                   /// Keeps the most recent H264 stream in memory when set
   
    
    RASPICAM_CAMERA_PARAMETERS camera_parameters; /// Camera setup parameters
+   const void *paramsSource;           /// PicamParams source and generation camera_parameters were taken from
+   unsigned long paramsGeneration;
 
    MMAL_COMPONENT_T *preview_component;    
    MMAL_COMPONENT_T *camera_component;    /// Pointer to the camera component
    MMAL_COMPONENT_T *encoder_component;   /// Pointer to the encoder component
    MMAL_COMPONENT_T *null_sink_component; /// Pointer to the null sink component
+   MMAL_COMPONENT_T *resize_component;    /// Scales the video port to packed frames of width x height, NULL if unused
    MMAL_CONNECTION_T *preview_connection; /// Pointer to the connection from camera to preview
    MMAL_CONNECTION_T *encoder_connection; /// Pointer to the connection from camera to encoder
+   MMAL_CONNECTION_T *resize_connection;  /// Pointer to the connection from camera video port to resizer
 
    MMAL_POOL_T *encoder_pool; /// Pointer to the pool of buffers used by encoder output port
 
@@ -100,6 +162,122 @@ typedef struct
    
 } PORT_USERDATA;
 
+/** Long lived stills graph (camera, null sink preview and image encoder) that
+ *  is kept connected between captures. Small raw captures keep a scaled video
+ *  port graph instead, only one of the two holds the camera at a time.
+ */
+struct CameraSession
+{
+   RASPISTILL_STATE state;              /// State of the graph, valid while built is set
+   PORT_USERDATA callback_data;         /// Userdata handed to the encoder output port
+   int built;                           /// Non-zero once the graph is connected and the encoder output port is enabled
+   FrameStream *small;                  /// Video port and resizer of small raw captures, NULL if not running
+   PicamBatch small_batch;              /// Batch of one frame small is re-armed with for every capture
+   int small_width;                     /// Size and format small was started for, as asked
+   int small_height;
+};
+
+/** Camera video port streaming packed frames into a fixed set of slots
+ */
+struct FrameStream
+{
+   RASPISTILL_STATE state;              /// Camera and null sink preview, the video port is ours
+   MMAL_POOL_T *video_pool;             /// Buffers cycled through the video port
+   PICAM_FRAME_QUEUE queue;             /// Frames waiting for, or lent to, the reader
+   int format;                          /// One of the raw PICAM_FORMAT_* values
+   int stride;                          /// Bytes per row of the first plane
+   long frame_length;                   /// Bytes published per frame (Y plane only for PICAM_FORMAT_LUMA)
+   int fill_slot;                       /// Slot the port is currently writing into, -1 if none
+   uint8_t *fill_data;                  /// Start of fill_slot
+   long fill_length;                    /// Bytes copied into fill_slot so far, or into the batch frame being filled
+   int running;                         /// Non-zero while the video port is enabled
+   PicamBatch *batch;                   /// Filled instead of the queue when set, see captureBatchWithDetails
+   sem_t batch_done;                    /// Posted once the batch is full, only set up with batch
+   int skip_frames;                     /// Frames still to be thrown away before the batch starts filling
+};
+
+/** Image encoder fed continuously by the camera video port, every JPEG it
+ *  makes is handed to a local HTTP server, see startMjpegServer
+ */
+struct MjpegServer
+{
+   RASPISTILL_STATE state;              /// Camera, null sink preview and image encoder on the video port
+   PICAM_HTTP http;                     /// Serves the JPEGs, started before the camera
+   int running;                         /// Non-zero while the encoder output port is enabled
+   int abort;                           /// Set in the callback if a frame could not be kept
+   int stopped;                         /// Set once the server is stopped, final_stats hold its counters
+   PICAM_HTTP_STATS final_stats;
+};
+
+
+/** H264 recording running on the encoder callback, see startRecorder
+ */
+struct Recorder
+{
+   RASPISTILL_STATE state;              /// Camera and video encoder, connected while running
+   pthread_mutex_t lock;                /// Guards the fields below shared with the callback
+   pthread_cond_t changed;              /// Broadcast when the recording finishes or the file is switched
+   PICAM_WRITER writer;                 /// Writes the stream to disk off the callback thread
+   int writing;                         /// Non-zero once writer is running, only the taps want the stream until then
+   int next_fd;                         /// Handed to the writer at the next IDR frame, -1 if none
+   PICAM_WRITER_STATS writer_stats;     /// Final writer counters, kept once the writer is finished
+   uint8_t config[1024];                /// Last SPS/PPS, repeated at the start of a split file
+   size_t config_length;                /// Bytes held in config
+   int64_t duration;                    /// Presentation time to record (us), 0 until stopped
+   int64_t first_pts;                   /// Presentation time of the first frame, MMAL_TIME_UNKNOWN until seen
+   int64_t last_pts;                    /// Presentation time of the last complete frame
+   unsigned long frames;                /// Complete frames recorded
+   int finished;                        /// Set once the duration is reached, on a failure or when stopped
+   int abort;                           /// Set in the callback if writing fails
+   int running;                         /// Non-zero while the encoder output port is enabled
+   int stopping;                        /// Set once teardown has begun
+   uint32_t last_flags;                 /// Flags of the previous encoder buffer
+   /* Segments, pattern is NULL unless the recording rolls over to new files */
+   char *pattern;                       /// printf pattern of the segment names, given the segment number
+   int64_t segment_duration;            /// Presentation time per segment (us), 0 for no limit
+   long segment_bytes;                  /// Bytes per segment, 0 for no limit
+   int64_t segment_pts;                 /// Presentation time of the first frame of this segment
+   long segment_written;                /// Bytes of stream queued for this segment
+   int segment;                         /// Number of the current segment, from 0
+   int cut_due;                         /// Set once the segment is full, it ends at the next IDR frame
+   int want_idr;                        /// Asks control_thread to request an IDR frame
+   int frame_us;                        /// Frame interval (us)
+   pthread_t control_thread;            /// Requests IDR frames, which must not be done from the callback
+   int control_started;
+   /* MP4 output, the muxer turns the stream into samples for the writer */
+   int container;                       /// One of the PICAM_CONTAINER_* values
+   PICAM_MP4 mp4;                       /// Used unless container is PICAM_CONTAINER_H264
+   /* Sink, NULL sink_queue if none. Encoder buffers are held, not copied,
+      until the sink is done with them */
+   MMAL_QUEUE_T *sink_queue;            /// Buffers waiting for the sink, in stream order
+   int sink_pull;                       /// Buffers are handed out by recorderNextChunk, else written to sink
+   PICAM_SINK sink;                     /// Pipe or socket the sink thread writes to
+   pthread_t sink_thread;
+   int sink_started;
+   MMAL_BUFFER_HEADER_T **sink_slots;   /// Buffers handed out by recorderNextChunk, by slot
+   int sink_slot_count;
+   int sink_outstanding;                /// Buffers queued for or held by the sink
+   unsigned long sink_stalls;           /// Times the encoder was left without a buffer
+   uint64_t sink_bytes;                 /// Bytes handed to the sink
+   int encoder_kept;                    /// Teardown left the encoder for buffers the sink still held
+   /* Stills taken from the capture port while the video port keeps recording */
+   RASPISTILL_STATE still;              /// Image encoder on the still port, built by the first recorderTakePhoto
+   pthread_mutex_t branch_lock;         /// Serialises stills and stopping the analysis branch, teardown takes it before the graph goes
+   int still_done;                      /// Set by the image encoder callback once the still is complete
+   int still_abort;                     /// Set if the still failed
+   int still_watch;                     /// Frames to watch for the gap a still leaves, counted down once it is done
+   int64_t still_interval;              /// Longest time between two video frames while watching
+   /* Analysis frames from the preview port, with buffers and slots of their own */
+   FrameStream *analysis;               /// NULL unless the taps asked for them
+   int analysis_running;                /// Non-zero once the preview port is set up, until it is stopped
+   /* Bitrate adapted to how fast the stream is taken, on the control thread */
+   int rate_control;                    /// Non-zero if the taps asked for it
+   int rate_interval_ms;                /// Time between two samples
+   PICAM_RATE rate;                     /// Controller and its last stats, guarded by lock
+   uint64_t encoded_bytes;              /// Stream bytes the encoder has produced, updated with atomics
+   uint64_t sink_taken;                 /// Bytes of buffers the sink has given back, guarded by lock
+   unsigned long rate_dropped;          /// Buffers the writer had dropped at the previous sample
+};
 
 /**
  * Assign a default set of parameters to the state passed in
@@ -115,7 +293,11 @@ static void default_status(RASPISTILL_STATE *state)
    state->width = 2592;
    state->height = 1944;
    state->quality = 85;   
-   state->bytesStored = 0l;
+   state->thumbnail.enable = 0;
+   state->thumbnail.width = 64;
+   state->thumbnail.height = 48;
+   state->thumbnail.quality = 35;
+   picam_buffer_init(&state->output);
    /*Video*/
                     
    state->bitrate = 17000000;
@@ -125,11 +307,28 @@ static void default_status(RASPISTILL_STATE *state)
    state->quantisationParameter = 0;
    state->inlineHeaders = 0;
    state->profile = MMAL_VIDEO_PROFILE_H264_HIGH;
-
+   state->videoBuffers = 0;
+   state->stillWidth = 0;
+   state->stillHeight = 0;
+   state->videoWidth = 0;
+   state->videoHeight = 0;
+   state->previewWidth = 0;
+   state->previewHeight = 0;
+   state->previewEncoding = MMAL_ENCODING_I420;
+
+   state->preview_component = NULL;
    state->camera_component = NULL;
    state->encoder_component = NULL;   
+   state->resize_component = NULL;
+   state->preview_connection = NULL;
    state->encoder_connection = NULL;
+   state->resize_connection = NULL;
    state->encoder_pool = NULL;
+   state->still_pool = NULL;
+   state->rawCapture = 0;
+   state->rawVideo = 0;
+   state->vectors = NULL;
+   state->ring = NULL;
    state->encoding = MMAL_ENCODING_JPEG; //MMAL_ENCODING_BMP  
    raspicamcontrol_set_defaults(&state->camera_parameters);
    //state->camera_parameters.exposureMode = MMAL_PARAM_EXPOSUREMODE_NIGHT;
@@ -157,6 +356,16 @@ static void camera_control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
    mmal_buffer_header_release(buffer);
 }
 
+/**
+ * Translate MMAL buffer flags into PICAM_RING_* flags
+ */
+static int ring_flags(uint32_t flags)
+{
+   return ((flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME) ? PICAM_RING_KEYFRAME : 0) |
+          ((flags & MMAL_BUFFER_HEADER_FLAG_CONFIG) ? PICAM_RING_CONFIG : 0) |
+          ((flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) ? PICAM_RING_FRAME_END : 0);
+}
+
 /**
  *  buffer header callback function for encoder
  *
@@ -176,42 +385,19 @@ static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
    if (pData) {
         
        RASPISTILL_STATE *state = pData->pstate;   
-       int bytes_written = buffer->length;
-       if (state->videoEncode == 1) {          
-           vcos_assert(pData->file_handle);
-           if (buffer->length) {
-               mmal_buffer_header_mem_lock(buffer);
-               bytes_written = fwrite(buffer->data, 1, buffer->length, pData->file_handle);
-               mmal_buffer_header_mem_unlock(buffer);
-           }
-           if (bytes_written != buffer->length) {
-               vcos_log_error("Failed to write buffer data (%d from %d)- aborting", bytes_written, buffer->length);
+       if (buffer->length) {
+           mmal_buffer_header_mem_lock(buffer);             
+           if (picam_buffer_append(&state->output, buffer->data, buffer->length) != 0) {
+               vcos_log_error("Failed to grow the capture buffer (%d bytes stored)- aborting", (int)state->output.length);
                pData->abort = 1;
            }
-       } else {    
-          if (buffer->length) {
-              mmal_buffer_header_mem_lock(buffer);             
-              if ((state->bytesStored > 0) && (bytes_written > 0)) {
-                  long newLen = state->bytesStored + bytes_written;
-                  uint8_t *new_buffer = malloc(newLen);
-                  memcpy(new_buffer, state->filedata, state->bytesStored);
-                  memcpy(new_buffer + state->bytesStored, buffer->data, bytes_written);
-              
-                  free(state->filedata); //Free previous buffer
-              
-                  state->filedata = new_buffer;             
-                  state->bytesStored =  state->bytesStored + bytes_written;             
-              } else {
-                  state->filedata = malloc(bytes_written);
-                  memcpy(state->filedata, buffer->data, bytes_written);
-                  state->bytesStored = bytes_written;
-              }         
-              mmal_buffer_header_mem_unlock(buffer);                 
-          }
+           mmal_buffer_header_mem_unlock(buffer);                 
        }
        // Now flag if we have completed
-       if (buffer->flags & (MMAL_BUFFER_HEADER_FLAG_FRAME_END | MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED))
+       if (buffer->flags & (MMAL_BUFFER_HEADER_FLAG_FRAME_END | MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED)) {
+         state->outputTimestamp = buffer->pts;
          complete = 1;
+       }
    } else {
       vcos_log_error("Received a encoder buffer callback with no state");
    }
@@ -224,7 +410,9 @@ static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
       MMAL_STATUS_T status = MMAL_SUCCESS;
       MMAL_BUFFER_HEADER_T *new_buffer;
 
-      new_buffer = mmal_queue_get(pData->pstate->encoder_pool->queue);
+      MMAL_POOL_T *pool = pData->pstate->rawCapture ? pData->pstate->still_pool : pData->pstate->encoder_pool;
+
+      new_buffer = mmal_queue_get(pool->queue);
 
       if (new_buffer) {
          status = mmal_port_send_buffer(port, new_buffer);
@@ -251,8 +439,12 @@ static MMAL_STATUS_T create_video_camera_component(RASPISTILL_STATE *state)
 {
    MMAL_COMPONENT_T *camera = 0;
    MMAL_ES_FORMAT_T *format;
-   MMAL_PORT_T  *video_port = NULL, *still_port = NULL;
+   MMAL_PORT_T  *preview_port = NULL, *video_port = NULL, *still_port = NULL;
    MMAL_STATUS_T status;
+   int still_width = state->stillWidth ? state->stillWidth : state->width;
+   int video_width = state->videoWidth ? state->videoWidth : state->width;
+   int video_height = state->videoHeight ? state->videoHeight : state->height;
+   int still_height = state->stillHeight ? state->stillHeight : state->height;
 
    /* Create the component */
    status = mmal_component_create(MMAL_COMPONENT_DEFAULT_CAMERA, &camera);
@@ -269,6 +461,7 @@ static MMAL_STATUS_T create_video_camera_component(RASPISTILL_STATE *state)
    }
 
    
+   preview_port = camera->output[MMAL_CAMERA_PREVIEW_PORT];
    video_port = camera->output[MMAL_CAMERA_VIDEO_PORT];
    still_port = camera->output[MMAL_CAMERA_CAPTURE_PORT];
 
@@ -285,8 +478,8 @@ static MMAL_STATUS_T create_video_camera_component(RASPISTILL_STATE *state)
    MMAL_PARAMETER_CAMERA_CONFIG_T cam_config =
       {
          { MMAL_PARAMETER_CAMERA_CONFIG, sizeof(cam_config) },
-         .max_stills_w = state->width,
-         .max_stills_h = state->height,
+         .max_stills_w = still_width,
+         .max_stills_h = still_height,
          .stills_yuv422 = 0,
          .one_shot_stills = 1,
          .max_preview_video_w = 640,
@@ -301,18 +494,55 @@ static MMAL_STATUS_T create_video_camera_component(RASPISTILL_STATE *state)
    raspicamcontrol_set_all_parameters(camera, &state->camera_parameters);
    // Now set up the port formats
 
+   if (state->previewWidth) {
+      // Small packed frames scaled by the camera from the same sensor image as the video port
+      format = preview_port->format;
+      format->encoding = state->previewEncoding;
+      format->encoding_variant = 0;
+      format->es->video.width = VCOS_ALIGN_UP(state->previewWidth, 32);
+      format->es->video.height = VCOS_ALIGN_UP(state->previewHeight, 16);
+      format->es->video.crop.x = 0;
+      format->es->video.crop.y = 0;
+      format->es->video.crop.width = state->previewWidth;
+      format->es->video.crop.height = state->previewHeight;
+      format->es->video.frame_rate.num = state->framerate;
+      format->es->video.frame_rate.den = VIDEO_FRAME_RATE_DEN;
+
+      status = mmal_port_format_commit(preview_port);
+
+      if (status != MMAL_SUCCESS) {
+         vcos_log_error("camera preview format couldn't be set");
+         goto error;
+      }
+
+      // One whole frame per buffer
+      preview_port->buffer_size = preview_port->buffer_size_recommended;
+      if (preview_port->buffer_size < preview_port->buffer_size_min)
+         preview_port->buffer_size = preview_port->buffer_size_min;
+      preview_port->buffer_num = preview_port->buffer_num_recommended;
+      if (preview_port->buffer_num < VIDEO_OUTPUT_BUFFERS_NUM)
+         preview_port->buffer_num = VIDEO_OUTPUT_BUFFERS_NUM;
+   }
+
    // Set the encode format on the video  port
 
    format = video_port->format;
-   format->encoding_variant = MMAL_ENCODING_I420;
-
-   format->encoding = MMAL_ENCODING_OPAQUE;
-   format->es->video.width = state->width;
-   format->es->video.height = state->height;
+   if (state->rawVideo) {
+      // Packed pixels delivered to us, padded to whole macroblocks like the still port
+      format->encoding = state->encoding;
+      format->encoding_variant = 0;
+      format->es->video.width = VCOS_ALIGN_UP(state->width, 32);
+      format->es->video.height = VCOS_ALIGN_UP(state->height, 16);
+   } else {
+      format->encoding_variant = MMAL_ENCODING_I420;
+      format->encoding = MMAL_ENCODING_OPAQUE;
+      format->es->video.width = video_width;
+      format->es->video.height = video_height;
+   }
    format->es->video.crop.x = 0;
    format->es->video.crop.y = 0;
-   format->es->video.crop.width = state->width;
-   format->es->video.crop.height = state->height;
+   format->es->video.crop.width = video_width;
+   format->es->video.crop.height = video_height;
    format->es->video.frame_rate.num = state->framerate;
    format->es->video.frame_rate.den = VIDEO_FRAME_RATE_DEN;
 
@@ -323,6 +553,14 @@ static MMAL_STATUS_T create_video_camera_component(RASPISTILL_STATE *state)
       goto error;
    }
 
+   if (state->rawVideo) {
+      // One whole frame per buffer
+      video_port->buffer_size = video_port->buffer_size_recommended;
+      if (video_port->buffer_size < video_port->buffer_size_min)
+         video_port->buffer_size = video_port->buffer_size_min;
+      video_port->buffer_num = video_port->buffer_num_recommended;
+   }
+
    // Ensure there are enough buffers to avoid dropping frames
    if (video_port->buffer_num < VIDEO_OUTPUT_BUFFERS_NUM)
       video_port->buffer_num = VIDEO_OUTPUT_BUFFERS_NUM;
@@ -332,16 +570,24 @@ static MMAL_STATUS_T create_video_camera_component(RASPISTILL_STATE *state)
 
    format = still_port->format;
 
-   format->encoding = MMAL_ENCODING_OPAQUE;
-   if (state->videoEncode == 1) {
-       format->encoding_variant = MMAL_ENCODING_I420;
+   if (state->rawCapture) {
+       // Packed pixels straight off the port, which wants whole macroblocks
+       format->encoding = state->encoding;
+       format->encoding_variant = 0;
+       format->es->video.width = VCOS_ALIGN_UP(still_width, 32);
+       format->es->video.height = VCOS_ALIGN_UP(still_height, 16);
+   } else {
+       format->encoding = MMAL_ENCODING_OPAQUE;
+       if (state->videoEncode == 1) {
+           format->encoding_variant = MMAL_ENCODING_I420;
+       }
+       format->es->video.width = still_width;
+       format->es->video.height = still_height;
    }
-   format->es->video.width = state->width;
-   format->es->video.height = state->height;
    format->es->video.crop.x = 0;
    format->es->video.crop.y = 0;
-   format->es->video.crop.width = state->width;
-   format->es->video.crop.height = state->height;
+   format->es->video.crop.width = still_width;
+   format->es->video.crop.height = still_height;
    format->es->video.frame_rate.num = STILLS_FRAME_RATE_NUM;
    format->es->video.frame_rate.den = STILLS_FRAME_RATE_DEN;
 
@@ -353,6 +599,16 @@ static MMAL_STATUS_T create_video_camera_component(RASPISTILL_STATE *state)
       goto error;
    }
 
+   if (state->rawCapture) {
+      // We own the buffers on this port, a frame is delivered in recommended sized chunks
+      still_port->buffer_size = still_port->buffer_size_recommended;
+      if (still_port->buffer_size < still_port->buffer_size_min)
+         still_port->buffer_size = still_port->buffer_size_min;
+      still_port->buffer_num = still_port->buffer_num_recommended;
+      if (still_port->buffer_num < still_port->buffer_num_min)
+         still_port->buffer_num = still_port->buffer_num_min;
+   }
+
    /* Ensure there are enough buffers to avoid dropping frames */
    if (still_port->buffer_num < VIDEO_OUTPUT_BUFFERS_NUM)
       still_port->buffer_num = VIDEO_OUTPUT_BUFFERS_NUM;
@@ -397,6 +653,25 @@ static void destroy_camera_component(RASPISTILL_STATE *state)
 
 
 
+/**
+ * Tell the image encoder which thumbnail to embed in the EXIF block of its JPEGs.
+ * The encoder scales it from the image it is given, nothing is done on the ARM.
+ *
+ * @param encoder Image encoder component
+ * @param config Thumbnail wanted, enable 0 for none
+ * @return MMAL_SUCCESS if the encoder took it
+ */
+static MMAL_STATUS_T set_thumbnail(MMAL_COMPONENT_T *encoder, const MMAL_PARAM_THUMBNAIL_CONFIG_T *config)
+{
+   MMAL_PARAMETER_THUMBNAIL_CONFIG_T param = {{MMAL_PARAMETER_THUMBNAIL_CONFIGURATION, sizeof(MMAL_PARAMETER_THUMBNAIL_CONFIG_T)}, 0, 0, 0, 0};
+
+   param.enable = config->enable;
+   param.width = config->width;
+   param.height = config->height;
+   param.quality = config->quality;
+   return mmal_port_parameter_set(encoder->control, &param.hdr);
+}
+
 /**
  * Create the encoder component, set up its ports
  *
@@ -459,6 +734,14 @@ static MMAL_STATUS_T create_encoder_component(RASPISTILL_STATE *state)
       goto error;
    }
 
+   if (state->encoding == MMAL_ENCODING_JPEG && state->thumbnail.enable) {
+      status = set_thumbnail(encoder, &state->thumbnail);
+
+      if (status != MMAL_SUCCESS) {
+         vcos_log_error("Unable to set the thumbnail configuration");
+         goto error;
+      }
+   }
    
    //  Enable component
    status = mmal_component_enable(encoder);
@@ -538,6 +821,9 @@ static MMAL_STATUS_T create_video_encoder_component(RASPISTILL_STATE *state)
    if (encoder_output->buffer_num < encoder_output->buffer_num_min)
       encoder_output->buffer_num = encoder_output->buffer_num_min;
 
+   if (encoder_output->buffer_num < (uint32_t)state->videoBuffers)
+      encoder_output->buffer_num = state->videoBuffers;
+
    // Commit the port changes to the output port
    status = mmal_port_format_commit(encoder_output);
 
@@ -616,6 +902,12 @@ static MMAL_STATUS_T create_video_encoder_component(RASPISTILL_STATE *state)
       vcos_log_error("failed to set INLINE HEADER FLAG parameters");
       // Continue rather than abort..
    }
+   //set INLINE VECTORS flag to get a motion vector field after every frame if requested
+   if (state->vectors && mmal_port_parameter_set_boolean(encoder_output, MMAL_PARAMETER_VIDEO_ENCODE_INLINE_VECTORS, 1) != MMAL_SUCCESS)
+   {
+      vcos_log_error("failed to set INLINE VECTORS parameters");
+      // Continue rather than abort..
+   }
    //  Enable component
    status = mmal_component_enable(encoder);
 
@@ -657,6 +949,7 @@ static void destroy_encoder_component(RASPISTILL_STATE *state)
    // Get rid of any port buffers first
    if (state->encoder_pool) {
       mmal_port_pool_destroy(state->encoder_component->output[0], state->encoder_pool);
+      state->encoder_pool = NULL;
    }
 
    if (state->encoder_component) {
@@ -665,6 +958,114 @@ static void destroy_encoder_component(RASPISTILL_STATE *state)
    }
 }
 
+/**
+ * Create the component scaling the camera video port to packed frames of
+ * state->width x state->height in state->encoding. The camera must already
+ * be created, its video port opaque at state->videoWidth x state->videoHeight.
+ * The output port is left for the caller to enable.
+ *
+ * @param state Pointer to state control struct. resize_component is set if successful.
+ *
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+static MMAL_STATUS_T create_resize_component(RASPISTILL_STATE *state)
+{
+   MMAL_COMPONENT_T *resizer = 0;
+   MMAL_PORT_T *video_port = state->camera_component->output[MMAL_CAMERA_VIDEO_PORT];
+   MMAL_PORT_T *resize_input, *resize_output;
+   MMAL_ES_FORMAT_T *format;
+   MMAL_STATUS_T status;
+   // vc.ril.resize has no 24 bit RGB output, the ISP converts as it scales
+   const char *name = state->encoding == MMAL_ENCODING_I420 ? "vc.ril.resize" : "vc.ril.isp";
+
+   status = mmal_component_create(name, &resizer);
+
+   if (status != MMAL_SUCCESS) {
+      vcos_log_error("Unable to create %s component", name);
+      goto error;
+   }
+
+   if (!resizer->input_num || !resizer->output_num) {
+      status = MMAL_ENOSYS;
+      vcos_log_error("%s doesn't have input/output ports", name);
+      goto error;
+   }
+
+   resize_input = resizer->input[0];
+   resize_output = resizer->output[0];
+
+   // Opaque frames straight from the camera, nothing is copied on the way in
+   mmal_format_copy(resize_input->format, video_port->format);
+   status = mmal_port_format_commit(resize_input);
+
+   if (status != MMAL_SUCCESS) {
+      vcos_log_error("Unable to set format on %s input port", name);
+      goto error;
+   }
+
+   // Packed pixels delivered to us, padded to whole macroblocks like the still port
+   format = resize_output->format;
+   mmal_format_copy(format, resize_input->format);
+   format->encoding = state->encoding;
+   format->encoding_variant = 0;
+   format->es->video.width = VCOS_ALIGN_UP(state->width, 32);
+   format->es->video.height = VCOS_ALIGN_UP(state->height, 16);
+   format->es->video.crop.x = 0;
+   format->es->video.crop.y = 0;
+   format->es->video.crop.width = state->width;
+   format->es->video.crop.height = state->height;
+   status = mmal_port_format_commit(resize_output);
+
+   if (status != MMAL_SUCCESS) {
+      vcos_log_error("Unable to set format on %s output port", name);
+      goto error;
+   }
+
+   // One whole frame per buffer
+   resize_output->buffer_size = resize_output->buffer_size_recommended;
+   if (resize_output->buffer_size < resize_output->buffer_size_min)
+      resize_output->buffer_size = resize_output->buffer_size_min;
+   resize_output->buffer_num = resize_output->buffer_num_recommended;
+   if (resize_output->buffer_num < VIDEO_OUTPUT_BUFFERS_NUM)
+      resize_output->buffer_num = VIDEO_OUTPUT_BUFFERS_NUM;
+
+   status = mmal_component_enable(resizer);
+
+   if (status != MMAL_SUCCESS) {
+      vcos_log_error("Unable to enable %s component", name);
+      goto error;
+   }
+
+   state->resize_component = resizer;
+
+   return status;
+
+   error:
+
+   if (resizer)
+      mmal_component_destroy(resizer);
+
+   return status;
+}
+
+/**
+ * Disconnect and destroy the resize component
+ *
+ * @param state Pointer to state control struct
+ */
+static void destroy_resize_component(RASPISTILL_STATE *state)
+{
+   if (state->resize_connection) {
+      mmal_connection_destroy(state->resize_connection);
+      state->resize_connection = NULL;
+   }
+   if (state->resize_component) {
+      mmal_component_disable(state->resize_component);
+      mmal_component_destroy(state->resize_component);
+      state->resize_component = NULL;
+   }
+}
+
 
 /**
  * Connect two specific ports together
@@ -702,348 +1103,2625 @@ static void check_disable_port(MMAL_PORT_T *port)
       mmal_port_disable(port);
 }
 
-uint8_t *takePhoto(PicamParams *parms, long *sizeread) { 
-    long test = 0l;    
-    uint8_t *tmp = internelPhotoWithDetails(2592,1944,85, MMAL_ENCODING_JPEG, parms, &test);        
-    *sizeread = test;   
-    return tmp;
+/**
+ * Copy the user supplied settings into the state structure
+ *
+ * @param state Pointer to state structure to fill
+ * @param parms Settings taken from picam.config
+ */
+static void fill_state_from_params(RASPISTILL_STATE *state, PicamParams *parms)
+{
+   state->bitrate = parms->videoBitrate;
+   state->framerate = parms->videoFramerate;
+   state->profile = parms->videoProfile;
+   state->quantisationParameter = parms->quantisationParameter;
+   state->inlineHeaders = parms->inlineHeaders;
+
+   state->camera_parameters = parms->camera;
+   state->paramsSource = parms->source;
+   state->paramsGeneration = parms->generation;
 }
 
-uint8_t *takePhotoWithDetails(int width, int height, int quality, PicamParams *parms, long *sizeread) {
-    long test = 0l;    
-    uint8_t *tmp = internelPhotoWithDetails(width,height,quality,MMAL_ENCODING_JPEG,parms, &test);        
-    *sizeread = test;   
-    return tmp;
+/**
+ * Bring a live camera up to new settings, sending it only the ones that changed
+ *
+ * @param state State of the running camera, camera_parameters holds what it was last given
+ * @param parms Settings wanted
+ * @param sent Set to the RASPICAM_PARAM_* bits of the settings sent, 0 if it was already
+ *             up to date. May be NULL
+ * @return 0 if the camera took them, non-zero if it rejected any. What it was last given
+ *         is then left alone, so the next call sends the same settings again
+ */
+static int apply_params(RASPISTILL_STATE *state, PicamParams *parms, unsigned int *sent)
+{
+   unsigned int changed = 0;
+
+   if (sent)
+      *sent = 0;
+   // Untouched since the camera was last given them, no need to compare
+   if (parms->source && parms->source == state->paramsSource && parms->generation == state->paramsGeneration)
+      return 0;
+   changed = raspicamcontrol_changed_parameters(&state->camera_parameters, &parms->camera);
+   if (sent)
+      *sent = changed;
+   if (changed && raspicamcontrol_set_parameters(state->camera_component, &parms->camera, changed) != 0) {
+      vcos_log_error("%s: Failed to apply some camera settings", __func__);
+      return 1;
+   }
+   state->camera_parameters = parms->camera;
+   state->paramsSource = parms->source;
+   state->paramsGeneration = parms->generation;
+   return 0;
 }
 
-uint8_t *takeRGBPhotoWithDetails(int width, int height, PicamParams *parms, long *sizeread) {
-    long test = 0l;    
-    uint8_t *tmp = internelPhotoWithDetails(width,height,100, MMAL_ENCODING_BMP, parms, &test);            
-    *sizeread = test;   
-    return tmp;
+/**
+ * Map a PICAM_FORMAT_* value to the encoding produced by the graph
+ *
+ * @param format One of the PICAM_FORMAT_* values
+ * @return The MMAL encoding, luma only captures are taken as I420
+ */
+static MMAL_FOURCC_T format_encoding(int format)
+{
+   switch (format) {
+   case PICAM_FORMAT_RGB24: return MMAL_ENCODING_RGB24;
+   case PICAM_FORMAT_BGR24: return MMAL_ENCODING_BGR24;
+   case PICAM_FORMAT_I420:
+   case PICAM_FORMAT_LUMA:  return MMAL_ENCODING_I420;
+   case PICAM_FORMAT_BMP:   return MMAL_ENCODING_BMP;
+   default:                 return MMAL_ENCODING_JPEG;
+   }
 }
 
-uint8_t *internelPhotoWithDetails(int width, int height, int quality,MMAL_FOURCC_T encoding, PicamParams *parms, long *sizeread) {
-   RASPISTILL_STATE state;   
-   MMAL_STATUS_T status = MMAL_SUCCESS;   
-   
-   MMAL_PORT_T *preview_input_port = NULL;
-   MMAL_PORT_T *camera_preview_port = NULL;
-   MMAL_PORT_T *camera_still_port = NULL;
-   MMAL_PORT_T *encoder_input_port = NULL;
-   MMAL_PORT_T *encoder_output_port = NULL;  
-   if (width > 2592) {
-       width = 2592;
-   } else if (width < 20) {
-       width = 20;
+/**
+ * @param format One of the PICAM_FORMAT_* values
+ * @return Non-zero if the format is packed pixels rather than an encoded image
+ */
+static int format_is_raw(int format)
+{
+   return format == PICAM_FORMAT_RGB24 || format == PICAM_FORMAT_BGR24 ||
+          format == PICAM_FORMAT_I420 || format == PICAM_FORMAT_LUMA;
+}
+
+/**
+ * Disconnect and destroy the stills graph of a session
+ *
+ * Safe to call on a partially built graph.
+ *
+ * @param session Session to tear down
+ */
+static void session_teardown(CameraSession *session)
+{
+   RASPISTILL_STATE *state = &session->state;
+
+   if (session->small) {
+      destroyFrameStream(session->small);
+      session->small = NULL;
    }
-   if (height > 1944) {
-       height = 1944;       
-   } else if (height < 20) {
-       height = 20;
+   free(session->small_batch.data);
+   free(session->small_batch.frames);
+   memset(&session->small_batch, 0, sizeof(session->small_batch));
+
+   if (state->encoder_component)
+      check_disable_port(state->encoder_component->output[0]);
+   if (state->camera_component)
+      check_disable_port(state->camera_component->output[MMAL_CAMERA_CAPTURE_PORT]);
+
+   if (state->encoder_connection) {
+      mmal_connection_destroy(state->encoder_connection);
+      state->encoder_connection = NULL;
    }
-   if (quality > 100) {
-       quality = 100;
-   } else if (quality < 0) {
-       quality = 85; 
-   }
-   bcm_host_init();          
-   default_status(&state);   
-   state.width = width;
-   state.height = height;
-   state.quality = quality;
-   state.encoding = encoding;
-   state.videoEncode = 0;
-   state.bitrate = parms->videoBitrate;
-   state.framerate = parms->videoFramerate;
-   state.profile = parms->videoProfile;
-   
-   state.camera_parameters.exposureMode = parms->exposure;
-   state.camera_parameters.exposureMeterMode = parms->meterMode;
-   state.camera_parameters.awbMode = parms->awbMode;
-   state.camera_parameters.imageEffect = parms->imageFX;   
-   state.camera_parameters.ISO = parms->ISO;
-   state.camera_parameters.sharpness = parms->sharpness;           
-   state.camera_parameters.contrast = parms->contrast;              
-   state.camera_parameters.brightness= parms->brightness;          
-   state.camera_parameters.saturation = parms->saturation;           
-   state.camera_parameters.videoStabilisation = parms->videoStabilisation;    /// 0 or 1 (false or true)
-   state.camera_parameters.exposureCompensation = parms->exposureCompensation; 
-   state.camera_parameters.rotation = parms->rotation;
-   state.camera_parameters.hflip = parms->hflip;
-   state.camera_parameters.vflip = parms->vflip;
-   state.camera_parameters.shutter_speed = parms->shutter_speed;  
-   state.camera_parameters.roi.x = parms->roi[0];
-   state.camera_parameters.roi.y = parms->roi[1];
-   state.camera_parameters.roi.w = parms->roi[2];
-   state.camera_parameters.roi.h = parms->roi[3];
-   
-   MMAL_COMPONENT_T *preview = 0;
-   
-   if ((status = create_video_camera_component(&state)) != MMAL_SUCCESS) {       
+   if (state->preview_connection) {
+      mmal_connection_destroy(state->preview_connection);
+      state->preview_connection = NULL;
+   }
+
+   if (state->encoder_component)
+      mmal_component_disable(state->encoder_component);
+
+   if (state->preview_component) {
+      mmal_component_disable(state->preview_component);
+      mmal_component_destroy(state->preview_component);
+      state->preview_component = NULL;
+   }
+   if (state->camera_component)
+      mmal_component_disable(state->camera_component);
+
+   if (state->still_pool) {
+      mmal_port_pool_destroy(state->camera_component->output[MMAL_CAMERA_CAPTURE_PORT], state->still_pool);
+      state->still_pool = NULL;
+   }
+   destroy_encoder_component(state);
+   destroy_camera_component(state);
+   picam_buffer_free(&state->output);
+
+   if (session->built)
+      vcos_semaphore_delete(&session->callback_data.complete_semaphore);
+
+   session->built = 0;
+}
+
+/**
+ * Build the stills graph and leave its output port enabled with all of its
+ * buffers queued, ready for repeated captures. Encoded formats go through the
+ * image encoder, raw formats are taken straight from the camera still port.
+ *
+ * @param session Session to build, must not already be built
+ * @param width Width of the stills
+ * @param height Height of the stills
+ * @param quality JPEG quality setting (1-100)
+ * @param format One of the PICAM_FORMAT_* values
+ * @param thumbnail Thumbnail to embed in JPEGs, NULL to leave it to the encoder
+ * @param parms Settings taken from picam.config
+ *
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+static MMAL_STATUS_T session_build(CameraSession *session, int width, int height, int quality, int format,
+                                   const MMAL_PARAM_THUMBNAIL_CONFIG_T *thumbnail, PicamParams *parms)
+{
+   RASPISTILL_STATE *state = &session->state;
+   MMAL_STATUS_T status = MMAL_SUCCESS;
+   MMAL_PORT_T *output_port = NULL;
+   MMAL_POOL_T *pool = NULL;
+   int num, q;
+
+   bcm_host_init();
+   default_status(state);
+   state->width = width;
+   state->height = height;
+   state->quality = quality;
+   state->encoding = format_encoding(format);
+   state->rawCapture = format_is_raw(format);
+   state->videoEncode = 0;
+   if (thumbnail)
+      state->thumbnail = *thumbnail;
+   fill_state_from_params(state, parms);
+
+   if ((status = create_video_camera_component(state)) != MMAL_SUCCESS) {
       vcos_log_error("%s: Failed to create camera component", __func__);
-   } else if ((status = mmal_component_create("vc.null_sink", &preview)) != MMAL_SUCCESS)  {
+      goto error;
+   }
+   if ((status = mmal_component_create("vc.null_sink", &state->preview_component)) != MMAL_SUCCESS) {
       vcos_log_error("%s: Failed to create preview component", __func__);
-      destroy_camera_component(&state);   
-   } else if ((status = create_encoder_component(&state)) != MMAL_SUCCESS) {     
-      vcos_log_error("%s: Failed to create encode component", __func__);      
-      destroy_camera_component(&state);
-   } else {       
-      status = mmal_component_enable(preview);
-      state.preview_component = preview;            
-      PORT_USERDATA callback_data;    
-      camera_preview_port = state.camera_component->output[MMAL_CAMERA_PREVIEW_PORT];
-      camera_still_port   = state.camera_component->output[MMAL_CAMERA_CAPTURE_PORT];
-      encoder_input_port  = state.encoder_component->input[0];
-      encoder_output_port = state.encoder_component->output[0];
-      preview_input_port  = state.preview_component->input[0];
-      
-      status = connect_ports(camera_preview_port, preview_input_port, &state.preview_connection);
-    
-      VCOS_STATUS_T vcos_status;
-         
-
-        // Now connect the camera to the encoder
-      status = connect_ports(camera_still_port, encoder_input_port, &state.encoder_connection);      
-      if (status != MMAL_SUCCESS) {
-          vcos_log_error("%s: Failed to connect camera video port to encoder input", __func__);
-          goto error;
+      state->preview_component = NULL;
+      goto error;
+   }
+
+   status = mmal_component_enable(state->preview_component);
+   status = connect_ports(state->camera_component->output[MMAL_CAMERA_PREVIEW_PORT], state->preview_component->input[0], &state->preview_connection);
+   if (status != MMAL_SUCCESS) {
+      vcos_log_error("%s: Failed to connect camera to preview", __func__);
+      state->preview_connection = NULL;
+      goto error;
+   }
+
+   if (state->rawCapture) {
+      output_port = state->camera_component->output[MMAL_CAMERA_CAPTURE_PORT];
+      state->still_pool = mmal_port_pool_create(output_port, output_port->buffer_num, output_port->buffer_size);
+      if (!state->still_pool) {
+         vcos_log_error("%s: Failed to create buffer header pool for camera still port", __func__);
+         status = MMAL_ENOMEM;
+         goto error;
+      }
+      pool = state->still_pool;
+   } else {
+      if ((status = create_encoder_component(state)) != MMAL_SUCCESS) {
+         vcos_log_error("%s: Failed to create encode component", __func__);
+         goto error;
       }
-      
-      // Set up our userdata - this is passed though to the callback where we need the information.
-      // Null until we open our filename     
-      callback_data.pstate = &state;      
-      vcos_status = vcos_semaphore_create(&callback_data.complete_semaphore, "picam-sem", 0);
-     
-      vcos_assert(vcos_status == VCOS_SUCCESS);
 
+      // Now connect the camera to the encoder
+      status = connect_ports(state->camera_component->output[MMAL_CAMERA_CAPTURE_PORT], state->encoder_component->input[0], &state->encoder_connection);
       if (status != MMAL_SUCCESS) {
-          vcos_log_error("Failed to setup encoder output");
-          goto error;
+         vcos_log_error("%s: Failed to connect camera still port to encoder input", __func__);
+         state->encoder_connection = NULL;
+         goto error;
       }
-            
-       
-      int num, q;                                                
-      // Enable the encoder output port
-      encoder_output_port->userdata = (struct MMAL_PORT_USERDATA_T *)&callback_data;
+      output_port = state->encoder_component->output[0];
+      pool = state->encoder_pool;
+   }
 
-      // Enable the encoder output port and tell it its callback function
-      status = mmal_port_enable(encoder_output_port, encoder_buffer_callback);
+   // Set up our userdata - this is passed though to the callback where we need the information.
+   session->callback_data.pstate = state;
+   session->callback_data.file_handle = NULL;
+   session->callback_data.abort = 0;
+   if (vcos_semaphore_create(&session->callback_data.complete_semaphore, "picam-sem", 0) != VCOS_SUCCESS) {
+      vcos_log_error("%s: Failed to create capture semaphore", __func__);
+      status = MMAL_ENOSPC;
+      goto error;
+   }
+   session->built = 1;
 
-      // Send all the buffers to the encoder output port
-      num = mmal_queue_length(state.encoder_pool->queue);
+   // Enable the output port and tell it its callback function
+   output_port->userdata = (struct MMAL_PORT_USERDATA_T *)&session->callback_data;
+   status = mmal_port_enable(output_port, encoder_buffer_callback);
+   if (status != MMAL_SUCCESS) {
+      vcos_log_error("%s: Failed to enable output port", __func__);
+      goto error;
+   }
 
-      for (q=0;q<num;q++) {
-         MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(state.encoder_pool->queue);
+   // Send all the buffers to the output port
+   num = mmal_queue_length(pool->queue);
 
-         if (!buffer)
-            vcos_log_error("Unable to get a required buffer %d from pool queue", q);
+   for (q=0;q<num;q++) {
+      MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(pool->queue);
 
-         if (mmal_port_send_buffer(encoder_output_port, buffer)!= MMAL_SUCCESS)
-            vcos_log_error("Unable to send a buffer to encoder output port (%d)", q);
-      }
+      if (!buffer)
+         vcos_log_error("Unable to get a required buffer %d from pool queue", q);
 
-      
+      if (mmal_port_send_buffer(output_port, buffer)!= MMAL_SUCCESS)
+         vcos_log_error("Unable to send a buffer to output port (%d)", q);
+   }
+   return MMAL_SUCCESS;
 
-      if (mmal_port_parameter_set_boolean(camera_still_port, MMAL_PARAMETER_CAPTURE, 1) != MMAL_SUCCESS) {
-         vcos_log_error("%s: Failed to start capture", __func__);
-      } else {
-         // Wait for capture to complete
-         // For some reason using vcos_semaphore_wait_timeout sometimes returns immediately with bad parameter error
-         // even though it appears to be all correct, so reverting to untimed one until figure out why its erratic
-         vcos_semaphore_wait(&callback_data.complete_semaphore);                
-      }                       
-      // Disable encoder output port
-      status = mmal_port_disable(encoder_output_port);
-      
-      *sizeread = state.bytesStored;
-           
-       vcos_semaphore_delete(&callback_data.complete_semaphore);      
-    }
-error:    
-    mmal_status_to_int(status);
-     
-    // Disable all our ports that are not handled by connections     
-    check_disable_port(encoder_output_port);  
-    mmal_connection_destroy(state.encoder_connection);
-
-    if (state.encoder_component)
-        mmal_component_disable(state.encoder_component);
-     
-    if (state.preview_component) {
-         mmal_component_disable(state.preview_component);        
-         mmal_component_destroy(state.preview_component);
-         state.preview_component = NULL;    
-    }
-    if (state.camera_component)
-        mmal_component_disable(state.camera_component);
-    
-    
-    destroy_encoder_component(&state);     
-    destroy_camera_component(&state);
-     
-
-    if (status != MMAL_SUCCESS)
-        raspicamcontrol_check_configuration(128);
-    
-    return state.filedata;
+error:
+   mmal_status_to_int(status);
+   session_teardown(session);
+   raspicamcontrol_check_configuration(128);
+   return status;
 }
 
-void internelVideoWithDetails(char *filename, int width, int height, int duration, PicamParams *parms) {
-   RASPISTILL_STATE state;   
-   MMAL_STATUS_T status = MMAL_SUCCESS;   
-   
-   
-   MMAL_PORT_T *camera_video_port = NULL;
-   MMAL_PORT_T *encoder_input_port = NULL;
-   MMAL_PORT_T *encoder_output_port = NULL; 
-   FILE *output_file = NULL;
-    
-   if (width > 1920) {
-       width = 1920;
-   } else if (width < 20) {
-       width = 20;
+/**
+ * Estimate the size of a still, used to size the output buffer before capture
+ *
+ * @param state Pointer to state control struct, the graph must already be built
+ * @return Number of bytes to reserve
+ */
+static long expected_still_size(RASPISTILL_STATE *state)
+{
+   long expected;
+
+   if (state->rawCapture) {
+      // Exactly one padded frame
+      return state->camera_component->output[MMAL_CAMERA_CAPTURE_PORT]->buffer_size_recommended;
    }
-   if (height > 1080) {
-       height = 1080;       
-   } else if (height < 20) {
-       height = 20;
+   if (state->encoding == MMAL_ENCODING_BMP) {
+      // 54 byte header followed by 24 bit rows padded to 4 bytes
+      expected = 54 + (long)((state->width * 3 + 3) & ~3) * state->height;
+   } else {
+      // Generous for JPEG, anything larger is handled by growing the buffer
+      expected = (long)state->width * state->height / 2;
    }
-   
-   bcm_host_init();       
-
-   default_status(&state);   
-   state.width = width;
-   state.height = height;
-   state.quality = 0;
-   state.videoEncode = 1;
-   state.filename = filename;
-   
-   state.bitrate = parms->videoBitrate;
-   state.framerate = parms->videoFramerate;
-   state.profile = parms->videoProfile;
-   state.quantisationParameter = parms->quantisationParameter;
-   state.inlineHeaders = parms->inlineHeaders;
-   
-   state.camera_parameters.exposureMode = parms->exposure;
-   state.camera_parameters.exposureMeterMode = parms->meterMode;
-   state.camera_parameters.awbMode = parms->awbMode;
-   state.camera_parameters.imageEffect = parms->imageFX;   
-   state.camera_parameters.ISO = parms->ISO;
-   state.camera_parameters.sharpness = parms->sharpness;           
-   state.camera_parameters.contrast = parms->contrast;              
-   state.camera_parameters.brightness= parms->brightness;          
-   state.camera_parameters.saturation = parms->saturation;           
-   state.camera_parameters.videoStabilisation = parms->videoStabilisation;    /// 0 or 1 (false or true)
-   state.camera_parameters.exposureCompensation = parms->exposureCompensation; 
-   state.camera_parameters.rotation = parms->rotation;
-   state.camera_parameters.hflip = parms->hflip;
-   state.camera_parameters.vflip = parms->vflip;
-   state.camera_parameters.shutter_speed = parms->shutter_speed;  
-   state.camera_parameters.roi.x = parms->roi[0];
-   state.camera_parameters.roi.y = parms->roi[1];
-   state.camera_parameters.roi.w = parms->roi[2];
-   state.camera_parameters.roi.h = parms->roi[3];
-   
-   if ((status = create_video_camera_component(&state)) != MMAL_SUCCESS) {       
-      vcos_log_error("%s: Failed to create camera component", __func__);
-   } else if ((status = create_video_encoder_component(&state)) != MMAL_SUCCESS) {     
-      vcos_log_error("%s: Failed to create encode component", __func__);      
-      destroy_camera_component(&state);
-   } else {       
-      PORT_USERDATA callback_data;    
-      camera_video_port   = state.camera_component->output[MMAL_CAMERA_VIDEO_PORT];
-      encoder_input_port  = state.encoder_component->input[0];
-      encoder_output_port = state.encoder_component->output[0];
-
-        // Now connect the camera to the encoder
-      status = connect_ports(camera_video_port, encoder_input_port, &state.encoder_connection);  
-     
-      if (status != MMAL_SUCCESS) {
-          vcos_log_error("%s: Failed to connect camera video port to encoder input", __func__);
-          goto error;
-      }
-      
-      // Set up our userdata - this is passed though to the callback where we need the information.
-      // Null until we open our filename     
-      callback_data.pstate = &state;      
-     
-
-      if (status != MMAL_SUCCESS) {
-          vcos_log_error("Failed to setup encoder output");
-          goto error;
-      }
-      
-      if (state.filename) {
-          output_file = fopen(state.filename, "wb");
-          callback_data.file_handle = output_file;
-          callback_data.pstate = &state;
-          callback_data.abort = 0;
-      }
-
-      encoder_output_port->userdata = (struct MMAL_PORT_USERDATA_T *)&callback_data;
-                                                     
-      int wait;
+   if (state->encoder_component && expected < (long)state->encoder_component->output[0]->buffer_size)
+      expected = state->encoder_component->output[0]->buffer_size;
+   return expected;
+}
 
-      // Enable the encoder output port and tell it its callback function
-      status = mmal_port_enable(encoder_output_port, encoder_buffer_callback);
-      if (mmal_port_parameter_set_boolean(camera_video_port, MMAL_PARAMETER_CAPTURE, 1) != MMAL_SUCCESS) {
-          goto error;
-      }
-     // Send all the buffers to the encoder output port
-     {
-          int num = mmal_queue_length(state.encoder_pool->queue);
-          int q;
-          for (q=0;q<num;q++) {
-             MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(state.encoder_pool->queue);
+CameraSession *createCameraSession(void) {
+    CameraSession *session = calloc(1, sizeof(CameraSession));
+    return session;
+}
 
-             if (!buffer)
-                vcos_log_error("Unable to get a required buffer %d from pool queue", q);
+void destroyCameraSession(CameraSession *session) {
+    if (!session)
+        return;
+    session_teardown(session);
+    free(session);
+}
 
-             if (mmal_port_send_buffer(encoder_output_port, buffer)!= MMAL_SUCCESS)
-                vcos_log_error("Unable to send a buffer to encoder output port (%d)", q);
+/**
+ * Make sure the session graph matches the requested size and format, and that
+ * the camera and encoder carry the current settings
+ *
+ * @param thumbnail Thumbnail to embed in JPEGs, NULL for none
+ * @return 0 if the graph is ready for a capture, non-zero otherwise
+ */
+static int session_prepare(CameraSession *session, int *width, int *height, int *quality, int format,
+                           const MMAL_PARAM_THUMBNAIL_CONFIG_T *thumbnail, PicamParams *parms)
+{
+   RASPISTILL_STATE *state = &session->state;
+   MMAL_FOURCC_T encoding = format_encoding(format);
+   MMAL_PARAM_THUMBNAIL_CONFIG_T none = state->thumbnail;
+
+   // A session only turns the thumbnail off again once one was asked for
+   none.enable = 0;
+   if (!thumbnail)
+      thumbnail = &none;
+
+   if (*width > 2592) {
+       *width = 2592;
+   } else if (*width < 20) {
+       *width = 20;
+   }
+   if (*height > 1944) {
+       *height = 1944;       
+   } else if (*height < 20) {
+       *height = 20;
+   }
+   if (*quality > 100) {
+       *quality = 100;
+   } else if (*quality < 0) {
+       *quality = 85; 
+   }
 
-          }
+   // The graph only has to be rebuilt when the port formats change, and the camera taken back from small captures
+   if (session->small || (session->built && (state->width != *width || state->height != *height || state->encoding != encoding))) {
+       session_teardown(session);
+   }
+   if (!session->built)
+       return session_build(session, *width, *height, *quality, format, thumbnail, parms) != MMAL_SUCCESS;
+
+   apply_params(state, parms, NULL);
+   if (!state->rawCapture && state->quality != *quality) {
+       if (mmal_port_parameter_set_uint32(state->encoder_component->output[0], MMAL_PARAMETER_JPEG_Q_FACTOR, *quality) != MMAL_SUCCESS) {
+           // Not accepted on a live port, fall back to a rebuild
+           session_teardown(session);
+           return session_build(session, *width, *height, *quality, format, thumbnail, parms) != MMAL_SUCCESS;
        }
-       for (wait = 0; wait < duration; wait+= ABORT_INTERVAL)  {
-          vcos_sleep(ABORT_INTERVAL);
-          if (callback_data.abort)
-             break;
+       state->quality = *quality;
+   }
+   if (state->encoding == MMAL_ENCODING_JPEG && memcmp(&state->thumbnail, thumbnail, sizeof(*thumbnail)) != 0) {
+       if (set_thumbnail(state->encoder_component, thumbnail) != MMAL_SUCCESS) {
+           session_teardown(session);
+           return session_build(session, *width, *height, *quality, format, thumbnail, parms) != MMAL_SUCCESS;
        }
-     
-     
-     
-     
-        
-      // Disable encoder output port
-      status = mmal_port_disable(encoder_output_port);
-      
-      
-           
-       vcos_semaphore_delete(&callback_data.complete_semaphore);      
-    }
-error:    
-    mmal_status_to_int(status);
-     
-    // Disable all our ports that are not handled by connections 
-    check_disable_port(encoder_output_port);  
-    if (output_file && output_file != stdout)
-         fclose(output_file);
-      
-    mmal_connection_destroy(state.encoder_connection);
-
-    if (state.encoder_component)
-        mmal_component_disable(state.encoder_component);
-     
-
-    if (state.camera_component)
-        mmal_component_disable(state.camera_component);
-
-    destroy_encoder_component(&state);     
-    destroy_camera_component(&state);
-     
-
-    if (status != MMAL_SUCCESS)
-        raspicamcontrol_check_configuration(128);
-    
+       state->thumbnail = *thumbnail;
+   }
+   return 0;
+}
+
+/**
+ * Trigger one capture on a prepared session and wait for it to land in state->output
+ *
+ * @return 0 if successful, non-zero otherwise
+ */
+static int session_capture(CameraSession *session)
+{
+   RASPISTILL_STATE *state = &session->state;
+
+   session->callback_data.abort = 0;
+   state->outputTimestamp = MMAL_TIME_UNKNOWN;
+   if (mmal_port_parameter_set_boolean(state->camera_component->output[MMAL_CAMERA_CAPTURE_PORT], MMAL_PARAMETER_CAPTURE, 1) != MMAL_SUCCESS) {
+       vcos_log_error("%s: Failed to start capture", __func__);
+       session_teardown(session);
+       return 1;
+   }
+   // Wait for capture to complete
+   // For some reason using vcos_semaphore_wait_timeout sometimes returns immediately with bad parameter error
+   // even though it appears to be all correct, so reverting to untimed one until figure out why its erratic
+   vcos_semaphore_wait(&session->callback_data.complete_semaphore);
+
+   return session->callback_data.abort;
+}
+
+/**
+ * Describe the capture held in state->output and hand its data over to frame
+ */
+static void session_detach_frame(CameraSession *session, int width, int height, int format, PicamFrame *frame)
+{
+   RASPISTILL_STATE *state = &session->state;
+
+   frame->format = format;
+   frame->width = width;
+   frame->height = height;
+   frame->stride = 0;
+   if (state->rawCapture) {
+       MMAL_ES_FORMAT_T *port_format = state->camera_component->output[MMAL_CAMERA_CAPTURE_PORT]->format;
+       frame->stride = port_format->es->video.width;
+       if (format == PICAM_FORMAT_RGB24 || format == PICAM_FORMAT_BGR24)
+           frame->stride *= 3;
+       if (format == PICAM_FORMAT_LUMA && state->output.length > (long)frame->stride * height)
+           state->output.length = (long)frame->stride * height; // Y plane only
+   }
+   frame->data = picam_buffer_detach(&state->output, &frame->length);
+}
+
+/**
+ * Take one still on a session into frame
+ *
+ * @param thumbnail Thumbnail to embed in a JPEG, NULL for none
+ * @return 0 if successful, non-zero otherwise
+ */
+static int session_frame(CameraSession *session, int width, int height, int quality, int format,
+                         const MMAL_PARAM_THUMBNAIL_CONFIG_T *thumbnail, PicamParams *parms, PicamFrame *frame)
+{
+   RASPISTILL_STATE *state = &session->state;
+
+   memset(frame, 0, sizeof(*frame));
+   if (session_prepare(session, &width, &height, &quality, format, thumbnail, parms) != 0)
+       return 1;
+
+   // Size the output up front so the common case never reallocates
+   picam_buffer_free(&state->output);
+   picam_buffer_reserve(&state->output, expected_still_size(state));
+   if (session_capture(session) != 0) {
+       picam_buffer_free(&state->output);
+       return 1;
+   }
+   session_detach_frame(session, width, height, format, frame);
+   return frame->data == NULL;
+}
+
+int sessionFrameWithDetails(CameraSession *session, int width, int height, int quality, int format, PicamParams *parms, PicamFrame *frame) {
+   return session_frame(session, width, height, quality, format, NULL, parms, frame);
+}
+
+int sessionPhotoWithThumbnail(CameraSession *session, int width, int height, int quality, MMAL_PARAM_THUMBNAIL_CONFIG_T *thumbnail, PicamParams *parms, PicamFrame *frame, PicamFrame *thumbnail_frame) {
+   MMAL_PARAM_THUMBNAIL_CONFIG_T config = *thumbnail;
+   long offset, length;
+
+   memset(thumbnail_frame, 0, sizeof(*thumbnail_frame));
+   config.enable = 1;
+   if (session_frame(session, width, height, quality, PICAM_FORMAT_JPEG, &config, parms, frame) != 0)
+       return 1;
+
+   // The encoder made the thumbnail as a complete JPEG inside the full one, it only has to be copied out
+   if (picam_exif_thumbnail(frame->data, frame->length, &offset, &length) != 0) {
+       vcos_log_error("%s: The JPEG carries no thumbnail", __func__);
+       return 0;
+   }
+   thumbnail_frame->data = malloc(length);
+   if (!thumbnail_frame->data)
+       return 0;
+   memcpy(thumbnail_frame->data, frame->data + offset, length);
+   thumbnail_frame->length = length;
+   thumbnail_frame->format = PICAM_FORMAT_JPEG;
+   if (picam_jpeg_dimensions(thumbnail_frame->data, length, &thumbnail_frame->width, &thumbnail_frame->height) != 0) {
+       thumbnail_frame->width = config.width;
+       thumbnail_frame->height = config.height;
+   }
+   return 0;
+}
+
+int sessionBurstWithDetails(CameraSession *session, int count, int width, int height, int quality, int interval, PicamParams *parms, PicamFrame *frames, int64_t *timestamps) {
+   RASPISTILL_STATE *state;
+   PICAM_BUFFER *buffers;
+   uint64_t start;
+   long expected;
+   int captured = 0;
+   int i;
+
+   if (count <= 0)
+       return 0;
+   memset(frames, 0, count * sizeof(PicamFrame));
+   if (session_prepare(session, &width, &height, &quality, PICAM_FORMAT_JPEG, NULL, parms) != 0)
+       return 0;
+   state = &session->state;
+
+   // Every frame gets its own buffer before the first trigger, nothing is allocated between captures
+   buffers = calloc(count, sizeof(PICAM_BUFFER));
+   if (!buffers)
+       return 0;
+   expected = expected_still_size(state);
+   for (i=0;i<count;i++) {
+       picam_buffer_init(&buffers[i]);
+       picam_buffer_reserve(&buffers[i], expected);
+   }
+
+   // Keep the sensor in stills mode between the triggers
+   mmal_port_parameter_set_boolean(state->camera_component->control, MMAL_PARAMETER_CAMERA_BURST_CAPTURE, 1);
+
+   start = vcos_getmicrosecs64();
+   for (i=0;i<count;i++) {
+       if (interval > 0) {
+           int64_t due = (int64_t)i * interval * 1000 - (int64_t)(vcos_getmicrosecs64() - start);
+           if (due > 0)
+               vcos_sleep(due / 1000);
+       }
+       picam_buffer_free(&state->output);
+       state->output = buffers[i];
+       picam_buffer_init(&buffers[i]);
+       if (session_capture(session) != 0)
+           break;
+       // 0 when the camera gave none, as in a PicamBatchFrame
+       timestamps[i] = state->outputTimestamp == MMAL_TIME_UNKNOWN ? 0 : state->outputTimestamp;
+       session_detach_frame(session, width, height, PICAM_FORMAT_JPEG, &frames[i]);
+       captured++;
+   }
+
+   if (session->built)
+       mmal_port_parameter_set_boolean(state->camera_component->control, MMAL_PARAMETER_CAMERA_BURST_CAPTURE, 0);
+   picam_buffer_free(&state->output);
+   for (i=0;i<count;i++)
+       picam_buffer_free(&buffers[i]);
+   free(buffers);
+   return captured;
+}
+
+int internelBurstWithDetails(int count, int width, int height, int quality, int interval, PicamParams *parms, PicamFrame *frames, int64_t *timestamps) {
+    CameraSession session;
+    int result;
+
+    memset(&session, 0, sizeof(session));
+    result = sessionBurstWithDetails(&session, count, width, height, quality, interval, parms, frames, timestamps);
+    session_teardown(&session);
+    return result;
+}
+
+uint8_t *sessionPhotoWithDetails(CameraSession *session, int width, int height, int quality, MMAL_FOURCC_T encoding, PicamParams *parms, long *sizeread) {
+    PicamFrame frame;
+
+    sessionFrameWithDetails(session, width, height, quality, encoding == MMAL_ENCODING_BMP ? PICAM_FORMAT_BMP : PICAM_FORMAT_JPEG, parms, &frame);
+    *sizeread = frame.length;
+    return frame.data;
+}
+
+uint8_t *takePhoto(PicamParams *parms, long *sizeread) { 
+    long test = 0l;    
+    uint8_t *tmp = internelPhotoWithDetails(2592,1944,85, MMAL_ENCODING_JPEG, parms, &test);        
+    *sizeread = test;   
+    return tmp;
+}
+
+uint8_t *takePhotoWithDetails(int width, int height, int quality, PicamParams *parms, long *sizeread) {
+    long test = 0l;    
+    uint8_t *tmp = internelPhotoWithDetails(width,height,quality,MMAL_ENCODING_JPEG,parms, &test);        
+    *sizeread = test;   
+    return tmp;
+}
+
+uint8_t *takeRGBPhotoWithDetails(int width, int height, PicamParams *parms, long *sizeread) {
+    long test = 0l;    
+    uint8_t *tmp = internelPhotoWithDetails(width,height,100, MMAL_ENCODING_BMP, parms, &test);            
+    *sizeread = test;   
+    return tmp;
+}
+
+int takeRawPhotoWithDetails(int width, int height, int format, PicamParams *parms, PicamFrame *frame) {
+    CameraSession session;
+    int result;
+
+    memset(&session, 0, sizeof(session));
+    result = sessionRawFrameWithDetails(&session, width, height, format, parms, frame);
+    session_teardown(&session);
+    return result;
+}
+
+int internelFrameWithDetails(int width, int height, int quality, int format, PicamParams *parms, PicamFrame *frame) {
+    CameraSession session;
+    int result;
+
+    // One shot capture, the graph is built and torn down around a single still
+    memset(&session, 0, sizeof(session));
+    result = sessionFrameWithDetails(&session, width, height, quality, format, parms, frame);
+    session_teardown(&session);
+    return result;
+}
+
+int internelPhotoWithThumbnail(int width, int height, int quality, MMAL_PARAM_THUMBNAIL_CONFIG_T *thumbnail, PicamParams *parms, PicamFrame *frame, PicamFrame *thumbnail_frame) {
+    CameraSession session;
+    int result;
+
+    memset(&session, 0, sizeof(session));
+    result = sessionPhotoWithThumbnail(&session, width, height, quality, thumbnail, parms, frame, thumbnail_frame);
+    session_teardown(&session);
+    return result;
+}
+
+uint8_t *internelPhotoWithDetails(int width, int height, int quality,MMAL_FOURCC_T encoding, PicamParams *parms, long *sizeread) {
+    PicamFrame frame;
+
+    internelFrameWithDetails(width, height, quality, encoding == MMAL_ENCODING_BMP ? PICAM_FORMAT_BMP : PICAM_FORMAT_JPEG, parms, &frame);
+    *sizeread = frame.length;
+    return frame.data;
+}
+
+void internelVideoWithDetails(char *filename, int width, int height, int duration, PicamParams *parms) {
+   internelVideoWithTaps(filename, width, height, duration, parms, NULL);
+}
+
+void internelVideoWithTaps(char *filename, int width, int height, int duration, PicamParams *parms, PicamVideoTaps *taps) {
+   Recorder *recorder = startRecorder(filename, width, height, duration, parms, taps);
+
+   if (!recorder)
+      return;
+   recorderWait(recorder, -1);
+   destroyRecorder(recorder);
+}
+
+/**
+ * Hand the file waiting in next_fd to the writer, called from the encoder
+ * callback on the first buffer of an IDR frame
+ *
+ * @param recorder Recorder whose output is switched
+ * @param with_config Non-zero to start the new file with the last SPS/PPS,
+ *                    when the buffer at hand is not the headers themselves
+ * @return Non-zero if the file was switched
+ */
+static int recorder_swap(Recorder *recorder, int with_config)
+{
+   int swapped = 0;
+
+   pthread_mutex_lock(&recorder->lock);
+   // The file is only ended if the switch fits straight after it, else both are left for the next IDR frame
+   if (recorder->next_fd >= 0 && recorder->container != PICAM_CONTAINER_H264 &&
+       picam_mp4_end_file(&recorder->mp4, 0, 1) != 0) {
+      pthread_mutex_unlock(&recorder->lock);
+      return 0;
+   }
+   // Left for the next IDR frame if the writer queue is full
+   if (recorder->next_fd >= 0 && picam_writer_switch(&recorder->writer, recorder->next_fd) == 0) {
+      recorder->next_fd = -1;
+      if (with_config && recorder->config_length && recorder->container == PICAM_CONTAINER_H264)
+         picam_writer_append(&recorder->writer, recorder->config, recorder->config_length, 1);
+      pthread_cond_broadcast(&recorder->changed);
+      swapped = 1;
+   }
+   pthread_mutex_unlock(&recorder->lock);
+   return swapped;
+}
+
+/**
+ * Start the next segment, called from the encoder callback on the first
+ * buffer of an IDR frame once the current one is full
+ *
+ * @param recorder Recorder whose output is switched
+ * @param with_config Non-zero to start the new file with the last SPS/PPS
+ * @return Non-zero if the next segment was started
+ */
+static int recorder_cut(Recorder *recorder, int with_config)
+{
+   char name[PATH_MAX];
+
+   snprintf(name, sizeof(name), recorder->pattern, recorder->segment + 1);
+   // Never waits for the writer: without room for the end of this file and the
+   // open of the next, the current file carries on and the cut is tried again
+   // at the next IDR frame
+   if (recorder->container != PICAM_CONTAINER_H264 &&
+       picam_mp4_end_file(&recorder->mp4, strlen(name), 1) != 0)
+      return 0;
+   // The end of the file left room for this, the writer only ever frees more
+   if (picam_writer_open(&recorder->writer, name) != 0) {
+      if (recorder->container != PICAM_CONTAINER_H264)
+         vcos_log_error("%s: No room to start %s", __func__, name);
+      return 0;
+   }
+   if (with_config && recorder->config_length && recorder->container == PICAM_CONTAINER_H264)
+      picam_writer_append(&recorder->writer, recorder->config, recorder->config_length, 1);
+   pthread_mutex_lock(&recorder->lock);
+   recorder->segment++;
+   pthread_mutex_unlock(&recorder->lock);
+   return 1;
+}
+
+/* Muxer output, see PICAM_MP4_OUTPUT */
+
+static int recorder_mp4_room(void *user, long length, int pieces)
+{
+   return picam_writer_room(&((Recorder *)user)->writer, length, pieces);
+}
+
+static void recorder_mp4_write(void *user, const uint8_t *data, long length)
+{
+   picam_writer_append(&((Recorder *)user)->writer, data, length, 1);
+}
+
+static void recorder_mp4_patch(void *user, uint64_t offset, const uint8_t *data, long length)
+{
+   picam_writer_patch(&((Recorder *)user)->writer, offset, data, length);
+}
+
+/**
+ * Absolute time for pthread_cond_timedwait
+ *
+ * @param until Set to timeout_ms from now
+ * @param timeout_ms Milliseconds from now
+ */
+static void deadline_after(struct timespec *until, int timeout_ms)
+{
+   struct timeval now;
+
+   gettimeofday(&now, NULL);
+   until->tv_sec = now.tv_sec + timeout_ms / 1000;
+   until->tv_nsec = (now.tv_usec + (timeout_ms % 1000) * 1000L) * 1000L;
+   if (until->tv_nsec >= 1000000000L) {
+      until->tv_sec++;
+      until->tv_nsec -= 1000000000L;
+   }
+}
+
+/**
+ * Sample how the stream is being taken and let the controller pick a new
+ * bitrate and QP floor
+ *
+ * Called on the control thread with lock held. The encoder is only given
+ * the new settings once the lock is released, see recorder_rate_apply.
+ *
+ * @param recorder Recorder with rate_control set
+ * @param elapsed_us Time since the previous sample
+ * @param stats Set to the controller's settings if it picked new ones
+ * @return Non-zero if the encoder has to be given stats
+ */
+static int recorder_rate_sample(Recorder *recorder, long elapsed_us, PICAM_RATE_STATS *stats)
+{
+   RASPISTILL_STATE *state = &recorder->state;
+   uint64_t encoded = __atomic_load_n(&recorder->encoded_bytes, __ATOMIC_RELAXED);
+   uint64_t drained = encoded;
+   int total = state->encoder_pool->headers_num;
+   int outstanding = __atomic_load_n(&recorder->sink_outstanding, __ATOMIC_RELAXED);
+   // Buffers in the pool are neither with the encoder nor with us, only a buffer short of a send
+   int free_buffers = total - outstanding - (int)mmal_queue_length(state->encoder_pool->queue);
+   int backlog = 0, lost = 0, changed;
+
+   if (recorder->writing) {
+      PICAM_WRITER_STATS writer_stats;
+
+      picam_writer_stats(&recorder->writer, &writer_stats);
+      drained = writer_stats.written;
+      backlog = (int)((uint64_t)writer_stats.queued * 100 / recorder->writer.capacity);
+      lost = writer_stats.dropped != recorder->rate_dropped;
+      recorder->rate_dropped = writer_stats.dropped;
+   }
+   if (recorder->sink_queue) {
+      // The slower of the file and the sink sets the pace
+      if (!recorder->writing || recorder->sink_taken < drained)
+         drained = recorder->sink_taken;
+      if (outstanding * 100 / total > backlog)
+         backlog = outstanding * 100 / total;
+   }
+
+   changed = picam_rate_update(&recorder->rate, encoded, drained, elapsed_us, backlog, free_buffers, lost);
+   *stats = recorder->rate.stats;
+   pthread_cond_broadcast(&recorder->changed);
+   return changed;
+}
+
+/**
+ * Hand the encoder the settings recorder_rate_sample picked
+ *
+ * Called on the control thread without lock, setting a parameter waits on
+ * the GPU and the callback takes lock for every buffer. Teardown joins the
+ * control thread before the encoder goes.
+ *
+ * @param recorder Recorder with rate_control set
+ * @param stats Settings copied out under lock
+ * @param max_qp QP ceiling, fixed for the recording
+ */
+static void recorder_rate_apply(Recorder *recorder, const PICAM_RATE_STATS *stats, int max_qp)
+{
+   MMAL_PORT_T *output_port = recorder->state.encoder_component->output[0];
+
+   if (mmal_port_parameter_set_uint32(output_port, MMAL_PARAMETER_VIDEO_BIT_RATE, stats->target) != MMAL_SUCCESS)
+      vcos_log_error("Unable to change the bitrate to %d", stats->target);
+   if (stats->min_qp &&
+       (mmal_port_parameter_set_uint32(output_port, MMAL_PARAMETER_VIDEO_ENCODE_MIN_QUANT, stats->min_qp) != MMAL_SUCCESS ||
+        mmal_port_parameter_set_uint32(output_port, MMAL_PARAMETER_VIDEO_ENCODE_MAX_QUANT, max_qp) != MMAL_SUCCESS))
+      vcos_log_error("Unable to change the QP bounds to %d..%d", stats->min_qp, max_qp);
+}
+
+/**
+ * Request IDR frames when the callback asks for them and adapt the bitrate
+ * when asked for, parameters cannot be set from the callback thread itself
+ */
+static void *recorder_control(void *arg)
+{
+   Recorder *recorder = arg;
+   struct timespec due;
+   struct timeval then, now;
+
+   gettimeofday(&then, NULL);
+   if (recorder->rate_control)
+      deadline_after(&due, recorder->rate_interval_ms);
+   pthread_mutex_lock(&recorder->lock);
+   for (;;) {
+      PICAM_RATE_STATS rate;
+      int timed_out = 0, want_idr, rate_changed = 0;
+
+      while (!recorder->want_idr && !recorder->stopping && !timed_out) {
+         if (recorder->rate_control)
+            timed_out = pthread_cond_timedwait(&recorder->changed, &recorder->lock, &due) == ETIMEDOUT;
+         else
+            pthread_cond_wait(&recorder->changed, &recorder->lock);
+      }
+      if (recorder->stopping)
+         break;
+      want_idr = recorder->want_idr;
+      recorder->want_idr = 0;
+      if (timed_out) {
+         gettimeofday(&now, NULL);
+         rate_changed = recorder_rate_sample(recorder, (now.tv_sec - then.tv_sec) * 1000000L + (now.tv_usec - then.tv_usec), &rate);
+         then = now;
+         deadline_after(&due, recorder->rate_interval_ms);
+      }
+
+      // The encoder is only told with the lock released, the callback must not wait on the GPU.
+      // Teardown sets stopping before it joins this thread and only then destroys the encoder.
+      pthread_mutex_unlock(&recorder->lock);
+      if (!__atomic_load_n(&recorder->stopping, __ATOMIC_ACQUIRE)) {
+         if (want_idr)
+            mmal_port_parameter_set_boolean(recorder->state.encoder_component->output[0], MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME, 1);
+         if (rate_changed)
+            recorder_rate_apply(recorder, &rate, recorder->rate.max_qp);
+      }
+      pthread_mutex_lock(&recorder->lock);
+   }
+   pthread_mutex_unlock(&recorder->lock);
+   return NULL;
+}
+
+/**
+ * Mark the recording as finished and wake anyone in recorderWait
+ */
+static void recorder_finish(Recorder *recorder)
+{
+   pthread_mutex_lock(&recorder->lock);
+   recorder->finished = 1;
+   pthread_cond_broadcast(&recorder->changed);
+   pthread_mutex_unlock(&recorder->lock);
+}
+
+/**
+ * Give a buffer the sink is done with back to the encoder. The encoder may
+ * have run out while the sink held them all, so one is sent to the port.
+ */
+static void recorder_sink_release(Recorder *recorder, MMAL_BUFFER_HEADER_T *buffer)
+{
+   RASPISTILL_STATE *state = &recorder->state;
+
+   uint32_t length = buffer->length;
+
+   mmal_buffer_header_release(buffer);
+   pthread_mutex_lock(&recorder->lock);
+   __atomic_sub_fetch(&recorder->sink_outstanding, 1, __ATOMIC_RELEASE);
+   recorder->sink_taken += length;
+   // Under the lock, teardown clears running before disabling the port
+   if (recorder->running && state->encoder_component->output[0]->is_enabled) {
+      MMAL_BUFFER_HEADER_T *new_buffer = mmal_queue_get(state->encoder_pool->queue);
+
+      if (new_buffer && mmal_port_send_buffer(state->encoder_component->output[0], new_buffer) != MMAL_SUCCESS)
+         vcos_log_error("Unable to return a buffer to the encoder port");
+   }
+   pthread_cond_broadcast(&recorder->changed);
+   pthread_mutex_unlock(&recorder->lock);
+}
+
+/**
+ * Write the buffers queued for the sink to its pipe or socket, in order
+ */
+static void *recorder_sink_thread(void *arg)
+{
+   Recorder *recorder = arg;
+   int error = 0;
+
+   for (;;) {
+      MMAL_BUFFER_HEADER_T *buffer = mmal_queue_timedwait(recorder->sink_queue, RECORDER_SINK_WAIT_MS);
+
+      if (!buffer) {
+         if (__atomic_load_n(&recorder->stopping, __ATOMIC_ACQUIRE))
+            break;
+         continue;
+      }
+      // After a failure the rest is only given back
+      if (!error) {
+         mmal_buffer_header_mem_lock(buffer);
+         error = picam_sink_write(&recorder->sink, buffer->data, buffer->length, &recorder->stopping);
+         mmal_buffer_header_mem_unlock(buffer);
+         if (error && error != ECANCELED) {
+            vcos_log_error("Failed to write to the sink (%s) - aborting", strerror(error));
+            recorder->abort = 1;
+            recorder_finish(recorder);
+         }
+      }
+      recorder_sink_release(recorder, buffer);
+   }
+   return NULL;
+}
+
+/**
+ *  buffer header callback function for the encoder output port of a recording
+ *
+ *  Writes the stream to the current file and the taps. Once the requested
+ *  duration has been recorded, by presentation time, the rest is discarded
+ *  until the recording is stopped.
+ *
+ * @param port Pointer to port from which callback originated
+ * @param buffer mmal buffer header pointer
+ */
+static void recorder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+   Recorder *recorder = (Recorder *)port->userdata;
+   RASPISTILL_STATE *state = &recorder->state;
+
+   if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO) {
+      // Inline motion vectors, not part of the H264 stream
+      if (state->vectors && buffer->length) {
+         mmal_buffer_header_mem_lock(buffer);
+         picam_vectors_analyse(state->vectors, buffer->data, buffer->length, buffer->pts);
+         mmal_buffer_header_mem_unlock(buffer);
+      }
+   } else if (buffer->length && !recorder->finished) {
+      int writing = __atomic_load_n(&recorder->writing, __ATOMIC_ACQUIRE);
+
+      // A file can start at SPS/PPS, or at the first buffer of an IDR frame
+      // that does not directly follow them
+      int config = (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG) != 0;
+      int boundary = config ||
+                     ((buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME) &&
+                      (recorder->last_flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) &&
+                      !(recorder->last_flags & MMAL_BUFFER_HEADER_FLAG_CONFIG));
+
+      __atomic_add_fetch(&recorder->encoded_bytes, buffer->length, __ATOMIC_RELAXED);
+      mmal_buffer_header_mem_lock(buffer);
+      if (config && buffer->length <= sizeof(recorder->config)) {
+         memcpy(recorder->config, buffer->data, buffer->length);
+         recorder->config_length = buffer->length;
+      }
+      if (boundary) {
+         int started = recorder_swap(recorder, !config);
+
+         if (!started && recorder->pattern && recorder->cut_due && writing)
+            started = recorder_cut(recorder, !config);
+         if (started) {
+            // A split starts a new segment as well
+            recorder->cut_due = 0;
+            recorder->segment_pts = MMAL_TIME_UNKNOWN;
+            recorder->segment_written = 0;
+         }
+      }
+      if (recorder->container != PICAM_CONTAINER_H264) {
+         // Parameter sets are kept for the sample description whether or not a file is open
+         if (config)
+            picam_mp4_config(&recorder->mp4, buffer->data, buffer->length);
+         else if (writing)
+            picam_mp4_add(&recorder->mp4, buffer->data, buffer->length,
+                          (buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME) != 0,
+                          (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) != 0,
+                          buffer->pts == MMAL_TIME_UNKNOWN ? INT64_MIN : buffer->pts);
+         if (writing)
+            recorder->segment_written += buffer->length;
+      // Only copied here, a slow card holds up the writer thread and not the encoder. Every
+      // buffer of an IDR frame carries KEYFRAME, so only a boundary may end a drop
+      } else if (writing && picam_writer_append(&recorder->writer, buffer->data, buffer->length, boundary) == 0) {
+         recorder->segment_written += buffer->length;
+      }
+      if (state->ring)
+         picam_ring_append(state->ring, buffer->data, buffer->length, ring_flags(buffer->flags), buffer->pts);
+      mmal_buffer_header_mem_unlock(buffer);
+      // Kept until the sink releases it, the reference taken here outlives the release below
+      if (recorder->sink_queue) {
+         mmal_buffer_header_acquire(buffer);
+         __atomic_add_fetch(&recorder->sink_outstanding, 1, __ATOMIC_RELAXED);
+         __atomic_store_n(&recorder->sink_bytes, recorder->sink_bytes + buffer->length, __ATOMIC_RELAXED);
+         mmal_queue_put(recorder->sink_queue, buffer);
+      }
+
+      if (writing && picam_writer_error(&recorder->writer)) {
+         vcos_log_error("Failed to write buffer data (%s)- aborting", strerror(picam_writer_error(&recorder->writer)));
+         recorder->abort = 1;
+         recorder_finish(recorder);
+      } else if ((buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) && buffer->pts != MMAL_TIME_UNKNOWN) {
+         pthread_mutex_lock(&recorder->lock);
+         if (recorder->first_pts == MMAL_TIME_UNKNOWN)
+            recorder->first_pts = buffer->pts;
+         // The sensor leaves video mode for a still, the frames it misses show up as a longer interval
+         if (recorder->still_watch > 0) {
+            if (recorder->frames > 0 && buffer->pts - recorder->last_pts > recorder->still_interval)
+               recorder->still_interval = buffer->pts - recorder->last_pts;
+            if (recorder->still_done && --recorder->still_watch == 0)
+               pthread_cond_broadcast(&recorder->changed);
+         }
+         recorder->last_pts = buffer->pts;
+         recorder->frames++;
+         // Checked every frame, so the recording ends within a frame of its duration
+         if (recorder->duration > 0 && buffer->pts - recorder->first_pts >= recorder->duration) {
+            recorder->finished = 1;
+            pthread_cond_broadcast(&recorder->changed);
+         }
+         if (recorder->pattern && recorder->segment_pts == MMAL_TIME_UNKNOWN)
+            recorder->segment_pts = buffer->pts;
+         // Asked for a frame early, so the IDR frame lands on the segment length
+         if (recorder->pattern && !recorder->cut_due &&
+             ((recorder->segment_duration > 0 && buffer->pts + 2 * recorder->frame_us - recorder->segment_pts >= recorder->segment_duration) ||
+              (recorder->segment_bytes > 0 && recorder->segment_written >= recorder->segment_bytes))) {
+            recorder->cut_due = 1;
+            recorder->want_idr = 1;
+            pthread_cond_broadcast(&recorder->changed);
+         }
+         pthread_mutex_unlock(&recorder->lock);
+      }
+   }
+   if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED) {
+      recorder->abort = 1;
+      recorder_finish(recorder);
+   }
+   if (!(buffer->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO))
+      recorder->last_flags = buffer->flags;
+
+   mmal_buffer_header_release(buffer);
+
+   // and send one back to the port (if still open)
+   if (port->is_enabled) {
+      MMAL_STATUS_T status = MMAL_SUCCESS;
+      MMAL_BUFFER_HEADER_T *new_buffer = mmal_queue_get(state->encoder_pool->queue);
+
+      if (new_buffer)
+         status = mmal_port_send_buffer(port, new_buffer);
+      // With a sink, every buffer may be waiting for it; the next one it releases goes back to the port
+      if (!new_buffer && recorder->sink_queue)
+         __atomic_add_fetch(&recorder->sink_stalls, 1, __ATOMIC_RELAXED);
+      else if (!new_buffer || status != MMAL_SUCCESS)
+         vcos_log_error("Unable to return a buffer to the encoder port");
+   }
+}
+
+/**
+ *  buffer header callback function for the image encoder of a recorder
+ *
+ *  Gathers the still in recorder->still.output and signals the end of it
+ *
+ * @param port Pointer to port from which callback originated
+ * @param buffer mmal buffer header pointer
+ */
+static void recorder_still_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+   Recorder *recorder = (Recorder *)port->userdata;
+   RASPISTILL_STATE *still = &recorder->still;
+   int failed = 0;
+
+   if (buffer->length) {
+      mmal_buffer_header_mem_lock(buffer);
+      if (picam_buffer_append(&still->output, buffer->data, buffer->length) != 0) {
+         vcos_log_error("Failed to grow the still buffer (%d bytes stored)- aborting", (int)still->output.length);
+         failed = 1;
+      }
+      mmal_buffer_header_mem_unlock(buffer);
+   }
+   if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED)
+      failed = 1;
+   if (failed || (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END)) {
+      pthread_mutex_lock(&recorder->lock);
+      if (failed)
+         recorder->still_abort = 1;
+      if (buffer->flags & (MMAL_BUFFER_HEADER_FLAG_FRAME_END | MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED)) {
+         still->outputTimestamp = buffer->pts;
+         recorder->still_done = 1;
+      }
+      pthread_cond_broadcast(&recorder->changed);
+      pthread_mutex_unlock(&recorder->lock);
+   }
+
+   mmal_buffer_header_release(buffer);
+
+   // and send one back to the port (if still open)
+   if (port->is_enabled) {
+      MMAL_STATUS_T status = MMAL_SUCCESS;
+      MMAL_BUFFER_HEADER_T *new_buffer = mmal_queue_get(still->encoder_pool->queue);
+
+      if (new_buffer)
+         status = mmal_port_send_buffer(port, new_buffer);
+      if (!new_buffer || status != MMAL_SUCCESS)
+         vcos_log_error("Unable to return a buffer to the image encoder port");
+   }
+}
+
+/**
+ * Disconnect and destroy the image encoder of a recorder, the video goes on
+ *
+ * Safe to call when it was never built. Called with branch_lock held.
+ *
+ * @param recorder Recorder whose still graph is torn down
+ */
+static void recorder_still_teardown(Recorder *recorder)
+{
+   RASPISTILL_STATE *still = &recorder->still;
+
+   if (still->encoder_component)
+      check_disable_port(still->encoder_component->output[0]);
+   if (still->encoder_connection) {
+      mmal_connection_destroy(still->encoder_connection);
+      still->encoder_connection = NULL;
+   }
+   if (still->encoder_component)
+      mmal_component_disable(still->encoder_component);
+   destroy_encoder_component(still);
+   picam_buffer_free(&still->output);
+}
+
+/**
+ * Connect an image encoder to the camera still port of a running recorder and
+ * leave its output port enabled with all of its buffers queued. The video port
+ * and its encoder are not touched.
+ *
+ * @param recorder Recorder to take stills from, called with branch_lock held
+ * @param quality JPEG quality setting (1-100)
+ *
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+static MMAL_STATUS_T recorder_still_build(Recorder *recorder, int quality)
+{
+   RASPISTILL_STATE *still = &recorder->still;
+   MMAL_STATUS_T status;
+   MMAL_PORT_T *output_port;
+   int num, q;
+
+   still->quality = quality;
+   still->encoding = MMAL_ENCODING_JPEG;
+   if ((status = create_encoder_component(still)) != MMAL_SUCCESS) {
+      vcos_log_error("%s: Failed to create encode component", __func__);
+      goto error;
+   }
+   if (!still->encoder_pool) {
+      status = MMAL_ENOMEM;
+      goto error;
+   }
+   status = connect_ports(recorder->state.camera_component->output[MMAL_CAMERA_CAPTURE_PORT], still->encoder_component->input[0], &still->encoder_connection);
+   if (status != MMAL_SUCCESS) {
+      vcos_log_error("%s: Failed to connect camera still port to encoder input", __func__);
+      still->encoder_connection = NULL;
+      goto error;
+   }
+
+   output_port = still->encoder_component->output[0];
+   output_port->userdata = (struct MMAL_PORT_USERDATA_T *)recorder;
+   if ((status = mmal_port_enable(output_port, recorder_still_callback)) != MMAL_SUCCESS) {
+      vcos_log_error("%s: Failed to enable output port", __func__);
+      goto error;
+   }
+
+   // Send all the buffers to the output port
+   num = mmal_queue_length(still->encoder_pool->queue);
+   for (q=0;q<num;q++) {
+      MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(still->encoder_pool->queue);
+
+      if (!buffer)
+         vcos_log_error("Unable to get a required buffer %d from pool queue", q);
+
+      if (mmal_port_send_buffer(output_port, buffer)!= MMAL_SUCCESS)
+         vcos_log_error("Unable to send a buffer to output port (%d)", q);
+   }
+   return MMAL_SUCCESS;
+
+error:
+   recorder_still_teardown(recorder);
+   return status;
+}
+
+/**
+ * Stop the analysis frames, the reader gets the frames still waiting and then
+ * the end of the stream. The video goes on.
+ *
+ * Called with branch_lock held, safe to call more than once.
+ *
+ * @param recorder Recorder whose preview port is stopped
+ */
+static void recorder_analysis_stop(Recorder *recorder)
+{
+   if (!recorder->analysis)
+      return;
+   stream_detach(recorder->analysis, recorder->analysis_running ? recorder->state.camera_component->output[MMAL_CAMERA_PREVIEW_PORT] : NULL);
+   recorder->analysis_running = 0;
+}
+
+/**
+ * Stop the encoder and release the camera and any files still open
+ *
+ * Safe to call on a partially built recorder and more than once.
+ *
+ * @param recorder Recorder to stop
+ */
+static void recorder_teardown(Recorder *recorder)
+{
+   RASPISTILL_STATE *state = &recorder->state;
+
+   pthread_mutex_lock(&recorder->lock);
+   if (recorder->stopping) {
+      pthread_mutex_unlock(&recorder->lock);
+      return;
+   }
+   recorder->stopping = 1;
+   recorder->running = 0;
+   pthread_cond_broadcast(&recorder->changed);
+   pthread_mutex_unlock(&recorder->lock);
+   if (recorder->control_started)
+      pthread_join(recorder->control_thread, NULL);
+   // A still being taken gives up once it sees stopping
+   pthread_mutex_lock(&recorder->branch_lock);
+   recorder_still_teardown(recorder);
+   recorder_analysis_stop(recorder);
+   pthread_mutex_unlock(&recorder->branch_lock);
+
+   // Returns once the callback has handed back the buffer in flight
+   if (state->encoder_component)
+      check_disable_port(state->encoder_component->output[0]);
+   recorder_finish(recorder);
+   // Gives up on a reader that stops taking the stream
+   if (recorder->sink_started)
+      pthread_join(recorder->sink_thread, NULL);
+   if (recorder->sink_queue && !recorder->sink_pull) {
+      MMAL_BUFFER_HEADER_T *buffer;
+
+      while ((buffer = mmal_queue_get(recorder->sink_queue)) != NULL)
+         recorder_sink_release(recorder, buffer);
+      picam_sink_close(&recorder->sink);
+   }
+
+   if (state->encoder_connection) {
+      mmal_connection_destroy(state->encoder_connection);
+      state->encoder_connection = NULL;
+   }
+   if (state->encoder_component)
+      mmal_component_disable(state->encoder_component);
+   if (state->camera_component)
+      mmal_component_disable(state->camera_component);
+   // The pool stays while a reader of chunks still has some, destroyRecorder finishes it
+   if (__atomic_load_n(&recorder->sink_outstanding, __ATOMIC_ACQUIRE) == 0)
+      destroy_encoder_component(state);
+   else
+      recorder->encoder_kept = 1;
+   destroy_camera_component(state);
+
+   // The callback is done with the writer, drain it and close the file
+   if (recorder->writing) {
+      // Last fragment, or the moov of a plain file, which may be larger than the queue and goes
+      // in pieces. The encoder is gone, so waiting here holds nothing up; only a writer that stops
+      // taking anything for RECORDER_FINISH_WAIT_MS is given up on
+      if (recorder->container != PICAM_CONTAINER_H264) {
+         PICAM_WRITER_STATS stats;
+         uint64_t written;
+         int waited = 0;
+
+         picam_writer_stats(&recorder->writer, &stats);
+         written = stats.written;
+         while (picam_mp4_finish(&recorder->mp4, RECORDER_MOOV_PIECE) != 0) {
+            picam_writer_stats(&recorder->writer, &stats);
+            if (stats.written != written) {
+               written = stats.written;
+               waited = 0;
+            } else if (waited++ == RECORDER_FINISH_WAIT_MS) {
+               vcos_log_error("%s: No room to finish the MP4 file", __func__);
+               recorder->mp4.dropped++;
+               break;
+            }
+            vcos_sleep(1);
+         }
+      }
+      pthread_mutex_lock(&recorder->lock);
+      recorder->writing = 0;
+      pthread_mutex_unlock(&recorder->lock);
+      if (picam_writer_finish(&recorder->writer, &recorder->writer_stats) != 0)
+         recorder->abort = 1;
+   }
+   if (recorder->next_fd >= 0) {
+      close(recorder->next_fd);
+      recorder->next_fd = -1;
+   }
+}
+
+int validSegmentPattern(const char *pattern) {
+   int conversions = 0;
+
+   for (; *pattern; pattern++) {
+      if (*pattern != '%')
+         continue;
+      if (pattern[1] == '%') {
+         pattern++;
+         continue;
+      }
+      // Only %d, zero padded and with a width if wanted
+      pattern++;
+      while (*pattern >= '0' && *pattern <= '9')
+         pattern++;
+      if (*pattern != 'd')
+         return 0;
+      conversions++;
+   }
+   return conversions == 1;
+}
+
+int containerForFilename(const char *filename) {
+   const char *extension = filename ? strrchr(filename, '.') : NULL;
+
+   if (extension && (strcasecmp(extension, ".mp4") == 0 || strcasecmp(extension, ".m4v") == 0))
+      return PICAM_CONTAINER_FMP4;
+   return PICAM_CONTAINER_H264;
+}
+
+Recorder *startRecorder(char *filename, int width, int height, int duration, PicamParams *parms, PicamVideoTaps *taps) {
+   return startSegmentedRecorder(filename, 0, 0, containerForFilename(filename), width, height, duration, parms, taps);
+}
+
+Recorder *startSegmentedRecorder(char *filename, int segment_seconds, long segment_bytes, int container, int width, int height, int duration, PicamParams *parms, PicamVideoTaps *taps) {
+   Recorder *recorder;
+   RASPISTILL_STATE *state;
+   MMAL_STATUS_T status = MMAL_SUCCESS;
+   MMAL_PORT_T *encoder_output_port;
+   char first[PATH_MAX];
+   int num, q;
+
+   if (segment_seconds > 0 || segment_bytes > 0) {
+      if (!filename || !validSegmentPattern(filename)) {
+         vcos_log_error("%s: Segment names need a pattern with one %%d", __func__);
+         return NULL;
+      }
+      snprintf(first, sizeof(first), filename, 0);
+   }
+
+   if (width > 1920) {
+       width = 1920;
+   } else if (width < 20) {
+       width = 20;
+   }
+   if (height > 1080) {
+       height = 1080;
+   } else if (height < 20) {
+       height = 20;
+   }
+
+   recorder = calloc(1, sizeof(Recorder));
+   if (!recorder)
+      return NULL;
+   pthread_mutex_init(&recorder->lock, NULL);
+   pthread_cond_init(&recorder->changed, NULL);
+   pthread_mutex_init(&recorder->branch_lock, NULL);
+   recorder->first_pts = MMAL_TIME_UNKNOWN;
+   recorder->next_fd = -1;
+   recorder->duration = duration > 0 ? (int64_t)duration * 1000 : 0;
+   recorder->last_flags = MMAL_BUFFER_HEADER_FLAG_FRAME_END;
+   state = &recorder->state;
+
+   bcm_host_init();
+   default_status(state);
+   state->width = width;
+   state->height = height;
+   state->quality = 0;
+   state->videoEncode = 1;
+   state->filename = filename;
+   fill_state_from_params(state, parms);
+   // The still port is set up for full resolution stills, its image encoder is only added when one is taken
+   default_status(&recorder->still);
+   state->stillWidth = recorder->still.width;
+   state->stillHeight = recorder->still.height;
+   if (taps && taps->vectors && picam_vectors_configure(taps->vectors, width, height) == 0)
+      state->vectors = taps->vectors;
+   if (taps && taps->ring) {
+      picam_ring_reset(taps->ring);
+      state->ring = taps->ring;
+   }
+   if (taps && taps->analysis) {
+      PicamVideoAnalysis *spec = taps->analysis;
+      int analysis_width = spec->width, analysis_height = spec->height;
+
+      if (analysis_width > RECORDER_ANALYSIS_MAX_WIDTH) {
+          analysis_width = RECORDER_ANALYSIS_MAX_WIDTH;
+      } else if (analysis_width < 20) {
+          analysis_width = 20;
+      }
+      if (analysis_height > RECORDER_ANALYSIS_MAX_HEIGHT) {
+          analysis_height = RECORDER_ANALYSIS_MAX_HEIGHT;
+      } else if (analysis_height < 20) {
+          analysis_height = 20;
+      }
+      if (!format_is_raw(spec->format)) {
+         vcos_log_error("%s: Analysis frames must be a raw format", __func__);
+         goto error;
+      }
+      if (!(recorder->analysis = calloc(1, sizeof(FrameStream)))) {
+         vcos_log_error("%s: Failed to allocate the analysis stream", __func__);
+         goto error;
+      }
+      recorder->analysis->format = spec->format;
+      recorder->analysis->state.width = analysis_width;
+      recorder->analysis->state.height = analysis_height;
+      state->previewWidth = analysis_width;
+      state->previewHeight = analysis_height;
+      state->previewEncoding = format_encoding(spec->format);
+   }
+   if (taps && taps->sink && (taps->sink->pull || taps->sink->fd >= 0)) {
+      int error;
+
+      recorder->sink_pull = taps->sink->pull;
+      if (!recorder->sink_pull && (error = picam_sink_open(&recorder->sink, taps->sink->fd)) != 0) {
+         vcos_log_error("%s: Cannot write to the sink (%s)", __func__, strerror(error));
+         goto error;
+      }
+      if (!(recorder->sink_queue = mmal_queue_create())) {
+         vcos_log_error("%s: Failed to create the sink queue", __func__);
+         goto error;
+      }
+      state->videoBuffers = RECORDER_SINK_BUFFERS;
+   }
+
+   if (taps && taps->rate) {
+      PicamVideoRate *spec = taps->rate;
+
+      // The encoder starts at the configured bitrate, kept within the limits
+      picam_rate_init(&recorder->rate, state->bitrate, spec->min_bitrate, spec->max_bitrate, spec->min_qp, spec->max_qp);
+      state->bitrate = recorder->rate.stats.target;
+      recorder->rate_interval_ms = spec->interval_ms > 0 ? spec->interval_ms : RECORDER_RATE_INTERVAL_MS;
+      recorder->rate_control = 1;
+   }
+
+   recorder->frame_us = 1000000 / (state->framerate > 0 ? state->framerate : VIDEO_FRAME_RATE_NUM);
+   recorder->container = container;
+   if (container != PICAM_CONTAINER_H264) {
+      PICAM_MP4_OUTPUT output = {recorder, recorder_mp4_room, recorder_mp4_write, recorder_mp4_patch};
+
+      picam_mp4_init(&recorder->mp4, container == PICAM_CONTAINER_MP4 ? PICAM_MP4_PLAIN : PICAM_MP4_FRAGMENTED,
+                     width, height, RECORDER_FRAGMENT_MS, state->framerate, &output);
+   }
+   if (segment_seconds > 0 || segment_bytes > 0) {
+      recorder->pattern = strdup(filename);
+      recorder->segment_duration = (int64_t)segment_seconds * 1000000;
+      recorder->segment_bytes = segment_bytes;
+      recorder->segment_pts = MMAL_TIME_UNKNOWN;
+      filename = first;
+   }
+
+   // No file when only the taps want the stream
+   if (filename) {
+      int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      // Reserve each file up front when its size can be told
+      long preallocate = duration > 0 && state->bitrate > 0 ? (long)((int64_t)state->bitrate / 8 * duration / 1000) : 0;
+
+      if (segment_seconds > 0 && state->bitrate > 0 && (preallocate == 0 || (int64_t)state->bitrate / 8 * segment_seconds < preallocate))
+         preallocate = (long)((int64_t)state->bitrate / 8 * segment_seconds);
+      if (segment_bytes > 0 && (preallocate == 0 || segment_bytes < preallocate))
+         preallocate = segment_bytes;
+      if (fd < 0) {
+         vcos_log_error("%s: Failed to open %s", __func__, filename);
+         goto error;
+      }
+      if (picam_writer_init(&recorder->writer, RECORDER_QUEUE_SIZE, fd, preallocate, recorder->frame_us) != 0) {
+         vcos_log_error("%s: Failed to start the writer", __func__);
+         close(fd);
+         goto error;
+      }
+      recorder->writing = 1;
+   }
+
+   if ((status = create_video_camera_component(state)) != MMAL_SUCCESS) {
+      vcos_log_error("%s: Failed to create camera component", __func__);
+      goto error;
+   }
+   if ((status = create_video_encoder_component(state)) != MMAL_SUCCESS) {
+      vcos_log_error("%s: Failed to create encode component", __func__);
+      goto error;
+   }
+   if (recorder->sink_pull) {
+      recorder->sink_slot_count = state->encoder_pool->headers_num;
+      if (!(recorder->sink_slots = calloc(recorder->sink_slot_count, sizeof(*recorder->sink_slots)))) {
+         vcos_log_error("%s: Failed to allocate the sink slots", __func__);
+         goto error;
+      }
+   } else if (recorder->sink_queue) {
+      if (pthread_create(&recorder->sink_thread, NULL, recorder_sink_thread, recorder) != 0) {
+         vcos_log_error("%s: Failed to start the sink thread", __func__);
+         goto error;
+      }
+      recorder->sink_started = 1;
+   }
+   if (recorder->analysis) {
+      // Buffers of its own, an analyser that falls behind only loses analysis frames
+      recorder->analysis_running = 1;
+      if ((status = stream_attach(recorder->analysis, state->camera_component->output[MMAL_CAMERA_PREVIEW_PORT],
+                                  taps->analysis->slots > 2 ? taps->analysis->slots : 2)) != MMAL_SUCCESS)
+         goto error;
+   }
+   status = connect_ports(state->camera_component->output[MMAL_CAMERA_VIDEO_PORT], state->encoder_component->input[0], &state->encoder_connection);
+   if (status != MMAL_SUCCESS) {
+      vcos_log_error("%s: Failed to connect camera video port to encoder input", __func__);
+      state->encoder_connection = NULL;
+      goto error;
+   }
+
+   encoder_output_port = state->encoder_component->output[0];
+   encoder_output_port->userdata = (struct MMAL_PORT_USERDATA_T *)recorder;
+   if ((status = mmal_port_enable(encoder_output_port, recorder_buffer_callback)) != MMAL_SUCCESS) {
+      vcos_log_error("%s: Failed to enable encoder output port", __func__);
+      goto error;
+   }
+   recorder->running = 1;
+   if (recorder->pattern || recorder->rate_control) {
+      if (pthread_create(&recorder->control_thread, NULL, recorder_control, recorder) != 0) {
+         vcos_log_error("%s: Failed to start the control thread", __func__);
+         goto error;
+      }
+      recorder->control_started = 1;
+   }
+
+   // Send all the buffers to the encoder output port
+   num = mmal_queue_length(state->encoder_pool->queue);
+   for (q=0;q<num;q++) {
+      MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(state->encoder_pool->queue);
+
+      if (!buffer)
+         vcos_log_error("Unable to get a required buffer %d from pool queue", q);
+
+      if (mmal_port_send_buffer(encoder_output_port, buffer)!= MMAL_SUCCESS)
+         vcos_log_error("Unable to send a buffer to encoder output port (%d)", q);
+   }
+
+   if ((status = mmal_port_parameter_set_boolean(state->camera_component->output[MMAL_CAMERA_VIDEO_PORT], MMAL_PARAMETER_CAPTURE, 1)) != MMAL_SUCCESS) {
+      vcos_log_error("%s: Failed to start capture", __func__);
+      goto error;
+   }
+   return recorder;
+
+error:
+   mmal_status_to_int(status);
+   destroyRecorder(recorder);
+   if (status != MMAL_SUCCESS)
+      raspicamcontrol_check_configuration(128);
+   return NULL;
+}
+
+
+int recorderWait(Recorder *recorder, int timeout_ms) {
+   struct timespec until;
+   int finished;
+
+   deadline_after(&until, timeout_ms);
+   pthread_mutex_lock(&recorder->lock);
+   while (!recorder->finished) {
+      if (timeout_ms < 0)
+         pthread_cond_wait(&recorder->changed, &recorder->lock);
+      else if (pthread_cond_timedwait(&recorder->changed, &recorder->lock, &until) == ETIMEDOUT)
+         break;
+   }
+   finished = recorder->abort ? -1 : recorder->finished;
+   pthread_mutex_unlock(&recorder->lock);
+   return finished;
+}
+
+int recorderSplit(Recorder *recorder, char *filename) {
+   int fd;
+   int retired;
+   int result = 0;
+
+   if ((fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+      vcos_log_error("%s: Failed to open %s", __func__, filename);
+      return -1;
+   }
+
+   pthread_mutex_lock(&recorder->lock);
+   if (!recorder->running || recorder->finished) {
+      pthread_mutex_unlock(&recorder->lock);
+      close(fd);
+      return 1;
+   }
+   if (!recorder->writing) {
+      // Only the taps had the stream so far, the writer discards it until the switch
+      if (picam_writer_init(&recorder->writer, RECORDER_QUEUE_SIZE, -1, 0, recorder->frame_us) != 0) {
+         pthread_mutex_unlock(&recorder->lock);
+         vcos_log_error("%s: Failed to start the writer", __func__);
+         close(fd);
+         errno = ENOMEM;
+         return -1;
+      }
+      __atomic_store_n(&recorder->writing, 1, __ATOMIC_RELEASE);
+   }
+   // An earlier split that has not happened yet is replaced by this one
+   retired = recorder->next_fd;
+   recorder->next_fd = fd;
+   // Ask for an IDR frame now rather than waiting out the intra period, the
+   // lock keeps the encoder from being torn down under us
+   mmal_port_parameter_set_boolean(recorder->state.encoder_component->output[0], MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME, 1);
+   pthread_mutex_unlock(&recorder->lock);
+   if (retired >= 0)
+      close(retired);
+
+   // The writer thread closes the previous file once it has written it out
+   pthread_mutex_lock(&recorder->lock);
+   while (recorder->next_fd == fd && !recorder->finished)
+      pthread_cond_wait(&recorder->changed, &recorder->lock);
+   if (recorder->next_fd == fd)
+      result = 1;     // recording ended first, the file is closed with the rest
+   pthread_mutex_unlock(&recorder->lock);
+   return result;
+}
+
+int recorderTakePhoto(Recorder *recorder, int quality, PicamFrame *frame, int64_t *timestamp, int64_t *gap, int *lost) {
+   RASPISTILL_STATE *still = &recorder->still;
+   struct timespec until;
+   int64_t interval;
+   int running, done;
+   int result = 1;
+
+   memset(frame, 0, sizeof(*frame));
+   *timestamp = 0;
+   *gap = 0;
+   *lost = 0;
+   if (quality > 100) {
+       quality = 100;
+   } else if (quality < 0) {
+       quality = 85;
+   }
+
+   pthread_mutex_lock(&recorder->branch_lock);
+   pthread_mutex_lock(&recorder->lock);
+   running = recorder->running && !recorder->stopping && !recorder->finished;
+   pthread_mutex_unlock(&recorder->lock);
+   if (!running)
+      goto done;
+   if (!still->encoder_component) {
+      if (recorder_still_build(recorder, quality) != MMAL_SUCCESS)
+         goto done;
+   } else if (still->quality != quality) {
+      if (mmal_port_parameter_set_uint32(still->encoder_component->output[0], MMAL_PARAMETER_JPEG_Q_FACTOR, quality) == MMAL_SUCCESS) {
+         still->quality = quality;
+      } else {
+         // Not accepted on a live port, only the still side is rebuilt
+         recorder_still_teardown(recorder);
+         if (recorder_still_build(recorder, quality) != MMAL_SUCCESS)
+            goto done;
+      }
+   }
+
+   // Generous for JPEG, anything larger is handled by growing the buffer
+   picam_buffer_free(&still->output);
+   picam_buffer_reserve(&still->output, (long)still->width * still->height / 2);
+   still->outputTimestamp = MMAL_TIME_UNKNOWN;
+   pthread_mutex_lock(&recorder->lock);
+   recorder->still_done = 0;
+   recorder->still_abort = 0;
+   recorder->still_interval = 0;
+   recorder->still_watch = RECORDER_STILL_SETTLE_FRAMES;
+   pthread_mutex_unlock(&recorder->lock);
+
+   if (mmal_port_parameter_set_boolean(recorder->state.camera_component->output[MMAL_CAMERA_CAPTURE_PORT], MMAL_PARAMETER_CAPTURE, 1) != MMAL_SUCCESS) {
+      vcos_log_error("%s: Failed to start capture", __func__);
+      pthread_mutex_lock(&recorder->lock);
+      recorder->still_watch = 0;
+      pthread_mutex_unlock(&recorder->lock);
+      goto done;
+   }
+
+   // Wait for the still, then for the video to come back so the gap is known
+   deadline_after(&until, RECORDER_STILL_WAIT_MS);
+   pthread_mutex_lock(&recorder->lock);
+   while (!recorder->stopping && !(recorder->still_done && (recorder->still_watch == 0 || recorder->finished))) {
+      if (pthread_cond_timedwait(&recorder->changed, &recorder->lock, &until) == ETIMEDOUT)
+         break;
+   }
+   done = recorder->still_done && !recorder->still_abort;
+   interval = recorder->still_interval;
+   if (!recorder->still_done) {
+      // Still in flight, the encoder must not write into the output once we return
+      vcos_log_error("%s: Still did not complete", __func__);
+   }
+   recorder->still_watch = 0;
+   pthread_mutex_unlock(&recorder->lock);
+   if (!done) {
+      recorder_still_teardown(recorder);
+      goto done;
+   }
+
+   frame->format = PICAM_FORMAT_JPEG;
+   frame->width = still->width;
+   frame->height = still->height;
+   frame->data = picam_buffer_detach(&still->output, &frame->length);
+   *timestamp = still->outputTimestamp == MMAL_TIME_UNKNOWN ? 0 : still->outputTimestamp;
+   // Only what goes past half a frame interval is counted, timestamps jitter
+   if (interval > recorder->frame_us + recorder->frame_us / 2) {
+      *gap = interval - recorder->frame_us;
+      *lost = (int)((*gap + recorder->frame_us / 2) / recorder->frame_us);
+   }
+   result = frame->data == NULL;
+
+done:
+   pthread_mutex_unlock(&recorder->branch_lock);
+   return result;
+}
+
+void recorderSetDuration(Recorder *recorder, int duration) {
+   pthread_mutex_lock(&recorder->lock);
+   recorder->duration = duration > 0 ? (int64_t)duration * 1000 : 0;
+   pthread_mutex_unlock(&recorder->lock);
+}
+
+void recorderStats(Recorder *recorder, unsigned long *frames, int64_t *elapsed, int *segment) {
+   pthread_mutex_lock(&recorder->lock);
+   *frames = recorder->frames;
+   *segment = recorder->segment;
+   *elapsed = recorder->frames ? recorder->last_pts - recorder->first_pts : 0;
+   pthread_mutex_unlock(&recorder->lock);
+}
+
+void recorderWriterStats(Recorder *recorder, PICAM_WRITER_STATS *stats) {
+   pthread_mutex_lock(&recorder->lock);
+   // Counters of a finished writer are only final once teardown returns
+   if (recorder->writing)
+      picam_writer_stats(&recorder->writer, stats);
+   else
+      *stats = recorder->writer_stats;
+   // Samples the muxer left out count as dropped buffers
+   stats->dropped += __atomic_load_n(&recorder->mp4.dropped, __ATOMIC_RELAXED);
+   pthread_mutex_unlock(&recorder->lock);
+}
+
+int recorderNextChunk(Recorder *recorder, PicamFrame *chunk, int64_t *timestamp, int *slot) {
+   MMAL_BUFFER_HEADER_T *buffer;
+   int i;
+
+   if (!recorder->sink_pull)
+      return 1;
+   while (!(buffer = mmal_queue_timedwait(recorder->sink_queue, RECORDER_SINK_WAIT_MS))) {
+      int ended;
+
+      pthread_mutex_lock(&recorder->lock);
+      ended = recorder->finished || recorder->stopping;
+      pthread_mutex_unlock(&recorder->lock);
+      // The callback queues nothing more once finished is set
+      if (ended && mmal_queue_length(recorder->sink_queue) == 0)
+         return 1;
+   }
+
+   pthread_mutex_lock(&recorder->lock);
+   // Every buffer in the pool has a slot, so one is always free
+   for (i = 0; recorder->sink_slots[i]; i++)
+      ;
+   recorder->sink_slots[i] = buffer;
+   pthread_mutex_unlock(&recorder->lock);
+
+   mmal_buffer_header_mem_lock(buffer);
+   memset(chunk, 0, sizeof(*chunk));
+   chunk->data = buffer->data;
+   chunk->length = buffer->length;
+   chunk->width = recorder->state.width;
+   chunk->height = recorder->state.height;
+   chunk->format = PICAM_FORMAT_H264;
+   *timestamp = buffer->pts == MMAL_TIME_UNKNOWN ? 0 : buffer->pts;
+   *slot = i;
+   return 0;
+}
+
+void recorderReleaseChunk(Recorder *recorder, int slot) {
+   MMAL_BUFFER_HEADER_T *buffer;
+
+   pthread_mutex_lock(&recorder->lock);
+   buffer = recorder->sink_slots[slot];
+   recorder->sink_slots[slot] = NULL;
+   pthread_mutex_unlock(&recorder->lock);
+   mmal_buffer_header_mem_unlock(buffer);
+   recorder_sink_release(recorder, buffer);
+}
+
+int recorderRateStats(Recorder *recorder, PICAM_RATE_STATS *stats, unsigned long after, int timeout_ms) {
+   struct timespec until;
+   int fresh;
+
+   if (timeout_ms > 0)
+      deadline_after(&until, timeout_ms);
+   pthread_mutex_lock(&recorder->lock);
+   while (recorder->rate_control && recorder->rate.stats.updates <= after &&
+          !recorder->finished && !recorder->stopping && timeout_ms != 0) {
+      if (timeout_ms < 0)
+         pthread_cond_wait(&recorder->changed, &recorder->lock);
+      else if (pthread_cond_timedwait(&recorder->changed, &recorder->lock, &until) == ETIMEDOUT)
+         break;
+   }
+   *stats = recorder->rate.stats;
+   fresh = recorder->rate_control && recorder->rate.stats.updates > after;
+   pthread_mutex_unlock(&recorder->lock);
+   return fresh;
+}
+
+int recorderApplyParams(Recorder *recorder, PicamParams *parms) {
+   unsigned int changed = 0;
+   int running, failed = 0, count = 0;
+
+   // Stills and teardown take branch_lock too, so the camera stays put while it is set
+   pthread_mutex_lock(&recorder->branch_lock);
+   pthread_mutex_lock(&recorder->lock);
+   running = recorder->running && !recorder->stopping && !recorder->finished;
+   pthread_mutex_unlock(&recorder->lock);
+   if (running)
+      failed = apply_params(&recorder->state, parms, &changed);
+   pthread_mutex_unlock(&recorder->branch_lock);
+   if (!running)
+      return -1;
+   if (failed)
+      return -2;
+   for (; changed; changed &= changed - 1)
+      count++;
+   return count;
+}
+
+FrameStream *recorderAnalysisStream(Recorder *recorder) {
+   return recorder->analysis;
+}
+
+void recorderStopAnalysis(Recorder *recorder) {
+   pthread_mutex_lock(&recorder->branch_lock);
+   recorder_analysis_stop(recorder);
+   pthread_mutex_unlock(&recorder->branch_lock);
+}
+
+void recorderSinkStats(Recorder *recorder, unsigned long *stalls, uint64_t *bytes) {
+   *stalls = __atomic_load_n(&recorder->sink_stalls, __ATOMIC_RELAXED);
+   *bytes = __atomic_load_n(&recorder->sink_bytes, __ATOMIC_RELAXED);
+}
+
+void stopRecorder(Recorder *recorder) {
+   recorder_teardown(recorder);
+}
+
+void destroyRecorder(Recorder *recorder) {
+   if (!recorder)
+      return;
+   recorder_teardown(recorder);
+   if (recorder->sink_queue) {
+      MMAL_BUFFER_HEADER_T *buffer;
+
+      while ((buffer = mmal_queue_get(recorder->sink_queue)) != NULL)
+         recorder_sink_release(recorder, buffer);
+      // Chunks handed out must all have been released
+      pthread_mutex_lock(&recorder->lock);
+      while (__atomic_load_n(&recorder->sink_outstanding, __ATOMIC_ACQUIRE) > 0)
+         pthread_cond_wait(&recorder->changed, &recorder->lock);
+      pthread_mutex_unlock(&recorder->lock);
+      mmal_queue_destroy(recorder->sink_queue);
+   }
+   if (recorder->encoder_kept)
+      destroy_encoder_component(&recorder->state);
+   free(recorder->sink_slots);
+   destroyFrameStream(recorder->analysis);
+   pthread_mutex_destroy(&recorder->branch_lock);
+   pthread_cond_destroy(&recorder->changed);
+   pthread_mutex_destroy(&recorder->lock);
+   free(recorder->pattern);
+   picam_mp4_free(&recorder->mp4);
+   free(recorder);
+}
+
+/**
+ *  buffer header callback function for the video port of a frame stream
+ *
+ *  Copies each frame into a free slot of the stream queue and publishes it on
+ *  frame end. Frames arriving while every slot is busy are dropped.
+ *
+ * @param port Pointer to port from which callback originated
+ * @param buffer mmal buffer header pointer
+ */
+static void stream_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+   FrameStream *stream = (FrameStream *)port->userdata;
+
+   if (buffer->length) {
+      if (!stream->fill_data && stream->fill_slot < 0) {
+         stream->fill_data = picam_frame_queue_acquire(&stream->queue, &stream->fill_slot);
+         stream->fill_length = 0;
+      }
+      if (stream->fill_data) {
+         if (stream->fill_length + (long)buffer->length > stream->queue.slot_size) {
+            vcos_log_error("Frame larger than its slot (%ld bytes) - dropped", stream->queue.slot_size);
+            picam_frame_queue_abandon(&stream->queue, stream->fill_slot);
+            stream->fill_data = NULL;
+         } else {
+            mmal_buffer_header_mem_lock(buffer);
+            memcpy(stream->fill_data + stream->fill_length, buffer->data, buffer->length);
+            mmal_buffer_header_mem_unlock(buffer);
+            stream->fill_length += buffer->length;
+         }
+      }
+   }
+
+   if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED) {
+      if (stream->fill_data)
+         picam_frame_queue_abandon(&stream->queue, stream->fill_slot);
+      stream->fill_data = NULL;
+      stream->fill_slot = -1;
+   } else if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) {
+      if (stream->fill_data)
+         picam_frame_queue_publish(&stream->queue, stream->fill_slot,
+                                   stream->fill_length < stream->frame_length ? stream->fill_length : stream->frame_length, buffer->pts);
+      stream->fill_data = NULL;
+      stream->fill_slot = -1;
+   }
+
+   mmal_buffer_header_release(buffer);
+
+   // and send one back to the port (if still open)
+   if (port->is_enabled) {
+      MMAL_STATUS_T status = MMAL_SUCCESS;
+      MMAL_BUFFER_HEADER_T *new_buffer = mmal_queue_get(stream->video_pool->queue);
+
+      if (new_buffer)
+         status = mmal_port_send_buffer(port, new_buffer);
+      if (!new_buffer || status != MMAL_SUCCESS)
+         vcos_log_error("Unable to return a buffer to the video port");
+   }
+}
+
+/**
+ *  buffer header callback function for the video port of a batch capture
+ *
+ *  Copies each frame straight to its place in the batch and notes where it
+ *  came from. Buffers stop going back to the port once the batch is full.
+ *
+ * @param port Pointer to port from which callback originated
+ * @param buffer mmal buffer header pointer
+ */
+static void batch_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+   FrameStream *stream = (FrameStream *)port->userdata;
+   PicamBatch *batch = stream->batch;
+   int wanted = !stream->skip_frames && batch->captured < batch->count;
+
+   if (buffer->length && wanted) {
+      // Anything past frame_size is padding, or the chroma of a PICAM_FORMAT_LUMA frame
+      long room = batch->frame_size - stream->fill_length;
+      long length = (long)buffer->length < room ? (long)buffer->length : room;
+
+      if (length > 0) {
+         mmal_buffer_header_mem_lock(buffer);
+         memcpy(batch->data + (size_t)batch->captured * batch->frame_size + stream->fill_length, buffer->data, length);
+         mmal_buffer_header_mem_unlock(buffer);
+         stream->fill_length += length;
+      }
+   }
+
+   if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED) {
+      if (wanted)
+         batch->dropped++;
+      stream->fill_length = 0;
+   } else if ((buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) && wanted && stream->fill_length) {
+      PicamBatchFrame *frame = &batch->frames[batch->captured];
+
+      frame->timestamp = buffer->pts == MMAL_TIME_UNKNOWN ? 0 : buffer->pts;
+      frame->length = (uint32_t)stream->fill_length;
+      frame->flags = buffer->flags;
+      stream->fill_length = 0;
+      if (++batch->captured == batch->count)
+         sem_post(&stream->batch_done);
+   } else if ((buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) && stream->skip_frames) {
+      stream->skip_frames--;
+   }
+
+   mmal_buffer_header_release(buffer);
+
+   // and send one back to the port (if still open and more frames are wanted)
+   if (port->is_enabled && batch->captured < batch->count) {
+      MMAL_STATUS_T status = MMAL_SUCCESS;
+      MMAL_BUFFER_HEADER_T *new_buffer = mmal_queue_get(stream->video_pool->queue);
+
+      if (new_buffer)
+         status = mmal_port_send_buffer(port, new_buffer);
+      if (!new_buffer || status != MMAL_SUCCESS)
+         vcos_log_error("Unable to return a buffer to the video port");
+   }
+}
+
+/**
+ * Allocate the slots of a stream and start copying the frames of a raw port
+ * into them. stream->format and stream->state.height must be set.
+ *
+ * @param stream Stream the frames go to
+ * @param port Camera output port, its format committed and the component enabled
+ * @param slots Number of frame slots, at most PICAM_MAX_FRAME_SLOTS are made
+ *
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+static MMAL_STATUS_T stream_attach(FrameStream *stream, MMAL_PORT_T *port, int slots)
+{
+   MMAL_STATUS_T status;
+   long slot_size;
+   int num, q;
+
+   stream->fill_slot = -1;
+   stream->stride = port->format->es->video.width;
+   if (stream->format == PICAM_FORMAT_RGB24 || stream->format == PICAM_FORMAT_BGR24) {
+      stream->stride *= 3;
+      stream->frame_length = (long)stream->stride * port->format->es->video.height;
+   } else if (stream->format == PICAM_FORMAT_LUMA) {
+      stream->frame_length = (long)stream->stride * stream->state.height;
+   } else {
+      stream->frame_length = (long)stream->stride * port->format->es->video.height * 3 / 2;
+   }
+
+   // All the frame memory there will ever be, allocated before the first frame
+   if (stream->batch) {
+      PicamBatch *batch = stream->batch;
+
+      batch->frame_size = stream->frame_length;
+      batch->width = stream->state.width;
+      batch->height = stream->state.height;
+      batch->stride = stream->stride;
+      batch->format = stream->format;
+      // size_t is 32 bits on Raspberry Pi OS, a long batch of big frames would wrap
+      if ((size_t)batch->count > SIZE_MAX / batch->frame_size) {
+         vcos_log_error("%s: A batch of %d frames of %ld bytes is too large", __func__, batch->count, batch->frame_size);
+         return MMAL_ENOMEM;
+      }
+      batch->data = malloc((size_t)batch->count * batch->frame_size);
+      batch->frames = calloc(batch->count, sizeof(PicamBatchFrame));
+      if (!batch->data || !batch->frames) {
+         vcos_log_error("%s: Failed to allocate a batch of %d frames", __func__, batch->count);
+         return MMAL_ENOMEM;
+      }
+   } else {
+      slot_size = port->buffer_size > stream->frame_length ? port->buffer_size : stream->frame_length;
+      if (slots > PICAM_MAX_FRAME_SLOTS)
+         slots = PICAM_MAX_FRAME_SLOTS;
+      if (picam_frame_queue_init(&stream->queue, slots, slot_size) != 0) {
+         vcos_log_error("%s: Failed to allocate %d frame slots", __func__, slots);
+         return MMAL_ENOMEM;
+      }
+   }
+   stream->video_pool = mmal_port_pool_create(port, port->buffer_num, port->buffer_size);
+   if (!stream->video_pool) {
+      vcos_log_error("%s: Failed to create buffer header pool for %s", __func__, port->name);
+      return MMAL_ENOMEM;
+   }
+
+   port->userdata = (struct MMAL_PORT_USERDATA_T *)stream;
+   status = mmal_port_enable(port, stream->batch ? batch_buffer_callback : stream_buffer_callback);
+   if (status != MMAL_SUCCESS) {
+      vcos_log_error("%s: Failed to enable %s", __func__, port->name);
+      return status;
+   }
+   stream->running = 1;
+
+   num = mmal_queue_length(stream->video_pool->queue);
+   for (q=0;q<num;q++) {
+      MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(stream->video_pool->queue);
+
+      if (!buffer)
+         vcos_log_error("Unable to get a required buffer %d from pool queue", q);
+
+      if (mmal_port_send_buffer(port, buffer)!= MMAL_SUCCESS)
+         vcos_log_error("Unable to send a buffer to video port (%d)", q);
+   }
+   return MMAL_SUCCESS;
+}
+
+/**
+ * Stop the frames of a port going to a stream and end its iteration once the
+ * waiting frames are read. The slots stay, frames handed out may point into them.
+ *
+ * Safe to call on a partially attached stream and more than once.
+ *
+ * @param stream Stream to detach
+ * @param port Port given to stream_attach, NULL if the camera is already gone
+ */
+static void stream_detach(FrameStream *stream, MMAL_PORT_T *port)
+{
+   if (port)
+      check_disable_port(port);
+   stream->running = 0;
+   if (stream->queue.memory)
+      picam_frame_queue_close(&stream->queue);
+   if (port && stream->video_pool) {
+      mmal_port_pool_destroy(port, stream->video_pool);
+      stream->video_pool = NULL;
+   }
+}
+
+/**
+ * Stop the camera and release everything but the slots, which frames handed
+ * out by frameStreamNext may still point into
+ *
+ * Safe to call on a partially built stream and more than once.
+ *
+ * @param stream Stream to stop
+ */
+static void stream_teardown(FrameStream *stream)
+{
+   RASPISTILL_STATE *state = &stream->state;
+
+   if (state->resize_component) {
+      stream_detach(stream, state->resize_component->output[0]);
+      check_disable_port(state->camera_component->output[MMAL_CAMERA_VIDEO_PORT]);
+   } else {
+      stream_detach(stream, state->camera_component ? state->camera_component->output[MMAL_CAMERA_VIDEO_PORT] : NULL);
+   }
+   destroy_resize_component(state);
+
+   if (state->preview_connection) {
+      mmal_connection_destroy(state->preview_connection);
+      state->preview_connection = NULL;
+   }
+   if (state->preview_component) {
+      mmal_component_disable(state->preview_component);
+      mmal_component_destroy(state->preview_component);
+      state->preview_component = NULL;
+   }
+   if (state->camera_component)
+      mmal_component_disable(state->camera_component);
+   destroy_camera_component(state);
+}
+
+/**
+ * Start the camera streaming raw frames from its video port
+ *
+ * @param width Frame size, clamped to what the video port takes
+ * @param height
+ * @param framerate Frames per second
+ * @param format One of the raw PICAM_FORMAT_* values
+ * @param slots Frames that can wait for the reader, ignored with batch
+ * @param parms Camera settings
+ * @param batch Batch to fill instead of handing frames to a reader, NULL for a FrameStream
+ * @param scaled Non-zero to take the whole field of view at SMALL_FRAME_SOURCE size from the
+ *               camera and have a resize component scale it, SMALL_FRAME_SETTLE_FRAMES are
+ *               thrown away before the batch fills
+ *
+ * @return The running stream, NULL on failure
+ */
+static FrameStream *stream_start(int width, int height, int framerate, int format, int slots, PicamParams *parms, PicamBatch *batch, int scaled)
+{
+   MMAL_PORT_T *output_port;
+   FrameStream *stream;
+   RASPISTILL_STATE *state;
+   MMAL_STATUS_T status = MMAL_SUCCESS;
+
+   if (!format_is_raw(format))
+      return NULL;
+   if (width > 1920) {
+       width = 1920;
+   } else if (width < 20) {
+       width = 20;
+   }
+   if (height > 1080) {
+       height = 1080;
+   } else if (height < 20) {
+       height = 20;
+   }
+   if (framerate > 90) {
+       framerate = 90;
+   } else if (framerate < 1) {
+       framerate = 1;
+   }
+   if (slots < 2)
+       slots = 2;
+
+   stream = calloc(1, sizeof(FrameStream));
+   if (!stream)
+      return NULL;
+   state = &stream->state;
+   stream->format = format;
+   if (batch) {
+      stream->batch = batch;
+      sem_init(&stream->batch_done, 0, 0);
+   }
+
+   bcm_host_init();
+   default_status(state);
+   state->width = width;
+   state->height = height;
+   state->encoding = format_encoding(format);
+   state->rawVideo = !scaled;
+   state->videoEncode = 0;
+   if (scaled) {
+      state->videoWidth = SMALL_FRAME_SOURCE_WIDTH;
+      state->videoHeight = SMALL_FRAME_SOURCE_HEIGHT;
+      stream->skip_frames = SMALL_FRAME_SETTLE_FRAMES;
+   }
+   fill_state_from_params(state, parms);
+   state->framerate = framerate;
+
+   if ((status = create_video_camera_component(state)) != MMAL_SUCCESS) {
+      vcos_log_error("%s: Failed to create camera component", __func__);
+      goto error;
+   }
+   if ((status = mmal_component_create("vc.null_sink", &state->preview_component)) != MMAL_SUCCESS) {
+      vcos_log_error("%s: Failed to create preview component", __func__);
+      state->preview_component = NULL;
+      goto error;
+   }
+   status = mmal_component_enable(state->preview_component);
+   status = connect_ports(state->camera_component->output[MMAL_CAMERA_PREVIEW_PORT], state->preview_component->input[0], &state->preview_connection);
+   if (status != MMAL_SUCCESS) {
+      vcos_log_error("%s: Failed to connect camera to preview", __func__);
+      state->preview_connection = NULL;
+      goto error;
+   }
+
+   output_port = state->camera_component->output[MMAL_CAMERA_VIDEO_PORT];
+   if (scaled) {
+      if ((status = create_resize_component(state)) != MMAL_SUCCESS) {
+         vcos_log_error("%s: Failed to create resize component", __func__);
+         goto error;
+      }
+      // Opaque frames stay on the GPU, only the scaled ones come to us
+      status = connect_ports(output_port, state->resize_component->input[0], &state->resize_connection);
+      if (status != MMAL_SUCCESS) {
+         vcos_log_error("%s: Failed to connect camera video port to resizer", __func__);
+         state->resize_connection = NULL;
+         goto error;
+      }
+      output_port = state->resize_component->output[0];
+   }
+
+   if ((status = stream_attach(stream, output_port, slots)) != MMAL_SUCCESS)
+      goto error;
+
+   if ((status = mmal_port_parameter_set_boolean(state->camera_component->output[MMAL_CAMERA_VIDEO_PORT], MMAL_PARAMETER_CAPTURE, 1)) != MMAL_SUCCESS) {
+      vcos_log_error("%s: Failed to start streaming", __func__);
+      goto error;
+   }
+   return stream;
+
+error:
+   mmal_status_to_int(status);
+   destroyFrameStream(stream);
+   raspicamcontrol_check_configuration(128);
+   return NULL;
+}
+
+FrameStream *startFrameStream(int width, int height, int framerate, int format, int slots, PicamParams *parms) {
+   return stream_start(width, height, framerate, format, slots, parms, NULL, 0);
+}
+
+int frameStreamNext(FrameStream *stream, PicamFrame *frame, int64_t *timestamp, int *slot) {
+   long length;
+
+   memset(frame, 0, sizeof(*frame));
+   frame->data = picam_frame_queue_next(&stream->queue, slot, &length, timestamp);
+   if (!frame->data)
+      return 1;
+   frame->length = length;
+   frame->width = stream->state.width;
+   frame->height = stream->state.height;
+   frame->stride = stream->stride;
+   frame->format = stream->format;
+   return 0;
+}
+
+void frameStreamRelease(FrameStream *stream, int slot) {
+   picam_frame_queue_release(&stream->queue, slot);
+}
+
+void frameStreamStats(FrameStream *stream, unsigned long *delivered, unsigned long *dropped) {
+   pthread_mutex_lock(&stream->queue.lock);
+   *delivered = stream->queue.delivered;
+   *dropped = stream->queue.dropped;
+   pthread_mutex_unlock(&stream->queue.lock);
+}
+
+void stopFrameStream(FrameStream *stream) {
+   stream_teardown(stream);
+}
+
+void destroyFrameStream(FrameStream *stream) {
+   if (!stream)
+      return;
+   stream_teardown(stream);
+   picam_frame_queue_destroy(&stream->queue);
+   if (stream->batch)
+      sem_destroy(&stream->batch_done);
+   free(stream);
+}
+
+/**
+ * Fill a batch from the video port and stop the camera again
+ *
+ * @return Frames captured, the batch memory is freed if none were
+ */
+static int batch_capture(int count, int width, int height, int framerate, int format, PicamParams *parms, PicamBatch *batch)
+{
+   FrameStream *stream;
+   struct timespec until;
+
+   memset(batch, 0, sizeof(*batch));
+   if (count < 1)
+      return 0;
+   batch->count = count;
+   stream = stream_start(width, height, framerate, format, 0, parms, batch, 0);
+   if (stream) {
+      // The camera takes a moment to start, then the frames come at the clamped rate
+      deadline_after(&until, 5000 + (int)((int64_t)(count + stream->skip_frames) * 1000 / (stream->state.framerate > 0 ? stream->state.framerate : 1)));
+      while (sem_timedwait(&stream->batch_done, &until) != 0 && errno == EINTR)
+         ;
+      // No frame is written once the port is disabled
+      destroyFrameStream(stream);
+   }
+   if (!batch->captured) {
+      free(batch->data);
+      free(batch->frames);
+      batch->data = NULL;
+      batch->frames = NULL;
+   }
+   return batch->captured;
+}
+
+int captureBatchWithDetails(int count, int width, int height, int framerate, int format, PicamParams *parms, PicamBatch *batch) {
+   return batch_capture(count, width, height, framerate, format, parms, batch);
+}
+
+/**
+ * Take one small raw frame on a session from the video port, scaled on the
+ * GPU. The graph is started on first use and left running, so later captures
+ * of the same size and format skip building it and waiting for the camera to
+ * settle, they only wait for a fresh frame.
+ *
+ * @return 0 if successful, non-zero otherwise
+ */
+static int session_small_frame(CameraSession *session, int width, int height, int format, PicamParams *parms, PicamFrame *frame)
+{
+   PicamBatch *batch = &session->small_batch;
+   FrameStream *stream = session->small;
+   struct timespec until;
+
+   memset(frame, 0, sizeof(*frame));
+   if (width > SMALL_FRAME_MAX_WIDTH || height > SMALL_FRAME_MAX_HEIGHT)
+      return 1;
+   // One camera, a stills graph gives it up, and the frames only change with a restart
+   if (session->built ||
+       (stream && (session->small_width != width || session->small_height != height || stream->format != format))) {
+      session_teardown(session);
+      stream = NULL;
+   }
+
+   if (!stream) {
+      batch->count = 1;
+      stream = stream_start(width, height, SMALL_FRAME_RATE, format, 0, parms, batch, 1);
+      if (!stream) {
+         session_teardown(session);
+         return 1;
+      }
+      session->small = stream;
+      session->small_width = width;
+      session->small_height = height;
+   } else {
+      MMAL_PORT_T *port = stream->state.resize_component->output[0];
+      MMAL_BUFFER_HEADER_T *buffer;
+
+      apply_params(&stream->state, parms, NULL);
+      // The last frame was handed over with its memory
+      if (!batch->data && !(batch->data = malloc(batch->frame_size))) {
+         vcos_log_error("%s: Failed to allocate a frame", __func__);
+         return 1;
+      }
+      // The callback stopped sending buffers once the last batch was full, re-arm it and hand them back
+      stream->skip_frames = SMALL_FRAME_STALE_FRAMES;
+      __atomic_store_n(&batch->captured, 0, __ATOMIC_RELEASE);
+      while ((buffer = mmal_queue_get(stream->video_pool->queue)) != NULL) {
+         if (mmal_port_send_buffer(port, buffer) != MMAL_SUCCESS)
+            vcos_log_error("Unable to send a buffer to %s", port->name);
+      }
+   }
+
+   deadline_after(&until, 5000 + (int)((int64_t)(1 + stream->skip_frames) * 1000 / SMALL_FRAME_RATE));
+   while (sem_timedwait(&stream->batch_done, &until) != 0 && errno == EINTR)
+      ;
+   if (!__atomic_load_n(&batch->captured, __ATOMIC_ACQUIRE)) {
+      vcos_log_error("%s: No frame from the camera", __func__);
+      session_teardown(session);
+      return 1;
+   }
+   // The one frame is the whole allocation, it is handed over as it is
+   frame->data = batch->data;
+   frame->length = batch->frames[0].length;
+   frame->width = batch->width;
+   frame->height = batch->height;
+   frame->stride = batch->stride;
+   frame->format = batch->format;
+   batch->data = NULL;
+   return 0;
+}
+
+int sessionRawFrameWithDetails(CameraSession *session, int width, int height, int format, PicamParams *parms, PicamFrame *frame) {
+   // Small frames are scaled on the GPU from the video port, the sensor never switches to stills.
+   // A failure there is the camera's, the still port is only for sizes the resizer is not used for.
+   if (width <= SMALL_FRAME_MAX_WIDTH && height <= SMALL_FRAME_MAX_HEIGHT)
+      return session_small_frame(session, width, height, format, parms, frame);
+   return sessionFrameWithDetails(session, width, height, 100, format, parms, frame);
+}
+
+int takeSmallFrameWithDetails(int width, int height, int format, PicamParams *parms, PicamFrame *frame) {
+   CameraSession session;
+   int result;
+
+   memset(&session, 0, sizeof(session));
+   result = session_small_frame(&session, width, height, format, parms, frame);
+   session_teardown(&session);
+   return result;
+}
+
+/**
+ *  Gathers each JPEG from the image encoder and hands it to the HTTP server
+ *  on frame end. The server copies it once for all of its clients, so the
+ *  buffer is reused for the next frame straight away.
+ *
+ * @param port Pointer to port from which callback originated
+ * @param buffer mmal buffer header pointer
+ */
+static void mjpeg_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+   MjpegServer *server = (MjpegServer *)port->userdata;
+   RASPISTILL_STATE *state = &server->state;
+
+   if (buffer->length && !server->abort) {
+      mmal_buffer_header_mem_lock(buffer);
+      if (picam_buffer_append(&state->output, buffer->data, buffer->length) != 0) {
+         vcos_log_error("Failed to grow the MJPEG frame buffer (%d bytes stored) - frame dropped", (int)state->output.length);
+         server->abort = 1;
+      }
+      mmal_buffer_header_mem_unlock(buffer);
+   }
+
+   if (buffer->flags & (MMAL_BUFFER_HEADER_FLAG_FRAME_END | MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED)) {
+      if (!server->abort && !(buffer->flags & MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED) && state->output.length)
+         picam_http_publish(&server->http, state->output.data, state->output.length);
+      state->output.length = 0;
+      server->abort = 0;
+   }
+
+   mmal_buffer_header_release(buffer);
+
+   // and send one back to the port (if still open)
+   if (port->is_enabled) {
+      MMAL_STATUS_T status = MMAL_SUCCESS;
+      MMAL_BUFFER_HEADER_T *new_buffer = mmal_queue_get(state->encoder_pool->queue);
+
+      if (new_buffer)
+         status = mmal_port_send_buffer(port, new_buffer);
+      if (!new_buffer || status != MMAL_SUCCESS)
+         vcos_log_error("Unable to return a buffer to the image encoder port");
+   }
+}
+
+/**
+ * Stop the camera and encoder, then the HTTP server, which closes every client
+ *
+ * Safe to call on a partially built server and more than once.
+ *
+ * @param server Server to stop
+ */
+static void mjpeg_teardown(MjpegServer *server)
+{
+   RASPISTILL_STATE *state = &server->state;
+
+   if (state->camera_component)
+      mmal_port_parameter_set_boolean(state->camera_component->output[MMAL_CAMERA_VIDEO_PORT], MMAL_PARAMETER_CAPTURE, 0);
+   if (state->encoder_component)
+      check_disable_port(state->encoder_component->output[0]);
+   server->running = 0;
+
+   if (state->encoder_connection) {
+      mmal_connection_destroy(state->encoder_connection);
+      state->encoder_connection = NULL;
+   }
+   if (state->preview_connection) {
+      mmal_connection_destroy(state->preview_connection);
+      state->preview_connection = NULL;
+   }
+   if (state->encoder_component)
+      mmal_component_disable(state->encoder_component);
+   if (state->preview_component) {
+      mmal_component_disable(state->preview_component);
+      mmal_component_destroy(state->preview_component);
+      state->preview_component = NULL;
+   }
+   if (state->camera_component)
+      mmal_component_disable(state->camera_component);
+   destroy_encoder_component(state);
+   destroy_camera_component(state);
+   picam_buffer_free(&state->output);
+
+   if (!server->stopped) {
+      picam_http_stats(&server->http, &server->final_stats);
+      server->final_stats.clients = 0;
+      server->stopped = 1;
+   }
+   picam_http_stop(&server->http);
+}
+
+MjpegServer *startMjpegServer(const char *address, int port, int width, int height, int quality, int framerate, PicamParams *parms, int *error) {
+   MjpegServer *server;
+   RASPISTILL_STATE *state;
+   MMAL_STATUS_T status = MMAL_SUCCESS;
+   MMAL_PORT_T *output_port;
+   int num, q;
+
+   *error = 0;
+   if (width > 1920) {
+       width = 1920;
+   } else if (width < 20) {
+       width = 20;
+   }
+   if (height > 1080) {
+       height = 1080;
+   } else if (height < 20) {
+       height = 20;
+   }
+   if (quality > 100) {
+       quality = 100;
+   } else if (quality < 1) {
+       quality = 1;
+   }
+   if (framerate > 30) {
+       framerate = 30;
+   } else if (framerate < 1) {
+       framerate = 1;
+   }
+
+   server = calloc(1, sizeof(MjpegServer));
+   if (!server) {
+      *error = ENOMEM;
+      return NULL;
+   }
+   state = &server->state;
+
+   // Listen first, a port in use is the likeliest failure and needs no camera
+   *error = picam_http_start(&server->http, address, port, MJPEG_MAX_CLIENTS, MJPEG_CLIENT_FRAMES);
+   if (*error) {
+      free(server);
+      return NULL;
+   }
+
+   bcm_host_init();
+   default_status(state);
+   state->width = width;
+   state->height = height;
+   state->quality = quality;
+   state->encoding = MMAL_ENCODING_JPEG;
+   state->videoEncode = 1;
+   fill_state_from_params(state, parms);
+   state->framerate = framerate;
+
+   if ((status = create_video_camera_component(state)) != MMAL_SUCCESS) {
+      vcos_log_error("%s: Failed to create camera component", __func__);
+      goto error;
+   }
+   if ((status = create_encoder_component(state)) != MMAL_SUCCESS) {
+      vcos_log_error("%s: Failed to create encode component", __func__);
+      goto error;
+   }
+   if (!state->encoder_pool) {
+      status = MMAL_ENOMEM;
+      goto error;
+   }
+   if ((status = mmal_component_create("vc.null_sink", &state->preview_component)) != MMAL_SUCCESS) {
+      vcos_log_error("%s: Failed to create preview component", __func__);
+      state->preview_component = NULL;
+      goto error;
+   }
+   status = mmal_component_enable(state->preview_component);
+   status = connect_ports(state->camera_component->output[MMAL_CAMERA_PREVIEW_PORT], state->preview_component->input[0], &state->preview_connection);
+   if (status != MMAL_SUCCESS) {
+      vcos_log_error("%s: Failed to connect camera to preview", __func__);
+      state->preview_connection = NULL;
+      goto error;
+   }
+   status = connect_ports(state->camera_component->output[MMAL_CAMERA_VIDEO_PORT], state->encoder_component->input[0], &state->encoder_connection);
+   if (status != MMAL_SUCCESS) {
+      vcos_log_error("%s: Failed to connect camera video port to encoder input", __func__);
+      state->encoder_connection = NULL;
+      goto error;
+   }
+
+   output_port = state->encoder_component->output[0];
+   output_port->userdata = (struct MMAL_PORT_USERDATA_T *)server;
+   if ((status = mmal_port_enable(output_port, mjpeg_buffer_callback)) != MMAL_SUCCESS) {
+      vcos_log_error("%s: Failed to enable output port", __func__);
+      goto error;
+   }
+   server->running = 1;
+
+   // Send all the buffers to the encoder output port
+   num = mmal_queue_length(state->encoder_pool->queue);
+   for (q=0;q<num;q++) {
+      MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(state->encoder_pool->queue);
+
+      if (!buffer)
+         vcos_log_error("Unable to get a required buffer %d from pool queue", q);
+
+      if (mmal_port_send_buffer(output_port, buffer)!= MMAL_SUCCESS)
+         vcos_log_error("Unable to send a buffer to encoder output port (%d)", q);
+   }
+
+   if ((status = mmal_port_parameter_set_boolean(state->camera_component->output[MMAL_CAMERA_VIDEO_PORT], MMAL_PARAMETER_CAPTURE, 1)) != MMAL_SUCCESS) {
+      vcos_log_error("%s: Failed to start streaming", __func__);
+      goto error;
+   }
+   return server;
+
+error:
+   mmal_status_to_int(status);
+   *error = EIO;
+   destroyMjpegServer(server);
+   raspicamcontrol_check_configuration(128);
+   return NULL;
+}
+
+int mjpegServerPort(MjpegServer *server) {
+   return server->http.port;
+}
+
+void mjpegServerStats(MjpegServer *server, PICAM_HTTP_STATS *stats) {
+   if (server->stopped)
+      *stats = server->final_stats;
+   else
+      picam_http_stats(&server->http, stats);
+}
+
+void stopMjpegServer(MjpegServer *server) {
+   mjpeg_teardown(server);
+}
+
+void destroyMjpegServer(MjpegServer *server) {
+   if (!server)
+      return;
+   mjpeg_teardown(server);
+   free(server);
 }
@@ -3,33 +3,182 @@
 
 #include <Python.h>
 #include "interface/mmal/mmal.h"
-typedef struct {      
-    int exposure;
-    int meterMode;
-    int imageFX;
-    int awbMode;
-    int ISO;
-    int sharpness;             /// -100 to 100
-    int contrast;              /// -100 to 100
-    int brightness;            ///  0 to 100
-    int saturation;            ///  -100 to 100
-    int videoStabilisation;    /// 0 or 1 (false or true)
-    int exposureCompensation;  /// -10 to +10 ?
-    int rotation;
-    int hflip;                 /// 0 or 1
-    int vflip;                 /// 0 or 1
-    int shutter_speed;          //0 for auto, otherwise the shutter speed in ms
+#include "picamvectors.h"
+#include "picamring.h"
+#include "picamwriter.h"
+#include "picammp4.h"
+#include "picamsink.h"
+#include "picamhttp.h"
+#include "picamrate.h"
+#include "RaspiCamControl.h"
+
+/** Settings for a capture or recording. The camera settings are kept in the
+ *  form RaspiCamControl applies them; a live camera only has the ones that
+ *  differ from what it was last given sent to it.
+ */
+typedef struct {
+    RASPICAM_CAMERA_PARAMETERS camera;  /// Sensor and ISP settings, checked when they were set on picam.Config
+    const void *source;                 /// Config the settings were taken from, NULL if not tracked
+    unsigned long generation;           /// Changes made to source when they were taken, see picam.Config.generation
     int videoProfile;
     int videoBitrate;           //17000000
     int videoFramerate;         //30
     int quantisationParameter;  //0
     int inlineHeaders;                  /// Insert inline headers to stream (SPS, PPS)
-    double roi[4];
 } PicamParams;
 
+/// Layout of captured images
+enum {
+    PICAM_FORMAT_JPEG = 0,      /// JPEG from the image encoder
+    PICAM_FORMAT_BMP,           /// BMP from the image encoder, bottom up BGR rows after a 54 byte header
+    PICAM_FORMAT_RGB24,         /// Packed R,G,B bytes, stride bytes per row
+    PICAM_FORMAT_BGR24,         /// Packed B,G,R bytes, stride bytes per row
+    PICAM_FORMAT_I420,          /// Planar Y, U, V; stride bytes per Y row, stride/2 per U and V row, planes padded to 16 rows
+    PICAM_FORMAT_LUMA,          /// Y plane only, stride bytes per row
+    PICAM_FORMAT_H264           /// One encoder buffer of a recording's H264 stream, see recorderNextChunk
+};
+
+/// Most frame slots a FrameStream or the analysis frames of a recording can have
+#define PICAM_MAX_FRAME_SLOTS 32
+
+/// File formats of a recording
+enum {
+    PICAM_CONTAINER_H264 = 0,   /// Raw Annex-B H264, no timing
+    PICAM_CONTAINER_MP4,        /// MP4 with one mdat, playable only once the recording ends cleanly
+    PICAM_CONTAINER_FMP4        /// Fragmented MP4, a crash loses at most the open fragment
+};
+
+/// A capture together with the information needed to interpret it
+typedef struct {
+    uint8_t *data;              /// malloc()ed image data, owned by the caller
+    long length;                /// Number of bytes in data
+    int width;                  /// Visible width in pixels
+    int height;                 /// Visible height in rows
+    int stride;                 /// Bytes from one row to the next, 0 for encoded formats
+    int format;                 /// One of the PICAM_FORMAT_* values
+} PicamFrame;
+
+/// Where one frame of a PicamBatch came from, laid out so the array can be handed out as it is
+typedef struct {
+    int64_t timestamp;          /// Presentation time (us), 0 if the camera gave none
+    uint32_t length;            /// Bytes of the frame, at most frame_size
+    uint32_t flags;             /// MMAL_BUFFER_HEADER_FLAG_* of the frame's last buffer
+} PicamBatchFrame;
+
+/** Raw frames taken back to back from the video port into one allocation,
+ *  frame i at data + i * frame_size. Everything is allocated before the
+ *  first frame arrives and each frame is copied once, see captureBatchWithDetails.
+ */
+typedef struct {
+    uint8_t *data;              /// count * frame_size bytes, malloc()ed, owned by the caller
+    PicamBatchFrame *frames;    /// count entries, malloc()ed, owned by the caller
+    long frame_size;            /// Bytes from one frame to the next
+    int count;                  /// Frames asked for
+    int captured;               /// Frames in data, fewer than count if the camera stopped early
+    int width;                  /// Visible width in pixels
+    int height;                 /// Visible height in rows
+    int stride;                 /// Bytes from one row to the next
+    int format;                 /// One of the raw PICAM_FORMAT_* values
+    unsigned long dropped;      /// Frames the port failed to deliver whole while the batch filled
+} PicamBatch;
+
+/** Where a recording hands the encoder's own buffers, without copying them.
+ *  Buffers are only returned to the encoder once the sink is done with them,
+ *  so a sink that falls behind holds back the encoder rather than growing a queue.
+ */
+typedef struct {
+    int fd;                    /// Pipe or socket the stream is written to in order, -1 for none
+    int pull;                  /// Non-zero to hand the buffers out through recorderNextChunk instead
+} PicamVideoSink;
+
+/** Small raw frames taken beside a recording, see recorderAnalysisStream.
+ *  The camera scales them from the same sensor image as the video into
+ *  buffers of their own, so an analyser that falls behind only loses
+ *  analysis frames and never holds back the encoder.
+ */
+typedef struct {
+    int width;                 /// Up to 640
+    int height;                /// Up to 480
+    int format;                /// One of the raw PICAM_FORMAT_* values
+    int slots;                 /// Frames waiting for or held by the reader, the oldest waiting is dropped
+} PicamVideoAnalysis;
+
+/** Limits for adapting a recording's bitrate to how fast its output is taken,
+ *  see recorderRateStats. The bitrate drops as soon as the file or sink backs
+ *  up and climbs back slowly once they keep up again.
+ */
+typedef struct {
+    int min_bitrate;           /// Bits/s
+    int max_bitrate;           /// Bits/s, also where a recording without videoBitrate starts
+    int min_qp;                /// QP floor at max_bitrate, rising to max_qp at min_bitrate,
+    int max_qp;                /// both 0 to leave QP to the encoder
+    int interval_ms;           /// Time between adjustments, 0 for the default
+} PicamVideoRate;
+
+/** Optional consumers of a recording besides the output file */
+typedef struct {
+    PICAM_VECTORS *vectors;    /// Inline motion vectors are turned on and analysed here when set
+    PICAM_RING *ring;          /// The H264 stream is also kept here when set
+    PicamVideoSink *sink;      /// The H264 stream also goes here when set
+    PicamVideoAnalysis *analysis; /// Small raw frames are delivered as well when set
+    PicamVideoRate *rate;      /// The bitrate follows the output when set
+} PicamVideoTaps;
+
+/// Camera graph kept alive between captures, see createCameraSession
+typedef struct CameraSession CameraSession;
+typedef struct FrameStream FrameStream;
+/// H264 recording that runs until its duration is reached or it is stopped, see startRecorder
+typedef struct Recorder Recorder;
+/// JPEGs of the camera video port served over HTTP, see startMjpegServer
+typedef struct MjpegServer MjpegServer;
+
 uint8_t *takePhoto(PicamParams *parms, long *sizeread);
 uint8_t *takePhotoWithDetails(int width, int height, int quality, PicamParams *parms, long *sizeread);
 uint8_t *takeRGBPhotoWithDetails(int width, int height, PicamParams *parms,long *sizeread); 
 uint8_t *internelPhotoWithDetails(int width, int height, int quality,MMAL_FOURCC_T encoding,PicamParams *parms, long *sizeread); 
+int takeRawPhotoWithDetails(int width, int height, int format, PicamParams *parms, PicamFrame *frame);
+int takeSmallFrameWithDetails(int width, int height, int format, PicamParams *parms, PicamFrame *frame);
+int internelFrameWithDetails(int width, int height, int quality, int format, PicamParams *parms, PicamFrame *frame);
+CameraSession *createCameraSession(void);
+void destroyCameraSession(CameraSession *session);
+uint8_t *sessionPhotoWithDetails(CameraSession *session, int width, int height, int quality, MMAL_FOURCC_T encoding, PicamParams *parms, long *sizeread);
+int sessionFrameWithDetails(CameraSession *session, int width, int height, int quality, int format, PicamParams *parms, PicamFrame *frame);
+int sessionRawFrameWithDetails(CameraSession *session, int width, int height, int format, PicamParams *parms, PicamFrame *frame);
+int sessionPhotoWithThumbnail(CameraSession *session, int width, int height, int quality, MMAL_PARAM_THUMBNAIL_CONFIG_T *thumbnail, PicamParams *parms, PicamFrame *frame, PicamFrame *thumbnail_frame);
+int internelPhotoWithThumbnail(int width, int height, int quality, MMAL_PARAM_THUMBNAIL_CONFIG_T *thumbnail, PicamParams *parms, PicamFrame *frame, PicamFrame *thumbnail_frame);
+int sessionBurstWithDetails(CameraSession *session, int count, int width, int height, int quality, int interval, PicamParams *parms, PicamFrame *frames, int64_t *timestamps);
+int internelBurstWithDetails(int count, int width, int height, int quality, int interval, PicamParams *parms, PicamFrame *frames, int64_t *timestamps);
+FrameStream *startFrameStream(int width, int height, int framerate, int format, int slots, PicamParams *parms);
+int frameStreamNext(FrameStream *stream, PicamFrame *frame, int64_t *timestamp, int *slot);
+void frameStreamRelease(FrameStream *stream, int slot);
+void frameStreamStats(FrameStream *stream, unsigned long *delivered, unsigned long *dropped);
+void stopFrameStream(FrameStream *stream);
+void destroyFrameStream(FrameStream *stream);
+int captureBatchWithDetails(int count, int width, int height, int framerate, int format, PicamParams *parms, PicamBatch *batch);
 void internelVideoWithDetails(char *filename, int width, int height, int duration, PicamParams *parms); 
+void internelVideoWithTaps(char *filename, int width, int height, int duration, PicamParams *parms, PicamVideoTaps *taps);
+Recorder *startRecorder(char *filename, int width, int height, int duration, PicamParams *parms, PicamVideoTaps *taps);
+Recorder *startSegmentedRecorder(char *pattern, int segment_seconds, long segment_bytes, int container, int width, int height, int duration, PicamParams *parms, PicamVideoTaps *taps);
+int validSegmentPattern(const char *pattern);
+int containerForFilename(const char *filename);
+int recorderWait(Recorder *recorder, int timeout_ms);
+int recorderSplit(Recorder *recorder, char *filename);
+int recorderTakePhoto(Recorder *recorder, int quality, PicamFrame *frame, int64_t *timestamp, int64_t *gap, int *lost);
+void recorderSetDuration(Recorder *recorder, int duration);
+void recorderStats(Recorder *recorder, unsigned long *frames, int64_t *elapsed, int *segment);
+void recorderWriterStats(Recorder *recorder, PICAM_WRITER_STATS *stats);
+int recorderNextChunk(Recorder *recorder, PicamFrame *chunk, int64_t *timestamp, int *slot);
+void recorderReleaseChunk(Recorder *recorder, int slot);
+int recorderRateStats(Recorder *recorder, PICAM_RATE_STATS *stats, unsigned long after, int timeout_ms);
+int recorderApplyParams(Recorder *recorder, PicamParams *parms);
+FrameStream *recorderAnalysisStream(Recorder *recorder);
+void recorderStopAnalysis(Recorder *recorder);
+void recorderSinkStats(Recorder *recorder, unsigned long *stalls, uint64_t *bytes);
+void stopRecorder(Recorder *recorder);
+void destroyRecorder(Recorder *recorder);
+MjpegServer *startMjpegServer(const char *address, int port, int width, int height, int quality, int framerate, PicamParams *parms, int *error);
+int mjpegServerPort(MjpegServer *server);
+void mjpegServerStats(MjpegServer *server, PICAM_HTTP_STATS *stats);
+void stopMjpegServer(MjpegServer *server);
+void destroyMjpegServer(MjpegServer *server);
 #endif // _PICAM_H
@@ -0,0 +1,107 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "picambuffer.h"
+
+/// Never grow by less than this, avoids a run of tiny reallocations for small stills
+#define PICAM_BUFFER_MIN_GROWTH 65536
+
+/**
+ * Set up an empty buffer, nothing is allocated until the first reserve or append
+ *
+ * @param buffer Buffer to initialise
+ */
+void picam_buffer_init(PICAM_BUFFER *buffer)
+{
+   buffer->data = NULL;
+   buffer->length = 0;
+   buffer->capacity = 0;
+}
+
+/**
+ * Make sure at least capacity bytes are allocated
+ *
+ * @param buffer Buffer to grow
+ * @param capacity Total number of bytes required
+ * @return 0 if successful, non-zero if the allocation failed
+ */
+int picam_buffer_reserve(PICAM_BUFFER *buffer, long capacity)
+{
+   uint8_t *data;
+
+   if (capacity <= buffer->capacity)
+      return 0;
+
+   data = realloc(buffer->data, capacity);
+   if (!data)
+      return 1;
+
+   buffer->data = data;
+   buffer->capacity = capacity;
+   return 0;
+}
+
+/**
+ * Append a chunk, doubling the allocation when it does not fit
+ *
+ * @param buffer Buffer to append to
+ * @param data Chunk to copy in
+ * @param length Size of the chunk in bytes
+ * @return 0 if successful, non-zero if the allocation failed
+ */
+int picam_buffer_append(PICAM_BUFFER *buffer, const uint8_t *data, long length)
+{
+   long needed = buffer->length + length;
+
+   if (needed > buffer->capacity) {
+      long capacity = buffer->capacity * 2;
+
+      if (capacity < buffer->capacity + PICAM_BUFFER_MIN_GROWTH)
+         capacity = buffer->capacity + PICAM_BUFFER_MIN_GROWTH;
+      if (capacity < needed)
+         capacity = needed;
+      if (picam_buffer_reserve(buffer, capacity) != 0)
+         return 1;
+   }
+
+   memcpy(buffer->data + buffer->length, data, length);
+   buffer->length = needed;
+   return 0;
+}
+
+/**
+ * Hand the stored bytes to the caller, who becomes responsible for free()ing them.
+ * The buffer is left empty and can be reused.
+ *
+ * @param buffer Buffer to detach the data from
+ * @param length Set to the number of bytes returned
+ * @return The stored bytes, NULL if nothing was stored
+ */
+uint8_t *picam_buffer_detach(PICAM_BUFFER *buffer, long *length)
+{
+   uint8_t *data = buffer->data;
+
+   *length = buffer->length;
+   if (buffer->length == 0) {
+      free(data);
+      data = NULL;
+   } else if (buffer->capacity - buffer->length > buffer->capacity / 4) {
+      // Give back a large over estimate, shrinking is done in place by the allocator
+      uint8_t *shrunk = realloc(data, buffer->length);
+      if (shrunk)
+         data = shrunk;
+   }
+   picam_buffer_init(buffer);
+   return data;
+}
+
+/**
+ * Release anything held by the buffer
+ *
+ * @param buffer Buffer to empty
+ */
+void picam_buffer_free(PICAM_BUFFER *buffer)
+{
+   free(buffer->data);
+   picam_buffer_init(buffer);
+}
@@ -0,0 +1,22 @@
+#ifndef _PICAMBUFFER_H
+#define _PICAMBUFFER_H
+
+#include <stdint.h>
+
+/** Contiguous output buffer that grows geometrically as encoder chunks are
+ *  appended, so a capture is copied out of the MMAL buffers exactly once
+ */
+typedef struct
+{
+   uint8_t *data;                      /// Start of the stored bytes, NULL until something is reserved or appended
+   long length;                        /// Number of bytes stored
+   long capacity;                      /// Number of bytes allocated
+} PICAM_BUFFER;
+
+void picam_buffer_init(PICAM_BUFFER *buffer);
+int picam_buffer_reserve(PICAM_BUFFER *buffer, long capacity);
+int picam_buffer_append(PICAM_BUFFER *buffer, const uint8_t *data, long length);
+uint8_t *picam_buffer_detach(PICAM_BUFFER *buffer, long *length);
+void picam_buffer_free(PICAM_BUFFER *buffer);
+
+#endif // _PICAMBUFFER_H
@@ -0,0 +1,273 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "picamdiff.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+   #define PICAM_DIFF_X86
+   #include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+   #define PICAM_DIFF_NEON
+   #include <arm_neon.h>
+   #if !defined(__aarch64__)
+      #include <sys/auxv.h>
+      #include <asm/hwcap.h>
+   #endif
+#endif
+
+/** Compares n bytes of two rows, sets flags to 0xff where the absolute
+ *  difference is above threshold (0 elsewhere) and returns how many were set
+ */
+typedef long (*PICAM_DIFF_KERNEL)(const uint8_t *a, const uint8_t *b, uint8_t *flags, int n, int threshold);
+
+static long diff_scalar(const uint8_t *a, const uint8_t *b, uint8_t *flags, int n, int threshold)
+{
+   long count = 0;
+   int i;
+
+   for (i = 0; i < n; i++) {
+      int d = a[i] - b[i];
+      uint8_t changed = (d > threshold || -d > threshold) ? 0xff : 0;
+      flags[i] = changed;
+      count += changed & 1;
+   }
+   return count;
+}
+
+#ifdef PICAM_DIFF_X86
+__attribute__((target("sse2")))
+static long diff_sse2(const uint8_t *a, const uint8_t *b, uint8_t *flags, int n, int threshold)
+{
+   const __m128i limit = _mm_set1_epi8((char)threshold);
+   const __m128i zero = _mm_setzero_si128();
+   const __m128i ones = _mm_set1_epi8(-1);
+   const __m128i one = _mm_set1_epi8(1);
+   __m128i total = zero;
+   uint64_t sums[2];
+   int i = 0;
+
+   for (; i + 16 <= n; i += 16) {
+      __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+      __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+      __m128i d = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+      // d - threshold saturates to 0 unless d is above the threshold
+      __m128i changed = _mm_xor_si128(_mm_cmpeq_epi8(_mm_subs_epu8(d, limit), zero), ones);
+      _mm_storeu_si128((__m128i *)(flags + i), changed);
+      total = _mm_add_epi64(total, _mm_sad_epu8(_mm_and_si128(changed, one), zero));
+   }
+   _mm_storeu_si128((__m128i *)sums, total);
+   return (long)(sums[0] + sums[1]) + diff_scalar(a + i, b + i, flags + i, n - i, threshold);
+}
+
+__attribute__((target("avx2")))
+static long diff_avx2(const uint8_t *a, const uint8_t *b, uint8_t *flags, int n, int threshold)
+{
+   const __m256i limit = _mm256_set1_epi8((char)threshold);
+   const __m256i zero = _mm256_setzero_si256();
+   const __m256i ones = _mm256_set1_epi8(-1);
+   const __m256i one = _mm256_set1_epi8(1);
+   __m256i total = zero;
+   uint64_t sums[4];
+   int i = 0;
+
+   for (; i + 32 <= n; i += 32) {
+      __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+      __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+      __m256i d = _mm256_or_si256(_mm256_subs_epu8(va, vb), _mm256_subs_epu8(vb, va));
+      __m256i changed = _mm256_xor_si256(_mm256_cmpeq_epi8(_mm256_subs_epu8(d, limit), zero), ones);
+      _mm256_storeu_si256((__m256i *)(flags + i), changed);
+      total = _mm256_add_epi64(total, _mm256_sad_epu8(_mm256_and_si256(changed, one), zero));
+   }
+   _mm256_storeu_si256((__m256i *)sums, total);
+   // Avoid the AVX to SSE transition penalty in the tail
+   _mm256_zeroupper();
+   return (long)(sums[0] + sums[1] + sums[2] + sums[3]) + diff_sse2(a + i, b + i, flags + i, n - i, threshold);
+}
+#endif
+
+#ifdef PICAM_DIFF_NEON
+static long diff_neon(const uint8_t *a, const uint8_t *b, uint8_t *flags, int n, int threshold)
+{
+   const uint8x16_t limit = vdupq_n_u8((uint8_t)threshold);
+   uint32x4_t total = vdupq_n_u32(0);
+   uint32_t sums[4];
+   int i = 0;
+
+   for (; i + 16 <= n; i += 16) {
+      uint8x16_t changed = vcgtq_u8(vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i)), limit);
+      vst1q_u8(flags + i, changed);
+      total = vpadalq_u16(total, vpaddlq_u8(vshrq_n_u8(changed, 7)));
+   }
+   vst1q_u32(sums, total);
+   return (long)(sums[0] + sums[1] + sums[2] + sums[3]) + diff_scalar(a + i, b + i, flags + i, n - i, threshold);
+}
+#endif
+
+static PICAM_DIFF_KERNEL kernel = NULL;
+static const char *kernel_name = NULL;
+
+/**
+ * Pick the widest kernel the CPU we are running on supports
+ */
+static void select_kernel(void)
+{
+   PICAM_DIFF_KERNEL best = diff_scalar;
+   const char *name = "scalar";
+
+#ifdef PICAM_DIFF_X86
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx2")) {
+      best = diff_avx2;
+      name = "avx2";
+   } else if (__builtin_cpu_supports("sse2")) {
+      best = diff_sse2;
+      name = "sse2";
+   }
+#endif
+#ifdef PICAM_DIFF_NEON
+   #if defined(__aarch64__)
+   best = diff_neon;
+   name = "neon";
+   #else
+   if (getauxval(AT_HWCAP) & HWCAP_NEON) {
+      best = diff_neon;
+      name = "neon";
+   }
+   #endif
+#endif
+   kernel_name = name;
+   kernel = best;
+}
+
+/**
+ * @return Name of the kernel picam_diff_frames runs on this CPU
+ */
+const char *picam_diff_implementation(void)
+{
+   if (!kernel)
+      select_kernel();
+   return kernel_name;
+}
+
+/**
+ * Force a kernel, for benchmarking the code paths against each other
+ *
+ * @param name "scalar", "sse2", "avx2" or "neon", NULL for the best one available
+ * @return Name of the kernel now in use, NULL if the requested one is not available (nothing changes)
+ */
+const char *picam_diff_use(const char *name)
+{
+   const char *previous = picam_diff_implementation();
+   PICAM_DIFF_KERNEL previous_kernel = kernel;
+
+   select_kernel();
+   if (!name || strcmp(name, kernel_name) == 0)
+      return kernel_name;
+   if (strcmp(name, "scalar") == 0) {
+      kernel = diff_scalar;
+      kernel_name = "scalar";
+      return kernel_name;
+   }
+#ifdef PICAM_DIFF_X86
+   if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+      kernel = diff_sse2;
+      kernel_name = "sse2";
+      return kernel_name;
+   }
+#endif
+   kernel = previous_kernel;
+   kernel_name = previous;
+   return NULL;
+}
+
+/**
+ * @return Number of bytes picam_diff_frames writes to a mask of the given kind
+ */
+long picam_diff_mask_size(int width, int height, int mask_kind)
+{
+   if (mask_kind == PICAM_DIFF_MASK_BYTES)
+      return (long)width * height;
+   if (mask_kind == PICAM_DIFF_MASK_BITS)
+      return (long)((width + 7) / 8) * height;
+   return 0;
+}
+
+static void pack_bits(const uint8_t *flags, uint8_t *bits, int width)
+{
+   int x = 0;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+   // 8 flags at a time: keep a different bit of each byte, the multiply adds them into the top byte
+   for (; x + 8 <= width; x += 8) {
+      uint64_t v;
+      memcpy(&v, flags + x, 8);
+      bits[x >> 3] = (uint8_t)(((v & 0x0102040810204080ULL) * 0x0101010101010101ULL) >> 56);
+   }
+#endif
+   if (x < width)
+      memset(bits + (x >> 3), 0, (width - x + 7) / 8);
+   for (; x < width; x++) {
+      if (flags[x])
+         bits[x >> 3] |= 0x80 >> (x & 7);
+   }
+}
+
+/**
+ * Count the pixels that differ between two packed frames. A pixel has changed
+ * when any of its bytes differs by more than threshold.
+ *
+ * @param a First frame
+ * @param b Second frame, same layout as a
+ * @param width Width in pixels
+ * @param height Height in rows
+ * @param stride Bytes from one row to the next in both frames
+ * @param bpp Bytes per pixel, 1 for luma, 3 for RGB24/BGR24
+ * @param threshold Largest difference that still counts as unchanged (0-255)
+ * @param mask Receives picam_diff_mask_size bytes, may be NULL for PICAM_DIFF_MASK_NONE
+ * @param mask_kind One of the PICAM_DIFF_MASK_* values
+ * @return Number of changed pixels, -1 if out of memory
+ */
+long picam_diff_frames(const uint8_t *a, const uint8_t *b, int width, int height, int stride, int bpp, int threshold, uint8_t *mask, int mask_kind)
+{
+   long count = 0;
+   long bits_stride = (width + 7) / 8;
+   uint8_t *scratch;
+   int x, y;
+
+   if (!kernel)
+      select_kernel();
+   if (threshold < 0)
+      threshold = 0;
+   if (threshold > 255)
+      threshold = 255;
+   if (!mask)
+      mask_kind = PICAM_DIFF_MASK_NONE;
+
+   scratch = malloc((size_t)width * bpp);
+   if (!scratch)
+      return -1;
+
+   for (y = 0; y < height; y++) {
+      const uint8_t *row_a = a + (long)y * stride;
+      const uint8_t *row_b = b + (long)y * stride;
+      uint8_t *pixels = mask_kind == PICAM_DIFF_MASK_BYTES ? mask + (long)y * width : scratch;
+
+      if (bpp == 1) {
+         count += kernel(row_a, row_b, pixels, width, threshold);
+      } else {
+         // Flags per byte, then a pixel has changed if any of its bytes did
+         kernel(row_a, row_b, scratch, width * bpp, threshold);
+         for (x = 0; x < width; x++) {
+            const uint8_t *f = scratch + x * bpp;
+            uint8_t changed = f[0] | f[1] | f[2];
+            pixels[x] = changed;
+            count += changed & 1;
+         }
+      }
+      if (mask_kind == PICAM_DIFF_MASK_BITS)
+         pack_bits(pixels, mask + y * bits_stride, width);
+   }
+   free(scratch);
+   return count;
+}
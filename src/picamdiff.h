@@ -0,0 +1,18 @@
+#ifndef _PICAMDIFF_H
+#define _PICAMDIFF_H
+
+#include <stdint.h>
+
+/// Optional per pixel output of picam_diff_frames
+enum {
+   PICAM_DIFF_MASK_NONE = 0,           /// Only count the changed pixels
+   PICAM_DIFF_MASK_BYTES,              /// width * height bytes, 255 where a pixel changed, 0 elsewhere
+   PICAM_DIFF_MASK_BITS                /// (width + 7) / 8 bytes per row, most significant bit first
+};
+
+long picam_diff_frames(const uint8_t *a, const uint8_t *b, int width, int height, int stride, int bpp, int threshold, uint8_t *mask, int mask_kind);
+long picam_diff_mask_size(int width, int height, int mask_kind);
+const char *picam_diff_implementation(void);
+const char *picam_diff_use(const char *name);
+
+#endif // _PICAMDIFF_H
@@ -0,0 +1,192 @@
+#include <errno.h>
+#include <string.h>
+
+#include "picamexif.h"
+
+/// JPEG markers the scan cares about
+#define JPEG_SOI 0xd8
+#define JPEG_EOI 0xd9
+#define JPEG_SOS 0xda
+#define JPEG_APP1 0xe1
+
+/// TIFF tags of IFD1 locating the thumbnail
+#define EXIF_JPEG_OFFSET 0x0201
+#define EXIF_JPEG_LENGTH 0x0202
+
+/// Byte order of the TIFF block inside an EXIF segment
+typedef struct
+{
+   const uint8_t *data;
+   long length;
+   int big_endian;
+} TIFF_BLOCK;
+
+static unsigned int be16(const uint8_t *p)
+{
+   return (unsigned int)p[0] << 8 | p[1];
+}
+
+static unsigned int tiff16(const TIFF_BLOCK *tiff, long offset)
+{
+   const uint8_t *p = tiff->data + offset;
+
+   return tiff->big_endian ? be16(p) : (unsigned int)p[1] << 8 | p[0];
+}
+
+static uint32_t tiff32(const TIFF_BLOCK *tiff, long offset)
+{
+   const uint8_t *p = tiff->data + offset;
+
+   if (tiff->big_endian)
+      return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+   return (uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 | (uint32_t)p[1] << 8 | p[0];
+}
+
+/**
+ * Find the next marker segment of a JPEG, skipping fill bytes
+ *
+ * @param jpeg Whole JPEG
+ * @param length Bytes in jpeg
+ * @param position Where to look, moved past the segment on return
+ * @param payload Set to the offset of the segment's contents after the length field
+ * @param payload_length Set to the bytes of those contents
+ * @return The marker, 0 if there is no complete segment at position
+ */
+static int next_segment(const uint8_t *jpeg, long length, long *position, long *payload, long *payload_length)
+{
+   long p = *position;
+   long size;
+   int marker;
+
+   if (p >= length || jpeg[p] != 0xff)
+      return 0;
+   while (p < length && jpeg[p] == 0xff)
+      p++;
+   if (p >= length)
+      return 0;
+   marker = jpeg[p++];
+   if (marker == JPEG_SOI || marker == JPEG_EOI) {
+      *payload = p;
+      *payload_length = 0;
+      *position = p;
+      return marker;
+   }
+   if (p + 2 > length)
+      return 0;
+   size = be16(jpeg + p);
+   if (size < 2 || p + size > length)
+      return 0;
+   *payload = p + 2;
+   *payload_length = size - 2;
+   *position = p + size;
+   return marker;
+}
+
+/**
+ * Locate the thumbnail the image encoder embeds in the EXIF block of a JPEG.
+ * Nothing is decoded or copied, the thumbnail is itself a complete JPEG
+ * lying inside the one given.
+ *
+ * @param jpeg Whole JPEG
+ * @param length Bytes in jpeg
+ * @param offset Set to the offset of the thumbnail in jpeg
+ * @param thumbnail_length Set to the bytes of the thumbnail
+ * @return 0 if found, ENOENT if the JPEG carries no thumbnail, EINVAL if it is malformed
+ */
+int picam_exif_thumbnail(const uint8_t *jpeg, long length, long *offset, long *thumbnail_length)
+{
+   long position = 2, payload, size;
+   int marker;
+
+   if (length < 4 || jpeg[0] != 0xff || jpeg[1] != JPEG_SOI)
+      return EINVAL;
+   while ((marker = next_segment(jpeg, length, &position, &payload, &size)) != 0) {
+      TIFF_BLOCK tiff;
+      uint32_t ifd, found = 0, start = 0, bytes = 0;
+      unsigned int entries, i;
+
+      if (marker == JPEG_SOS || marker == JPEG_EOI)
+         break;
+      if (marker != JPEG_APP1 || size < 14 || memcmp(jpeg + payload, "Exif\0\0", 6) != 0)
+         continue;
+
+      tiff.data = jpeg + payload + 6;
+      tiff.length = size - 6;
+      if (tiff.data[0] == 'M' && tiff.data[1] == 'M')
+         tiff.big_endian = 1;
+      else if (tiff.data[0] == 'I' && tiff.data[1] == 'I')
+         tiff.big_endian = 0;
+      else
+         return EINVAL;
+      if (tiff16(&tiff, 2) != 42)
+         return EINVAL;
+
+      // IFD0 only matters for where it says IFD1 starts
+      ifd = tiff32(&tiff, 4);
+      if (ifd < 8 || ifd + 2 > (uint32_t)tiff.length)
+         return EINVAL;
+      entries = tiff16(&tiff, ifd);
+      if (ifd + 2 + entries * 12 + 4 > (uint32_t)tiff.length)
+         return EINVAL;
+      ifd = tiff32(&tiff, ifd + 2 + entries * 12);
+      if (ifd == 0)
+         return ENOENT;
+      if (ifd < 8 || ifd + 2 > (uint32_t)tiff.length)
+         return EINVAL;
+      entries = tiff16(&tiff, ifd);
+      if (ifd + 2 + entries * 12 > (uint32_t)tiff.length)
+         return EINVAL;
+      for (i = 0; i < entries; i++) {
+         long entry = ifd + 2 + i * 12;
+         unsigned int tag = tiff16(&tiff, entry);
+
+         // Both are single LONGs, held in the value field itself
+         if (tag == EXIF_JPEG_OFFSET) {
+            start = tiff32(&tiff, entry + 8);
+            found |= 1;
+         } else if (tag == EXIF_JPEG_LENGTH) {
+            bytes = tiff32(&tiff, entry + 8);
+            found |= 2;
+         }
+      }
+      if (found != 3 || bytes == 0)
+         return ENOENT;
+      if (start > (uint32_t)tiff.length || bytes > (uint32_t)tiff.length - start)
+         return EINVAL;
+      *offset = (long)(tiff.data - jpeg) + start;
+      *thumbnail_length = bytes;
+      return 0;
+   }
+   return ENOENT;
+}
+
+/**
+ * Read the size of a JPEG from its frame header
+ *
+ * @param jpeg Whole JPEG, or a thumbnail found by picam_exif_thumbnail
+ * @param length Bytes in jpeg
+ * @param width Set to the width in pixels
+ * @param height Set to the height in rows
+ * @return 0 if successful, EINVAL if there is no frame header before the image data
+ */
+int picam_jpeg_dimensions(const uint8_t *jpeg, long length, int *width, int *height)
+{
+   long position = 2, payload, size;
+   int marker;
+
+   if (length < 4 || jpeg[0] != 0xff || jpeg[1] != JPEG_SOI)
+      return EINVAL;
+   while ((marker = next_segment(jpeg, length, &position, &payload, &size)) != 0) {
+      if (marker == JPEG_SOS || marker == JPEG_EOI)
+         break;
+      // SOF0 to SOF15, less DHT, JPG and DAC which share the range
+      if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+         if (size < 5)
+            return EINVAL;
+         *height = (int)be16(jpeg + payload + 1);
+         *width = (int)be16(jpeg + payload + 3);
+         return 0;
+      }
+   }
+   return EINVAL;
+}
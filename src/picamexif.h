@@ -0,0 +1,9 @@
+#ifndef _PICAMEXIF_H
+#define _PICAMEXIF_H
+
+#include <stdint.h>
+
+int picam_exif_thumbnail(const uint8_t *jpeg, long length, long *offset, long *thumbnail_length);
+int picam_jpeg_dimensions(const uint8_t *jpeg, long length, int *width, int *height);
+
+#endif // _PICAMEXIF_H
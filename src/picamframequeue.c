@@ -0,0 +1,166 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "picamframequeue.h"
+
+/**
+ * Allocate the slots, the only allocation the queue ever makes
+ *
+ * @param queue Queue to set up
+ * @param slot_count Number of frames that can be in flight at once
+ * @param slot_size Size of the largest frame
+ * @return 0 if successful, non-zero if out of memory or the slots would not fit in it
+ */
+int picam_frame_queue_init(PICAM_FRAME_QUEUE *queue, int slot_count, long slot_size)
+{
+   memset(queue, 0, sizeof(*queue));
+   // size_t is 32 bits on Raspberry Pi OS, the product could wrap
+   if (slot_count < 1 || slot_size < 1 || (size_t)slot_count > SIZE_MAX / slot_size)
+      return 1;
+   queue->memory = malloc((size_t)slot_count * slot_size);
+   queue->slots = calloc(slot_count, sizeof(PICAM_FRAME_SLOT));
+   queue->ready = calloc(slot_count, sizeof(int));
+   if (!queue->memory || !queue->slots || !queue->ready) {
+      free(queue->memory);
+      free(queue->slots);
+      free(queue->ready);
+      return 1;
+   }
+   queue->slot_size = slot_size;
+   queue->slot_count = slot_count;
+   pthread_mutex_init(&queue->lock, NULL);
+   pthread_cond_init(&queue->cond, NULL);
+   return 0;
+}
+
+/**
+ * Free the slots, nothing may be lent out any more
+ *
+ * @param queue Queue to release
+ */
+void picam_frame_queue_destroy(PICAM_FRAME_QUEUE *queue)
+{
+   if (!queue->memory)
+      return;
+   pthread_cond_destroy(&queue->cond);
+   pthread_mutex_destroy(&queue->lock);
+   free(queue->memory);
+   free(queue->slots);
+   free(queue->ready);
+   queue->memory = NULL;
+}
+
+/**
+ * Producer: take a slot to write the next frame into. If every slot is
+ * waiting or lent, the oldest waiting frame is dropped to make room.
+ *
+ * @param queue Queue to take the slot from
+ * @param slot Set to the index of the slot
+ * @return Start of the slot, NULL if every slot is lent to the consumer (the frame has to be dropped)
+ */
+uint8_t *picam_frame_queue_acquire(PICAM_FRAME_QUEUE *queue, int *slot)
+{
+   int i;
+   int found = -1;
+
+   pthread_mutex_lock(&queue->lock);
+   for (i = 0; i < queue->slot_count; i++) {
+      if (queue->slots[i].state == PICAM_SLOT_FREE) {
+         found = i;
+         break;
+      }
+   }
+   if (found < 0 && queue->ready_count > 0) {
+      found = queue->ready[queue->ready_head];
+      queue->ready_head = (queue->ready_head + 1) % queue->slot_count;
+      queue->ready_count--;
+      queue->dropped++;
+   }
+   if (found < 0)
+      queue->dropped++;
+   else {
+      queue->slots[found].state = PICAM_SLOT_FILLING;
+      queue->slots[found].length = 0;
+   }
+   pthread_mutex_unlock(&queue->lock);
+
+   *slot = found;
+   return found < 0 ? NULL : queue->memory + (long)found * queue->slot_size;
+}
+
+/**
+ * Producer: the slot holds a complete frame, hand it to the consumer
+ */
+void picam_frame_queue_publish(PICAM_FRAME_QUEUE *queue, int slot, long length, int64_t pts)
+{
+   pthread_mutex_lock(&queue->lock);
+   queue->slots[slot].state = PICAM_SLOT_READY;
+   queue->slots[slot].length = length;
+   queue->slots[slot].pts = pts;
+   queue->ready[(queue->ready_head + queue->ready_count) % queue->slot_count] = slot;
+   queue->ready_count++;
+   pthread_cond_signal(&queue->cond);
+   pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Producer: give back a slot without publishing it (corrupt or incomplete frame)
+ */
+void picam_frame_queue_abandon(PICAM_FRAME_QUEUE *queue, int slot)
+{
+   pthread_mutex_lock(&queue->lock);
+   queue->slots[slot].state = PICAM_SLOT_FREE;
+   queue->dropped++;
+   pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Consumer: wait for the oldest waiting frame. The slot stays valid until it
+ * is given back with picam_frame_queue_release.
+ *
+ * @return Start of the frame, NULL once the queue is closed and drained
+ */
+uint8_t *picam_frame_queue_next(PICAM_FRAME_QUEUE *queue, int *slot, long *length, int64_t *pts)
+{
+   int found;
+
+   pthread_mutex_lock(&queue->lock);
+   while (queue->ready_count == 0 && !queue->closed)
+      pthread_cond_wait(&queue->cond, &queue->lock);
+   if (queue->ready_count == 0) {
+      pthread_mutex_unlock(&queue->lock);
+      return NULL;
+   }
+   found = queue->ready[queue->ready_head];
+   queue->ready_head = (queue->ready_head + 1) % queue->slot_count;
+   queue->ready_count--;
+   queue->slots[found].state = PICAM_SLOT_LENT;
+   queue->delivered++;
+   *slot = found;
+   *length = queue->slots[found].length;
+   *pts = queue->slots[found].pts;
+   pthread_mutex_unlock(&queue->lock);
+
+   return queue->memory + (long)found * queue->slot_size;
+}
+
+/**
+ * Consumer: the frame in the slot is no longer needed
+ */
+void picam_frame_queue_release(PICAM_FRAME_QUEUE *queue, int slot)
+{
+   pthread_mutex_lock(&queue->lock);
+   queue->slots[slot].state = PICAM_SLOT_FREE;
+   pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * No more frames will be published, wakes a consumer waiting in picam_frame_queue_next
+ */
+void picam_frame_queue_close(PICAM_FRAME_QUEUE *queue)
+{
+   pthread_mutex_lock(&queue->lock);
+   queue->closed = 1;
+   pthread_cond_broadcast(&queue->cond);
+   pthread_mutex_unlock(&queue->lock);
+}
@@ -0,0 +1,51 @@
+#ifndef _PICAMFRAMEQUEUE_H
+#define _PICAMFRAMEQUEUE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/// What a slot is currently used for
+enum {
+   PICAM_SLOT_FREE = 0,                /// Available to the producer
+   PICAM_SLOT_FILLING,                 /// Being written by the producer
+   PICAM_SLOT_READY,                   /// Complete, waiting for the consumer
+   PICAM_SLOT_LENT                     /// Handed to the consumer, returned by picam_frame_queue_release
+};
+
+typedef struct
+{
+   int state;                          /// One of the PICAM_SLOT_* values
+   long length;                        /// Bytes written to the slot
+   int64_t pts;                        /// Presentation time of the frame in the slot (us)
+} PICAM_FRAME_SLOT;
+
+/** Fixed pool of frame sized slots shared by one producer (a port callback)
+ *  and one consumer. Nothing is allocated once the queue is set up; when the
+ *  consumer falls behind the oldest waiting frame is dropped.
+ */
+typedef struct
+{
+   uint8_t *memory;                    /// slot_count * slot_size bytes
+   long slot_size;                     /// Capacity of each slot
+   int slot_count;
+   PICAM_FRAME_SLOT *slots;
+   int *ready;                         /// Ring of slot indices waiting for the consumer, oldest first
+   int ready_head;
+   int ready_count;
+   int closed;                         /// Set once no more frames will be published
+   unsigned long delivered;            /// Frames handed to the consumer
+   unsigned long dropped;              /// Frames lost because every slot was busy or waiting
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+} PICAM_FRAME_QUEUE;
+
+int picam_frame_queue_init(PICAM_FRAME_QUEUE *queue, int slot_count, long slot_size);
+void picam_frame_queue_destroy(PICAM_FRAME_QUEUE *queue);
+uint8_t *picam_frame_queue_acquire(PICAM_FRAME_QUEUE *queue, int *slot);
+void picam_frame_queue_publish(PICAM_FRAME_QUEUE *queue, int slot, long length, int64_t pts);
+void picam_frame_queue_abandon(PICAM_FRAME_QUEUE *queue, int slot);
+uint8_t *picam_frame_queue_next(PICAM_FRAME_QUEUE *queue, int *slot, long *length, int64_t *pts);
+void picam_frame_queue_release(PICAM_FRAME_QUEUE *queue, int slot);
+void picam_frame_queue_close(PICAM_FRAME_QUEUE *queue);
+
+#endif // _PICAMFRAMEQUEUE_H
@@ -0,0 +1,464 @@
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "picamhttp.h"
+
+/// Separates the JPEGs of the multipart response
+#define PICAM_HTTP_BOUNDARY "picamframe"
+
+struct PICAM_HTTP_FRAME
+{
+   int references;                     /// Queues and clients holding the frame, only the server thread changes it
+   long length;                        /// Bytes in data
+   uint8_t data[];                     /// Part header, JPEG, CRLF
+};
+
+static const char response_header[] =
+   "HTTP/1.0 200 OK\r\n"
+   "Content-Type: multipart/x-mixed-replace; boundary=" PICAM_HTTP_BOUNDARY "\r\n"
+   "Cache-Control: no-cache, no-store, must-revalidate\r\n"
+   "Pragma: no-cache\r\n"
+   "Connection: close\r\n"
+   "\r\n";
+
+static const char not_allowed[] =
+   "HTTP/1.0 405 Method Not Allowed\r\n"
+   "Allow: GET\r\n"
+   "Connection: close\r\n"
+   "\r\n";
+
+static void *http_thread(void *arg);
+
+static void frame_release(PICAM_HTTP_FRAME *frame)
+{
+   if (frame && --frame->references == 0)
+      free(frame);
+}
+
+/**
+ * Open the listening socket and start the server thread
+ *
+ * @param http Server to set up
+ * @param address Dotted IPv4 address to listen on, NULL or "" for all interfaces
+ * @param port TCP port, 0 to have one picked (see http->port)
+ * @param max_clients Most clients served at once, others wait to be accepted
+ * @param queue_frames Frames each client can fall behind by before its oldest is dropped
+ * @return 0 if successful, an errno value otherwise
+ */
+int picam_http_start(PICAM_HTTP *http, const char *address, int port, int max_clients, int queue_frames)
+{
+   struct sockaddr_in addr;
+   socklen_t addr_length = sizeof(addr);
+   int one = 1;
+   int error;
+   int i;
+
+   memset(http, 0, sizeof(*http));
+   http->listen_fd = -1;
+   http->wake[0] = http->wake[1] = -1;
+   http->max_clients = max_clients > 0 ? max_clients : 1;
+   http->queue_frames = queue_frames > 0 ? queue_frames : 1;
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons(port);
+   addr.sin_addr.s_addr = htonl(INADDR_ANY);
+   if (address && *address && inet_pton(AF_INET, address, &addr.sin_addr) != 1)
+      return EINVAL;
+
+   if ((http->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+      return errno;
+   setsockopt(http->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+   if (bind(http->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+       listen(http->listen_fd, 16) != 0 ||
+       getsockname(http->listen_fd, (struct sockaddr *)&addr, &addr_length) != 0 ||
+       pipe2(http->wake, O_NONBLOCK | O_CLOEXEC) != 0)
+      goto error;
+   http->port = ntohs(addr.sin_port);
+
+   if (!(http->clients = calloc(http->max_clients, sizeof(PICAM_HTTP_CLIENT)))) {
+      errno = ENOMEM;
+      goto error;
+   }
+   for (i = 0; i < http->max_clients; i++) {
+      http->clients[i].fd = -1;
+      if (!(http->clients[i].queue = calloc(http->queue_frames, sizeof(PICAM_HTTP_FRAME *)))) {
+         errno = ENOMEM;
+         goto error;
+      }
+   }
+
+   pthread_mutex_init(&http->lock, NULL);
+   if ((error = pthread_create(&http->thread, NULL, http_thread, http)) != 0) {
+      pthread_mutex_destroy(&http->lock);
+      errno = error;
+      goto error;
+   }
+   http->started = 1;
+   return 0;
+
+error:
+   error = errno;
+   picam_http_stop(http);
+   return error;
+}
+
+/**
+ * Hand a JPEG to every client streaming now. It is copied once, with its part
+ * header, into a frame shared by all of them. Never blocks on the clients.
+ *
+ * @param http Running server
+ * @param data The JPEG
+ * @param length Bytes in data
+ * @return 0 if the frame was taken or nobody is watching, non-zero if out of memory
+ */
+int picam_http_publish(PICAM_HTTP *http, const uint8_t *data, long length)
+{
+   PICAM_HTTP_FRAME *frame, *replaced;
+   char header[128];
+   int header_length;
+   int clients;
+
+   pthread_mutex_lock(&http->lock);
+   http->stats.published++;
+   clients = http->stats.clients;
+   pthread_mutex_unlock(&http->lock);
+   if (clients == 0)
+      return 0;
+
+   header_length = snprintf(header, sizeof(header),
+                            "--" PICAM_HTTP_BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: %ld\r\n\r\n", length);
+   frame = malloc(sizeof(PICAM_HTTP_FRAME) + header_length + length + 2);
+   if (!frame)
+      return 1;
+   frame->references = 1;
+   frame->length = header_length + length + 2;
+   memcpy(frame->data, header, header_length);
+   memcpy(frame->data + header_length, data, length);
+   memcpy(frame->data + header_length + length, "\r\n", 2);
+
+   // The server thread has not taken the previous frame yet, nobody gets that one
+   pthread_mutex_lock(&http->lock);
+   replaced = http->inbox;
+   http->inbox = frame;
+   if (replaced)
+      http->stats.dropped += http->stats.clients;
+   pthread_mutex_unlock(&http->lock);
+   free(replaced);
+
+   if (write(http->wake[1], "f", 1) < 0) {
+      // Pipe full, the server thread is awake already
+   }
+   return 0;
+}
+
+void picam_http_stats(PICAM_HTTP *http, PICAM_HTTP_STATS *stats)
+{
+   pthread_mutex_lock(&http->lock);
+   *stats = http->stats;
+   pthread_mutex_unlock(&http->lock);
+}
+
+/**
+ * Stop the server thread, disconnect every client and close the socket
+ *
+ * Safe to call on a server that failed to start.
+ *
+ * @param http Server to stop
+ */
+void picam_http_stop(PICAM_HTTP *http)
+{
+   int i;
+
+   if (http->started) {
+      pthread_mutex_lock(&http->lock);
+      http->stopping = 1;
+      pthread_mutex_unlock(&http->lock);
+      if (write(http->wake[1], "s", 1) < 0) {
+         // Pipe full, the thread wakes up anyway
+      }
+      pthread_join(http->thread, NULL);
+      pthread_mutex_destroy(&http->lock);
+      http->started = 0;
+   }
+   if (http->clients) {
+      for (i = 0; i < http->max_clients; i++)
+         free(http->clients[i].queue);
+      free(http->clients);
+      http->clients = NULL;
+   }
+   free(http->inbox);
+   http->inbox = NULL;
+   if (http->listen_fd >= 0)
+      close(http->listen_fd);
+   if (http->wake[0] >= 0)
+      close(http->wake[0]);
+   if (http->wake[1] >= 0)
+      close(http->wake[1]);
+   http->listen_fd = http->wake[0] = http->wake[1] = -1;
+}
+
+static void client_close(PICAM_HTTP *http, PICAM_HTTP_CLIENT *client)
+{
+   if (client->streaming) {
+      pthread_mutex_lock(&http->lock);
+      http->stats.clients--;
+      pthread_mutex_unlock(&http->lock);
+   }
+   close(client->fd);
+   frame_release(client->out_frame);
+   while (client->queue_count > 0) {
+      frame_release(client->queue[client->queue_head]);
+      client->queue_head = (client->queue_head + 1) % http->queue_frames;
+      client->queue_count--;
+   }
+   client->fd = -1;
+   client->streaming = 0;
+   client->request_length = 0;
+   client->out = NULL;
+   client->out_frame = NULL;
+   client->queue_head = 0;
+}
+
+/**
+ * Write as much of the client's output as the socket takes without blocking
+ *
+ * @return 0 if the client is still connected, non-zero if it was closed
+ */
+static int client_flush(PICAM_HTTP *http, PICAM_HTTP_CLIENT *client)
+{
+   for (;;) {
+      ssize_t sent;
+
+      if (!client->out) {
+         if (client->queue_count == 0)
+            return 0;
+         client->out_frame = client->queue[client->queue_head];
+         client->queue_head = (client->queue_head + 1) % http->queue_frames;
+         client->queue_count--;
+         client->out = client->out_frame->data;
+         client->out_length = client->out_frame->length;
+         client->out_sent = 0;
+      }
+      sent = send(client->fd, client->out + client->out_sent, client->out_length - client->out_sent, MSG_NOSIGNAL);
+      if (sent < 0) {
+         if (errno == EINTR)
+            continue;
+         if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+         client_close(http, client);
+         return 1;
+      }
+      client->out_sent += sent;
+      if (client->out_sent < client->out_length)
+         continue;
+      if (client->out_frame) {
+         pthread_mutex_lock(&http->lock);
+         http->stats.sent++;
+         pthread_mutex_unlock(&http->lock);
+         frame_release(client->out_frame);
+         client->out_frame = NULL;
+      }
+      client->out = NULL;
+   }
+}
+
+/**
+ * Read from a client, its request until the stream starts and then only to
+ * notice it going away
+ */
+static void client_read(PICAM_HTTP *http, PICAM_HTTP_CLIENT *client)
+{
+   char discard[512];
+   ssize_t got;
+
+   if (client->streaming) {
+      got = recv(client->fd, discard, sizeof(discard), 0);
+      if (got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+         client_close(http, client);
+      return;
+   }
+
+   got = recv(client->fd, client->request + client->request_length, sizeof(client->request) - 1 - client->request_length, 0);
+   if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      return;
+   if (got <= 0) {
+      client_close(http, client);
+      return;
+   }
+   client->request_length += got;
+   client->request[client->request_length] = '\0';
+   if (!strstr(client->request, "\r\n\r\n") && !strstr(client->request, "\n\n")) {
+      // Headers this long are not from a browser
+      if (client->request_length >= (int)sizeof(client->request) - 1)
+         client_close(http, client);
+      return;
+   }
+
+   if (strncmp(client->request, "GET ", 4) != 0) {
+      if (send(client->fd, not_allowed, sizeof(not_allowed) - 1, MSG_NOSIGNAL) < 0) {
+         // Closed anyway
+      }
+      client_close(http, client);
+      return;
+   }
+   // Any path gets the stream, the response header goes out first
+   client->streaming = 1;
+   client->out = (const uint8_t *)response_header;
+   client->out_length = sizeof(response_header) - 1;
+   client->out_sent = 0;
+   pthread_mutex_lock(&http->lock);
+   http->stats.clients++;
+   pthread_mutex_unlock(&http->lock);
+   client_flush(http, client);
+}
+
+static void accept_clients(PICAM_HTTP *http)
+{
+   for (;;) {
+      PICAM_HTTP_CLIENT *client = NULL;
+      int one = 1;
+      int fd;
+      int i;
+
+      for (i = 0; i < http->max_clients && !client; i++)
+         if (http->clients[i].fd < 0)
+            client = &http->clients[i];
+      if (!client)
+         return;
+      if ((fd = accept4(http->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+         return;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      client->fd = fd;
+   }
+}
+
+/**
+ * Queue a frame for every streaming client, dropping the oldest waiting frame
+ * of a client that is already queue_frames behind
+ */
+static void distribute(PICAM_HTTP *http, PICAM_HTTP_FRAME *frame)
+{
+   unsigned long dropped = 0;
+   int i;
+
+   for (i = 0; i < http->max_clients; i++) {
+      PICAM_HTTP_CLIENT *client = &http->clients[i];
+
+      if (client->fd < 0 || !client->streaming)
+         continue;
+      if (client->queue_count == http->queue_frames) {
+         frame_release(client->queue[client->queue_head]);
+         client->queue_head = (client->queue_head + 1) % http->queue_frames;
+         client->queue_count--;
+         dropped++;
+      }
+      frame->references++;
+      client->queue[(client->queue_head + client->queue_count) % http->queue_frames] = frame;
+      client->queue_count++;
+      client_flush(http, client);
+   }
+   if (dropped) {
+      pthread_mutex_lock(&http->lock);
+      http->stats.dropped += dropped;
+      pthread_mutex_unlock(&http->lock);
+   }
+   frame_release(frame);
+}
+
+static void *http_thread(void *arg)
+{
+   PICAM_HTTP *http = (PICAM_HTTP *)arg;
+   struct pollfd *fds = calloc(http->max_clients + 2, sizeof(struct pollfd));
+   int *owner = calloc(http->max_clients + 2, sizeof(int));
+   int i;
+
+   if (!fds || !owner) {
+      free(fds);
+      free(owner);
+      return NULL;
+   }
+
+   for (;;) {
+      PICAM_HTTP_FRAME *frame;
+      int stopping;
+      int count = 0;
+      int room = 0;
+      char drain[64];
+
+      fds[count].fd = http->wake[0];
+      fds[count].events = POLLIN;
+      owner[count++] = -1;
+      for (i = 0; i < http->max_clients; i++) {
+         PICAM_HTTP_CLIENT *client = &http->clients[i];
+
+         if (client->fd < 0) {
+            room = 1;
+            continue;
+         }
+         fds[count].fd = client->fd;
+         fds[count].events = POLLIN | (client->out ? POLLOUT : 0);
+         owner[count++] = i;
+      }
+      // Further connections wait in the backlog until a client leaves
+      if (room) {
+         fds[count].fd = http->listen_fd;
+         fds[count].events = POLLIN;
+         owner[count++] = -2;
+      }
+
+      if (poll(fds, count, -1) < 0 && errno != EINTR)
+         break;
+
+      for (i = 0; i < count; i++) {
+         short revents = fds[i].revents;
+
+         if (!revents || owner[i] < 0)
+            continue;
+         if (revents & (POLLERR | POLLNVAL)) {
+            client_close(http, &http->clients[owner[i]]);
+            continue;
+         }
+         if ((revents & POLLOUT) && client_flush(http, &http->clients[owner[i]]) != 0)
+            continue;
+         if (revents & (POLLIN | POLLHUP))
+            client_read(http, &http->clients[owner[i]]);
+      }
+      if (fds[count - 1].fd == http->listen_fd && (fds[count - 1].revents & POLLIN))
+         accept_clients(http);
+
+      if (fds[0].revents & POLLIN) {
+         while (read(http->wake[0], drain, sizeof(drain)) > 0)
+            ;
+         pthread_mutex_lock(&http->lock);
+         frame = http->inbox;
+         http->inbox = NULL;
+         stopping = http->stopping;
+         pthread_mutex_unlock(&http->lock);
+         if (frame)
+            distribute(http, frame);
+         if (stopping)
+            break;
+      }
+   }
+
+   for (i = 0; i < http->max_clients; i++)
+      if (http->clients[i].fd >= 0)
+         client_close(http, &http->clients[i]);
+   free(fds);
+   free(owner);
+   return NULL;
+}
@@ -0,0 +1,61 @@
+#ifndef _PICAMHTTP_H
+#define _PICAMHTTP_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/// One published JPEG with its multipart headers, shared by every client it is queued for
+typedef struct PICAM_HTTP_FRAME PICAM_HTTP_FRAME;
+
+/// A connection to the server, only touched by the server thread
+typedef struct
+{
+   int fd;                             /// -1 if the entry is free
+   int streaming;                      /// Request read and response header queued, frames follow
+   char request[1024];                 /// Request received so far
+   int request_length;
+   const uint8_t *out;                 /// Bytes being written: the response header or out_frame
+   long out_length;
+   long out_sent;
+   PICAM_HTTP_FRAME *out_frame;        /// Frame being written, NULL while writing the header
+   PICAM_HTTP_FRAME **queue;           /// Frames waiting, oldest first, queue_frames entries
+   int queue_head;
+   int queue_count;
+} PICAM_HTTP_CLIENT;
+
+/// Counters kept by a server, see picam_http_stats
+typedef struct
+{
+   int clients;                        /// Clients receiving the stream now
+   unsigned long published;            /// Frames handed to the server
+   unsigned long sent;                 /// Frames written out in full, summed over the clients
+   unsigned long dropped;              /// Frames a client fell too far behind to get, summed over the clients
+} PICAM_HTTP_STATS;
+
+/** Serves published JPEGs as multipart/x-mixed-replace to any number of
+ *  clients from one event driven thread. Each client has a short queue of its
+ *  own from which the oldest frame is dropped when it falls behind, so a slow
+ *  client never holds back the others or the publisher.
+ */
+typedef struct
+{
+   int listen_fd;
+   int port;                           /// Port listened on, the one picked when 0 was asked for
+   int wake[2];                        /// Pipe that wakes the server thread for a new frame or to stop
+   int queue_frames;                   /// Frames a client can fall behind by
+   int max_clients;
+   PICAM_HTTP_CLIENT *clients;         /// max_clients entries
+   PICAM_HTTP_FRAME *inbox;            /// Newest frame not yet taken by the server thread
+   int stopping;
+   PICAM_HTTP_STATS stats;             /// Counters, guarded by lock
+   pthread_mutex_t lock;               /// Guards inbox, stopping and stats
+   pthread_t thread;
+   int started;
+} PICAM_HTTP;
+
+int picam_http_start(PICAM_HTTP *http, const char *address, int port, int max_clients, int queue_frames);
+int picam_http_publish(PICAM_HTTP *http, const uint8_t *data, long length);
+void picam_http_stats(PICAM_HTTP *http, PICAM_HTTP_STATS *stats);
+void picam_http_stop(PICAM_HTTP *http);
+
+#endif // _PICAMHTTP_H
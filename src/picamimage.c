@@ -0,0 +1,357 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "picamimage.h"
+
+/// Most bytes a stored deflate block can hold
+#define PICAM_PNG_BLOCK 65535
+/// Bytes adler32 can sum before its 32 bit sums have to be reduced
+#define PICAM_ADLER_NMAX 5552
+
+/// Layout each row is converted to before it is written
+enum {
+   ROW_RGB = 0,
+   ROW_BGR,
+   ROW_GREY
+};
+
+/// Deflate stream of stored blocks, each sent as an IDAT chunk once full
+typedef struct
+{
+   FILE *file;
+   uint8_t block[PICAM_PNG_BLOCK];
+   long used;                          /// Bytes waiting in block
+   uint32_t s1, s2;                    /// adler32 of everything appended so far
+   int started;                        /// Set once the zlib header is written
+   int error;                          /// errno of the first failed write, 0 if none
+} PNG_STREAM;
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void)
+{
+   uint32_t c;
+   int n, k;
+
+   for (n = 0; n < 256; n++) {
+      c = (uint32_t)n;
+      for (k = 0; k < 8; k++)
+         c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      crc_table[n] = c;
+   }
+}
+
+static uint32_t crc_update(uint32_t crc, const uint8_t *data, long length)
+{
+   long i;
+
+   for (i = 0; i < length; i++)
+      crc = crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+   return crc;
+}
+
+static void put_be32(uint8_t *out, uint32_t value)
+{
+   out[0] = value >> 24;
+   out[1] = value >> 16;
+   out[2] = value >> 8;
+   out[3] = value;
+}
+
+static void put_le16(uint8_t *out, uint32_t value)
+{
+   out[0] = value;
+   out[1] = value >> 8;
+}
+
+static void put_le32(uint8_t *out, uint32_t value)
+{
+   put_le16(out, value);
+   put_le16(out + 2, value >> 16);
+}
+
+static int write_all(FILE *file, const void *data, long length)
+{
+   if (length && fwrite(data, 1, length, file) != (size_t)length)
+      return errno ? errno : EIO;
+   return 0;
+}
+
+/**
+ * Write one PNG chunk whose data comes in up to three parts
+ */
+static int png_chunk(FILE *file, const char *type, const uint8_t *a, long a_length,
+                     const uint8_t *b, long b_length, const uint8_t *c, long c_length)
+{
+   uint8_t word[4];
+   uint32_t crc;
+   int error;
+
+   put_be32(word, (uint32_t)(a_length + b_length + c_length));
+   crc = crc_update(0xffffffffu, (const uint8_t *)type, 4);
+   crc = crc_update(crc, a, a_length);
+   crc = crc_update(crc, b, b_length);
+   crc = crc_update(crc, c, c_length);
+   if ((error = write_all(file, word, 4)) != 0 ||
+       (error = write_all(file, type, 4)) != 0 ||
+       (error = write_all(file, a, a_length)) != 0 ||
+       (error = write_all(file, b, b_length)) != 0 ||
+       (error = write_all(file, c, c_length)) != 0)
+      return error;
+   put_be32(word, crc ^ 0xffffffffu);
+   return write_all(file, word, 4);
+}
+
+/**
+ * Send the waiting bytes as one stored block in an IDAT chunk. The first
+ * carries the zlib header, the final one the adler32 of the whole stream.
+ */
+static void png_flush(PNG_STREAM *png, int final)
+{
+   uint8_t head[7], tail[4];
+   long head_length = 0;
+
+   if (png->error)
+      return;
+   if (!png->started) {
+      head[head_length++] = 0x78;      // deflate, 32K window
+      head[head_length++] = 0x01;      // no preset dictionary, header checksum
+      png->started = 1;
+   }
+   head[head_length++] = final ? 1 : 0;
+   put_le16(head + head_length, (uint32_t)png->used);
+   put_le16(head + head_length + 2, (uint32_t)~png->used & 0xffff);
+   head_length += 4;
+   put_be32(tail, (png->s2 << 16) | png->s1);
+   png->error = png_chunk(png->file, "IDAT", head, head_length, png->block, png->used, tail, final ? 4 : 0);
+   png->used = 0;
+}
+
+static void png_append(PNG_STREAM *png, const uint8_t *data, long length)
+{
+   while (length > 0) {
+      long take = PICAM_PNG_BLOCK - png->used;
+      long i, done;
+
+      if (take > length)
+         take = length;
+      memcpy(png->block + png->used, data, take);
+      for (done = 0; done < take; done += PICAM_ADLER_NMAX) {
+         long end = done + PICAM_ADLER_NMAX < take ? done + PICAM_ADLER_NMAX : take;
+
+         for (i = done; i < end; i++) {
+            png->s1 += data[i];
+            png->s2 += png->s1;
+         }
+         png->s1 %= 65521;
+         png->s2 %= 65521;
+      }
+      png->used += take;
+      data += take;
+      length -= take;
+      if (png->used == PICAM_PNG_BLOCK)
+         png_flush(png, 0);
+   }
+}
+
+/**
+ * Convert one row of pixels to the layout a file wants
+ */
+static void convert_row(uint8_t *out, const uint8_t *in, int width, int pixel_format, int row_layout)
+{
+   int x;
+
+   if (pixel_format == PICAM_PIXELS_LUMA) {
+      if (row_layout == ROW_GREY) {
+         memcpy(out, in, width);
+      } else {
+         for (x = 0; x < width; x++, out += 3)
+            out[0] = out[1] = out[2] = in[x];
+      }
+   } else if (row_layout == ROW_GREY) {
+      int r = pixel_format == PICAM_PIXELS_RGB24 ? 0 : 2;
+
+      // BT.601 luma in 8 bit fixed point
+      for (x = 0; x < width; x++, in += 3)
+         out[x] = (uint8_t)((77 * in[r] + 150 * in[1] + 29 * in[2 - r]) >> 8);
+   } else if ((pixel_format == PICAM_PIXELS_RGB24) == (row_layout == ROW_RGB)) {
+      memcpy(out, in, (size_t)width * 3);
+   } else {
+      for (x = 0; x < width; x++, in += 3, out += 3) {
+         out[0] = in[2];
+         out[1] = in[1];
+         out[2] = in[0];
+      }
+   }
+}
+
+/**
+ * Choose the file format from a file name's extension
+ *
+ * @param filename Name ending in .ppm, .pgm, .bmp or .png, in any case
+ * @return One of the PICAM_IMAGE_* values, -1 for any other name
+ */
+int picam_image_format_for_filename(const char *filename)
+{
+   const char *dot = strrchr(filename, '.');
+
+   if (!dot)
+      return -1;
+   if (strcasecmp(dot, ".ppm") == 0)
+      return PICAM_IMAGE_PPM;
+   if (strcasecmp(dot, ".pgm") == 0)
+      return PICAM_IMAGE_PGM;
+   if (strcasecmp(dot, ".bmp") == 0)
+      return PICAM_IMAGE_BMP;
+   if (strcasecmp(dot, ".png") == 0)
+      return PICAM_IMAGE_PNG;
+   return -1;
+}
+
+/**
+ * Write packed pixels as an image file, converting them a row at a time
+ *
+ * @param file Where the image goes, written from its current position
+ * @param image_format One of the PICAM_IMAGE_* values
+ * @param pixels First (top) row
+ * @param width Pixels per row
+ * @param height Rows
+ * @param stride Bytes from one row to the next, negative for rows stored bottom up
+ * @param pixel_format One of the PICAM_PIXELS_* values
+ * @return 0 if successful, errno otherwise (EINVAL for arguments it cannot write)
+ */
+int picam_image_write(FILE *file, int image_format, const uint8_t *pixels, int width, int height, long stride, int pixel_format)
+{
+   int grey = pixel_format == PICAM_PIXELS_LUMA;
+   int row_layout, channels, error = 0;
+   long row_bytes, padded;
+   uint8_t *row = NULL;
+   PNG_STREAM *png = NULL;
+   uint8_t header[1078];
+   int y;
+
+   if (width <= 0 || height <= 0 || pixel_format < PICAM_PIXELS_RGB24 || pixel_format > PICAM_PIXELS_LUMA)
+      return EINVAL;
+   switch (image_format) {
+   case PICAM_IMAGE_PPM:
+      row_layout = ROW_RGB;
+      break;
+   case PICAM_IMAGE_PGM:
+      row_layout = ROW_GREY;
+      break;
+   case PICAM_IMAGE_BMP:
+      row_layout = grey ? ROW_GREY : ROW_BGR;
+      break;
+   case PICAM_IMAGE_PNG:
+      row_layout = grey ? ROW_GREY : ROW_RGB;
+      break;
+   default:
+      return EINVAL;
+   }
+   channels = row_layout == ROW_GREY ? 1 : 3;
+   row_bytes = (long)width * channels;
+   // BMP rows are padded to 4 bytes, a PNG row starts with its filter type
+   padded = image_format == PICAM_IMAGE_BMP ? (row_bytes + 3) & ~3L : row_bytes + 1;
+   row = calloc(1, padded);
+   if (!row)
+      return ENOMEM;
+
+   if (image_format == PICAM_IMAGE_PPM || image_format == PICAM_IMAGE_PGM) {
+      if (fprintf(file, "P%c\n%d %d\n255\n", image_format == PICAM_IMAGE_PPM ? '6' : '5', width, height) < 0)
+         error = errno ? errno : EIO;
+      for (y = 0; y < height && !error; y++) {
+         convert_row(row, pixels + y * stride, width, pixel_format, row_layout);
+         error = write_all(file, row, row_bytes);
+      }
+   } else if (image_format == PICAM_IMAGE_BMP) {
+      long palette = channels == 1 ? 1024 : 0;
+      long offset = 54 + palette;
+      int i;
+
+      memset(header, 0, sizeof(header));
+      header[0] = 'B';
+      header[1] = 'M';
+      put_le32(header + 2, (uint32_t)(offset + padded * height));
+      put_le32(header + 10, (uint32_t)offset);
+      put_le32(header + 14, 40);
+      put_le32(header + 18, (uint32_t)width);
+      put_le32(header + 22, (uint32_t)height);  // positive, rows stored bottom up
+      put_le16(header + 26, 1);
+      put_le16(header + 28, channels * 8);
+      put_le32(header + 34, (uint32_t)(padded * height));
+      put_le32(header + 38, 2835);               // 72 dpi
+      put_le32(header + 42, 2835);
+      if (palette) {
+         put_le32(header + 46, 256);
+         for (i = 0; i < 256; i++)
+            header[54 + i * 4] = header[55 + i * 4] = header[56 + i * 4] = (uint8_t)i;
+      }
+      error = write_all(file, header, offset);
+      for (y = height - 1; y >= 0 && !error; y--) {
+         convert_row(row, pixels + y * stride, width, pixel_format, row_layout);
+         error = write_all(file, row, padded);
+      }
+   } else {
+      static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+      pthread_once(&crc_once, crc_init);
+      png = calloc(1, sizeof(PNG_STREAM));
+      if (!png) {
+         free(row);
+         return ENOMEM;
+      }
+      png->file = file;
+      png->s1 = 1;
+      put_be32(header, (uint32_t)width);
+      put_be32(header + 4, (uint32_t)height);
+      header[8] = 8;                             // bits per channel
+      header[9] = channels == 1 ? 0 : 2;         // grey or RGB
+      header[10] = header[11] = header[12] = 0;  // deflate, adaptive filters, no interlace
+      if ((error = write_all(file, signature, 8)) == 0)
+         error = png_chunk(file, "IHDR", header, 13, NULL, 0, NULL, 0);
+      for (y = 0; y < height && !error; y++) {
+         row[0] = 0;                             // no filter, stored blocks gain nothing from one
+         convert_row(row + 1, pixels + y * stride, width, pixel_format, row_layout);
+         png_append(png, row, row_bytes + 1);
+         error = png->error;
+      }
+      if (!error) {
+         png_flush(png, 1);
+         error = png->error;
+      }
+      if (!error)
+         error = png_chunk(file, "IEND", NULL, 0, NULL, 0, NULL, 0);
+      free(png);
+   }
+   free(row);
+   return error;
+}
+
+/**
+ * Write packed pixels to a new file, see picam_image_write
+ *
+ * @param filename File to create or replace
+ * @param image_format One of the PICAM_IMAGE_* values, -1 to choose from the extension
+ * @return 0 if successful, errno otherwise (EINVAL for a name or arguments it cannot write)
+ */
+int picam_image_save(const char *filename, int image_format, const uint8_t *pixels, int width, int height, long stride, int pixel_format)
+{
+   FILE *file;
+   int error;
+
+   if (image_format < 0)
+      image_format = picam_image_format_for_filename(filename);
+   if (image_format < 0)
+      return EINVAL;
+   file = fopen(filename, "wb");
+   if (!file)
+      return errno;
+   error = picam_image_write(file, image_format, pixels, width, height, stride, pixel_format);
+   if (fclose(file) != 0 && !error)
+      error = errno ? errno : EIO;
+   return error;
+}
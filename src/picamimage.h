@@ -0,0 +1,26 @@
+#ifndef _PICAMIMAGE_H
+#define _PICAMIMAGE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/// Files written by picam_image_write
+enum {
+   PICAM_IMAGE_PPM = 0,                /// Binary PPM (P6), 8 bit RGB
+   PICAM_IMAGE_PGM,                    /// Binary PGM (P5), 8 bit grey, colour is converted to luma
+   PICAM_IMAGE_BMP,                    /// 24 bit BMP, 8 bit with a grey palette for luma
+   PICAM_IMAGE_PNG                     /// PNG in stored (uncompressed) deflate blocks, RGB or grey as the pixels are
+};
+
+/// Pixel layouts read by picam_image_write
+enum {
+   PICAM_PIXELS_RGB24 = 0,             /// Packed R,G,B bytes
+   PICAM_PIXELS_BGR24,                 /// Packed B,G,R bytes
+   PICAM_PIXELS_LUMA                   /// One grey byte per pixel, such as the Y plane of I420
+};
+
+int picam_image_format_for_filename(const char *filename);
+int picam_image_write(FILE *file, int image_format, const uint8_t *pixels, int width, int height, long stride, int pixel_format);
+int picam_image_save(const char *filename, int image_format, const uint8_t *pixels, int width, int height, long stride, int pixel_format);
+
+#endif // _PICAMIMAGE_H
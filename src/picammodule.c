@@ -1,40 +1,81 @@
 #include <Python.h>
 #include "structmember.h"
+#include "pythread.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
 #include "picam.h"
+#include "picamdiff.h"
+#include "picammotion.h"
+#include "picamimage.h"
 #include "interface/mmal/mmal.h"
 
 #define CLAMP(x, low, high)  (((x) > (high)) ? (high) : (((x) < (low)) ? (low) : (x)))
 #define DICT_SET(dict,val) PyModule_AddIntConstant(dict, #val, val);
+// Run a blocking camera call with the GIL released, serialised on lock
+#define WITHOUT_GIL(lock, call) \
+    Py_BEGIN_ALLOW_THREADS \
+    PyThread_acquire_lock(lock, WAIT_LOCK); \
+    call; \
+    PyThread_release_lock(lock); \
+    Py_END_ALLOW_THREADS
 
 
 typedef struct {
     PyObject_HEAD
-    /* Type-specific fields go here. */
-    int exposure;
-    int meterMode;
-    int imageFX;
-    int awbMode;
-    int ISO;   
-    int sharpness;             /// -100 to 100
-    int contrast;              /// -100 to 100
-    int brightness;            ///  0 to 100
-    int saturation;            ///  -100 to 100
-    int videoStabilisation;    /// 0 or 1 (false or true)
-    int exposureCompensation;  /// -10 to +10 ?
-    int rotation;              /// 0-359
-    int hflip;                 /// 0 or 1
-    int vflip;                 /// 0 or 1
-    int shutter_speed;         /// 0 = auto, otherwise the shutter speed in ms
-    int videoProfile;       //  MMAL_VIDEO_PROFILE_H264_HIGH
-    int videoBitrate;
-    int videoFramerate;     //30
-    int quantisationParameter;          // Quantisation parameter - quality. Set bitrate 0 and set this for variable bitrate
-    int inlineHeaders;                  // Insert inline headers to stream (SPS, PPS)
-    PyObject *roi;
+    PicamParams params;                 /// Settings in the form the camera takes them, checked as they are set
+    unsigned long generation;           /// Stamp taken from configChanges whenever a setting changes
 } _PicamConfig;
 
+/// Counts changes to every Config, so a (config, generation) pair never repeats even if a Config is freed
+static unsigned long configChanges = 0;
+
+/// Where each integer setting of a Config lives and what it accepts, indexed by the getset closure
+typedef struct {
+    const char *name;
+    size_t offset;                      /// Offset of the int in PicamParams
+    long min;
+    long max;
+} ConfigField;
+
+enum { CONFIG_ROTATION = 11 };
+
+static const ConfigField configFields[] = {
+    {"exposure", offsetof(PicamParams, camera.exposureMode), MMAL_PARAM_EXPOSUREMODE_OFF, MMAL_PARAM_EXPOSUREMODE_FIREWORKS},
+    {"meterMode", offsetof(PicamParams, camera.exposureMeterMode), MMAL_PARAM_EXPOSUREMETERINGMODE_AVERAGE, MMAL_PARAM_EXPOSUREMETERINGMODE_MATRIX},
+    {"imageFX", offsetof(PicamParams, camera.imageEffect), MMAL_PARAM_IMAGEFX_NONE, MMAL_PARAM_IMAGEFX_CARTOON},
+    {"awbMode", offsetof(PicamParams, camera.awbMode), MMAL_PARAM_AWBMODE_OFF, MMAL_PARAM_AWBMODE_HORIZON},
+    {"ISO", offsetof(PicamParams, camera.ISO), 0, 1600},
+    {"sharpness", offsetof(PicamParams, camera.sharpness), -100, 100},
+    {"contrast", offsetof(PicamParams, camera.contrast), -100, 100},
+    {"brightness", offsetof(PicamParams, camera.brightness), 0, 100},
+    {"saturation", offsetof(PicamParams, camera.saturation), -100, 100},
+    {"videoStabilisation", offsetof(PicamParams, camera.videoStabilisation), 0, 1},
+    {"exposureCompensation", offsetof(PicamParams, camera.exposureCompensation), -10, 10},
+    {"rotation", offsetof(PicamParams, camera.rotation), 0, 270},     // CONFIG_ROTATION, any angle is taken
+    {"hflip", offsetof(PicamParams, camera.hflip), 0, 1},
+    {"vflip", offsetof(PicamParams, camera.vflip), 0, 1},
+    {"shutterSpeed", offsetof(PicamParams, camera.shutter_speed), 0, INT_MAX},
+    {"videoProfile", offsetof(PicamParams, videoProfile), MMAL_VIDEO_PROFILE_H264_BASELINE, MMAL_VIDEO_PROFILE_H264_HIGH},
+    {"videoBitrate", offsetof(PicamParams, videoBitrate), 0, INT_MAX},
+    {"videoFramerate", offsetof(PicamParams, videoFramerate), 1, 120},
+    {"quantisationParameter", offsetof(PicamParams, quantisationParameter), 0, 51},
+    {"inlineHeaders", offsetof(PicamParams, inlineHeaders), 0, 1},
+};
+
+static void config_defaults(_PicamConfig *self) {
+    memset(&self->params, 0, sizeof(self->params));
+    raspicamcontrol_set_defaults(&self->params.camera);
+    self->params.videoProfile = MMAL_VIDEO_PROFILE_H264_HIGH;
+    self->params.videoBitrate = 17000000;
+    self->params.videoFramerate = 30;
+    self->params.quantisationParameter = 0;
+    self->params.inlineHeaders = 0;
+    self->generation = ++configChanges;
+}
+
 static void PicamConfig_dealloc(_PicamConfig* self) {    
     self->ob_type->tp_free((PyObject*)self);
 }
@@ -48,60 +89,105 @@ static PyObject *Picam_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
 
     self = (_PicamConfig *)type->tp_alloc(type, 0);
     if (self != NULL) {
-        self->exposure = MMAL_PARAM_EXPOSUREMODE_AUTO;       
-        self->meterMode = MMAL_PARAM_EXPOSUREMETERINGMODE_AVERAGE;       
-        self->imageFX = MMAL_PARAM_IMAGEFX_NONE;    
-        self->awbMode = MMAL_PARAM_AWBMODE_AUTO;       
-        self->ISO = 0;
-        self->sharpness = 0;           
-        self->contrast = 0;              
-        self->brightness= 50;          
-        self->saturation = 0;           
-        self->videoStabilisation = 0;    /// 0 or 1 (false or true)
-        self->exposureCompensation = 0 ; 
-        self->rotation = 0;
-        self->hflip = 0;
-        self->vflip = 0;
-        self->shutter_speed = 0;
-        self->videoProfile = MMAL_VIDEO_PROFILE_H264_HIGH;
-        self->videoBitrate = 17000000;
-        self->videoFramerate = 30;
-        self->quantisationParameter = 0;
-        self->inlineHeaders = 0;
-        self->roi = PyList_New(4);
-        PyList_SetItem(self->roi, 0,PyFloat_FromDouble(0));
-        PyList_SetItem(self->roi, 1, PyFloat_FromDouble(0));
-        PyList_SetItem(self->roi, 2, PyFloat_FromDouble(1.0)); 
-        PyList_SetItem(self->roi, 3, PyFloat_FromDouble(1.0)); 
-        
-        
+        config_defaults(self);
     }
     return (PyObject *)self;
 }
-static PyMemberDef PicamConfig_members[] = {
-    {"exposure", T_INT, offsetof(_PicamConfig, exposure), 0, "exposure"},
-    {"meterMode",T_INT, offsetof(_PicamConfig, meterMode), 0, "meterMode"},
-    {"imageFX",  T_INT, offsetof(_PicamConfig, imageFX), 0, "imageFX"},
-    {"awbMode",  T_INT, offsetof(_PicamConfig, awbMode), 0, "awbMode"},   
-    {"ISO",  T_INT, offsetof(_PicamConfig, ISO), 0, "ISO"},       
-    {"sharpness",  T_INT, offsetof(_PicamConfig, sharpness), 0, "sharpness"},       
-    {"contrast",  T_INT, offsetof(_PicamConfig, contrast), 0, "contrast"},       
-    {"brightness",  T_INT, offsetof(_PicamConfig, brightness), 0, "brightness"},       
-    {"saturation",  T_INT, offsetof(_PicamConfig, saturation), 0, "saturation"},       
-    {"videoStabilisation",  T_INT, offsetof(_PicamConfig, videoStabilisation), 0, "videoStabilisation"}, 
-    {"exposureCompensation",  T_INT, offsetof(_PicamConfig, exposureCompensation), 0, "exposureCompensation"},     
-    {"rotation",  T_INT, offsetof(_PicamConfig, rotation), 0, "rotation"},     
-    {"hflip",  T_INT, offsetof(_PicamConfig, hflip), 0, "hflip"},     
-    {"vflip",  T_INT, offsetof(_PicamConfig, vflip), 0, "vflip"},     
-    {"shutterSpeed",  T_INT, offsetof(_PicamConfig, shutter_speed), 0, "0 = auto, otherwise the shutter speed in ms"},     
-    {"videoProfile",  T_INT, offsetof(_PicamConfig, videoProfile), 0, "videoProfile"},  
-    {"videoBitrate",  T_INT, offsetof(_PicamConfig, videoBitrate), 0, "videoBitrate"},  
-    {"videoFramerate",  T_INT, offsetof(_PicamConfig, videoFramerate), 0, "videoFramerate"},  
-    {"quantisationParameter", T_INT, offsetof(_PicamConfig, quantisationParameter), 0, "quantisationParameter"},  
-    {"inlineHeaders", T_INT, offsetof(_PicamConfig, inlineHeaders), 0, "inlineHeaders"},  
-    {"roi", T_OBJECT, offsetof(_PicamConfig, roi), 0, "roi"},  
+
+static PyObject *PicamConfig_getint(_PicamConfig *self, void *closure) {
+    const ConfigField *field = &configFields[(long)closure];
+    return PyInt_FromLong(*(int *)((char *)&self->params + field->offset));
+}
+
+static int PicamConfig_setint(_PicamConfig *self, PyObject *value, void *closure) {
+    const ConfigField *field = &configFields[(long)closure];
+    int *setting = (int *)((char *)&self->params + field->offset);
+    long v;
+    if (value == NULL) {
+        PyErr_Format(PyExc_TypeError, "cannot delete %s", field->name);
+        return -1;
+    }
+    v = PyInt_AsLong(value);
+    if (v == -1 && PyErr_Occurred())
+        return -1;
+    if ((long)closure == CONFIG_ROTATION) {
+        // The camera turns in quarters, as raspicamcontrol_set_rotation does
+        v = (v % 360 + 360) % 360 / 90 * 90;
+    } else if (v < field->min || v > field->max) {
+        PyErr_Format(PyExc_ValueError, "%s must be from %ld to %ld, not %ld", field->name, field->min, field->max, v);
+        return -1;
+    }
+    if (*setting != v) {
+        *setting = (int)v;
+        self->generation = ++configChanges;
+    }
+    return 0;
+}
+
+static PyObject *PicamConfig_getroi(_PicamConfig *self, void *closure) {
+    PARAM_FLOAT_RECT_T *roi = &self->params.camera.roi;
+    return Py_BuildValue("[dddd]", roi->x, roi->y, roi->w, roi->h);
+}
+
+static int PicamConfig_setroi(_PicamConfig *self, PyObject *value, void *closure) {
+    PARAM_FLOAT_RECT_T roi;
+    if (value == NULL) {
+        PyErr_SetString(PyExc_TypeError, "cannot delete roi");
+        return -1;
+    }
+    if (!PySequence_Check(value) || PySequence_Size(value) != 4) {
+        PyErr_SetString(PyExc_ValueError, "roi must be [x, y, width, height]");
+        return -1;
+    }
+    value = PySequence_Tuple(value);
+    if (value == NULL)
+        return -1;
+    if (!PyArg_ParseTuple(value, "dddd;roi must be four numbers", &roi.x, &roi.y, &roi.w, &roi.h)) {
+        Py_DECREF(value);
+        return -1;
+    }
+    Py_DECREF(value);
+    if (roi.x < 0.0 || roi.y < 0.0 || roi.w <= 0.0 || roi.h <= 0.0 || roi.x + roi.w > 1.0 || roi.y + roi.h > 1.0) {
+        PyErr_SetString(PyExc_ValueError, "roi must lie within [0.0, 0.0, 1.0, 1.0] and not be empty");
+        return -1;
+    }
+    if (memcmp(&roi, &self->params.camera.roi, sizeof(roi)) != 0) {
+        self->params.camera.roi = roi;
+        self->generation = ++configChanges;
+    }
+    return 0;
+}
+
+static PyObject *PicamConfig_getgeneration(_PicamConfig *self, void *closure) {
+    return PyLong_FromUnsignedLong(self->generation);
+}
+
+static PyGetSetDef PicamConfig_getset[] = {
+    {"exposure", (getter)PicamConfig_getint, (setter)PicamConfig_setint, "One of the MMAL_PARAM_EXPOSUREMODE_* constants", (void *)0},
+    {"meterMode", (getter)PicamConfig_getint, (setter)PicamConfig_setint, "One of the MMAL_PARAM_EXPOSUREMETERINGMODE_* constants", (void *)1},
+    {"imageFX", (getter)PicamConfig_getint, (setter)PicamConfig_setint, "One of the MMAL_PARAM_IMAGEFX_* constants", (void *)2},
+    {"awbMode", (getter)PicamConfig_getint, (setter)PicamConfig_setint, "One of the MMAL_PARAM_AWBMODE_* constants", (void *)3},
+    {"ISO", (getter)PicamConfig_getint, (setter)PicamConfig_setint, "0 for auto, up to 1600", (void *)4},
+    {"sharpness", (getter)PicamConfig_getint, (setter)PicamConfig_setint, "-100 to 100", (void *)5},
+    {"contrast", (getter)PicamConfig_getint, (setter)PicamConfig_setint, "-100 to 100", (void *)6},
+    {"brightness", (getter)PicamConfig_getint, (setter)PicamConfig_setint, "0 to 100", (void *)7},
+    {"saturation", (getter)PicamConfig_getint, (setter)PicamConfig_setint, "-100 to 100", (void *)8},
+    {"videoStabilisation", (getter)PicamConfig_getint, (setter)PicamConfig_setint, "0 or 1", (void *)9},
+    {"exposureCompensation", (getter)PicamConfig_getint, (setter)PicamConfig_setint, "-10 to 10", (void *)10},
+    {"rotation", (getter)PicamConfig_getint, (setter)PicamConfig_setint, "Degrees, kept as 0, 90, 180 or 270", (void *)CONFIG_ROTATION},
+    {"hflip", (getter)PicamConfig_getint, (setter)PicamConfig_setint, "0 or 1", (void *)12},
+    {"vflip", (getter)PicamConfig_getint, (setter)PicamConfig_setint, "0 or 1", (void *)13},
+    {"shutterSpeed", (getter)PicamConfig_getint, (setter)PicamConfig_setint, "0 = auto, otherwise the shutter speed in microseconds", (void *)14},
+    {"videoProfile", (getter)PicamConfig_getint, (setter)PicamConfig_setint, "One of the MMAL_VIDEO_PROFILE_H264_* constants", (void *)15},
+    {"videoBitrate", (getter)PicamConfig_getint, (setter)PicamConfig_setint, "Bits per second, 0 to leave it to quantisationParameter", (void *)16},
+    {"videoFramerate", (getter)PicamConfig_getint, (setter)PicamConfig_setint, "1 to 120", (void *)17},
+    {"quantisationParameter", (getter)PicamConfig_getint, (setter)PicamConfig_setint, "0 to 51, 0 to leave it to the encoder", (void *)18},
+    {"inlineHeaders", (getter)PicamConfig_getint, (setter)PicamConfig_setint, "1 to repeat SPS and PPS before every keyframe", (void *)19},
+    {"roi", (getter)PicamConfig_getroi, (setter)PicamConfig_setroi, "[x, y, width, height] of the sensor to use, each 0.0 to 1.0. Assign a whole list, the one read is a copy.", NULL},
+    {"generation", (getter)PicamConfig_getgeneration, NULL, "Changes whenever a setting does, live cameras are only sent the settings that differ", NULL},
     {NULL}  /* Sentinel */
 };
+
 static PyTypeObject PicamConfigType = {
     PyObject_HEAD_INIT(NULL)
     0,                         /*ob_size*/
@@ -132,8 +218,8 @@ static PyTypeObject PicamConfigType = {
     0,		               /* tp_iter */
     0,		               /* tp_iternext */
     0,                      /* tp_methods */
-    PicamConfig_members,             /* tp_members */
-    0,                         /* tp_getset */
+    0,                         /* tp_members */
+    PicamConfig_getset,        /* tp_getset */
     0,                         /* tp_base */
     0,                         /* tp_dict */
     0,                         /* tp_descr_get */
@@ -148,36 +234,147 @@ static _PicamConfig* picam_newconfig()
     _PicamConfig* o = PyObject_New(_PicamConfig, &PicamConfigType);
 
     if (o != 0) {        
-        o->exposure = MMAL_PARAM_EXPOSUREMODE_AUTO;       
-        o->meterMode = MMAL_PARAM_EXPOSUREMETERINGMODE_AVERAGE;       
-        o->imageFX = MMAL_PARAM_IMAGEFX_NONE;    
-        o->awbMode = MMAL_PARAM_AWBMODE_AUTO; 
-        o->ISO = 0;  
-        o->sharpness = 0;           
-        o->contrast = 0;              
-        o->brightness= 50;          
-        o->saturation = 0;           
-        o->videoStabilisation = 0;    /// 0 or 1 (false or true)
-        o->exposureCompensation = 0 ; 
-        o->rotation = 0;
-        o->hflip = 0;
-        o->vflip = 0;
-        o->shutter_speed = 0;
-        o->videoProfile = MMAL_VIDEO_PROFILE_H264_HIGH;
-        o->videoBitrate = 17000000;
-        o->videoFramerate = 30;
-        o->quantisationParameter = 0;
-        o->inlineHeaders = 0;
-        o->roi = PyList_New(4);
-        PyList_SetItem(o->roi, 0,PyFloat_FromDouble(0));
-        PyList_SetItem(o->roi, 1, PyFloat_FromDouble(0));
-        PyList_SetItem(o->roi, 2, PyFloat_FromDouble(1.0)); 
-        PyList_SetItem(o->roi, 3, PyFloat_FromDouble(1.0)); 
+        config_defaults(o);
     }    
     return o;
 }
 
+/** Capture result that owns the malloc()ed encoder output and exposes it
+ *  through the buffer protocol, so the image is never copied into a str
+ */
+typedef struct {
+    PyObject_HEAD
+    uint8_t *data;
+    Py_ssize_t length;
+    int width;
+    int height;
+    int stride;
+    int format;
+    PY_LONG_LONG timestamp;
+    PyObject *owner;                           /// Object the data is borrowed from, NULL if the frame owns it
+    int slot;                                  /// Passed back to release
+    void (*release)(PyObject *owner, int slot); /// Gives borrowed data back to its owner
+} _PicamFrame;
+
+static void PicamFrame_dealloc(_PicamFrame* self) {
+    if (self->owner) {
+        if (self->release)
+            self->release(self->owner, self->slot);
+        Py_DECREF(self->owner);
+    } else {
+        free(self->data);
+    }
+    self->ob_type->tp_free((PyObject*)self);
+}
+
+static Py_ssize_t PicamFrame_length(_PicamFrame *self) {
+    return self->length;
+}
+
+static Py_ssize_t PicamFrame_getreadbuffer(_PicamFrame *self, Py_ssize_t segment, void **ptrptr) {
+    if (segment != 0) {
+        PyErr_SetString(PyExc_SystemError, "accessing non-existent frame segment");
+        return -1;
+    }
+    *ptrptr = self->data;
+    return self->length;
+}
+
+static Py_ssize_t PicamFrame_getsegcount(_PicamFrame *self, Py_ssize_t *lenp) {
+    if (lenp)
+        *lenp = self->length;
+    return 1;
+}
+
+static int PicamFrame_getbuffer(_PicamFrame *self, Py_buffer *view, int flags) {
+    return PyBuffer_FillInfo(view, (PyObject *)self, self->data, self->length, 1, flags);
+}
+
+static PyMemberDef PicamFrame_members[] = {
+    {"width", T_INT, offsetof(_PicamFrame, width), READONLY, "Width in pixels"},
+    {"height", T_INT, offsetof(_PicamFrame, height), READONLY, "Height in rows"},
+    {"stride", T_INT, offsetof(_PicamFrame, stride), READONLY, "Bytes from one row to the next, 0 for JPEG and BMP"},
+    {"format", T_INT, offsetof(_PicamFrame, format), READONLY, "One of the PICAM_FORMAT_* constants"},
+    {"timestamp", T_LONGLONG, offsetof(_PicamFrame, timestamp), READONLY, "Presentation time in us of a streamed frame, 0 for stills"},
+    {NULL}  /* Sentinel */
+};
+
+static PySequenceMethods PicamFrame_as_sequence = {
+    (lenfunc)PicamFrame_length,             /* sq_length */
+};
+
+static PyBufferProcs PicamFrame_as_buffer = {
+    (readbufferproc)PicamFrame_getreadbuffer,   /* bf_getreadbuffer */
+    0,                                          /* bf_getwritebuffer */
+    (segcountproc)PicamFrame_getsegcount,       /* bf_getsegcount */
+    (charbufferproc)PicamFrame_getreadbuffer,   /* bf_getcharbuffer */
+    (getbufferproc)PicamFrame_getbuffer,        /* bf_getbuffer */
+    0,                                          /* bf_releasebuffer */
+};
+
+static PyTypeObject PicamFrameType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "picam.Frame",             /*tp_name*/
+    sizeof(_PicamFrame),       /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)PicamFrame_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    &PicamFrame_as_sequence,   /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    &PicamFrame_as_buffer,     /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /*tp_flags*/
+    "Captured image data, readable through the buffer protocol (memoryview, buffer, cStringIO)", /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    0,                         /* tp_iter */
+    0,                         /* tp_iternext */
+    0,                         /* tp_methods */
+    PicamFrame_members,        /* tp_members */
+};
+
+/**
+ * Wrap a capture in a Frame, which takes ownership of its malloc()ed data
+ *
+ * @return new Frame, None if the capture failed
+ */
+static PyObject *frameFromPicamFrame(PicamFrame *capture) {
+    _PicamFrame *frame;
+    if (capture->data == NULL) {
+        Py_RETURN_NONE;
+    }
+    frame = PyObject_New(_PicamFrame, &PicamFrameType);
+    if (frame == NULL) {
+        free(capture->data);
+        return NULL;
+    }
+    frame->data = capture->data;
+    frame->length = capture->length;
+    frame->width = capture->width;
+    frame->height = capture->height;
+    frame->stride = capture->stride;
+    frame->format = capture->format;
+    frame->timestamp = 0;
+    frame->owner = NULL;
+    frame->release = NULL;
+    return (PyObject *)frame;
+}
+
 static _PicamConfig *picamConfig = NULL;
+/// Serialises the one shot functions, only one of them can own the camera at a time
+static PyThread_type_lock cameraLock = NULL;
 
 static PyObject * picam_listtest(PyObject *self, PyObject *args) {   
     PyObject *V = PyList_New(3);
@@ -187,60 +384,24 @@ static PyObject * picam_listtest(PyObject *self, PyObject *args) {
     return Py_BuildValue("N", V);
 }
 
+/// Take the settings of a Config, already checked as they were set
+static void paramsFromConfig(_PicamConfig *config, PicamParams *parms) {
+    *parms = config->params;
+    parms->source = config;
+    parms->generation = config->generation;
+}
+
 static void fillParms(PicamParams *parms) {   
-    parms->exposure = picamConfig->exposure;
-    parms->meterMode = picamConfig->meterMode;
-    parms->imageFX = picamConfig->imageFX;
-    parms->awbMode = picamConfig->awbMode;
-    parms->ISO = picamConfig->ISO;    
-    parms->sharpness = picamConfig->sharpness;             /// -100 to 100
-    parms->contrast = picamConfig->contrast;              /// -100 to 100
-    parms->brightness = picamConfig->brightness;            ///  0 to 100
-    parms->saturation = picamConfig->saturation;            ///  -100 to 100
-    parms->videoStabilisation = picamConfig->videoStabilisation;    /// 0 or 1 (false or true)
-    parms->exposureCompensation = picamConfig->exposureCompensation;  /// -10 to +10 ?
-    parms->rotation = picamConfig->rotation;
-    parms->hflip =  picamConfig->hflip;
-    parms->vflip = picamConfig->vflip;     
-    parms->shutter_speed = picamConfig->shutter_speed;
-    parms->videoProfile = picamConfig->videoProfile;
-    parms->videoBitrate = picamConfig->videoBitrate;
-    parms->videoFramerate = picamConfig->videoFramerate;
-    parms->quantisationParameter = picamConfig->quantisationParameter;
-    parms->inlineHeaders = picamConfig->inlineHeaders;
-    parms->roi[0] = PyFloat_AsDouble(PyList_GetItem(picamConfig->roi, 0));
-    parms->roi[1] = PyFloat_AsDouble(PyList_GetItem(picamConfig->roi, 1));;
-    parms->roi[2] = PyFloat_AsDouble(PyList_GetItem(picamConfig->roi, 2));;
-    parms->roi[3] = PyFloat_AsDouble(PyList_GetItem(picamConfig->roi, 3));;
-    if (parms->roi[0] > 1.0) {
-        parms->roi[0] = 0.0;
-    }
-    if (parms->roi[1] > 1.0) {
-        parms->roi[1] = 0.0;
-    }
-    if (parms->roi[2] > 1.0) {
-        parms->roi[2] = 1.0;
-    }
-    if (parms->roi[3] > 1.0) {
-        parms->roi[3] = 1.0;
-    }
-    if (parms->roi[0] + parms->roi[2] > 1.0)
-        parms->roi[2] = 1 - parms->roi[0];
-
-    if (parms->roi[1] + parms->roi[3] > 1.0)
-        parms->roi[3] = 1 - parms->roi[1];
+    paramsFromConfig(picamConfig, parms);
 }
 
 static PyObject * picam_takephoto(PyObject *self, PyObject *args) {
-    PyObject *result = Py_None;                           
-    long bufsize = 0l;    
     //printf("%d %d %d %d %d\n",picamConfig->exposure, picamConfig->meterMode, picamConfig->imageFX, picamConfig->awbMode, picamConfig->ISO); 
     PicamParams parms;
+    PicamFrame frame;
     fillParms(&parms);
-    char *buffer = (char *)takePhoto(&parms, &bufsize);                    
-    result = Py_BuildValue("s#", buffer, bufsize);
-    free(buffer);      
-    return result;
+    WITHOUT_GIL(cameraLock, internelFrameWithDetails(2592, 1944, 85, PICAM_FORMAT_JPEG, &parms, &frame));
+    return frameFromPicamFrame(&frame);
 }
 
 static PyObject *picam_difference(PyObject *self, PyObject *args) { 
@@ -303,152 +464,2344 @@ static PyObject *picam_difference(PyObject *self, PyObject *args) {
 }
 
 
+/**
+ * Native counterpart of difference, works on packed frames (any buffer object)
+ * instead of lists. Returns (count, mask), mask is a bytearray or None.
+ */
+static PyObject *picam_differencebuffers(PyObject *self, PyObject *args) {
+    Py_buffer a;
+    Py_buffer b;
+    int width;
+    int height;
+    int stride;
+    int format;
+    int threshold;
+    int maskKind = PICAM_DIFF_MASK_NONE;
+    int bpp;
+    long count;
+    long needed;
+    PyObject *mask = NULL;
+    uint8_t *maskData = NULL;
+    if (!PyArg_ParseTuple(args,"s*s*iiiii|i",&a,&b,&width,&height,&stride,&format,&threshold,&maskKind)) {
+       return NULL;
+    }
+    if (format == PICAM_FORMAT_RGB24 || format == PICAM_FORMAT_BGR24) {
+        bpp = 3;
+    } else if (format == PICAM_FORMAT_LUMA || format == PICAM_FORMAT_I420) {
+        bpp = 1;    // the Y plane
+    } else {
+        PyErr_SetString(PyExc_ValueError, "format must be one of PICAM_FORMAT_RGB24, PICAM_FORMAT_BGR24, PICAM_FORMAT_I420 or PICAM_FORMAT_LUMA");
+        goto error;
+    }
+    if (maskKind < PICAM_DIFF_MASK_NONE || maskKind > PICAM_DIFF_MASK_BITS) {
+        PyErr_SetString(PyExc_ValueError, "mask must be one of PICAM_DIFF_MASK_NONE, PICAM_DIFF_MASK_BYTES or PICAM_DIFF_MASK_BITS");
+        goto error;
+    }
+    if (stride == 0)
+        stride = width * bpp;
+    needed = width > 0 && height > 0 ? (long)(height - 1) * stride + (long)width * bpp : 0;
+    if (width <= 0 || height <= 0 || stride < width * bpp || a.len < needed || b.len < needed) {
+        PyErr_SetString(PyExc_ValueError, "buffers are smaller than width, height and stride describe");
+        goto error;
+    }
+    if (maskKind != PICAM_DIFF_MASK_NONE) {
+        mask = PyByteArray_FromStringAndSize(NULL, picam_diff_mask_size(width, height, maskKind));
+        if (mask == NULL)
+            goto error;
+        maskData = (uint8_t *)PyByteArray_AS_STRING(mask);
+    }
+    Py_BEGIN_ALLOW_THREADS
+    count = picam_diff_frames(a.buf, b.buf, width, height, stride, bpp, threshold, maskData, maskKind);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&a);
+    PyBuffer_Release(&b);
+    if (count < 0) {
+        Py_XDECREF(mask);
+        return PyErr_NoMemory();
+    }
+    if (mask == NULL) {
+        Py_INCREF(Py_None);
+        mask = Py_None;
+    }
+    return Py_BuildValue("lN", count, mask);
+
+error:
+    PyBuffer_Release(&a);
+    PyBuffer_Release(&b);
+    return NULL;
+}
+
+static PyObject *picam_differenceimplementation(PyObject *self, PyObject *args) {
+    const char *name = NULL;
+    const char *used;
+    if (PyTuple_Size(args) == 0)
+        return PyString_FromString(picam_diff_implementation());
+    // None goes back to the best path for this CPU
+    if (!PyArg_ParseTuple(args,"z",&name)) {
+       return NULL;
+    }
+    used = picam_diff_use(name);
+    if (used == NULL) {
+        PyErr_Format(PyExc_ValueError, "%s is not available on this CPU", name);
+        return NULL;
+    }
+    return PyString_FromString(used);
+}
+
+/**
+ * Convert a packed RGB24 capture into the list of 0xRRGGBB ints returned by
+ * takeRGBPhotoWithDetails. Rows are listed bottom up, as they used to be
+ * when the list was built from a BMP. Frees the capture.
+ */
+static PyObject *rgbListFromFrame(PicamFrame *capture) {
+    if (capture->data == NULL) {
+        Py_RETURN_NONE;
+    }
+    PyObject *listResult = PyList_New((Py_ssize_t)capture->width * capture->height);
+    int x, y;
+    Py_ssize_t i = 0;
+    if (listResult != NULL) {
+        for (y=capture->height-1;y>=0;y--) {
+            const uint8_t *row = capture->data + (long)y * capture->stride;
+            for (x=0;x<capture->width;x++,row+=3) {
+                long val = (row[0] << 16) | (row[1] << 8) | row[2];
+                PyList_SET_ITEM(listResult, i++, PyInt_FromLong(val));
+            }
+        }
+    }
+    free(capture->data);    
+    
+    return listResult;   
+}
+
+/**
+ * Pack a list of 0xRRGGBB ints, rows bottom up as takeRGBPhotoWithDetails
+ * returns them, into top down RGB24 rows of width * 3 bytes
+ *
+ * @return 0 if successful, -1 with a Python error set
+ */
+static int packRGBRows(PyObject *list, int width, int height, uint8_t *out) {
+    PyObject *items = PySequence_Fast(list, "pixels must be a list of 0xRRGGBB ints");
+    PyObject **item;
+    int x, y;
+    if (items == NULL)
+        return -1;
+    if (PySequence_Fast_GET_SIZE(items) != (Py_ssize_t)width * height) {
+        PyErr_SetString(PyExc_ValueError, "pixel list is not width * height long");
+        Py_DECREF(items);
+        return -1;
+    }
+    item = PySequence_Fast_ITEMS(items);
+    for (y = height - 1; y >= 0; y--) {
+        uint8_t *row = out + (long)y * width * 3;
+        for (x = 0; x < width; x++, row += 3) {
+            long rgb = PyInt_AsLong(*item++);
+            if (rgb == -1 && PyErr_Occurred()) {
+                Py_DECREF(items);
+                return -1;
+            }
+            row[0] = (uint8_t)(rgb >> 16);
+            row[1] = (uint8_t)(rgb >> 8);
+            row[2] = (uint8_t)rgb;
+        }
+    }
+    Py_DECREF(items);
+    return 0;
+}
+
+static PyObject *picam_packrgblist(PyObject *self, PyObject *args) {
+    PyObject *list;
+    PyObject *result;
+    int width;
+    int height;
+    if (!PyArg_ParseTuple(args,"Oii",&list,&width,&height)) {
+       return NULL;
+    }
+    if (width <= 0 || height <= 0) {
+        PyErr_SetString(PyExc_ValueError, "width and height must be positive");
+        return NULL;
+    }
+    result = PyString_FromStringAndSize(NULL, (Py_ssize_t)width * height * 3);
+    if (result == NULL)
+        return NULL;
+    if (packRGBRows(list, width, height, (uint8_t *)PyString_AS_STRING(result)) != 0) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    return result;
+}
+
+static PyObject *picam_saveimage(PyObject *self, PyObject *args) {
+    PyObject *source;
+    const char *filename;
+    int width;
+    int height;
+    int stride = 0;
+    int format = PICAM_FORMAT_RGB24;
+    int pixels;
+    int bpp;
+    int imageFormat;
+    int error;
+    long needed;
+    uint8_t *packed = NULL;
+    Py_buffer view;
+    if (!PyArg_ParseTuple(args,"Osii|ii",&source,&filename,&width,&height,&stride,&format)) {
+       return NULL;
+    }
+    if (format == PICAM_FORMAT_RGB24 || format == PICAM_FORMAT_BGR24) {
+        pixels = format == PICAM_FORMAT_RGB24 ? PICAM_PIXELS_RGB24 : PICAM_PIXELS_BGR24;
+        bpp = 3;
+    } else if (format == PICAM_FORMAT_LUMA || format == PICAM_FORMAT_I420) {
+        pixels = PICAM_PIXELS_LUMA;    // the Y plane
+        bpp = 1;
+    } else {
+        PyErr_SetString(PyExc_ValueError, "format must be one of PICAM_FORMAT_RGB24, PICAM_FORMAT_BGR24, PICAM_FORMAT_I420 or PICAM_FORMAT_LUMA");
+        return NULL;
+    }
+    imageFormat = picam_image_format_for_filename(filename);
+    if (imageFormat < 0) {
+        PyErr_SetString(PyExc_ValueError, "filename must end in .ppm, .pgm, .bmp or .png");
+        return NULL;
+    }
+    if (width <= 0 || height <= 0) {
+        PyErr_SetString(PyExc_ValueError, "width and height must be positive");
+        return NULL;
+    }
+    if (PyList_Check(source) || PyTuple_Check(source)) {
+        // The 0xRRGGBB ints of takeRGBPhotoWithDetails
+        packed = malloc((size_t)width * height * 3);
+        if (packed == NULL)
+            return PyErr_NoMemory();
+        if (packRGBRows(source, width, height, packed) != 0) {
+            free(packed);
+            return NULL;
+        }
+        pixels = PICAM_PIXELS_RGB24;
+        stride = width * 3;
+        Py_BEGIN_ALLOW_THREADS
+        error = picam_image_save(filename, imageFormat, packed, width, height, stride, pixels);
+        Py_END_ALLOW_THREADS
+        free(packed);
+    } else {
+        if (PyObject_GetBuffer(source, &view, PyBUF_SIMPLE) != 0)
+            return NULL;
+        if (stride == 0)
+            stride = width * bpp;
+        needed = (long)(height - 1) * stride + (long)width * bpp;
+        if (stride < width * bpp || view.len < needed) {
+            PyErr_SetString(PyExc_ValueError, "buffer is smaller than width, height and stride describe");
+            PyBuffer_Release(&view);
+            return NULL;
+        }
+        Py_BEGIN_ALLOW_THREADS
+        error = picam_image_save(filename, imageFormat, view.buf, width, height, stride, pixels);
+        Py_END_ALLOW_THREADS
+        PyBuffer_Release(&view);
+    }
+    if (error) {
+        errno = error;
+        return PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)filename);
+    }
+    Py_RETURN_NONE;
+}
+
 static PyObject *picam_takergbphotowithdetails(PyObject *self, PyObject *args) {   
     int width;
     int height;   
     if (!PyArg_ParseTuple(args,"ii",&width,&height)) {
        return NULL;
     }
-    long bufsize = 0l;
     PicamParams parms;
+    PicamFrame frame;
     fillParms(&parms);
-    char *buffer = (char *)takeRGBPhotoWithDetails(width, height,&parms, &bufsize); 
-     
-    long bufMinusHeader = bufsize-54;    
-    long listSize = bufMinusHeader / 3;   
-    PyObject *listResult = PyList_New(listSize);
-    int i;
-    int ii = 0;
-    for (i=54;i<bufsize;i+=3) {        
-        long val = (buffer[i+2] << 16) | (buffer[i+1] << 8) | buffer[i];                    
-        PyList_SetItem(listResult, (i-54)/3,PyInt_FromLong(val));        
-        ii++;
+    WITHOUT_GIL(cameraLock, takeRawPhotoWithDetails(width, height, PICAM_FORMAT_RGB24, &parms, &frame));
+    return rgbListFromFrame(&frame);
+}
+
+static PyObject *picam_takerawphotowithdetails(PyObject *self, PyObject *args) {
+    int width;
+    int height;
+    int format;
+    if (!PyArg_ParseTuple(args,"iii",&width,&height,&format)) {
+       return NULL;
     }
-    free(buffer);    
-    
-    return Py_BuildValue("N", listResult);   
+    if (format < PICAM_FORMAT_RGB24 || format > PICAM_FORMAT_LUMA) {
+       PyErr_SetString(PyExc_ValueError, "format must be one of PICAM_FORMAT_RGB24, PICAM_FORMAT_BGR24, PICAM_FORMAT_I420 or PICAM_FORMAT_LUMA");
+       return NULL;
+    }
+    PicamParams parms;
+    PicamFrame frame;
+    fillParms(&parms);
+    WITHOUT_GIL(cameraLock, takeRawPhotoWithDetails(width, height, format, &parms, &frame));
+    return frameFromPicamFrame(&frame);
 }
 
 static PyObject * picam_takephotowithdetails(PyObject *self, PyObject *args) {
-    PyObject *result = Py_None;
     int width;
     int height;
     int quality;    
     if (!PyArg_ParseTuple(args,"iii",&width,&height,&quality)) {
        return NULL;
     }
-    long bufsize = 0l;
     PicamParams parms;
+    PicamFrame frame;
     fillParms(&parms);
-    char *buffer = (char *)takePhotoWithDetails(width, height, quality, &parms, &bufsize);   
-    result = Py_BuildValue("s#", buffer, bufsize);
-    free(buffer);      
-    return result;
+    WITHOUT_GIL(cameraLock, internelFrameWithDetails(width, height, quality, PICAM_FORMAT_JPEG, &parms, &frame));
+    return frameFromPicamFrame(&frame);
 }
 
-static PyObject * picam_recordvideowithdetails(PyObject *self, PyObject *args) {
-    PyObject *result = Py_None;
+/**
+ * Read the (width, height, quality, thumbWidth, thumbHeight[, thumbQuality]) arguments of takePhotoWithThumbnail
+ */
+static int thumbnailFromArgs(PyObject *args, int *width, int *height, int *quality, MMAL_PARAM_THUMBNAIL_CONFIG_T *thumbnail) {
+    thumbnail->enable = 1;
+    thumbnail->quality = 35;
+    if (!PyArg_ParseTuple(args,"iiiii|i",width,height,quality,&thumbnail->width,&thumbnail->height,&thumbnail->quality)) {
+       return -1;
+    }
+    if (thumbnail->width <= 0 || thumbnail->height <= 0 || thumbnail->width > *width || thumbnail->height > *height) {
+       PyErr_SetString(PyExc_ValueError, "the thumbnail must be at least 1x1 and no larger than the photo");
+       return -1;
+    }
+    if (thumbnail->quality < 1 || thumbnail->quality > 100) {
+       PyErr_SetString(PyExc_ValueError, "thumbnail quality must be from 1 to 100");
+       return -1;
+    }
+    return 0;
+}
+
+/**
+ * Build the (Frame, thumbnail Frame or None) pair returned by takePhotoWithThumbnail, taking ownership of both,
+ * None if the photo failed
+ */
+static PyObject *thumbnailPairFromFrames(PicamFrame *frame, PicamFrame *thumbnail) {
+    PyObject *photo;
+    PyObject *small;
+    if (frame->data == NULL) {
+        free(thumbnail->data);
+        Py_RETURN_NONE;
+    }
+    photo = frameFromPicamFrame(frame);
+    small = frameFromPicamFrame(thumbnail);
+    if (photo == NULL || small == NULL) {
+        Py_XDECREF(photo);
+        Py_XDECREF(small);
+        return NULL;
+    }
+    return Py_BuildValue("NN", photo, small);
+}
+
+static PyObject *picam_takephotowiththumbnail(PyObject *self, PyObject *args) {
     int width;
     int height;
-    int duration;
-    char *filename;
+    int quality;
+    MMAL_PARAM_THUMBNAIL_CONFIG_T config;
+    if (thumbnailFromArgs(args, &width, &height, &quality, &config) != 0) {
+       return NULL;
+    }
     PicamParams parms;
+    PicamFrame frame;
+    PicamFrame thumbnail;
     fillParms(&parms);
-    if (!PyArg_ParseTuple(args,"siii",&filename, &width,&height,&duration)) {
+    WITHOUT_GIL(cameraLock, internelPhotoWithThumbnail(width, height, quality, &config, &parms, &frame, &thumbnail));
+    return thumbnailPairFromFrames(&frame, &thumbnail);
+}
+
+/**
+ * Build the [(Frame, timestamp), ...] list returned by takeBurst, taking ownership of the frames
+ */
+static PyObject *burstListFromFrames(PicamFrame *frames, int64_t *timestamps, int count, int captured) {
+    PyObject *listResult = PyList_New(captured);
+    int i;
+    for (i=0;i<count;i++) {
+        if (listResult != NULL && i < captured) {
+            PyObject *frame = frameFromPicamFrame(&frames[i]);
+            PyObject *item = frame ? Py_BuildValue("NL", frame, (PY_LONG_LONG)timestamps[i]) : NULL;
+            if (item == NULL) {
+                Py_CLEAR(listResult);
+                continue;
+            }
+            PyList_SET_ITEM(listResult, i, item);
+        } else {
+            free(frames[i].data);
+        }
+    }
+    free(frames);
+    free(timestamps);
+    return listResult;
+}
+
+static PyObject *picam_takeburst(PyObject *self, PyObject *args) {
+    int count;
+    int width;
+    int height;
+    int quality;
+    int interval = 0;
+    if (!PyArg_ParseTuple(args,"iiii|i",&count,&width,&height,&quality,&interval)) {
        return NULL;
     }
-    internelVideoWithDetails(filename, width, height, duration,&parms);  
-    Py_INCREF(result);
-    return result;
+    if (count <= 0) {
+       PyErr_SetString(PyExc_ValueError, "count must be positive");
+       return NULL;
+    }
+    PicamParams parms;
+    PicamFrame *frames = calloc(count, sizeof(PicamFrame));
+    int64_t *timestamps = calloc(count, sizeof(int64_t));
+    int captured = 0;
+    if (frames == NULL || timestamps == NULL) {
+        free(frames);
+        free(timestamps);
+        return PyErr_NoMemory();
+    }
+    fillParms(&parms);
+    WITHOUT_GIL(cameraLock, captured = internelBurstWithDetails(count, width, height, quality, interval, &parms, frames, timestamps));
+    return burstListFromFrames(frames, timestamps, count, captured);
 }
 
-static PyMethodDef PiCamMethods[] = {
-    
-    {"takePhoto",  picam_takephoto, METH_VARARGS, "Take a basic photo."},  
-    {"takePhotoWithDetails",  picam_takephotowithdetails, METH_VARARGS, "Take a  photo with width, height and quality."},    
-    {"takeRGBPhotoWithDetails",  picam_takergbphotowithdetails, METH_VARARGS, "Take a photo and return as RGB array."}, 
-    {"difference",  picam_difference, METH_VARARGS, "Difference between 2 RGB arrays."}, 
-    {"recordVideoWithDetails",  picam_recordvideowithdetails, METH_VARARGS, "Record a video with width, height and duration."}, 
-    {"listTest", picam_listtest,  METH_VARARGS, "Test returning a list"}, 
-    {NULL, NULL, 0, NULL}        /* Sentinel */
-};
+/** Frames captured back to back, all in one malloc()ed block exposed through
+ *  the buffer protocol, with a packed record of each frame beside it
+ */
+typedef struct {
+    PyObject_HEAD
+    PicamBatch batch;
+} _PicamBatch;
 
-void setupExposureConstants(PyObject *module_dict) {   
-    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMODE_OFF);
-    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMODE_AUTO);
-    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMODE_NIGHT);
-    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMODE_NIGHTPREVIEW);
-    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMODE_BACKLIGHT);
-    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMODE_SPOTLIGHT);
-    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMODE_SPORTS);
-    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMODE_SNOW);
-    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMODE_BEACH);
-    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMODE_VERYLONG);
-    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMODE_FIXEDFPS);
-    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMODE_ANTISHAKE);
-    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMODE_FIREWORKS);
+static void PicamBatch_dealloc(_PicamBatch* self) {
+    free(self->batch.data);
+    free(self->batch.frames);
+    self->ob_type->tp_free((PyObject*)self);
 }
-void setupAWBConstants(PyObject *module_dict) {   
-    DICT_SET(module_dict,MMAL_PARAM_AWBMODE_OFF);
-    DICT_SET(module_dict,MMAL_PARAM_AWBMODE_AUTO);
-    DICT_SET(module_dict,MMAL_PARAM_AWBMODE_SUNLIGHT);
-    DICT_SET(module_dict,MMAL_PARAM_AWBMODE_CLOUDY);
-    DICT_SET(module_dict,MMAL_PARAM_AWBMODE_SHADE);
-    DICT_SET(module_dict,MMAL_PARAM_AWBMODE_TUNGSTEN);
-    DICT_SET(module_dict,MMAL_PARAM_AWBMODE_FLUORESCENT);
-    DICT_SET(module_dict,MMAL_PARAM_AWBMODE_INCANDESCENT);
-    DICT_SET(module_dict,MMAL_PARAM_AWBMODE_FLASH);
-    DICT_SET(module_dict,MMAL_PARAM_AWBMODE_HORIZON);   
+
+static Py_ssize_t PicamBatch_length(_PicamBatch *self) {
+    return self->batch.captured;
 }
 
-void setupMeteringConstants(PyObject *module_dict) {   
-    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMETERINGMODE_AVERAGE);
-    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMETERINGMODE_SPOT);
-    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMETERINGMODE_BACKLIT);
-    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMETERINGMODE_MATRIX);     
+/// batch[i] is a Frame borrowing frame i from the batch, which it keeps alive
+static PyObject *PicamBatch_item(_PicamBatch *self, Py_ssize_t i) {
+    _PicamFrame *frame;
+    if (i < 0 || i >= self->batch.captured) {
+        PyErr_SetString(PyExc_IndexError, "batch index out of range");
+        return NULL;
+    }
+    frame = PyObject_New(_PicamFrame, &PicamFrameType);
+    if (frame == NULL)
+        return NULL;
+    frame->data = self->batch.data + i * self->batch.frame_size;
+    frame->length = self->batch.frames[i].length;
+    frame->width = self->batch.width;
+    frame->height = self->batch.height;
+    frame->stride = self->batch.stride;
+    frame->format = self->batch.format;
+    frame->timestamp = self->batch.frames[i].timestamp;
+    frame->slot = (int)i;
+    frame->release = NULL;
+    Py_INCREF(self);
+    frame->owner = (PyObject *)self;
+    return (PyObject *)frame;
 }
-void setupImageFXConstants(PyObject *module_dict) {    
-    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_NONE);
-    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_NEGATIVE);
-    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_SOLARIZE);
-    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_SKETCH);
-    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_DENOISE);
-    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_EMBOSS);
-    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_OILPAINT);
-    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_HATCH);
-    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_GPEN);
-    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_PASTEL);
-    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_WATERCOLOUR);
-    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_BLUR);
-    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_SATURATION);
-    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_COLOURSWAP);
-    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_WASHEDOUT);
-    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_POSTERISE);
-    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_COLOURPOINT);
-    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_COLOURBALANCE);
-    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_CARTOON);  
+
+static Py_ssize_t PicamBatch_getreadbuffer(_PicamBatch *self, Py_ssize_t segment, void **ptrptr) {
+    if (segment != 0) {
+        PyErr_SetString(PyExc_SystemError, "accessing non-existent batch segment");
+        return -1;
+    }
+    *ptrptr = self->batch.data;
+    return (Py_ssize_t)self->batch.captured * self->batch.frame_size;
 }
-void setupVideoProfileConstants(PyObject *module_dict) {   
-    DICT_SET(module_dict,MMAL_VIDEO_PROFILE_H264_BASELINE);
-    DICT_SET(module_dict,MMAL_VIDEO_PROFILE_H264_MAIN);
-    DICT_SET(module_dict,MMAL_VIDEO_PROFILE_H264_HIGH);   
+
+static Py_ssize_t PicamBatch_getsegcount(_PicamBatch *self, Py_ssize_t *lenp) {
+    if (lenp)
+        *lenp = (Py_ssize_t)self->batch.captured * self->batch.frame_size;
+    return 1;
 }
 
-PyMODINIT_FUNC
-init_picam(void)
+static int PicamBatch_getbuffer(_PicamBatch *self, Py_buffer *view, int flags) {
+    return PyBuffer_FillInfo(view, (PyObject *)self, self->batch.data, (Py_ssize_t)self->batch.captured * self->batch.frame_size, 1, flags);
+}
+
+static PyObject *PicamBatch_getmetadata(_PicamBatch *self, void *closure) {
+    return PyString_FromStringAndSize((const char *)self->batch.frames, self->batch.captured * sizeof(PicamBatchFrame));
+}
+
+static PyObject *PicamBatch_gettimestamps(_PicamBatch *self, void *closure) {
+    PyObject *timestamps = PyList_New(self->batch.captured);
+    int i;
+    if (timestamps == NULL)
+        return NULL;
+    for (i = 0; i < self->batch.captured; i++)
+        PyList_SET_ITEM(timestamps, i, PyLong_FromLongLong(self->batch.frames[i].timestamp));
+    return timestamps;
+}
+
+static PyMemberDef PicamBatch_members[] = {
+    {"frameSize", T_LONG, offsetof(_PicamBatch, batch.frame_size), READONLY, "Bytes from one frame to the next in the buffer"},
+    {"width", T_INT, offsetof(_PicamBatch, batch.width), READONLY, "Width in pixels"},
+    {"height", T_INT, offsetof(_PicamBatch, batch.height), READONLY, "Height in rows"},
+    {"stride", T_INT, offsetof(_PicamBatch, batch.stride), READONLY, "Bytes from one row to the next"},
+    {"format", T_INT, offsetof(_PicamBatch, batch.format), READONLY, "One of the raw PICAM_FORMAT_* constants"},
+    {"requested", T_INT, offsetof(_PicamBatch, batch.count), READONLY, "Frames asked for, len() is the number captured"},
+    {"dropped", T_ULONG, offsetof(_PicamBatch, batch.dropped), READONLY, "Frames the camera failed to deliver while the batch filled"},
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef PicamBatch_getset[] = {
+    {"metadata", (getter)PicamBatch_getmetadata, NULL, "One 16 byte record per frame: int64 timestamp (us), uint32 length, uint32 MMAL buffer flags, native byte order (struct format 'qII')", NULL},
+    {"timestamps", (getter)PicamBatch_gettimestamps, NULL, "Presentation time of each frame in us", NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PySequenceMethods PicamBatch_as_sequence = {
+    (lenfunc)PicamBatch_length,             /* sq_length */
+    0,                                      /* sq_concat */
+    0,                                      /* sq_repeat */
+    (ssizeargfunc)PicamBatch_item,          /* sq_item */
+};
+
+static PyBufferProcs PicamBatch_as_buffer = {
+    (readbufferproc)PicamBatch_getreadbuffer,   /* bf_getreadbuffer */
+    0,                                          /* bf_getwritebuffer */
+    (segcountproc)PicamBatch_getsegcount,       /* bf_getsegcount */
+    (charbufferproc)PicamBatch_getreadbuffer,   /* bf_getcharbuffer */
+    (getbufferproc)PicamBatch_getbuffer,        /* bf_getbuffer */
+    0,                                          /* bf_releasebuffer */
+};
+
+static PyTypeObject PicamBatchType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "picam.Batch",             /*tp_name*/
+    sizeof(_PicamBatch),       /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)PicamBatch_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    &PicamBatch_as_sequence,   /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    &PicamBatch_as_buffer,     /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /*tp_flags*/
+    "Frames from captureBatch, frame i at offset i * frameSize of the buffer. batch[i] is a Frame of its own.", /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    0,                         /* tp_iter */
+    0,                         /* tp_iternext */
+    0,                         /* tp_methods */
+    PicamBatch_members,        /* tp_members */
+    PicamBatch_getset,         /* tp_getset */
+};
+
+static PyObject *picam_capturebatch(PyObject *self, PyObject *args) {
+    int count;
+    int format;
+    int width;
+    int height;
+    int framerate = 30;
+    int captured;
+    PicamParams parms;
+    _PicamBatch *result;
+    if (!PyArg_ParseTuple(args,"iiii|i",&count,&format,&width,&height,&framerate)) {
+       return NULL;
+    }
+    if (count <= 0) {
+       PyErr_SetString(PyExc_ValueError, "count must be positive");
+       return NULL;
+    }
+    if (format != PICAM_FORMAT_RGB24 && format != PICAM_FORMAT_BGR24 && format != PICAM_FORMAT_I420 && format != PICAM_FORMAT_LUMA) {
+       PyErr_SetString(PyExc_ValueError, "format must be PICAM_FORMAT_RGB24, BGR24, I420 or LUMA");
+       return NULL;
+    }
+    if (width <= 0 || height <= 0 || width > 0xffff || height > 0xffff) {
+       PyErr_SetString(PyExc_ValueError, "width and height must be from 1 to 65535");
+       return NULL;
+    }
+    // The whole batch is one allocation, at most 3 bytes a pixel of the padded frame
+    if (count > PY_SSIZE_T_MAX / ((width + 31) / 32 * 32) / ((height + 15) / 16 * 16) / 3) {
+       PyErr_Format(PyExc_MemoryError, "a batch of %d frames of %dx%d does not fit in memory", count, width, height);
+       return NULL;
+    }
+    result = PyObject_New(_PicamBatch, &PicamBatchType);
+    if (result == NULL)
+        return NULL;
+    fillParms(&parms);
+    WITHOUT_GIL(cameraLock, captured = captureBatchWithDetails(count, width, height, framerate, format, &parms, &result->batch));
+    if (!captured) {
+        Py_DECREF(result);
+        Py_RETURN_NONE;
+    }
+    return (PyObject *)result;
+}
+
+typedef struct {
+    PyObject_HEAD
+    PICAM_VECTORS vectors;
+} _PicamVectors;
+
+static void PicamVectors_dealloc(_PicamVectors* self) {
+    picam_vectors_free(&self->vectors);
+    self->ob_type->tp_free((PyObject*)self);
+}
+
+static PyObject *PicamVectors_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"columns", "rows", "threshold", NULL};
+    _PicamVectors *self;
+    int columns = 4;
+    int rows = 3;
+    int threshold = 10;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iii", kwlist, &columns, &rows, &threshold)) {
+       return NULL;
+    }
+    if (threshold < 0 || threshold > PICAM_VECTORS_MAX_THRESHOLD) {
+       PyErr_Format(PyExc_ValueError, "threshold must be from 0 to %d, not %d", PICAM_VECTORS_MAX_THRESHOLD, threshold);
+       return NULL;
+    }
+    self = (_PicamVectors *)type->tp_alloc(type, 0);
+    if (self != NULL)
+        picam_vectors_init(&self->vectors, columns, rows, threshold);
+    return (PyObject *)self;
+}
+
+static PyObject *PicamVectors_wait(_PicamVectors *self, PyObject *args) {
+    double timeout = -1.0;
+    unsigned long seen;
+    int newer;
+    if (!PyArg_ParseTuple(args,"k|d",&seen,&timeout)) {
+       return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    newer = picam_vectors_wait(&self->vectors, seen, timeout < 0 ? -1 : (int)(timeout * 1000));
+    Py_END_ALLOW_THREADS
+    return PyBool_FromLong(newer);
+}
+
+/**
+ * Per region results of the last field as a tuple, ints or floats
+ */
+static PyObject *vectorRegionTuple(_PicamVectors *self, uint32_t *counts, float *means) {
+    PICAM_VECTORS *vectors = &self->vectors;
+    PyObject *result;
+    int regions;
+    int i;
+    pthread_mutex_lock(&vectors->lock);
+    if (vectors->field == NULL) {
+        pthread_mutex_unlock(&vectors->lock);
+        return PyTuple_New(0);
+    }
+    regions = vectors->columns * vectors->rows;
+    result = PyTuple_New(regions);
+    for (i=0;result != NULL && i<regions;i++)
+        PyTuple_SET_ITEM(result, i, counts ? PyInt_FromLong(counts[i]) : PyFloat_FromDouble(means[i]));
+    pthread_mutex_unlock(&vectors->lock);
+    return result;
+}
+
+static PyObject *PicamVectors_getmoving(_PicamVectors *self, void *closure) {
+    return vectorRegionTuple(self, self->vectors.moving, NULL);
+}
+
+static PyObject *PicamVectors_getmagnitude(_PicamVectors *self, void *closure) {
+    return vectorRegionTuple(self, NULL, self->vectors.magnitude);
+}
+
+static PyObject *PicamVectors_getsad(_PicamVectors *self, void *closure) {
+    return vectorRegionTuple(self, NULL, self->vectors.sad);
+}
+
+static PyObject *PicamVectors_getfield(_PicamVectors *self, void *closure) {
+    PICAM_VECTORS *vectors = &self->vectors;
+    PyObject *result;
+    pthread_mutex_lock(&vectors->lock);
+    result = PyString_FromStringAndSize((const char *)vectors->field,
+                                        vectors->field ? (Py_ssize_t)vectors->mb_columns * vectors->mb_rows * sizeof(PICAM_MOTION_VECTOR) : 0);
+    pthread_mutex_unlock(&vectors->lock);
+    return result;
+}
+
+static PyObject *PicamVectors_getframes(_PicamVectors *self, void *closure) {
+    return PyLong_FromUnsignedLong(self->vectors.frames);
+}
+
+static PyObject *PicamVectors_gettimestamp(_PicamVectors *self, void *closure) {
+    return PyLong_FromLongLong(self->vectors.pts);
+}
+
+static PyObject *PicamVectors_getthreshold(_PicamVectors *self, void *closure) {
+    return PyInt_FromLong(self->vectors.threshold);
+}
+
+static int PicamVectors_setthreshold(_PicamVectors *self, PyObject *value, void *closure) {
+    long threshold;
+    if (value == NULL) {
+        PyErr_SetString(PyExc_TypeError, "cannot delete threshold");
+        return -1;
+    }
+    threshold = PyInt_AsLong(value);
+    if (threshold == -1 && PyErr_Occurred())
+        return -1;
+    if (threshold < 0 || threshold > PICAM_VECTORS_MAX_THRESHOLD) {
+        PyErr_Format(PyExc_ValueError, "threshold must be from 0 to %d, not %ld", PICAM_VECTORS_MAX_THRESHOLD, threshold);
+        return -1;
+    }
+    // The encoder callback reads it once per field under the lock, and never waits for the GIL
+    pthread_mutex_lock(&self->vectors.lock);
+    self->vectors.threshold = (int)threshold;
+    pthread_mutex_unlock(&self->vectors.lock);
+    return 0;
+}
+
+static PyMethodDef PicamVectors_methods[] = {
+    {"wait", (PyCFunction)PicamVectors_wait, METH_VARARGS, "wait(frames[, timeout s]) blocks until more than frames fields have been analysed, returns False on timeout."},
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef PicamVectors_getset[] = {
+    {"moving", (getter)PicamVectors_getmoving, NULL, "Macroblocks per region whose vector is longer than threshold in the last field", NULL},
+    {"magnitude", (getter)PicamVectors_getmagnitude, NULL, "Mean vector length per region in the last field", NULL},
+    {"sad", (getter)PicamVectors_getsad, NULL, "Mean SAD per region in the last field", NULL},
+    {"field", (getter)PicamVectors_getfield, NULL, "Copy of the last field, mbColumns x mbRows of (int8 x, int8 y, uint16 sad)", NULL},
+    {"frames", (getter)PicamVectors_getframes, NULL, "Fields analysed since the recording started", NULL},
+    {"timestamp", (getter)PicamVectors_gettimestamp, NULL, "Presentation time in us of the last field", NULL},
+    {"threshold", (getter)PicamVectors_getthreshold, (setter)PicamVectors_setthreshold, "Vectors longer than this count as moving (0-181)", NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyMemberDef PicamVectors_members[] = {
+    {"columns", T_INT, offsetof(_PicamVectors, vectors.columns), READONLY, "Regions across"},
+    {"rows", T_INT, offsetof(_PicamVectors, vectors.rows), READONLY, "Regions down"},
+    {"mbColumns", T_INT, offsetof(_PicamVectors, vectors.mb_columns), READONLY, "Macroblocks per row of field, including the extra column"},
+    {"mbRows", T_INT, offsetof(_PicamVectors, vectors.mb_rows), READONLY, "Macroblock rows in field"},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject PicamVectorsType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "picam.VectorAnalyser",    /*tp_name*/
+    sizeof(_PicamVectors),     /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)PicamVectors_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    "VectorAnalyser(columns=4, rows=3, threshold=10)\n\n"
+    "Pass to recordVideoWithDetails to turn on the encoder's inline motion vectors.\n"
+    "Each field is summarised per region of a columns x rows grid.", /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    0,                         /* tp_iter */
+    0,                         /* tp_iternext */
+    PicamVectors_methods,      /* tp_methods */
+    PicamVectors_members,      /* tp_members */
+    PicamVectors_getset,       /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    0,                         /* tp_init */
+    0,                         /* tp_alloc */
+    PicamVectors_new,          /* tp_new */
+};
+
+typedef struct {
+    PyObject_HEAD
+    PICAM_RING ring;
+} _PicamRing;
+
+static void PicamRing_dealloc(_PicamRing* self) {
+    picam_ring_free(&self->ring);
+    self->ob_type->tp_free((PyObject*)self);
+}
+
+static PyObject *PicamRing_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"size", NULL};
+    _PicamRing *self;
+    long size = 16 * 1024 * 1024;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|l", kwlist, &size)) {
+       return NULL;
+    }
+    if (size < 65536) {
+        PyErr_SetString(PyExc_ValueError, "size must be at least 65536 bytes");
+        return NULL;
+    }
+    self = (_PicamRing *)type->tp_alloc(type, 0);
+    if (self != NULL && picam_ring_init(&self->ring, size, 0) != 0) {
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+    return (PyObject *)self;
+}
+
+static PyObject *PicamRing_dump(_PicamRing *self, PyObject *args) {
+    PyObject *target;
+    double seconds = 0;
+    char *path = NULL;
+    int fd;
+    long written;
+    if (!PyArg_ParseTuple(args,"O|d",&target,&seconds)) {
+       return NULL;
+    }
+    if (PyString_Check(target)) {
+        path = PyString_AsString(target);
+        Py_BEGIN_ALLOW_THREADS
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        Py_END_ALLOW_THREADS
+        if (fd < 0)
+            return PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+    } else {
+        // an int or anything with fileno()
+        fd = PyObject_AsFileDescriptor(target);
+        if (fd < 0)
+            return NULL;
+        if (PyFile_Check(target))
+            fflush(PyFile_AsFile(target));
+    }
+    Py_BEGIN_ALLOW_THREADS
+    written = picam_ring_dump(&self->ring, fd, seconds);
+    if (path)
+        close(fd);
+    Py_END_ALLOW_THREADS
+    if (written < 0)
+        return PyErr_SetFromErrno(PyExc_IOError);
+    return PyInt_FromLong(written);
+}
+
+static PyObject *PicamRing_getstat(_PicamRing *self, void *closure) {
+    long bytes;
+    double seconds;
+    int keyframes;
+    unsigned long dropped;
+    picam_ring_stats(&self->ring, &bytes, &seconds, &keyframes, &dropped);
+    switch ((long)closure) {
+    case 0:  return PyInt_FromLong(bytes);
+    case 1:  return PyFloat_FromDouble(seconds);
+    case 2:  return PyInt_FromLong(keyframes);
+    default: return PyLong_FromUnsignedLong(dropped);
+    }
+}
+
+static PyMethodDef PicamRing_methods[] = {
+    {"dump", (PyCFunction)PicamRing_dump, METH_VARARGS, "dump(path_or_fd[, seconds]) writes the last seconds (all if 0) from a keyframe, returns the bytes written. Recording carries on."},
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef PicamRing_getset[] = {
+    {"bytes", (getter)PicamRing_getstat, NULL, "Bytes of stream held", (void *)0},
+    {"seconds", (getter)PicamRing_getstat, NULL, "Time between the oldest and newest frames held", (void *)1},
+    {"keyframes", (getter)PicamRing_getstat, NULL, "Keyframes a dump can start at", (void *)2},
+    {"dropped", (getter)PicamRing_getstat, NULL, "Encoder buffers not stored", (void *)3},
+    {NULL}  /* Sentinel */
+};
+
+static PyMemberDef PicamRing_members[] = {
+    {"size", T_LONG, offsetof(_PicamRing, ring.capacity), READONLY, "Byte budget"},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject PicamRingType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "picam.H264Ring",          /*tp_name*/
+    sizeof(_PicamRing),        /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)PicamRing_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    "H264Ring(size=16MB)\n\n"
+    "Pass to recordVideoWithDetails to keep the most recent H264 stream in memory,\n"
+    "oldest first out. dump() writes a pre-roll that starts on a keyframe.", /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    0,                         /* tp_iter */
+    0,                         /* tp_iternext */
+    PicamRing_methods,         /* tp_methods */
+    PicamRing_members,         /* tp_members */
+    PicamRing_getset,          /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    0,                         /* tp_init */
+    0,                         /* tp_alloc */
+    PicamRing_new,             /* tp_new */
+};
+
+/**
+ * Fill taps from the optional analyser and ring arguments of a recording
+ *
+ * @return 0 if successful, -1 with an exception set otherwise
+ */
+static int tapsFromArgs(PyObject *analyser, PyObject *ring, PicamVideoTaps *taps) {
+    memset(taps, 0, sizeof(*taps));
+    if (analyser != Py_None) {
+        if (!PyObject_TypeCheck(analyser, &PicamVectorsType)) {
+            PyErr_SetString(PyExc_TypeError, "analyser must be a VectorAnalyser");
+            return -1;
+        }
+        taps->vectors = &((_PicamVectors *)analyser)->vectors;
+    }
+    if (ring != Py_None) {
+        if (!PyObject_TypeCheck(ring, &PicamRingType)) {
+            PyErr_SetString(PyExc_TypeError, "ring must be an H264Ring");
+            return -1;
+        }
+        taps->ring = &((_PicamRing *)ring)->ring;
+    }
+    return 0;
+}
+
+/**
+ * Fill in a sink from the sink argument of a recording
+ *
+ * @param sink None, a file descriptor or an object with fileno() such as a socket
+ * @param chunks True to hand the stream out by iterating over the recorder instead
+ * @return 0 if successful, -1 with an exception set otherwise
+ */
+static int sinkFromArgs(PyObject *sink, int chunks, PicamVideoSink *out) {
+    out->fd = -1;
+    out->pull = chunks;
+    if (sink != Py_None) {
+        if (chunks) {
+            PyErr_SetString(PyExc_ValueError, "a recording can have a sink or chunks, not both");
+            return -1;
+        }
+        if ((out->fd = PyObject_AsFileDescriptor(sink)) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Fill in the analysis frames of a recording from the analysis argument
+ *
+ * @param analysis None or (width, height[, format[, buffers]])
+ * @return 0 if successful, -1 with an exception set otherwise
+ */
+static int analysisFromArgs(PyObject *analysis, PicamVideoAnalysis *out) {
+    out->format = PICAM_FORMAT_I420;
+    out->slots = 4;
+    if (!PyTuple_Check(analysis)) {
+        PyErr_SetString(PyExc_TypeError, "analysis must be a tuple (width, height[, format[, buffers]])");
+        return -1;
+    }
+    if (!PyArg_ParseTuple(analysis, "ii|ii", &out->width, &out->height, &out->format, &out->slots))
+        return -1;
+    if (out->format < PICAM_FORMAT_RGB24 || out->format > PICAM_FORMAT_LUMA) {
+        PyErr_SetString(PyExc_ValueError, "analysis format must be one of PICAM_FORMAT_RGB24, PICAM_FORMAT_BGR24, PICAM_FORMAT_I420 or PICAM_FORMAT_LUMA");
+        return -1;
+    }
+    if (out->slots < 1 || out->slots > PICAM_MAX_FRAME_SLOTS) {
+        PyErr_Format(PyExc_ValueError, "analysis buffers must be from 1 to %d", PICAM_MAX_FRAME_SLOTS);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Fill in the bitrate limits of a recording from the bitrateRange argument
+ *
+ * @param range (min, max[, minQP, maxQP[, interval ms]]) in bits/s
+ * @return 0 if successful, -1 with an exception set otherwise
+ */
+static int rateFromArgs(PyObject *range, PicamVideoRate *out) {
+    memset(out, 0, sizeof(*out));
+    if (!PyTuple_Check(range)) {
+        PyErr_SetString(PyExc_TypeError, "bitrateRange must be a tuple (min, max[, minQP, maxQP[, interval ms]])");
+        return -1;
+    }
+    if (!PyArg_ParseTuple(range, "ii|iii", &out->min_bitrate, &out->max_bitrate, &out->min_qp, &out->max_qp, &out->interval_ms))
+        return -1;
+    if (out->min_bitrate <= 0 || out->max_bitrate < out->min_bitrate) {
+        PyErr_SetString(PyExc_ValueError, "bitrateRange needs 0 < min <= max");
+        return -1;
+    }
+    if (out->min_qp < 0 || out->max_qp < out->min_qp || out->max_qp > 51) {
+        PyErr_SetString(PyExc_ValueError, "bitrateRange QP bounds need 0 <= minQP <= maxQP <= 51");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Dictionary of what a rate controller measured and decided
+ */
+static PyObject *rateDict(PICAM_RATE_STATS *stats) {
+    return Py_BuildValue("{s:i,s:i,s:l,s:l,s:i,s:i,s:k,s:k,s:k}",
+                         "bitrate", stats->target, "minQP", stats->min_qp,
+                         "measured", stats->measured, "drained", stats->drained,
+                         "backlog", stats->backlog, "freeBuffers", stats->free_buffers,
+                         "decreases", stats->decreases, "increases", stats->increases,
+                         "updates", stats->updates);
+}
+
+typedef struct {
+    PyObject_HEAD
+    Recorder *recorder;
+    PyObject *analyser;        /// Kept alive while the callback may feed it
+    PyObject *ring;            /// Kept alive while the callback may feed it
+    PyObject *sink;            /// Kept alive, with its descriptor, while the sink thread writes to it
+    int chunks;                /// Non-zero if the stream is read by iterating
+    int duration;
+    double still_gap;          /// Seconds of video lost to the last still
+    int still_lost;            /// Frames lost to the last still
+    unsigned long rate_seen;   /// Rate updates handed out by nextRate
+} _PicamRecorder;
+
+static void PicamRecorder_dealloc(_PicamRecorder* self) {
+    if (self->recorder) {
+        Py_BEGIN_ALLOW_THREADS
+        destroyRecorder(self->recorder);
+        Py_END_ALLOW_THREADS
+    }
+    Py_XDECREF(self->analyser);
+    Py_XDECREF(self->ring);
+    Py_XDECREF(self->sink);
+    self->ob_type->tp_free((PyObject*)self);
+}
+
+static PyObject *PicamRecorder_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"filename", "width", "height", "duration", "analyser", "ring", "segmentSeconds", "segmentBytes", "container", "sink", "chunks", "analysis", "bitrateRange", NULL};
+    _PicamRecorder *self;
+    char *filename;
+    int width;
+    int height;
+    int duration = 0;
+    PyObject *analyser = Py_None;
+    PyObject *ring = Py_None;
+    int segment_seconds = 0;
+    long segment_bytes = 0;
+    PyObject *container_arg = Py_None;
+    int container;
+    PyObject *sink = Py_None;
+    int chunks = 0;
+    PyObject *analysis = Py_None;
+    PyObject *range = Py_None;
+    PicamVideoSink sink_spec;
+    PicamVideoAnalysis analysis_spec;
+    PicamVideoRate rate_spec;
+    PicamVideoTaps taps;
+    PicamParams parms;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "zii|iOOilOOiOO", kwlist, &filename, &width, &height, &duration, &analyser, &ring, &segment_seconds, &segment_bytes, &container_arg, &sink, &chunks, &analysis, &range)) {
+       return NULL;
+    }
+    if (container_arg == Py_None) {
+        container = containerForFilename(filename);
+    } else if ((container = PyInt_AsLong(container_arg)) == -1 && PyErr_Occurred()) {
+        return NULL;
+    } else if (container < PICAM_CONTAINER_H264 || container > PICAM_CONTAINER_FMP4) {
+        PyErr_SetString(PyExc_ValueError, "container must be one of PICAM_CONTAINER_H264, PICAM_CONTAINER_MP4 or PICAM_CONTAINER_FMP4");
+        return NULL;
+    }
+    if (tapsFromArgs(analyser, ring, &taps) != 0 || sinkFromArgs(sink, chunks, &sink_spec) != 0)
+        return NULL;
+    if (sink != Py_None || chunks)
+        taps.sink = &sink_spec;
+    if (analysis != Py_None) {
+        if (analysisFromArgs(analysis, &analysis_spec) != 0)
+            return NULL;
+        taps.analysis = &analysis_spec;
+    }
+    if (range != Py_None) {
+        if (rateFromArgs(range, &rate_spec) != 0)
+            return NULL;
+        taps.rate = &rate_spec;
+    }
+    if ((segment_seconds > 0 || segment_bytes > 0) && (filename == NULL || !validSegmentPattern(filename))) {
+        PyErr_SetString(PyExc_ValueError, "segmented recordings need a filename pattern with one %d for the segment number");
+        return NULL;
+    }
+    if (filename == NULL && taps.ring == NULL && taps.sink == NULL) {
+        PyErr_SetString(PyExc_ValueError, "filename can only be None when recording into a ring or a sink");
+        return NULL;
+    }
+
+    self = (_PicamRecorder *)type->tp_alloc(type, 0);
+    if (self != NULL) {
+        fillParms(&parms);
+        Py_BEGIN_ALLOW_THREADS
+        self->recorder = startSegmentedRecorder(filename, segment_seconds, segment_bytes, container, width, height, duration, &parms, &taps);
+        Py_END_ALLOW_THREADS
+        if (self->recorder == NULL) {
+            Py_DECREF(self);
+            PyErr_SetString(PyExc_RuntimeError, "Failed to start recording");
+            return NULL;
+        }
+        Py_INCREF(analyser);
+        self->analyser = analyser;
+        Py_INCREF(ring);
+        self->ring = ring;
+        Py_INCREF(sink);
+        self->sink = sink;
+        self->chunks = chunks != 0;
+        self->duration = duration;
+    }
+    return (PyObject *)self;
+}
+
+static PyObject *PicamRecorder_wait(_PicamRecorder *self, PyObject *args) {
+    PyObject *timeout = Py_None;
+    int timeout_ms = -1;
+    int finished;
+    if (!PyArg_ParseTuple(args,"|O",&timeout)) {
+       return NULL;
+    }
+    if (timeout != Py_None) {
+        double seconds = PyFloat_AsDouble(timeout);
+        if (seconds == -1.0 && PyErr_Occurred())
+            return NULL;
+        timeout_ms = seconds > 0 ? (int)(seconds * 1000) : 0;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    finished = recorderWait(self->recorder, timeout_ms);
+    Py_END_ALLOW_THREADS
+    if (finished < 0) {
+        PyErr_SetString(PyExc_IOError, "Failed to write the recording");
+        return NULL;
+    }
+    return PyBool_FromLong(finished);
+}
+
+static PyObject *PicamRecorder_split(_PicamRecorder *self, PyObject *args) {
+    char *filename;
+    int result;
+    if (!PyArg_ParseTuple(args,"s",&filename)) {
+       return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    result = recorderSplit(self->recorder, filename);
+    Py_END_ALLOW_THREADS
+    if (result < 0)
+        return PyErr_SetFromErrnoWithFilename(PyExc_IOError, filename);
+    return PyBool_FromLong(result == 0);
+}
+
+static PyObject *PicamRecorder_takephoto(_PicamRecorder *self, PyObject *args) {
+    int quality = 85;
+    PicamFrame capture;
+    int64_t timestamp;
+    int64_t gap;
+    int lost;
+    PyObject *frame;
+    if (!PyArg_ParseTuple(args,"|i",&quality)) {
+       return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    recorderTakePhoto(self->recorder, quality, &capture, &timestamp, &gap, &lost);
+    Py_END_ALLOW_THREADS
+    self->still_gap = gap / 1000000.0;
+    self->still_lost = lost;
+    frame = frameFromPicamFrame(&capture);
+    if (frame != NULL && frame != Py_None)
+        ((_PicamFrame *)frame)->timestamp = timestamp;
+    return frame;
+}
+
+static PyObject *PicamRecorder_getstill(_PicamRecorder *self, void *closure) {
+    if (closure == NULL)
+        return PyFloat_FromDouble(self->still_gap);
+    return PyInt_FromLong(self->still_lost);
+}
+
+static PyObject *PicamRecorder_stop(_PicamRecorder *self, PyObject *args) {
+    Py_BEGIN_ALLOW_THREADS
+    stopRecorder(self->recorder);
+    Py_END_ALLOW_THREADS
+    Py_RETURN_NONE;
+}
+
+static PyObject *PicamRecorder_getstat(_PicamRecorder *self, void *closure) {
+    unsigned long frames;
+    int64_t elapsed;
+    int segment;
+    recorderStats(self->recorder, &frames, &elapsed, &segment);
+    switch ((long)closure) {
+    case 0:  return PyLong_FromUnsignedLong(frames);
+    case 1:  return PyFloat_FromDouble(elapsed / 1000000.0);
+    default: return PyInt_FromLong(segment);
+    }
+}
+
+static PyObject *PicamRecorder_getduration(_PicamRecorder *self, void *closure) {
+    return PyInt_FromLong(self->duration);
+}
+
+static int PicamRecorder_setduration(_PicamRecorder *self, PyObject *value, void *closure) {
+    long duration;
+    if (value == NULL) {
+        PyErr_SetString(PyExc_TypeError, "Cannot delete the duration");
+        return -1;
+    }
+    duration = PyInt_AsLong(value);
+    if (duration == -1 && PyErr_Occurred())
+        return -1;
+    self->duration = CLAMP(duration, 0, INT_MAX);
+    recorderSetDuration(self->recorder, self->duration);
+    return 0;
+}
+
+static PyObject *PicamRecorder_getwriter(_PicamRecorder *self, void *closure) {
+    PICAM_WRITER_STATS stats;
+    recorderWriterStats(self->recorder, &stats);
+    switch ((long)closure) {
+    case 0:  return PyInt_FromLong(stats.queued);
+    case 1:  return PyInt_FromLong(stats.peak_queued);
+    case 2:  return PyFloat_FromDouble(stats.worst_write_us / 1000000.0);
+    case 3:  return PyLong_FromUnsignedLong(stats.late_frames);
+    default: return PyLong_FromUnsignedLong(stats.dropped);
+    }
+}
+
+static PyObject *PicamRecorder_getsink(_PicamRecorder *self, void *closure) {
+    unsigned long stalls;
+    uint64_t bytes;
+    recorderSinkStats(self->recorder, &stalls, &bytes);
+    if (closure == NULL)
+        return PyLong_FromUnsignedLong(stalls);
+    return PyLong_FromUnsignedLongLong(bytes);
+}
+
+static PyObject *PicamRecorder_nextrate(_PicamRecorder *self, PyObject *args) {
+    PyObject *timeout = Py_None;
+    int timeout_ms = -1;
+    int fresh;
+    PICAM_RATE_STATS stats;
+    if (!PyArg_ParseTuple(args,"|O",&timeout)) {
+       return NULL;
+    }
+    if (timeout != Py_None) {
+        double seconds = PyFloat_AsDouble(timeout);
+        if (seconds == -1.0 && PyErr_Occurred())
+            return NULL;
+        timeout_ms = seconds > 0 ? (int)(seconds * 1000) : 0;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    fresh = recorderRateStats(self->recorder, &stats, self->rate_seen, timeout_ms);
+    Py_END_ALLOW_THREADS
+    if (!fresh) {
+        Py_RETURN_NONE;
+    }
+    self->rate_seen = stats.updates;
+    return rateDict(&stats);
+}
+
+static PyObject *PicamRecorder_applyconfig(_PicamRecorder *self, PyObject *args) {
+    _PicamConfig *config = picamConfig;
+    PicamParams parms;
+    int sent;
+    if (!PyArg_ParseTuple(args,"|O!",&PicamConfigType,&config)) {
+       return NULL;
+    }
+    paramsFromConfig(config, &parms);
+    Py_BEGIN_ALLOW_THREADS
+    sent = recorderApplyParams(self->recorder, &parms);
+    Py_END_ALLOW_THREADS
+    if (sent == -2) {
+        PyErr_SetString(PyExc_RuntimeError, "The camera rejected some of the settings, the next applyConfig() sends them again");
+        return NULL;
+    }
+    if (sent < 0) {
+        Py_RETURN_NONE;
+    }
+    return PyInt_FromLong(sent);
+}
+
+static PyObject *PicamRecorder_getrate(_PicamRecorder *self, void *closure) {
+    PICAM_RATE_STATS stats;
+    recorderRateStats(self->recorder, &stats, 0, 0);
+    if (closure == NULL)
+        return PyInt_FromLong(stats.target);
+    return PyInt_FromLong(stats.measured);
+}
+
+static void PicamRecorder_releasechunk(PyObject *owner, int slot) {
+    recorderReleaseChunk(((_PicamRecorder *)owner)->recorder, slot);
+}
+
+static PyObject *PicamRecorder_iternext(_PicamRecorder *self) {
+    PicamFrame capture;
+    int64_t timestamp = 0;
+    int slot = -1;
+    int ended;
+    _PicamFrame *frame;
+
+    if (!self->chunks) {
+        PyErr_SetString(PyExc_TypeError, "only a Recorder started with chunks=True can be iterated");
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    ended = recorderNextChunk(self->recorder, &capture, &timestamp, &slot);
+    Py_END_ALLOW_THREADS
+    if (ended) {
+        return NULL;    // StopIteration
+    }
+    frame = PyObject_New(_PicamFrame, &PicamFrameType);
+    if (frame == NULL) {
+        recorderReleaseChunk(self->recorder, slot);
+        return NULL;
+    }
+    frame->data = capture.data;
+    frame->length = capture.length;
+    frame->width = capture.width;
+    frame->height = capture.height;
+    frame->stride = capture.stride;
+    frame->format = capture.format;
+    frame->timestamp = timestamp;
+    // The chunk is the encoder's own buffer, it goes back to the encoder once the frame is garbage
+    Py_INCREF(self);
+    frame->owner = (PyObject *)self;
+    frame->slot = slot;
+    frame->release = PicamRecorder_releasechunk;
+    return (PyObject *)frame;
+}
+
+static PyTypeObject PicamStreamType;
+
+static PyObject *PicamRecorder_getanalysis(_PicamRecorder *self, void *closure);
+
+static PyMethodDef PicamRecorder_methods[] = {
+    {"wait", (PyCFunction)PicamRecorder_wait, METH_VARARGS, "wait([timeout]) blocks until the duration is recorded or the recording stops, returns False on timeout."},
+    {"split", (PyCFunction)PicamRecorder_split, METH_VARARGS, "split(filename) carries on in a new file from the next keyframe, one is requested at once. Returns False if the recording ended first."},
+    {"nextRate", (PyCFunction)PicamRecorder_nextrate, METH_VARARGS, "nextRate([timeout]) waits for the next bitrate adjustment of a recording started with bitrateRange and returns what was measured and decided as a dict, None once the recording ends or on timeout."},
+    {"applyConfig", (PyCFunction)PicamRecorder_applyconfig, METH_VARARGS, "applyConfig([config]) sends the camera settings of config, picam.config by default, that differ from what the recording has. Returns how many settings were sent, None once the recording has ended. Raises RuntimeError if the camera rejected any. Video settings only apply to new recordings."},
+    {"takePhoto", (PyCFunction)PicamRecorder_takephoto, METH_VARARGS, "takePhoto([quality]) returns a full resolution JPEG Frame taken while the video goes on, None if it failed. See stillGap."},
+    {"stop", (PyCFunction)PicamRecorder_stop, METH_VARARGS, "Stop recording, close the file and release the camera."},
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef PicamRecorder_getset[] = {
+    {"frames", (getter)PicamRecorder_getstat, NULL, "Frames recorded so far", (void *)0},
+    {"elapsed", (getter)PicamRecorder_getstat, NULL, "Seconds recorded so far, by presentation time", (void *)1},
+    {"segment", (getter)PicamRecorder_getstat, NULL, "Number of the segment being written, counted from 0", (void *)2},
+    {"duration", (getter)PicamRecorder_getduration, (setter)PicamRecorder_setduration, "Milliseconds to record, 0 until stopped. Can be changed while recording.", NULL},
+    {"queued", (getter)PicamRecorder_getwriter, NULL, "Bytes waiting for the writer thread", (void *)0},
+    {"peakQueued", (getter)PicamRecorder_getwriter, NULL, "Most bytes ever waiting for the writer thread", (void *)1},
+    {"worstWrite", (getter)PicamRecorder_getwriter, NULL, "Seconds taken by the slowest write to the file", (void *)2},
+    {"lateFrames", (getter)PicamRecorder_getwriter, NULL, "Frames that writing on the encoder thread would have lost", (void *)3},
+    {"droppedBuffers", (getter)PicamRecorder_getwriter, NULL, "Encoder buffers lost because the writer queue was full", (void *)4},
+    {"sinkStalls", (getter)PicamRecorder_getsink, NULL, "Times the encoder had to wait because the sink held every buffer", NULL},
+    {"sinkBytes", (getter)PicamRecorder_getsink, NULL, "Bytes of stream handed to the sink", (void *)1},
+    {"analysis", (getter)PicamRecorder_getanalysis, NULL, "FrameStream of the small raw frames asked for with analysis=, None without", NULL},
+    {"bitrate", (getter)PicamRecorder_getrate, NULL, "Bitrate the encoder is asked for now with bitrateRange, 0 without", NULL},
+    {"measuredBitrate", (getter)PicamRecorder_getrate, NULL, "Bits per second the encoder produced lately with bitrateRange, 0 without", (void *)1},
+    {"stillGap", (getter)PicamRecorder_getstill, NULL, "Seconds missing from the video around the last still, 0.0 if none", NULL},
+    {"stillFramesLost", (getter)PicamRecorder_getstill, NULL, "Video frames missing around the last still", (void *)1},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject PicamRecorderType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "picam.Recorder",          /*tp_name*/
+    sizeof(_PicamRecorder),    /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)PicamRecorder_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    "Recorder(filename, width, height, duration=0, analyser=None, ring=None, segmentSeconds=0, segmentBytes=0, container=None, sink=None, chunks=False, analysis=None, bitrateRange=None)\n\n"
+    "Records H264 in the background from the moment it is created. The camera\n"
+    "stays busy until stop() is called or the recorder is garbage.\n"
+    "With segmentSeconds or segmentBytes the recording rolls over to a new file\n"
+    "at the first IDR frame past either limit, filename is then a pattern like\n"
+    "'/data/cam-%05d.h264' given the segment number.\n"
+    "container is one of the PICAM_CONTAINER_* constants, by default files\n"
+    "ending in .mp4 or .m4v are fragmented MP4 and anything else raw H264.\n"
+    "sink is a descriptor or an object with fileno() (pipe, UNIX socket) the\n"
+    "raw H264 is written to straight from the encoder's buffers. With\n"
+    "chunks=True iterating the recorder yields those buffers as Frames instead,\n"
+    "each given back to the encoder once it is garbage. Either way a consumer\n"
+    "that falls behind holds back the encoder (see sinkStalls).\n"
+    "takePhoto() takes a full resolution still from the same camera without\n"
+    "stopping the video, the sensor mode switch may cost a few frames (see stillGap).\n"
+    "bitrateRange=(min, max[, minQP, maxQP[, interval ms]]) adapts the bitrate to\n"
+    "how fast the file or sink takes the stream: it drops as soon as they back up\n"
+    "and climbs back slowly once they keep up (see nextRate and bitrate).\n"
+    "analysis=(width, height[, format[, buffers]]) delivers small raw frames (up to\n"
+    "640x480) from the camera preview port as well, read through the analysis\n"
+    "FrameStream. They have buffers of their own, a slow analyser drops analysis\n"
+    "frames but never holds back the encoder.", /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    PyObject_SelfIter,         /* tp_iter */
+    (iternextfunc)PicamRecorder_iternext, /* tp_iternext */
+    PicamRecorder_methods,     /* tp_methods */
+    0,                         /* tp_members */
+    PicamRecorder_getset,      /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    0,                         /* tp_init */
+    0,                         /* tp_alloc */
+    PicamRecorder_new,         /* tp_new */
+};
+
+static PyObject * picam_recordvideowithdetails(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"filename", "width", "height", "duration", "analyser", "ring", "sink", "bitrateRange", NULL};
+    PyObject *result = Py_None;
+    int width;
+    int height;
+    int duration;
+    char *filename;
+    PyObject *analyser = Py_None;
+    PyObject *ring = Py_None;
+    PyObject *sink = Py_None;
+    PyObject *range = Py_None;
+    PicamVideoSink sink_spec;
+    PicamVideoRate rate_spec;
+    PicamVideoTaps taps;
+    PicamParams parms;
+    fillParms(&parms);
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "ziii|OOOO", kwlist, &filename, &width, &height, &duration, &analyser, &ring, &sink, &range)) {
+       return NULL;
+    }
+    if (tapsFromArgs(analyser, ring, &taps) != 0 || sinkFromArgs(sink, 0, &sink_spec) != 0)
+        return NULL;
+    if (sink != Py_None)
+        taps.sink = &sink_spec;
+    if (range != Py_None) {
+        if (rateFromArgs(range, &rate_spec) != 0)
+            return NULL;
+        taps.rate = &rate_spec;
+    }
+    if (filename == NULL && taps.ring == NULL && taps.sink == NULL) {
+        PyErr_SetString(PyExc_ValueError, "filename can only be None when recording into a ring or a sink");
+        return NULL;
+    }
+    WITHOUT_GIL(cameraLock, internelVideoWithTaps(filename, width, height, duration, &parms, &taps));
+    Py_INCREF(result);
+    return result;
+}
+
+typedef struct {
+    PyObject_HEAD
+    CameraSession *session;
+    PyThread_type_lock lock;   /// Held while the session is in use with the GIL released
+} _PicamSession;
+
+static void PicamSession_dealloc(_PicamSession* self) {
+    destroyCameraSession(self->session);
+    if (self->lock)
+        PyThread_free_lock(self->lock);
+    self->ob_type->tp_free((PyObject*)self);
+}
+
+static PyObject *PicamSession_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+    _PicamSession *self;
+
+    self = (_PicamSession *)type->tp_alloc(type, 0);
+    if (self != NULL) {
+        self->session = createCameraSession();
+        self->lock = PyThread_allocate_lock();
+        if (self->session == NULL || self->lock == NULL) {
+            Py_DECREF(self);
+            return PyErr_NoMemory();
+        }
+    }
+    return (PyObject *)self;
+}
+
+static PyObject *PicamSession_takephoto(_PicamSession *self, PyObject *args) {
+    PicamParams parms;
+    PicamFrame frame;
+    fillParms(&parms);
+    WITHOUT_GIL(self->lock, sessionFrameWithDetails(self->session, 2592, 1944, 85, PICAM_FORMAT_JPEG, &parms, &frame));
+    return frameFromPicamFrame(&frame);
+}
+
+static PyObject *PicamSession_takephotowithdetails(_PicamSession *self, PyObject *args) {
+    int width;
+    int height;
+    int quality;
+    if (!PyArg_ParseTuple(args,"iii",&width,&height,&quality)) {
+       return NULL;
+    }
+    PicamParams parms;
+    PicamFrame frame;
+    fillParms(&parms);
+    WITHOUT_GIL(self->lock, sessionFrameWithDetails(self->session, width, height, quality, PICAM_FORMAT_JPEG, &parms, &frame));
+    return frameFromPicamFrame(&frame);
+}
+
+static PyObject *PicamSession_takephotowiththumbnail(_PicamSession *self, PyObject *args) {
+    int width;
+    int height;
+    int quality;
+    MMAL_PARAM_THUMBNAIL_CONFIG_T config;
+    if (thumbnailFromArgs(args, &width, &height, &quality, &config) != 0) {
+       return NULL;
+    }
+    PicamParams parms;
+    PicamFrame frame;
+    PicamFrame thumbnail;
+    fillParms(&parms);
+    WITHOUT_GIL(self->lock, sessionPhotoWithThumbnail(self->session, width, height, quality, &config, &parms, &frame, &thumbnail));
+    return thumbnailPairFromFrames(&frame, &thumbnail);
+}
+
+static PyObject *PicamSession_takergbphotowithdetails(_PicamSession *self, PyObject *args) {
+    int width;
+    int height;
+    if (!PyArg_ParseTuple(args,"ii",&width,&height)) {
+       return NULL;
+    }
+    PicamParams parms;
+    PicamFrame frame;
+    fillParms(&parms);
+    WITHOUT_GIL(self->lock, sessionRawFrameWithDetails(self->session, width, height, PICAM_FORMAT_RGB24, &parms, &frame));
+    return rgbListFromFrame(&frame);
+}
+
+static PyObject *PicamSession_takerawphotowithdetails(_PicamSession *self, PyObject *args) {
+    int width;
+    int height;
+    int format;
+    if (!PyArg_ParseTuple(args,"iii",&width,&height,&format)) {
+       return NULL;
+    }
+    if (format < PICAM_FORMAT_RGB24 || format > PICAM_FORMAT_LUMA) {
+       PyErr_SetString(PyExc_ValueError, "format must be one of PICAM_FORMAT_RGB24, PICAM_FORMAT_BGR24, PICAM_FORMAT_I420 or PICAM_FORMAT_LUMA");
+       return NULL;
+    }
+    PicamParams parms;
+    PicamFrame frame;
+    fillParms(&parms);
+    WITHOUT_GIL(self->lock, sessionRawFrameWithDetails(self->session, width, height, format, &parms, &frame));
+    return frameFromPicamFrame(&frame);
+}
+
+static PyObject *PicamSession_takeburst(_PicamSession *self, PyObject *args) {
+    int count;
+    int width;
+    int height;
+    int quality;
+    int interval = 0;
+    if (!PyArg_ParseTuple(args,"iiii|i",&count,&width,&height,&quality,&interval)) {
+       return NULL;
+    }
+    if (count <= 0) {
+       PyErr_SetString(PyExc_ValueError, "count must be positive");
+       return NULL;
+    }
+    PicamParams parms;
+    PicamFrame *frames = calloc(count, sizeof(PicamFrame));
+    int64_t *timestamps = calloc(count, sizeof(int64_t));
+    int captured = 0;
+    if (frames == NULL || timestamps == NULL) {
+        free(frames);
+        free(timestamps);
+        return PyErr_NoMemory();
+    }
+    fillParms(&parms);
+    WITHOUT_GIL(self->lock, captured = sessionBurstWithDetails(self->session, count, width, height, quality, interval, &parms, frames, timestamps));
+    return burstListFromFrames(frames, timestamps, count, captured);
+}
+
+static PyObject *PicamSession_close(_PicamSession *self, PyObject *args) {
+    WITHOUT_GIL(self->lock, destroyCameraSession(self->session); self->session = createCameraSession());
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef PicamSession_methods[] = {
+    {"takePhoto", (PyCFunction)PicamSession_takephoto, METH_VARARGS, "Take a basic photo using the session camera."},
+    {"takePhotoWithDetails", (PyCFunction)PicamSession_takephotowithdetails, METH_VARARGS, "Take a photo with width, height and quality using the session camera."},
+    {"takePhotoWithThumbnail", (PyCFunction)PicamSession_takephotowiththumbnail, METH_VARARGS, "Take a JPEG with width, height, quality and the thumbnail thumbWidth, thumbHeight[, thumbQuality] the encoder embeds in it, returns (Frame, thumbnail Frame or None)."},
+    {"takeRGBPhotoWithDetails", (PyCFunction)PicamSession_takergbphotowithdetails, METH_VARARGS, "Take a photo and return as RGB array using the session camera."},
+    {"takeRawPhotoWithDetails", (PyCFunction)PicamSession_takerawphotowithdetails, METH_VARARGS, "Take a photo with width, height and PICAM_FORMAT_* as packed pixels using the session camera."},
+    {"takeBurst", (PyCFunction)PicamSession_takeburst, METH_VARARGS, "Take count JPEGs with width, height, quality and optional interval (ms), returns [(Frame, timestamp us), ...]."},
+    {"close", (PyCFunction)PicamSession_close, METH_VARARGS, "Release the camera, it is set up again by the next capture."},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject PicamSessionType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "picam.CameraSession",     /*tp_name*/
+    sizeof(_PicamSession),     /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)PicamSession_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /*tp_flags*/
+    "Camera kept set up between captures, rebuilt only when the size or encoding changes", /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    0,                         /* tp_iter */
+    0,                         /* tp_iternext */
+    PicamSession_methods,      /* tp_methods */
+    0,                         /* tp_members */
+    0,                         /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    0,                         /* tp_init */
+    0,                         /* tp_alloc */
+    PicamSession_new,          /* tp_new */
+};
+
+typedef struct {
+    PyObject_HEAD
+    FrameStream *stream;
+    PyObject *recorder;        /// Recorder the stream belongs to, NULL if the stream has the camera to itself
+} _PicamStream;
+
+static void PicamStream_dealloc(_PicamStream* self) {
+    // Every frame holds a reference, so none of the slots are lent out any more
+    if (self->recorder) {
+        Py_DECREF(self->recorder);
+    } else if (self->stream) {
+        Py_BEGIN_ALLOW_THREADS
+        destroyFrameStream(self->stream);
+        Py_END_ALLOW_THREADS
+    }
+    self->ob_type->tp_free((PyObject*)self);
+}
+
+static PyObject *PicamStream_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"width", "height", "framerate", "format", "buffers", NULL};
+    _PicamStream *self;
+    int width;
+    int height;
+    int framerate = 30;
+    int format = PICAM_FORMAT_I420;
+    int buffers = 4;
+    PicamParams parms;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "ii|iii", kwlist, &width, &height, &framerate, &format, &buffers)) {
+       return NULL;
+    }
+    if (format < PICAM_FORMAT_RGB24 || format > PICAM_FORMAT_LUMA) {
+       PyErr_SetString(PyExc_ValueError, "format must be one of PICAM_FORMAT_RGB24, PICAM_FORMAT_BGR24, PICAM_FORMAT_I420 or PICAM_FORMAT_LUMA");
+       return NULL;
+    }
+    if (buffers < 1 || buffers > PICAM_MAX_FRAME_SLOTS) {
+       PyErr_Format(PyExc_ValueError, "buffers must be from 1 to %d", PICAM_MAX_FRAME_SLOTS);
+       return NULL;
+    }
+
+    self = (_PicamStream *)type->tp_alloc(type, 0);
+    if (self != NULL) {
+        fillParms(&parms);
+        Py_BEGIN_ALLOW_THREADS
+        self->stream = startFrameStream(width, height, framerate, format, buffers, &parms);
+        Py_END_ALLOW_THREADS
+        if (self->stream == NULL) {
+            Py_DECREF(self);
+            PyErr_SetString(PyExc_RuntimeError, "Failed to start the camera video port");
+            return NULL;
+        }
+    }
+    return (PyObject *)self;
+}
+
+static void PicamStream_releaseslot(PyObject *owner, int slot) {
+    frameStreamRelease(((_PicamStream *)owner)->stream, slot);
+}
+
+static PyObject *PicamStream_iternext(_PicamStream *self) {
+    PicamFrame capture;
+    int64_t timestamp = 0;
+    int slot = -1;
+    int stopped;
+    _PicamFrame *frame;
+
+    Py_BEGIN_ALLOW_THREADS
+    stopped = frameStreamNext(self->stream, &capture, &timestamp, &slot);
+    Py_END_ALLOW_THREADS
+    if (stopped) {
+        return NULL;    // StopIteration
+    }
+    frame = PyObject_New(_PicamFrame, &PicamFrameType);
+    if (frame == NULL) {
+        frameStreamRelease(self->stream, slot);
+        return NULL;
+    }
+    frame->data = capture.data;
+    frame->length = capture.length;
+    frame->width = capture.width;
+    frame->height = capture.height;
+    frame->stride = capture.stride;
+    frame->format = capture.format;
+    frame->timestamp = timestamp;
+    // The frame points into a slot of the stream until it is garbage
+    Py_INCREF(self);
+    frame->owner = (PyObject *)self;
+    frame->slot = slot;
+    frame->release = PicamStream_releaseslot;
+    return (PyObject *)frame;
+}
+
+static PyObject *PicamStream_stop(_PicamStream *self, PyObject *args) {
+    Py_BEGIN_ALLOW_THREADS
+    if (self->recorder)
+        recorderStopAnalysis(((_PicamRecorder *)self->recorder)->recorder);
+    else
+        stopFrameStream(self->stream);
+    Py_END_ALLOW_THREADS
+    Py_RETURN_NONE;
+}
+
+static PyObject *PicamStream_getdelivered(_PicamStream *self, void *closure) {
+    unsigned long delivered, dropped;
+    frameStreamStats(self->stream, &delivered, &dropped);
+    return PyLong_FromUnsignedLong(delivered);
+}
+
+static PyObject *PicamStream_getdropped(_PicamStream *self, void *closure) {
+    unsigned long delivered, dropped;
+    frameStreamStats(self->stream, &delivered, &dropped);
+    return PyLong_FromUnsignedLong(dropped);
+}
+
+static PyMethodDef PicamStream_methods[] = {
+    {"stop", (PyCFunction)PicamStream_stop, METH_VARARGS, "Stop the camera, iteration ends once the waiting frames are read. A recording's analysis stream stops on its own, the video goes on."},
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef PicamStream_getset[] = {
+    {"delivered", (getter)PicamStream_getdelivered, NULL, "Frames handed out so far", NULL},
+    {"dropped", (getter)PicamStream_getdropped, NULL, "Frames lost because every buffer was waiting or still referenced", NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject PicamStreamType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "picam.FrameStream",       /*tp_name*/
+    sizeof(_PicamStream),      /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)PicamStream_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_ITER, /*tp_flags*/
+    "FrameStream(width, height, framerate=30, format=PICAM_FORMAT_I420, buffers=4)\n\n"
+    "Iterates over frames from the camera video port. Each Frame borrows one of\n"
+    "the buffers until it is garbage. When the reader falls behind, the oldest\n"
+    "waiting frame is dropped.", /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    PyObject_SelfIter,         /* tp_iter */
+    (iternextfunc)PicamStream_iternext, /* tp_iternext */
+    PicamStream_methods,       /* tp_methods */
+    0,                         /* tp_members */
+    PicamStream_getset,        /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    0,                         /* tp_init */
+    0,                         /* tp_alloc */
+    PicamStream_new,           /* tp_new */
+};
+
+static PyObject *PicamRecorder_getanalysis(_PicamRecorder *self, void *closure) {
+    FrameStream *stream = recorderAnalysisStream(self->recorder);
+    _PicamStream *analysis;
+    if (stream == NULL) {
+        Py_RETURN_NONE;
+    }
+    // Borrows the recorder's stream and keeps the recorder alive while it is read
+    analysis = PyObject_New(_PicamStream, &PicamStreamType);
+    if (analysis == NULL)
+        return NULL;
+    analysis->stream = stream;
+    Py_INCREF(self);
+    analysis->recorder = (PyObject *)self;
+    return (PyObject *)analysis;
+}
+
+typedef struct {
+    PyObject_HEAD
+    MjpegServer *server;
+} _PicamMjpeg;
+
+static void PicamMjpeg_dealloc(_PicamMjpeg* self) {
+    if (self->server) {
+        Py_BEGIN_ALLOW_THREADS
+        destroyMjpegServer(self->server);
+        Py_END_ALLOW_THREADS
+    }
+    self->ob_type->tp_free((PyObject*)self);
+}
+
+static PyObject *PicamMjpeg_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"port", "width", "height", "quality", "framerate", "address", NULL};
+    _PicamMjpeg *self;
+    int port = 8080;
+    int width = 640;
+    int height = 480;
+    int quality = 80;
+    int framerate = 15;
+    char *address = "127.0.0.1";
+    int error = 0;
+    PicamParams parms;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iiiiiz", kwlist, &port, &width, &height, &quality, &framerate, &address)) {
+       return NULL;
+    }
+    if (port < 0 || port > 65535) {
+       PyErr_SetString(PyExc_ValueError, "port must be between 0 and 65535");
+       return NULL;
+    }
+
+    self = (_PicamMjpeg *)type->tp_alloc(type, 0);
+    if (self != NULL) {
+        fillParms(&parms);
+        Py_BEGIN_ALLOW_THREADS
+        self->server = startMjpegServer(address, port, width, height, quality, framerate, &parms, &error);
+        Py_END_ALLOW_THREADS
+        if (self->server == NULL) {
+            Py_DECREF(self);
+            errno = error;
+            return PyErr_SetFromErrno(PyExc_IOError);
+        }
+    }
+    return (PyObject *)self;
+}
+
+static PyObject *PicamMjpeg_stop(_PicamMjpeg *self, PyObject *args) {
+    Py_BEGIN_ALLOW_THREADS
+    stopMjpegServer(self->server);
+    Py_END_ALLOW_THREADS
+    Py_RETURN_NONE;
+}
+
+static PyObject *PicamMjpeg_getport(_PicamMjpeg *self, void *closure) {
+    return PyInt_FromLong(mjpegServerPort(self->server));
+}
+
+static PyObject *PicamMjpeg_getstat(_PicamMjpeg *self, void *closure) {
+    PICAM_HTTP_STATS stats;
+    mjpegServerStats(self->server, &stats);
+    switch ((long)closure) {
+        case 0: return PyInt_FromLong(stats.clients);
+        case 1: return PyLong_FromUnsignedLong(stats.published);
+        case 2: return PyLong_FromUnsignedLong(stats.sent);
+        default: return PyLong_FromUnsignedLong(stats.dropped);
+    }
+}
+
+static PyMethodDef PicamMjpeg_methods[] = {
+    {"stop", (PyCFunction)PicamMjpeg_stop, METH_VARARGS, "Stop the camera and close every client"},
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef PicamMjpeg_getset[] = {
+    {"port", (getter)PicamMjpeg_getport, NULL, "Port listened on, the one picked when port=0 was asked for", NULL},
+    {"clients", (getter)PicamMjpeg_getstat, NULL, "Clients receiving the stream now", (void *)0},
+    {"published", (getter)PicamMjpeg_getstat, NULL, "JPEGs the encoder has made", (void *)1},
+    {"sent", (getter)PicamMjpeg_getstat, NULL, "JPEGs written out in full, summed over the clients", (void *)2},
+    {"dropped", (getter)PicamMjpeg_getstat, NULL, "JPEGs clients fell too far behind to get, summed over the clients", (void *)3},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject PicamMjpegType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "picam.MJPEGServer",       /*tp_name*/
+    sizeof(_PicamMjpeg),       /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)PicamMjpeg_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    "MJPEGServer(port=8080, width=640, height=480, quality=80, framerate=15, address=\"127.0.0.1\")\n\n"
+    "Encodes the camera video port to JPEG continuously and serves it as\n"
+    "multipart/x-mixed-replace to every HTTP client that connects, from a thread\n"
+    "of its own. A client that falls behind loses its oldest frames and never\n"
+    "holds back the others. Pass address=None to listen on every interface.", /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    0,                         /* tp_iter */
+    0,                         /* tp_iternext */
+    PicamMjpeg_methods,        /* tp_methods */
+    0,                         /* tp_members */
+    PicamMjpeg_getset,         /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    0,                         /* tp_init */
+    0,                         /* tp_alloc */
+    PicamMjpeg_new,            /* tp_new */
+};
+
+typedef struct {
+    PyObject_HEAD
+    PICAM_MOTION motion;
+    int format;
+    PyThread_type_lock lock;   /// Held while the model is updated with the GIL released
+} _PicamMotion;
+
+static void PicamMotion_dealloc(_PicamMotion* self) {
+    picam_motion_free(&self->motion);
+    if (self->lock)
+        PyThread_free_lock(self->lock);
+    self->ob_type->tp_free((PyObject*)self);
+}
+
+static PyObject *PicamMotion_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"width", "height", "format", "threshold", "rate", "columns", "rows", NULL};
+    _PicamMotion *self;
+    int width;
+    int height;
+    int format = PICAM_FORMAT_LUMA;
+    int threshold = 15;
+    int rate = 4;
+    int columns = 8;
+    int rows = 6;
+    int bpp;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "ii|iiiii", kwlist, &width, &height, &format, &threshold, &rate, &columns, &rows)) {
+       return NULL;
+    }
+    if (format == PICAM_FORMAT_RGB24 || format == PICAM_FORMAT_BGR24) {
+        bpp = 3;
+    } else if (format == PICAM_FORMAT_LUMA || format == PICAM_FORMAT_I420) {
+        bpp = 1;    // the Y plane
+    } else {
+        PyErr_SetString(PyExc_ValueError, "format must be one of PICAM_FORMAT_RGB24, PICAM_FORMAT_BGR24, PICAM_FORMAT_I420 or PICAM_FORMAT_LUMA");
+        return NULL;
+    }
+    if (width <= 0 || height <= 0) {
+        PyErr_SetString(PyExc_ValueError, "width and height must be positive");
+        return NULL;
+    }
+    if (threshold < 0 || threshold > 255) {
+        PyErr_Format(PyExc_ValueError, "threshold must be from 0 to 255, not %d", threshold);
+        return NULL;
+    }
+
+    self = (_PicamMotion *)type->tp_alloc(type, 0);
+    if (self != NULL) {
+        self->format = format;
+        self->lock = PyThread_allocate_lock();
+        if (self->lock == NULL || picam_motion_init(&self->motion, width, height, bpp, threshold, rate, columns, rows) != 0) {
+            Py_DECREF(self);
+            return PyErr_NoMemory();
+        }
+    }
+    return (PyObject *)self;
+}
+
+static PyObject *PicamMotion_update(_PicamMotion *self, PyObject *args) {
+    PyObject *source;
+    Py_buffer view;
+    int stride = 0;
+    long changed;
+    long needed;
+    if (!PyArg_ParseTuple(args,"O|i",&source,&stride)) {
+       return NULL;
+    }
+    if (PyObject_TypeCheck(source, &PicamFrameType)) {
+        _PicamFrame *frame = (_PicamFrame *)source;
+        if (frame->width != self->motion.width || frame->height != self->motion.height) {
+            PyErr_SetString(PyExc_ValueError, "frame size does not match the detector");
+            return NULL;
+        }
+        if (stride == 0)
+            stride = frame->stride;
+    }
+    if (stride == 0)
+        stride = self->motion.width * self->motion.bpp;
+    if (PyObject_GetBuffer(source, &view, PyBUF_SIMPLE) != 0)
+        return NULL;
+    needed = (long)(self->motion.height - 1) * stride + (long)self->motion.width * self->motion.bpp;
+    if (stride < self->motion.width * self->motion.bpp || view.len < needed) {
+        PyBuffer_Release(&view);
+        PyErr_SetString(PyExc_ValueError, "buffer is smaller than the detector width, height and stride describe");
+        return NULL;
+    }
+    WITHOUT_GIL(self->lock, changed = picam_motion_update(&self->motion, view.buf, stride));
+    PyBuffer_Release(&view);
+    return PyInt_FromLong(changed);
+}
+
+static PyObject *PicamMotion_reset(_PicamMotion *self, PyObject *args) {
+    WITHOUT_GIL(self->lock, picam_motion_reset(&self->motion));
+    Py_RETURN_NONE;
+}
+
+static PyObject *PicamMotion_getcells(_PicamMotion *self, void *closure) {
+    int count = self->motion.columns * self->motion.rows;
+    PyObject *cells = PyTuple_New(count);
+    int i;
+    if (cells == NULL)
+        return NULL;
+    for (i=0;i<count;i++)
+        PyTuple_SET_ITEM(cells, i, PyInt_FromLong(self->motion.cells[i]));
+    return cells;
+}
+
+static PyObject *PicamMotion_getmask(_PicamMotion *self, void *closure) {
+    _PicamFrame *frame = PyObject_New(_PicamFrame, &PicamFrameType);
+    if (frame == NULL)
+        return NULL;
+    // A view of the detector's own mask, rewritten by the next update
+    frame->data = self->motion.mask;
+    frame->length = (Py_ssize_t)self->motion.width * self->motion.height;
+    frame->width = self->motion.width;
+    frame->height = self->motion.height;
+    frame->stride = self->motion.width;
+    frame->format = PICAM_FORMAT_LUMA;
+    frame->timestamp = 0;
+    Py_INCREF(self);
+    frame->owner = (PyObject *)self;
+    frame->slot = 0;
+    frame->release = NULL;
+    return (PyObject *)frame;
+}
+
+static PyObject *PicamMotion_getchanged(_PicamMotion *self, void *closure) {
+    return PyInt_FromLong(self->motion.changed);
+}
+
+static PyObject *PicamMotion_getframes(_PicamMotion *self, void *closure) {
+    return PyLong_FromUnsignedLong(self->motion.frames);
+}
+
+static PyObject *PicamMotion_getthreshold(_PicamMotion *self, void *closure) {
+    return PyInt_FromLong(self->motion.threshold);
+}
+
+static int PicamMotion_setthreshold(_PicamMotion *self, PyObject *value, void *closure) {
+    long threshold;
+    if (value == NULL) {
+        PyErr_SetString(PyExc_TypeError, "cannot delete threshold");
+        return -1;
+    }
+    threshold = PyInt_AsLong(value);
+    if (threshold == -1 && PyErr_Occurred())
+        return -1;
+    if (threshold < 0 || threshold > 255) {
+        PyErr_Format(PyExc_ValueError, "threshold must be from 0 to 255, not %ld", threshold);
+        return -1;
+    }
+    // An update running without the GIL reads it once per frame
+    __atomic_store_n(&self->motion.threshold, (int)threshold, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static PyMethodDef PicamMotion_methods[] = {
+    {"update", (PyCFunction)PicamMotion_update, METH_VARARGS, "Compare a frame (Frame or buffer[, stride]) with the background and blend it in, returns the number of changed pixels."},
+    {"reset", (PyCFunction)PicamMotion_reset, METH_VARARGS, "Forget the background, the next frame seeds it again."},
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef PicamMotion_getset[] = {
+    {"cells", (getter)PicamMotion_getcells, NULL, "Changed pixels per cell of the columns x rows grid in the last frame, row major", NULL},
+    {"mask", (getter)PicamMotion_getmask, NULL, "Luma Frame viewing the detector mask, 255 where the last frame showed motion", NULL},
+    {"changed", (getter)PicamMotion_getchanged, NULL, "Changed pixels in the last frame", NULL},
+    {"frames", (getter)PicamMotion_getframes, NULL, "Frames seen since the background was seeded", NULL},
+    {"threshold", (getter)PicamMotion_getthreshold, (setter)PicamMotion_setthreshold, "Largest difference from the background that is not motion (0-255)", NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyMemberDef PicamMotion_members[] = {
+    {"columns", T_INT, offsetof(_PicamMotion, motion.columns), READONLY, "Activity cells across"},
+    {"rows", T_INT, offsetof(_PicamMotion, motion.rows), READONLY, "Activity cells down"},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject PicamMotionType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "picam.MotionDetector",    /*tp_name*/
+    sizeof(_PicamMotion),      /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)PicamMotion_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    "MotionDetector(width, height, format=PICAM_FORMAT_LUMA, threshold=15, rate=4, columns=8, rows=6)\n\n"
+    "Keeps an exponential running average of the frames (each frame moves it\n"
+    "1/2**rate of the way) and reports the pixels that differ from it.", /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    0,                         /* tp_iter */
+    0,                         /* tp_iternext */
+    PicamMotion_methods,       /* tp_methods */
+    PicamMotion_members,       /* tp_members */
+    PicamMotion_getset,        /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    0,                         /* tp_init */
+    0,                         /* tp_alloc */
+    PicamMotion_new,           /* tp_new */
+};
+
+static PyMethodDef PiCamMethods[] = {
+    
+    {"takePhoto",  picam_takephoto, METH_VARARGS, "Take a basic photo."},  
+    {"takePhotoWithDetails",  picam_takephotowithdetails, METH_VARARGS, "Take a  photo with width, height and quality."},    
+    {"takePhotoWithThumbnail",  picam_takephotowiththumbnail, METH_VARARGS, "Take a JPEG with width, height, quality and the thumbnail thumbWidth, thumbHeight[, thumbQuality] the encoder embeds in it, returns (Frame, thumbnail Frame or None)."}, 
+    {"takeRGBPhotoWithDetails",  picam_takergbphotowithdetails, METH_VARARGS, "Take a photo and return as RGB array."}, 
+    {"takeRawPhotoWithDetails",  picam_takerawphotowithdetails, METH_VARARGS, "Take a photo with width, height and PICAM_FORMAT_* as packed pixels."}, 
+    {"takeBurst",  picam_takeburst, METH_VARARGS, "Take count JPEGs with width, height, quality and optional interval (ms), returns [(Frame, timestamp us), ...]."}, 
+    {"saveImage",  picam_saveimage, METH_VARARGS, "saveImage(pixels, filename, width, height[, stride, format]) writes packed pixels, or the list from takeRGBPhotoWithDetails, as .ppm, .pgm, .bmp or .png."}, 
+    {"packRGBList",  picam_packrgblist, METH_VARARGS, "packRGBList(pixels, width, height) turns the list from takeRGBPhotoWithDetails into top down RGB24 bytes."}, 
+    {"captureBatch",  picam_capturebatch, METH_VARARGS, "captureBatch(count, format, width, height[, framerate]) takes count raw video frames in one call, returns a Batch or None if the camera failed."}, 
+    {"difference",  picam_difference, METH_VARARGS, "Difference between 2 RGB arrays."}, 
+    {"differenceBuffers",  picam_differencebuffers, METH_VARARGS, "Changed pixels between 2 packed frames (a, b, width, height, stride, format, threshold[, mask]), returns (count, mask)."}, 
+    {"differenceImplementation",  picam_differenceimplementation, METH_VARARGS, "Name of the SIMD path used by differenceBuffers, or force one (scalar, sse2, avx2, neon, None for the best)."}, 
+    {"recordVideoWithDetails",  (PyCFunction)picam_recordvideowithdetails, METH_VARARGS | METH_KEYWORDS, "Record a video with width, height, duration and an optional VectorAnalyser, H264Ring, sink and bitrateRange."}, 
+    {"listTest", picam_listtest,  METH_VARARGS, "Test returning a list"}, 
+    {NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+void setupExposureConstants(PyObject *module_dict) {   
+    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMODE_OFF);
+    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMODE_AUTO);
+    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMODE_NIGHT);
+    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMODE_NIGHTPREVIEW);
+    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMODE_BACKLIGHT);
+    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMODE_SPOTLIGHT);
+    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMODE_SPORTS);
+    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMODE_SNOW);
+    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMODE_BEACH);
+    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMODE_VERYLONG);
+    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMODE_FIXEDFPS);
+    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMODE_ANTISHAKE);
+    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMODE_FIREWORKS);
+}
+void setupAWBConstants(PyObject *module_dict) {   
+    DICT_SET(module_dict,MMAL_PARAM_AWBMODE_OFF);
+    DICT_SET(module_dict,MMAL_PARAM_AWBMODE_AUTO);
+    DICT_SET(module_dict,MMAL_PARAM_AWBMODE_SUNLIGHT);
+    DICT_SET(module_dict,MMAL_PARAM_AWBMODE_CLOUDY);
+    DICT_SET(module_dict,MMAL_PARAM_AWBMODE_SHADE);
+    DICT_SET(module_dict,MMAL_PARAM_AWBMODE_TUNGSTEN);
+    DICT_SET(module_dict,MMAL_PARAM_AWBMODE_FLUORESCENT);
+    DICT_SET(module_dict,MMAL_PARAM_AWBMODE_INCANDESCENT);
+    DICT_SET(module_dict,MMAL_PARAM_AWBMODE_FLASH);
+    DICT_SET(module_dict,MMAL_PARAM_AWBMODE_HORIZON);   
+}
+
+void setupMeteringConstants(PyObject *module_dict) {   
+    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMETERINGMODE_AVERAGE);
+    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMETERINGMODE_SPOT);
+    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMETERINGMODE_BACKLIT);
+    DICT_SET(module_dict,MMAL_PARAM_EXPOSUREMETERINGMODE_MATRIX);     
+}
+void setupImageFXConstants(PyObject *module_dict) {    
+    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_NONE);
+    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_NEGATIVE);
+    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_SOLARIZE);
+    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_SKETCH);
+    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_DENOISE);
+    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_EMBOSS);
+    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_OILPAINT);
+    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_HATCH);
+    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_GPEN);
+    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_PASTEL);
+    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_WATERCOLOUR);
+    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_BLUR);
+    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_SATURATION);
+    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_COLOURSWAP);
+    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_WASHEDOUT);
+    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_POSTERISE);
+    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_COLOURPOINT);
+    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_COLOURBALANCE);
+    DICT_SET(module_dict,MMAL_PARAM_IMAGEFX_CARTOON);  
+}
+void setupVideoProfileConstants(PyObject *module_dict) {   
+    DICT_SET(module_dict,MMAL_VIDEO_PROFILE_H264_BASELINE);
+    DICT_SET(module_dict,MMAL_VIDEO_PROFILE_H264_MAIN);
+    DICT_SET(module_dict,MMAL_VIDEO_PROFILE_H264_HIGH);   
+}
+
+void setupFormatConstants(PyObject *module_dict) {
+    DICT_SET(module_dict,PICAM_FORMAT_JPEG);
+    DICT_SET(module_dict,PICAM_FORMAT_BMP);
+    DICT_SET(module_dict,PICAM_FORMAT_RGB24);
+    DICT_SET(module_dict,PICAM_FORMAT_BGR24);
+    DICT_SET(module_dict,PICAM_FORMAT_I420);
+    DICT_SET(module_dict,PICAM_FORMAT_LUMA);
+    DICT_SET(module_dict,PICAM_FORMAT_H264);
+    DICT_SET(module_dict,PICAM_CONTAINER_H264);
+    DICT_SET(module_dict,PICAM_CONTAINER_MP4);
+    DICT_SET(module_dict,PICAM_CONTAINER_FMP4);
+}
+
+void setupDifferenceConstants(PyObject *module_dict) {
+    DICT_SET(module_dict,PICAM_DIFF_MASK_NONE);
+    DICT_SET(module_dict,PICAM_DIFF_MASK_BYTES);
+    DICT_SET(module_dict,PICAM_DIFF_MASK_BITS);
+}
+
+PyMODINIT_FUNC
+init_picam(void)
 {
     PyObject *module;  
     
+    PyEval_InitThreads();
+    cameraLock = PyThread_allocate_lock();
+    if (cameraLock == NULL)
+        return;
     if (PyType_Ready(&PicamConfigType) < 0)
         return;
+    if (PyType_Ready(&PicamSessionType) < 0)
+        return;
+    if (PyType_Ready(&PicamFrameType) < 0)
+        return;
+    if (PyType_Ready(&PicamBatchType) < 0)
+        return;
+    if (PyType_Ready(&PicamStreamType) < 0)
+        return;
+    if (PyType_Ready(&PicamMotionType) < 0)
+        return;
+    if (PyType_Ready(&PicamVectorsType) < 0)
+        return;
+    if (PyType_Ready(&PicamRingType) < 0)
+        return;
+    if (PyType_Ready(&PicamRecorderType) < 0)
+        return;
+    if (PyType_Ready(&PicamMjpegType) < 0)
+        return;
     module = Py_InitModule("_picam", PiCamMethods);         
     setupExposureConstants(module);    
     setupAWBConstants(module);
     setupMeteringConstants(module);
     setupImageFXConstants(module);
     setupVideoProfileConstants(module);
+    setupFormatConstants(module);
+    setupDifferenceConstants(module);
     picamConfig = picam_newconfig();
     Py_INCREF(picamConfig);
     PyModule_AddObject(module, "config", (PyObject *)picamConfig); 
+    Py_INCREF(&PicamConfigType);
+    PyModule_AddObject(module, "Config", (PyObject *)&PicamConfigType);
+    Py_INCREF(&PicamFrameType);
+    PyModule_AddObject(module, "Frame", (PyObject *)&PicamFrameType);
+    Py_INCREF(&PicamBatchType);
+    PyModule_AddObject(module, "Batch", (PyObject *)&PicamBatchType);
+    Py_INCREF(&PicamSessionType);
+    PyModule_AddObject(module, "CameraSession", (PyObject *)&PicamSessionType);
+    Py_INCREF(&PicamStreamType);
+    PyModule_AddObject(module, "FrameStream", (PyObject *)&PicamStreamType);
+    Py_INCREF(&PicamMotionType);
+    PyModule_AddObject(module, "MotionDetector", (PyObject *)&PicamMotionType);
+    Py_INCREF(&PicamVectorsType);
+    PyModule_AddObject(module, "VectorAnalyser", (PyObject *)&PicamVectorsType);
+    Py_INCREF(&PicamRingType);
+    PyModule_AddObject(module, "H264Ring", (PyObject *)&PicamRingType);
+    Py_INCREF(&PicamRecorderType);
+    PyModule_AddObject(module, "Recorder", (PyObject *)&PicamRecorderType);
+    Py_INCREF(&PicamMjpegType);
+    PyModule_AddObject(module, "MJPEGServer", (PyObject *)&PicamMjpegType);
     //http://docs.python.org/2/extending/newtypes.html
 }
@@ -0,0 +1,134 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "picammotion.h"
+
+/// Pixels showing motion are blended into the background this many times more slowly
+#define PICAM_MOTION_FOREGROUND_SHIFT 3
+
+/**
+ * Allocate the background and mask, the first frame seeds the background
+ *
+ * @param motion Detector to set up
+ * @param width Width of the frames in pixels
+ * @param height Height of the frames in rows
+ * @param bpp Bytes per pixel, 1 for luma, 3 for RGB24/BGR24
+ * @param threshold Largest difference from the background that is not motion (0-255)
+ * @param shift Learning rate, each frame moves the background 1/2^shift of the way towards it
+ * @param columns Number of activity cells across
+ * @param rows Number of activity cells down
+ * @return 0 if successful, non-zero if out of memory
+ */
+int picam_motion_init(PICAM_MOTION *motion, int width, int height, int bpp, int threshold, int shift, int columns, int rows)
+{
+   memset(motion, 0, sizeof(*motion));
+   if (columns > width)
+      columns = width;
+   if (rows > height)
+      rows = height;
+   motion->width = width;
+   motion->height = height;
+   motion->bpp = bpp;
+   motion->threshold = threshold < 0 ? 0 : threshold > 255 ? 255 : threshold;
+   motion->shift = shift < 0 ? 0 : shift > 8 ? 8 : shift;
+   motion->columns = columns < 1 ? 1 : columns;
+   motion->rows = rows < 1 ? 1 : rows;
+   motion->background = malloc((size_t)width * height * bpp * sizeof(uint16_t));
+   motion->mask = calloc((size_t)width * height, 1);
+   motion->cells = calloc((size_t)motion->columns * motion->rows, sizeof(uint32_t));
+   if (!motion->background || !motion->mask || !motion->cells) {
+      picam_motion_free(motion);
+      return 1;
+   }
+   return 0;
+}
+
+/**
+ * Forget the background, the next frame seeds it again
+ */
+void picam_motion_reset(PICAM_MOTION *motion)
+{
+   motion->frames = 0;
+   motion->changed = 0;
+   memset(motion->mask, 0, (size_t)motion->width * motion->height);
+   memset(motion->cells, 0, (size_t)motion->columns * motion->rows * sizeof(uint32_t));
+}
+
+/**
+ * Compare a frame with the background, then blend it in. A pixel shows motion
+ * when any of its bytes is more than threshold away from the background.
+ * Those pixels are blended in more slowly, so an object that stops is only
+ * absorbed gradually and a moving one leaves no trail.
+ *
+ * @param motion Detector
+ * @param frame Packed pixels, same size and bytes per pixel as the detector
+ * @param stride Bytes from one row of frame to the next
+ * @return Number of pixels showing motion, 0 for the frame that seeds the background
+ */
+long picam_motion_update(PICAM_MOTION *motion, const uint8_t *frame, int stride)
+{
+   const int bpp = motion->bpp;
+   const int threshold = motion->threshold;
+   const int fast = motion->shift;
+   const int slow = motion->shift + PICAM_MOTION_FOREGROUND_SHIFT;
+   long changed = 0;
+   int x, y, c;
+
+   memset(motion->cells, 0, (size_t)motion->columns * motion->rows * sizeof(uint32_t));
+
+   if (motion->frames == 0) {
+      for (y = 0; y < motion->height; y++) {
+         const uint8_t *row = frame + (long)y * stride;
+         uint16_t *background = motion->background + (long)y * motion->width * bpp;
+         for (x = 0; x < motion->width * bpp; x++)
+            background[x] = row[x] << 8;
+      }
+      memset(motion->mask, 0, (size_t)motion->width * motion->height);
+      motion->frames = 1;
+      motion->changed = 0;
+      return 0;
+   }
+
+   for (y = 0; y < motion->height; y++) {
+      const uint8_t *pixel = frame + (long)y * stride;
+      uint16_t *background = motion->background + (long)y * motion->width * bpp;
+      uint8_t *mask = motion->mask + (long)y * motion->width;
+      uint32_t *cells = motion->cells + (long)(y * motion->rows / motion->height) * motion->columns;
+      int cell = 0;
+      int cell_end = motion->width / motion->columns;
+
+      for (x = 0; x < motion->width; x++, pixel += bpp, background += bpp) {
+         int moving = 0;
+         int rate;
+
+         if (x >= cell_end)
+            cell_end = (++cell + 1) * motion->width / motion->columns;
+         for (c = 0; c < bpp; c++) {
+            int d = pixel[c] - ((background[c] + 128) >> 8);
+            moving |= d > threshold || -d > threshold;
+         }
+         rate = moving ? slow : fast;
+         for (c = 0; c < bpp; c++)
+            background[c] += ((pixel[c] << 8) - (int)background[c]) >> rate;
+         mask[x] = moving ? 0xff : 0;
+         cells[cell] += moving;
+         changed += moving;
+      }
+   }
+   motion->frames++;
+   motion->changed = changed;
+   return changed;
+}
+
+/**
+ * Release the background, mask and cells
+ */
+void picam_motion_free(PICAM_MOTION *motion)
+{
+   free(motion->background);
+   free(motion->mask);
+   free(motion->cells);
+   motion->background = NULL;
+   motion->mask = NULL;
+   motion->cells = NULL;
+}
@@ -0,0 +1,30 @@
+#ifndef _PICAMMOTION_H
+#define _PICAMMOTION_H
+
+#include <stdint.h>
+
+/** Exponential running average background and the mask of the pixels that
+ *  differed from it in the last frame
+ */
+typedef struct
+{
+   int width;
+   int height;
+   int bpp;                            /// Bytes per pixel of the frames, 1 for luma, 3 for RGB24/BGR24
+   int threshold;                      /// Largest difference from the background that is not motion (0-255)
+   int shift;                          /// Background learns 1/2^shift of each new frame
+   int columns;                        /// Activity grid
+   int rows;
+   uint16_t *background;               /// 8.8 fixed point, width * height * bpp samples
+   uint8_t *mask;                      /// width * height bytes, 255 where the last frame showed motion
+   uint32_t *cells;                    /// Changed pixels per grid cell in the last frame, row major
+   long changed;                       /// Changed pixels in the last frame
+   unsigned long frames;               /// Frames seen since the background was reset
+} PICAM_MOTION;
+
+int picam_motion_init(PICAM_MOTION *motion, int width, int height, int bpp, int threshold, int shift, int columns, int rows);
+void picam_motion_reset(PICAM_MOTION *motion);
+long picam_motion_update(PICAM_MOTION *motion, const uint8_t *frame, int stride);
+void picam_motion_free(PICAM_MOTION *motion);
+
+#endif // _PICAMMOTION_H
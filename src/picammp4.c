@@ -0,0 +1,718 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "picammp4.h"
+
+/// Media time units per second
+#define PICAM_MP4_TIMESCALE 90000
+/// Fragments are closed early rather than grow past this, so they fit in the output
+#define PICAM_MP4_FRAGMENT_BYTES (2 * 1024 * 1024)
+
+/// What is known about each sample in the index
+typedef struct
+{
+   uint32_t size;
+   uint32_t sync;                      /// Non-zero for IDR frames
+   int64_t pts;                        /// Presentation time (us)
+   uint64_t offset;                    /// Position in the file (plain layout)
+} PICAM_MP4_SAMPLE;
+
+int picam_mp4_init(PICAM_MP4 *mp4, int layout, int width, int height, int fragment_ms, int framerate, PICAM_MP4_OUTPUT *output)
+{
+   memset(mp4, 0, sizeof(*mp4));
+   mp4->layout = layout;
+   mp4->width = width;
+   mp4->height = height;
+   mp4->fragment_us = (fragment_ms > 0 ? fragment_ms : 1000) * 1000LL;
+   mp4->frame_us = 1000000 / (framerate > 0 ? framerate : 30);
+   mp4->output = *output;
+   mp4->need_sync = 1;
+   picam_buffer_init(&mp4->frame);
+   picam_buffer_init(&mp4->sample);
+   picam_buffer_init(&mp4->boxes);
+   picam_buffer_init(&mp4->index);
+   picam_buffer_init(&mp4->fragment);
+   return 0;
+}
+
+void picam_mp4_free(PICAM_MP4 *mp4)
+{
+   picam_buffer_free(&mp4->frame);
+   picam_buffer_free(&mp4->sample);
+   picam_buffer_free(&mp4->boxes);
+   picam_buffer_free(&mp4->index);
+   picam_buffer_free(&mp4->fragment);
+}
+
+/* Box building, every helper appends to buffer and flags mp4 on failure */
+
+static void put(PICAM_MP4 *mp4, PICAM_BUFFER *buffer, const void *data, long length)
+{
+   if (picam_buffer_append(buffer, data, length) != 0)
+      mp4->failed = 1;
+}
+
+static void put8(PICAM_MP4 *mp4, PICAM_BUFFER *buffer, uint32_t value)
+{
+   uint8_t byte = value;
+   put(mp4, buffer, &byte, 1);
+}
+
+static void put16(PICAM_MP4 *mp4, PICAM_BUFFER *buffer, uint32_t value)
+{
+   uint8_t bytes[2] = {value >> 8, value};
+   put(mp4, buffer, bytes, 2);
+}
+
+static void put32(PICAM_MP4 *mp4, PICAM_BUFFER *buffer, uint32_t value)
+{
+   uint8_t bytes[4] = {value >> 24, value >> 16, value >> 8, value};
+   put(mp4, buffer, bytes, 4);
+}
+
+static void put64(PICAM_MP4 *mp4, PICAM_BUFFER *buffer, uint64_t value)
+{
+   put32(mp4, buffer, value >> 32);
+   put32(mp4, buffer, value);
+}
+
+static void put_zeros(PICAM_MP4 *mp4, PICAM_BUFFER *buffer, int count)
+{
+   while (count--)
+      put8(mp4, buffer, 0);
+}
+
+static void set32(PICAM_MP4 *mp4, PICAM_BUFFER *buffer, long at, uint32_t value)
+{
+   if (mp4->failed)
+      return;
+   buffer->data[at] = value >> 24;
+   buffer->data[at + 1] = value >> 16;
+   buffer->data[at + 2] = value >> 8;
+   buffer->data[at + 3] = value;
+}
+
+/**
+ * Start a box, closed with box_close
+ *
+ * @return Position of the box in buffer
+ */
+static long box_open(PICAM_MP4 *mp4, PICAM_BUFFER *buffer, const char *type)
+{
+   long at = buffer->length;
+   put32(mp4, buffer, 0);
+   put(mp4, buffer, type, 4);
+   return at;
+}
+
+/// Start a box with a version and flags word
+static long full_box_open(PICAM_MP4 *mp4, PICAM_BUFFER *buffer, const char *type, int version, uint32_t flags)
+{
+   long at = box_open(mp4, buffer, type);
+   put32(mp4, buffer, (uint32_t)version << 24 | flags);
+   return at;
+}
+
+static void box_close(PICAM_MP4 *mp4, PICAM_BUFFER *buffer, long at)
+{
+   set32(mp4, buffer, at, buffer->length - at);
+}
+
+static void put_matrix(PICAM_MP4 *mp4, PICAM_BUFFER *buffer)
+{
+   static const uint32_t unity[9] = {0x10000, 0, 0, 0, 0x10000, 0, 0, 0, 0x40000000};
+   int i;
+   for (i = 0; i < 9; i++)
+      put32(mp4, buffer, unity[i]);
+}
+
+/// Microseconds to media time
+static int64_t ticks(int64_t us)
+{
+   return us * PICAM_MP4_TIMESCALE / 1000000;
+}
+
+/* Annex-B parsing */
+
+/**
+ * Find the next NAL unit of an Annex-B stream
+ *
+ * @param data Stream
+ * @param length Bytes in data
+ * @param pos Where to start looking, updated to the end of the unit found
+ * @param nal Receives the position of the unit, after its start code
+ * @return Bytes in the unit, -1 if there are no more
+ */
+static long next_nal(const uint8_t *data, long length, long *pos, long *nal)
+{
+   long i = *pos, end;
+
+   while (i + 3 <= length && !(data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1))
+      i++;
+   if (i + 3 > length)
+      return -1;
+   *nal = i + 3;
+   for (i = *nal; i + 3 <= length && !(data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1); i++)
+      ;
+   end = i + 3 <= length ? i : length;
+   *pos = end;
+   // Zero bytes in front of the next start code are not part of this unit
+   while (end > *nal && data[end - 1] == 0)
+      end--;
+   return end - *nal;
+}
+
+/**
+ * Keep the SPS and PPS of a configuration buffer for the sample description
+ */
+void picam_mp4_config(PICAM_MP4 *mp4, const uint8_t *data, long length)
+{
+   long pos = 0, nal, size;
+
+   while ((size = next_nal(data, length, &pos, &nal)) >= 0) {
+      int type = size ? data[nal] & 0x1f : 0;
+
+      if (type == 7 && size >= 4 && size <= (long)sizeof(mp4->sps)) {
+         memcpy(mp4->sps, data + nal, size);
+         mp4->sps_length = size;
+      } else if (type == 8 && size <= (long)sizeof(mp4->pps)) {
+         memcpy(mp4->pps, data + nal, size);
+         mp4->pps_length = size;
+      }
+   }
+}
+
+/**
+ * Convert the assembled frame to length prefixed NAL units in sample,
+ * parameter sets go to the sample description instead
+ */
+static void frame_to_sample(PICAM_MP4 *mp4)
+{
+   const uint8_t *data = mp4->frame.data;
+   long pos = 0, nal, size;
+
+   mp4->sample.length = 0;
+   while ((size = next_nal(data, mp4->frame.length, &pos, &nal)) >= 0) {
+      int type = size ? data[nal] & 0x1f : 0;
+
+      if (size == 0)
+         continue;
+      if (type == 7 || type == 8) {
+         picam_mp4_config(mp4, data + nal - 3, size + 3);
+         continue;
+      }
+      put32(mp4, &mp4->sample, size);
+      put(mp4, &mp4->sample, data + nal, size);
+   }
+}
+
+/* Output */
+
+static int emit(PICAM_MP4 *mp4, PICAM_BUFFER *buffer)
+{
+   if (!mp4->output.room(mp4->output.user, buffer->length, 1))
+      return 1;
+   mp4->output.write(mp4->output.user, buffer->data, buffer->length);
+   mp4->file_offset += buffer->length;
+   return 0;
+}
+
+static void put_ftyp(PICAM_MP4 *mp4, PICAM_BUFFER *b)
+{
+   long ftyp = box_open(mp4, b, "ftyp");
+   put(mp4, b, "isom", 4);
+   put32(mp4, b, 0x200);
+   put(mp4, b, "isomiso2avc1mp41", 16);
+   if (mp4->layout == PICAM_MP4_FRAGMENTED)
+      put(mp4, b, "iso5", 4);
+   box_close(mp4, b, ftyp);
+}
+
+/**
+ * Build the moov box into boxes
+ *
+ * @param samples Sample index of a finished plain file, NULL for the
+ *                empty tables of a fragmented file
+ * @param count Number of samples
+ * @param duration Length of the file (us)
+ */
+static void put_moov(PICAM_MP4 *mp4, PICAM_BUFFER *b, const PICAM_MP4_SAMPLE *samples, long count, int64_t duration)
+{
+   long moov, trak, mdia, minf, dinf, box, stbl, stsd, avc1, entries;
+   uint32_t duration_ms = duration / 1000;
+   int profile = mp4->sps[1];
+   long i;
+
+   moov = box_open(mp4, b, "moov");
+
+   box = full_box_open(mp4, b, "mvhd", 0, 0);
+   put32(mp4, b, 0);                   // creation time
+   put32(mp4, b, 0);                   // modification time
+   put32(mp4, b, 1000);                // timescale
+   put32(mp4, b, duration_ms);
+   put32(mp4, b, 0x10000);             // rate 1.0
+   put16(mp4, b, 0x100);               // volume 1.0
+   put_zeros(mp4, b, 10);
+   put_matrix(mp4, b);
+   put_zeros(mp4, b, 24);
+   put32(mp4, b, 2);                   // next track id
+   box_close(mp4, b, box);
+
+   trak = box_open(mp4, b, "trak");
+   box = full_box_open(mp4, b, "tkhd", 0, 3);
+   put32(mp4, b, 0);
+   put32(mp4, b, 0);
+   put32(mp4, b, 1);                   // track id
+   put32(mp4, b, 0);
+   put32(mp4, b, duration_ms);
+   put_zeros(mp4, b, 16);              // reserved, layer, group, volume, reserved
+   put_matrix(mp4, b);
+   put32(mp4, b, (uint32_t)mp4->width << 16);
+   put32(mp4, b, (uint32_t)mp4->height << 16);
+   box_close(mp4, b, box);
+
+   mdia = box_open(mp4, b, "mdia");
+   box = full_box_open(mp4, b, "mdhd", 0, 0);
+   put32(mp4, b, 0);
+   put32(mp4, b, 0);
+   put32(mp4, b, PICAM_MP4_TIMESCALE);
+   put32(mp4, b, ticks(duration));
+   put16(mp4, b, 0x55c4);              // 'und'
+   put16(mp4, b, 0);
+   box_close(mp4, b, box);
+   box = full_box_open(mp4, b, "hdlr", 0, 0);
+   put32(mp4, b, 0);
+   put(mp4, b, "vide", 4);
+   put_zeros(mp4, b, 12);
+   put(mp4, b, "VideoHandler", 13);
+   box_close(mp4, b, box);
+
+   minf = box_open(mp4, b, "minf");
+   box = full_box_open(mp4, b, "vmhd", 0, 1);
+   put_zeros(mp4, b, 8);
+   box_close(mp4, b, box);
+   dinf = box_open(mp4, b, "dinf");
+   box = full_box_open(mp4, b, "dref", 0, 0);
+   put32(mp4, b, 1);
+   put32(mp4, b, 12);
+   put(mp4, b, "url ", 4);
+   put32(mp4, b, 1);                   // media in this file
+   box_close(mp4, b, box);
+   box_close(mp4, b, dinf);
+
+   stbl = box_open(mp4, b, "stbl");
+   stsd = full_box_open(mp4, b, "stsd", 0, 0);
+   put32(mp4, b, 1);
+   avc1 = box_open(mp4, b, "avc1");
+   put_zeros(mp4, b, 6);
+   put16(mp4, b, 1);                   // data reference index
+   put_zeros(mp4, b, 16);
+   put16(mp4, b, mp4->width);
+   put16(mp4, b, mp4->height);
+   put32(mp4, b, 0x480000);            // 72 dpi
+   put32(mp4, b, 0x480000);
+   put32(mp4, b, 0);
+   put16(mp4, b, 1);                   // frame count
+   put_zeros(mp4, b, 32);              // compressor name
+   put16(mp4, b, 0x18);                // depth
+   put16(mp4, b, 0xffff);
+   box = box_open(mp4, b, "avcC");
+   put8(mp4, b, 1);
+   put8(mp4, b, mp4->sps[1]);          // profile
+   put8(mp4, b, mp4->sps[2]);          // compatibility
+   put8(mp4, b, mp4->sps[3]);          // level
+   put8(mp4, b, 0xff);                 // 4 byte NAL lengths
+   put8(mp4, b, 0xe1);                 // one SPS
+   put16(mp4, b, mp4->sps_length);
+   put(mp4, b, mp4->sps, mp4->sps_length);
+   put8(mp4, b, 1);                    // one PPS
+   put16(mp4, b, mp4->pps_length);
+   put(mp4, b, mp4->pps, mp4->pps_length);
+   if (profile == 100 || profile == 110 || profile == 122 || profile == 144) {
+      put8(mp4, b, 0xfc | 1);          // 4:2:0
+      put8(mp4, b, 0xf8);              // 8 bit luma
+      put8(mp4, b, 0xf8);              // 8 bit chroma
+      put8(mp4, b, 0);
+   }
+   box_close(mp4, b, box);
+   box_close(mp4, b, avc1);
+   box_close(mp4, b, stsd);
+
+   // Time to sample, runs of equal durations
+   box = full_box_open(mp4, b, "stts", 0, 0);
+   entries = b->length;
+   put32(mp4, b, 0);
+   if (samples && count) {
+      int64_t end = samples[count - 1].pts - mp4->file_pts + (count > 1 ? samples[count - 1].pts - samples[count - 2].pts : mp4->frame_us);
+      uint32_t run_duration = 0, run = 0, runs = 0;
+
+      for (i = 0; i < count; i++) {
+         int64_t next = i + 1 < count ? samples[i + 1].pts - mp4->file_pts : end;
+         int64_t delta = ticks(next) - ticks(samples[i].pts - mp4->file_pts);
+         uint32_t sample_duration = delta > 0 ? delta : 1;
+
+         if (run && sample_duration != run_duration) {
+            put32(mp4, b, run);
+            put32(mp4, b, run_duration);
+            runs++;
+            run = 0;
+         }
+         run_duration = sample_duration;
+         run++;
+      }
+      put32(mp4, b, run);
+      put32(mp4, b, run_duration);
+      set32(mp4, b, entries, runs + 1);
+   }
+   box_close(mp4, b, box);
+
+   if (samples) {
+      uint32_t syncs = 0;
+
+      box = full_box_open(mp4, b, "stss", 0, 0);
+      entries = b->length;
+      put32(mp4, b, 0);
+      for (i = 0; i < count; i++) {
+         if (samples[i].sync) {
+            put32(mp4, b, i + 1);
+            syncs++;
+         }
+      }
+      set32(mp4, b, entries, syncs);
+      box_close(mp4, b, box);
+   }
+
+   // Every sample is its own chunk, so dropped samples leave no holes in the tables
+   box = full_box_open(mp4, b, "stsc", 0, 0);
+   if (samples && count) {
+      put32(mp4, b, 1);
+      put32(mp4, b, 1);
+      put32(mp4, b, 1);
+      put32(mp4, b, 1);
+   } else {
+      put32(mp4, b, 0);
+   }
+   box_close(mp4, b, box);
+
+   box = full_box_open(mp4, b, "stsz", 0, 0);
+   put32(mp4, b, 0);
+   put32(mp4, b, samples ? count : 0);
+   for (i = 0; samples && i < count; i++)
+      put32(mp4, b, samples[i].size);
+   box_close(mp4, b, box);
+
+   box = full_box_open(mp4, b, "co64", 0, 0);
+   put32(mp4, b, samples ? count : 0);
+   for (i = 0; samples && i < count; i++)
+      put64(mp4, b, samples[i].offset);
+   box_close(mp4, b, box);
+
+   box_close(mp4, b, stbl);
+   box_close(mp4, b, minf);
+   box_close(mp4, b, mdia);
+   box_close(mp4, b, trak);
+
+   if (!samples) {
+      long mvex = box_open(mp4, b, "mvex");
+      box = full_box_open(mp4, b, "trex", 0, 0);
+      put32(mp4, b, 1);                // track id
+      put32(mp4, b, 1);                // sample description
+      put_zeros(mp4, b, 12);           // duration, size, flags come with every fragment
+      box_close(mp4, b, box);
+      box_close(mp4, b, mvex);
+   }
+   box_close(mp4, b, moov);
+}
+
+/**
+ * Write the header of a new file, starting with the sample at pts
+ *
+ * @return 0 if written, non-zero if the output had no room
+ */
+static int start_file(PICAM_MP4 *mp4, int64_t pts)
+{
+   PICAM_BUFFER *b = &mp4->boxes;
+
+   b->length = 0;
+   put_ftyp(mp4, b);
+   if (mp4->layout == PICAM_MP4_FRAGMENTED) {
+      put_moov(mp4, b, NULL, 0, 0);
+   } else {
+      // 64 bit size, filled in once the file ends
+      put32(mp4, b, 1);
+      put(mp4, b, "mdat", 4);
+      put64(mp4, b, 0);
+   }
+   if (mp4->failed)
+      return 1;
+   mp4->file_offset = 0;
+   if (emit(mp4, b) != 0)
+      return 1;
+   mp4->mdat_offset = b->length - 16;
+   mp4->file_pts = pts;
+   mp4->sequence = 0;
+   mp4->index.length = 0;
+   mp4->fragment.length = 0;
+   mp4->started = 1;
+   return 0;
+}
+
+/**
+ * Write the open fragment as a moof and mdat
+ *
+ * @param end_pts Presentation time the last sample lasts until
+ * @param reserve Bytes of writes the output must still take after the fragment, -1 to
+ *                drop the fragment if it does not fit rather than keep it open
+ * @param reserve_pieces Number of writes reserve is split across
+ * @return 0 if written or dropped, 1 if kept open for lack of room
+ */
+static int flush_fragment(PICAM_MP4 *mp4, int64_t end_pts, long reserve, int reserve_pieces)
+{
+   PICAM_BUFFER *b = &mp4->boxes;
+   const PICAM_MP4_SAMPLE *samples = (const PICAM_MP4_SAMPLE *)mp4->index.data;
+   long count = mp4->index.length / sizeof(PICAM_MP4_SAMPLE);
+   long moof, traf, box, data_offset, i;
+
+   if (!count)
+      return 0;
+   b->length = 0;
+   moof = box_open(mp4, b, "moof");
+   box = full_box_open(mp4, b, "mfhd", 0, 0);
+   put32(mp4, b, mp4->sequence + 1);
+   box_close(mp4, b, box);
+   traf = box_open(mp4, b, "traf");
+   box = full_box_open(mp4, b, "tfhd", 0, 0x020000);    // offsets from the moof
+   put32(mp4, b, 1);
+   box_close(mp4, b, box);
+   box = full_box_open(mp4, b, "tfdt", 1, 0);
+   put64(mp4, b, ticks(samples[0].pts - mp4->file_pts));
+   box_close(mp4, b, box);
+   box = full_box_open(mp4, b, "trun", 0, 0x000701);    // offset, duration, size and flags
+   put32(mp4, b, count);
+   data_offset = b->length;
+   put32(mp4, b, 0);
+   for (i = 0; i < count; i++) {
+      int64_t next = i + 1 < count ? samples[i + 1].pts : end_pts;
+      int64_t delta = ticks(next - mp4->file_pts) - ticks(samples[i].pts - mp4->file_pts);
+
+      put32(mp4, b, delta > 0 ? delta : 1);
+      put32(mp4, b, samples[i].size);
+      put32(mp4, b, samples[i].sync ? 0x02000000 : 0x01010000);
+   }
+   box_close(mp4, b, box);
+   box_close(mp4, b, traf);
+   box_close(mp4, b, moof);
+   set32(mp4, b, data_offset, b->length - moof + 8);
+   put32(mp4, b, 8 + mp4->fragment.length);
+   put(mp4, b, "mdat", 4);
+
+   // All of the fragment or none of it
+   if (!mp4->failed && mp4->output.room(mp4->output.user, b->length + mp4->fragment.length + (reserve > 0 ? reserve : 0),
+                                        2 + (reserve >= 0 ? reserve_pieces : 0))) {
+      mp4->output.write(mp4->output.user, b->data, b->length);
+      mp4->output.write(mp4->output.user, mp4->fragment.data, mp4->fragment.length);
+      mp4->file_offset += b->length + mp4->fragment.length;
+      mp4->sequence++;
+   } else if (reserve >= 0 && !mp4->failed) {
+      return 1;
+   } else {
+      mp4->dropped++;
+      mp4->need_sync = 2;
+   }
+   mp4->index.length = 0;
+   mp4->fragment.length = 0;
+   return 0;
+}
+
+/**
+ * Add the converted frame in sample to the file
+ */
+static void add_sample(PICAM_MP4 *mp4, int sync, int64_t pts)
+{
+   PICAM_MP4_SAMPLE entry;
+
+   if (mp4->need_sync && !sync) {
+      if (mp4->need_sync == 2)
+         mp4->dropped++;
+      return;
+   }
+   if (!mp4->started && (!mp4->sps_length || !mp4->pps_length || start_file(mp4, pts) != 0))
+      return;
+
+   memset(&entry, 0, sizeof(entry));
+   entry.size = mp4->sample.length;
+   entry.sync = sync;
+   entry.pts = pts;
+   if (mp4->layout == PICAM_MP4_FRAGMENTED) {
+      int64_t elapsed = pts - mp4->fragment_pts;
+
+      // Fragments start at IDR frames where the intra period allows, so each can be played on its own
+      if (mp4->index.length &&
+          ((sync && elapsed + mp4->frame_us / 2 >= mp4->fragment_us) || elapsed >= 2 * mp4->fragment_us ||
+           mp4->fragment.length + mp4->sample.length > PICAM_MP4_FRAGMENT_BYTES))
+         flush_fragment(mp4, pts, -1, 0);
+      if (mp4->need_sync && !sync)
+         return;
+      if (!mp4->index.length)
+         mp4->fragment_pts = pts;
+      put(mp4, &mp4->fragment, mp4->sample.data, mp4->sample.length);
+   } else {
+      if (!mp4->output.room(mp4->output.user, mp4->sample.length, 1)) {
+         mp4->dropped++;
+         mp4->need_sync = 2;
+         return;
+      }
+      entry.offset = mp4->file_offset;
+      mp4->output.write(mp4->output.user, mp4->sample.data, mp4->sample.length);
+      mp4->file_offset += mp4->sample.length;
+   }
+   put(mp4, &mp4->index, &entry, sizeof(entry));
+   mp4->last_pts = pts;
+   mp4->need_sync = 0;
+}
+
+/**
+ * Add a buffer of the H264 stream, configuration buffers go to picam_mp4_config
+ *
+ * @param mp4 Muxer
+ * @param data Annex-B bytes, part or all of a frame
+ * @param length Bytes in data
+ * @param keyframe Non-zero if the buffer is part of an IDR frame
+ * @param frame_end Non-zero on the last buffer of a frame
+ * @param pts Presentation time of the frame (us), INT64_MIN if unknown
+ */
+void picam_mp4_add(PICAM_MP4 *mp4, const uint8_t *data, long length, int keyframe, int frame_end, int64_t pts)
+{
+   int sync;
+
+   if (mp4->failed)
+      return;
+   put(mp4, &mp4->frame, data, length);
+   mp4->frame_sync |= keyframe;
+   if (!frame_end)
+      return;
+
+   frame_to_sample(mp4);
+   sync = mp4->frame_sync;
+   mp4->frame.length = 0;
+   mp4->frame_sync = 0;
+   if (pts == INT64_MIN)
+      pts = mp4->started ? mp4->last_pts + mp4->frame_us : 0;
+   if (mp4->sample.length && !mp4->failed)
+      add_sample(mp4, sync, pts);
+}
+
+/**
+ * Reset for the next IDR frame to start a new file
+ */
+static void file_ended(PICAM_MP4 *mp4)
+{
+   mp4->started = 0;
+   mp4->finishing = 0;
+   mp4->need_sync = 1;
+   mp4->index.length = 0;
+   mp4->fragment.length = 0;
+}
+
+/**
+ * Finish the current file: write out the open fragment, or the moov of a
+ * plain file. The next IDR frame starts a new file. Never waits for the
+ * output: when it has no room the file is left open and nothing is written,
+ * so the caller can try again later.
+ *
+ * @param mp4 Muxer
+ * @param reserve Bytes of writes the output must still take once the file is ended,
+ *                such as switching to the next file
+ * @param reserve_pieces Number of writes reserve is split across
+ * @return 0 if the file was ended, 1 if the output had no room for the end
+ */
+int picam_mp4_end_file(PICAM_MP4 *mp4, long reserve, int reserve_pieces)
+{
+   const PICAM_MP4_SAMPLE *samples = (const PICAM_MP4_SAMPLE *)mp4->index.data;
+   long count = mp4->index.length / sizeof(PICAM_MP4_SAMPLE);
+   int64_t last = count > 1 ? samples[count - 1].pts - samples[count - 2].pts : mp4->frame_us;
+
+   if (!mp4->started)
+      return 0;
+   if (mp4->layout == PICAM_MP4_FRAGMENTED) {
+      if (flush_fragment(mp4, mp4->last_pts + last, reserve, reserve_pieces) != 0)
+         return 1;
+   } else if (count) {
+      PICAM_BUFFER *b = &mp4->boxes;
+      uint8_t size[8];
+      uint64_t mdat_size = mp4->file_offset - mp4->mdat_offset;
+      int i;
+
+      b->length = 0;
+      put_moov(mp4, b, samples, count, mp4->last_pts + last - mp4->file_pts);
+      // Without its moov the whole file is lost, so keep the file open until the output takes it
+      if (!mp4->failed && !mp4->output.room(mp4->output.user, b->length + reserve, 1 + reserve_pieces))
+         return 1;
+      if (!mp4->failed) {
+         mp4->output.write(mp4->output.user, b->data, b->length);
+         mp4->file_offset += b->length;
+         for (i = 0; i < 8; i++)
+            size[i] = mdat_size >> (56 - 8 * i);
+         mp4->output.patch(mp4->output.user, mp4->mdat_offset + 8, size, 8);
+      } else {
+         mp4->dropped++;
+      }
+   }
+   file_ended(mp4);
+   return 0;
+}
+
+/**
+ * End the last file once nothing more will be added. The moov of a long
+ * plain file can be larger than the output takes at once, so it is written
+ * in pieces, as many as the output has room for on each call. Never waits,
+ * call again while it returns 1.
+ *
+ * @param mp4 Muxer
+ * @param piece Most bytes handed to the output in one write
+ * @return 0 if the file was ended, 1 if some of its end is still to be written
+ */
+int picam_mp4_finish(PICAM_MP4 *mp4, long piece)
+{
+   PICAM_BUFFER *b = &mp4->boxes;
+   uint8_t size[8];
+   int i;
+
+   if (!mp4->started)
+      return 0;
+   if (mp4->layout == PICAM_MP4_FRAGMENTED)
+      return picam_mp4_end_file(mp4, 0, 0);
+   if (!mp4->finishing) {
+      const PICAM_MP4_SAMPLE *samples = (const PICAM_MP4_SAMPLE *)mp4->index.data;
+      long count = mp4->index.length / sizeof(PICAM_MP4_SAMPLE);
+      int64_t last = count > 1 ? samples[count - 1].pts - samples[count - 2].pts : mp4->frame_us;
+
+      if (!count) {
+         file_ended(mp4);
+         return 0;
+      }
+      b->length = 0;
+      put_moov(mp4, b, samples, count, mp4->last_pts + last - mp4->file_pts);
+      if (mp4->failed) {
+         mp4->dropped++;
+         file_ended(mp4);
+         return 0;
+      }
+      mp4->finishing = 1;
+      mp4->moov_written = 0;
+   }
+   while (mp4->moov_written < b->length) {
+      long length = b->length - mp4->moov_written < piece ? b->length - mp4->moov_written : piece;
+
+      if (!mp4->output.room(mp4->output.user, length, 1))
+         return 1;
+      mp4->output.write(mp4->output.user, b->data + mp4->moov_written, length);
+      mp4->moov_written += length;
+   }
+   for (i = 0; i < 8; i++)
+      size[i] = (mp4->file_offset - mp4->mdat_offset) >> (56 - 8 * i);
+   mp4->output.patch(mp4->output.user, mp4->mdat_offset + 8, size, 8);
+   mp4->file_offset += b->length;
+   file_ended(mp4);
+   return 0;
+}
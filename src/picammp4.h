@@ -0,0 +1,68 @@
+#ifndef _PICAMMP4_H
+#define _PICAMMP4_H
+
+#include <stdint.h>
+#include "picambuffer.h"
+
+/// Layouts written by the muxer
+enum {
+   PICAM_MP4_PLAIN = 1,                /// One mdat, moov written when the file ends
+   PICAM_MP4_FRAGMENTED                /// moov up front, then a moof and mdat per fragment
+};
+
+/// Where the muxer output goes, see picam_mp4_init
+typedef struct
+{
+   void *user;
+   /// Non-zero if length bytes in pieces separate writes can be taken now without dropping any
+   int (*room)(void *user, long length, int pieces);
+   void (*write)(void *user, const uint8_t *data, long length);
+   /// Overwrite bytes already written to the current file
+   void (*patch)(void *user, uint64_t offset, const uint8_t *data, long length);
+} PICAM_MP4_OUTPUT;
+
+/** Muxes an Annex-B H264 elementary stream into MP4 as it is produced. Only
+ *  the frame being assembled, the open fragment and (plain layout) the
+ *  sample index are held in memory.
+ */
+typedef struct
+{
+   int layout;                         /// PICAM_MP4_*
+   int width;
+   int height;
+   int64_t fragment_us;                /// Fragments are closed at the first IDR frame past this length,
+                                       /// or any frame past twice it
+   int64_t frame_us;                   /// Duration given to a frame when the next one never comes
+   PICAM_MP4_OUTPUT output;
+   uint8_t sps[256];                   /// Latest sequence parameter set, without start code
+   int sps_length;
+   uint8_t pps[256];                   /// Latest picture parameter set, without start code
+   int pps_length;
+   PICAM_BUFFER frame;                 /// Annex-B bytes of the frame being assembled
+   int frame_sync;                     /// Frame being assembled is an IDR frame
+   PICAM_BUFFER sample;                /// Scratch, a frame converted to length prefixed NAL units
+   PICAM_BUFFER boxes;                 /// Scratch, boxes being built
+   PICAM_BUFFER index;                 /// PICAM_MP4_SAMPLE for each sample of the file (plain) or fragment
+   PICAM_BUFFER fragment;              /// mdat payload of the open fragment
+   int started;                        /// Header of the current file is written
+   int need_sync;                      /// Nothing is written until the next IDR frame
+   uint64_t file_offset;               /// Bytes written to the current file
+   uint64_t mdat_offset;               /// Position of the mdat header (plain layout)
+   int64_t file_pts;                   /// Presentation time of the first sample of the file (us)
+   int64_t fragment_pts;               /// Presentation time of the first sample of the open fragment
+   int64_t last_pts;                   /// Presentation time of the last sample added
+   uint32_t sequence;                  /// moof sequence number, from 1 in every file
+   int finishing;                      /// picam_mp4_finish has built the moov into boxes
+   long moov_written;                  /// Bytes of that moov written so far
+   unsigned long dropped;              /// Samples or fragments that did not fit in the output
+   int failed;                         /// Set when out of memory, nothing more is written
+} PICAM_MP4;
+
+int picam_mp4_init(PICAM_MP4 *mp4, int layout, int width, int height, int fragment_ms, int framerate, PICAM_MP4_OUTPUT *output);
+void picam_mp4_config(PICAM_MP4 *mp4, const uint8_t *data, long length);
+void picam_mp4_add(PICAM_MP4 *mp4, const uint8_t *data, long length, int keyframe, int frame_end, int64_t pts);
+int picam_mp4_end_file(PICAM_MP4 *mp4, long reserve, int reserve_pieces);
+int picam_mp4_finish(PICAM_MP4 *mp4, long piece);
+void picam_mp4_free(PICAM_MP4 *mp4);
+
+#endif // _PICAMMP4_H
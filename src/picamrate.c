@@ -0,0 +1,132 @@
+#include <string.h>
+
+#include "picamrate.h"
+
+/// Backlog (percent of the queue) at which the target is cut hard
+#define PICAM_RATE_HIGH_WATER 50
+/// Backlog under which the output counts as keeping up
+#define PICAM_RATE_LOW_WATER 10
+/// Quiet intervals needed before the target is raised again
+#define PICAM_RATE_CALM_INTERVALS 3
+/// Steps from min to max when raising the target
+#define PICAM_RATE_STEPS 16
+
+/**
+ * QP floor for a target, linear from min_qp at max_bitrate to max_qp at min_bitrate
+ */
+static int qp_floor(PICAM_RATE *rate, int target)
+{
+   long span = rate->max_bitrate - rate->min_bitrate;
+
+   if (!rate->min_qp)
+      return 0;
+   if (span <= 0)
+      return rate->min_qp;
+   return rate->max_qp - (int)((long)(rate->max_qp - rate->min_qp) * (target - rate->min_bitrate) / span);
+}
+
+/**
+ * Start a controller off at a bitrate
+ *
+ * @param rate Controller to set up
+ * @param start Bitrate the encoder was created with, 0 to start at max_bitrate
+ * @param min_bitrate Lowest target (bits/s)
+ * @param max_bitrate Highest target (bits/s), raised to min_bitrate if lower
+ * @param min_qp Lowest QP when the target is at max_bitrate, 0 to leave QP alone
+ * @param max_qp Highest QP, the floor reached at min_bitrate, 0 to leave QP alone
+ */
+void picam_rate_init(PICAM_RATE *rate, int start, int min_bitrate, int max_bitrate, int min_qp, int max_qp)
+{
+   memset(rate, 0, sizeof(*rate));
+   if (min_bitrate < 1)
+      min_bitrate = 1;
+   if (max_bitrate < min_bitrate)
+      max_bitrate = min_bitrate;
+   rate->min_bitrate = min_bitrate;
+   rate->max_bitrate = max_bitrate;
+   if (min_qp > 0 && max_qp >= min_qp) {
+      rate->min_qp = min_qp;
+      rate->max_qp = max_qp;
+   }
+   if (start <= 0 || start > max_bitrate)
+      start = max_bitrate;
+   else if (start < min_bitrate)
+      start = min_bitrate;
+   rate->stats.target = start;
+   rate->stats.min_qp = qp_floor(rate, start);
+}
+
+/**
+ * Bits per second from a byte counter, smoothed with the previous value
+ */
+static long smoothed(long previous, uint64_t bytes, long elapsed_us, int first)
+{
+   long now = (long)(bytes * 8 * 1000000 / (uint64_t)elapsed_us);
+
+   return first ? now : (previous + now) / 2;
+}
+
+/**
+ * Feed one interval of measurements and work out the next target
+ *
+ * @param rate Controller
+ * @param encoded Bytes the encoder has produced in all
+ * @param drained Bytes the file or sink has taken in all
+ * @param elapsed_us Time since the previous update
+ * @param backlog Percent of the output queue waiting now
+ * @param free_buffers Buffers the encoder has to fill now, 0 means it is waiting for us
+ * @param lost Non-zero if output was thrown away or the encoder was starved since the previous update
+ * @return Non-zero if the target or the QP floor changed and should be given to the encoder
+ */
+int picam_rate_update(PICAM_RATE *rate, uint64_t encoded, uint64_t drained, long elapsed_us,
+                      int backlog, int free_buffers, int lost)
+{
+   PICAM_RATE_STATS *stats = &rate->stats;
+   int previous = stats->target;
+   int previous_qp = stats->min_qp;
+   long target = previous;
+
+   if (elapsed_us <= 0)
+      elapsed_us = 1;
+   if (rate->have_sample) {
+      int first = stats->updates == 0;
+
+      stats->measured = smoothed(stats->measured, encoded - rate->last_encoded, elapsed_us, first);
+      stats->drained = smoothed(stats->drained, drained - rate->last_drained, elapsed_us, first);
+      stats->updates++;
+   }
+   rate->last_encoded = encoded;
+   rate->last_drained = drained;
+   rate->have_sample = 1;
+   stats->backlog = backlog;
+   stats->free_buffers = free_buffers;
+
+   if (lost || backlog >= PICAM_RATE_HIGH_WATER || free_buffers == 0) {
+      // Backed up: cut hard, to what the consumer manages when that is known
+      target = target * 3 / 4;
+      if (stats->drained > 0 && stats->drained * 9 / 10 < target)
+         target = stats->drained * 9 / 10;
+      rate->calm = 0;
+   } else if (backlog >= PICAM_RATE_LOW_WATER) {
+      // Falling behind a little, ease off and wait
+      target = target * 7 / 8;
+      rate->calm = 0;
+   } else if (++rate->calm >= PICAM_RATE_CALM_INTERVALS) {
+      long step = (long)(rate->max_bitrate - rate->min_bitrate) / PICAM_RATE_STEPS;
+
+      target += step > 0 ? step : 1;
+      rate->calm = 0;
+   }
+   if (target < rate->min_bitrate)
+      target = rate->min_bitrate;
+   else if (target > rate->max_bitrate)
+      target = rate->max_bitrate;
+
+   if (target < previous)
+      stats->decreases++;
+   else if (target > previous)
+      stats->increases++;
+   stats->target = (int)target;
+   stats->min_qp = qp_floor(rate, stats->target);
+   return stats->target != previous || stats->min_qp != previous_qp;
+}
@@ -0,0 +1,43 @@
+#ifndef _PICAMRATE_H
+#define _PICAMRATE_H
+
+#include <stdint.h>
+
+/// What a rate controller measured and decided, see picam_rate_update
+typedef struct
+{
+   int target;                         /// Bitrate asked of the encoder now (bits/s)
+   int min_qp;                         /// Lowest QP the encoder may use now, 0 if QP is left alone
+   long measured;                      /// Bits/s the encoder produced, smoothed over the last intervals
+   long drained;                       /// Bits/s the file or sink took, smoothed the same way
+   int backlog;                        /// Percent of the output queue waiting at the last sample
+   int free_buffers;                   /// Buffers the encoder had to fill at the last sample
+   unsigned long decreases;            /// Intervals the target went down
+   unsigned long increases;            /// Intervals the target went up
+   unsigned long updates;              /// Intervals sampled so far
+} PICAM_RATE_STATS;
+
+/** Closed loop bitrate control for a live encoder. Each interval it is given
+ *  how much the encoder produced, how much the consumer took, how full the
+ *  output queue is and how many encoder buffers are free. The target drops
+ *  multiplicatively as soon as the output backs up and climbs back slowly
+ *  once it has been clear for a while, always within min and max.
+ */
+typedef struct
+{
+   int min_bitrate;                    /// Bits/s, the target never goes below
+   int max_bitrate;                    /// Bits/s, the target never goes above
+   int min_qp;                         /// QP bounds, the floor rises towards max_qp as the target falls,
+   int max_qp;                         /// both 0 to leave QP to the encoder
+   int calm;                           /// Intervals in a row without any sign of congestion
+   int have_sample;                    /// Set once the byte counters have a previous value
+   uint64_t last_encoded;              /// Byte counters at the previous sample
+   uint64_t last_drained;
+   PICAM_RATE_STATS stats;
+} PICAM_RATE;
+
+void picam_rate_init(PICAM_RATE *rate, int start, int min_bitrate, int max_bitrate, int min_qp, int max_qp);
+int picam_rate_update(PICAM_RATE *rate, uint64_t encoded, uint64_t drained, long elapsed_us,
+                      int backlog, int free_buffers, int lost);
+
+#endif // _PICAMRATE_H
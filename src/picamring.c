@@ -0,0 +1,260 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "picamring.h"
+
+/// SPS and PPS together are a few dozen bytes
+#define PICAM_RING_CONFIG_SIZE 1024
+
+/**
+ * Allocate the ring, the only allocation it ever makes
+ *
+ * @param ring Ring to set up
+ * @param capacity Byte budget for the stream
+ * @param entries Most buffers held at once, 0 to derive it from capacity
+ * @return 0 if successful, non-zero if out of memory
+ */
+int picam_ring_init(PICAM_RING *ring, long capacity, int entries)
+{
+   memset(ring, 0, sizeof(*ring));
+   if (entries <= 0)
+      entries = capacity / 512 > 1024 ? capacity / 512 : 1024;
+   ring->data = malloc(capacity);
+   ring->entries = malloc(entries * sizeof(PICAM_RING_ENTRY));
+   ring->config = malloc(PICAM_RING_CONFIG_SIZE);
+   if (!ring->data || !ring->entries || !ring->config) {
+      picam_ring_free(ring);
+      return 1;
+   }
+   ring->capacity = capacity;
+   ring->entry_capacity = entries;
+   ring->config_capacity = PICAM_RING_CONFIG_SIZE;
+   ring->last_flags = PICAM_RING_FRAME_END;
+   ring->need_keyframe = 1;
+   pthread_mutex_init(&ring->lock, NULL);
+   pthread_mutex_init(&ring->dump_lock, NULL);
+   return 0;
+}
+
+void picam_ring_free(PICAM_RING *ring)
+{
+   if (ring->capacity) {
+      pthread_mutex_destroy(&ring->lock);
+      pthread_mutex_destroy(&ring->dump_lock);
+   }
+   free(ring->data);
+   free(ring->entries);
+   free(ring->config);
+   memset(ring, 0, sizeof(*ring));
+}
+
+/**
+ * Forget the stream held, for a new recording
+ */
+void picam_ring_reset(PICAM_RING *ring)
+{
+   pthread_mutex_lock(&ring->lock);
+   ring->tail = ring->head;
+   ring->entry_first = 0;
+   ring->entry_count = 0;
+   ring->config_length = 0;
+   ring->last_flags = PICAM_RING_FRAME_END;
+   ring->need_keyframe = 1;
+   pthread_mutex_unlock(&ring->lock);
+}
+
+static void evict_oldest(PICAM_RING *ring)
+{
+   PICAM_RING_ENTRY *oldest = &ring->entries[ring->entry_first];
+
+   ring->tail = oldest->offset + oldest->length;
+   ring->entry_first = (ring->entry_first + 1) % ring->entry_capacity;
+   ring->entry_count--;
+}
+
+/**
+ * Store an encoder buffer, overwriting the oldest ones to make room. Never
+ * overwrites data a dump is still reading, the new buffer is dropped instead
+ * and storing resumes at the next keyframe.
+ *
+ * @param ring Ring
+ * @param data Buffer contents
+ * @param length Bytes in data
+ * @param flags PICAM_RING_KEYFRAME, PICAM_RING_CONFIG and PICAM_RING_FRAME_END as reported by the encoder
+ * @param pts Presentation time (us), INT64_MIN if unknown
+ */
+void picam_ring_append(PICAM_RING *ring, const uint8_t *data, long length, int flags, int64_t pts)
+{
+   PICAM_RING_ENTRY *entry;
+   long start, first;
+
+   pthread_mutex_lock(&ring->lock);
+   if (ring->last_flags & (PICAM_RING_FRAME_END | PICAM_RING_CONFIG))
+      flags |= PICAM_RING_FRAME_START;
+
+   if (flags & PICAM_RING_CONFIG) {
+      // SPS and PPS may arrive as separate buffers, keep the latest run of them
+      if (!(ring->last_flags & PICAM_RING_CONFIG))
+         ring->config_length = 0;
+      if (ring->config_length + length <= ring->config_capacity) {
+         memcpy(ring->config + ring->config_length, data, length);
+         ring->config_length += length;
+      }
+   }
+   ring->last_flags = flags;
+
+   if (ring->need_keyframe && !((flags & PICAM_RING_KEYFRAME) && (flags & PICAM_RING_FRAME_START)))
+      goto drop;
+   if (length > ring->capacity || (ring->pinned && ring->head + length > ring->pin + ring->capacity)) {
+      ring->need_keyframe = 1;
+      goto drop;
+   }
+   ring->need_keyframe = 0;
+
+   while (ring->entry_count > 0 && (ring->head + length - ring->tail > (uint64_t)ring->capacity || ring->entry_count == ring->entry_capacity))
+      evict_oldest(ring);
+   if (ring->entry_count == 0)
+      ring->tail = ring->head;
+
+   start = ring->head % ring->capacity;
+   first = ring->capacity - start < length ? ring->capacity - start : length;
+   memcpy(ring->data + start, data, first);
+   memcpy(ring->data, data + first, length - first);
+
+   entry = &ring->entries[(ring->entry_first + ring->entry_count) % ring->entry_capacity];
+   entry->offset = ring->head;
+   entry->length = length;
+   entry->pts = pts;
+   entry->flags = flags;
+   ring->entry_count++;
+   ring->head += length;
+   pthread_mutex_unlock(&ring->lock);
+   return;
+
+drop:
+   if (!(flags & PICAM_RING_CONFIG))
+      ring->dropped++;
+   pthread_mutex_unlock(&ring->lock);
+}
+
+static int write_all(int fd, const uint8_t *data, long length)
+{
+   while (length > 0) {
+      ssize_t written = write(fd, data, length);
+      if (written < 0) {
+         if (errno == EINTR)
+            continue;
+         return 1;
+      }
+      data += written;
+      length -= written;
+   }
+   return 0;
+}
+
+/**
+ * Write the last seconds of the stream to fd, starting at the keyframe at or
+ * before that point (or the oldest keyframe held) and preceded by the latest
+ * SPS/PPS. Appending carries on while the data is written. Dumps from other
+ * threads wait for this one, each would otherwise move the other's pin.
+ *
+ * @param ring Ring
+ * @param fd Where to write
+ * @param seconds How far back to start, everything held if <= 0
+ * @return Bytes written, -1 if a write failed
+ */
+long picam_ring_dump(PICAM_RING *ring, int fd, double seconds)
+{
+   uint8_t config[PICAM_RING_CONFIG_SIZE];
+   long config_length;
+   uint64_t from = 0, to;
+   int64_t newest = INT64_MIN;
+   int64_t target;
+   int found = 0;
+   int i;
+   long total = 0;
+
+   pthread_mutex_lock(&ring->dump_lock);
+   pthread_mutex_lock(&ring->lock);
+   for (i = ring->entry_count - 1; i >= 0 && newest == INT64_MIN; i--)
+      newest = ring->entries[(ring->entry_first + i) % ring->entry_capacity].pts;
+   target = seconds > 0 && newest != INT64_MIN ? newest - (int64_t)(seconds * 1000000) : INT64_MIN;
+
+   // Latest keyframe at or before the target, otherwise the oldest one held
+   for (i = 0; i < ring->entry_count; i++) {
+      PICAM_RING_ENTRY *entry = &ring->entries[(ring->entry_first + i) % ring->entry_capacity];
+      if ((entry->flags & PICAM_RING_KEYFRAME) && (entry->flags & PICAM_RING_FRAME_START)) {
+         if (!found || (entry->pts != INT64_MIN && entry->pts <= target)) {
+            from = entry->offset;
+            found = 1;
+         } else {
+            break;
+         }
+      }
+   }
+   to = ring->head;
+   config_length = ring->config_length;
+   memcpy(config, ring->config, config_length);
+   if (found) {
+      ring->pinned = 1;
+      ring->pin = from;
+   }
+   pthread_mutex_unlock(&ring->lock);
+
+   if (!found) {
+      pthread_mutex_unlock(&ring->dump_lock);
+      return 0;
+   }
+
+   if (config_length && write_all(fd, config, config_length) != 0)
+      total = -1;
+   else
+      total = config_length;
+   while (total >= 0 && from < to) {
+      long start = from % ring->capacity;
+      long length = ring->capacity - start < (long)(to - from) ? ring->capacity - start : (long)(to - from);
+      if (write_all(fd, ring->data + start, length) != 0) {
+         total = -1;
+         break;
+      }
+      from += length;
+      total += length;
+   }
+
+   pthread_mutex_lock(&ring->lock);
+   ring->pinned = 0;
+   pthread_mutex_unlock(&ring->lock);
+   pthread_mutex_unlock(&ring->dump_lock);
+   return total;
+}
+
+/**
+ * @param bytes Set to the bytes of stream held
+ * @param seconds Set to the time between the oldest and newest buffers held
+ * @param keyframes Set to the number of keyframes a dump could start at
+ * @param dropped Set to the number of buffers not stored
+ */
+void picam_ring_stats(PICAM_RING *ring, long *bytes, double *seconds, int *keyframes, unsigned long *dropped)
+{
+   int64_t oldest = INT64_MIN, newest = INT64_MIN;
+   int i;
+
+   pthread_mutex_lock(&ring->lock);
+   *bytes = (long)(ring->head - ring->tail);
+   *keyframes = 0;
+   for (i = 0; i < ring->entry_count; i++) {
+      PICAM_RING_ENTRY *entry = &ring->entries[(ring->entry_first + i) % ring->entry_capacity];
+      if (entry->pts != INT64_MIN) {
+         if (oldest == INT64_MIN)
+            oldest = entry->pts;
+         newest = entry->pts;
+      }
+      if ((entry->flags & PICAM_RING_KEYFRAME) && (entry->flags & PICAM_RING_FRAME_START))
+         (*keyframes)++;
+   }
+   *seconds = oldest != INT64_MIN ? (newest - oldest) / 1000000.0 : 0;
+   *dropped = ring->dropped;
+   pthread_mutex_unlock(&ring->lock);
+}
@@ -0,0 +1,57 @@
+#ifndef _PICAMRING_H
+#define _PICAMRING_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/// Flags of a ring entry
+enum {
+   PICAM_RING_KEYFRAME = 1,            /// Part of an IDR frame
+   PICAM_RING_CONFIG = 2,              /// SPS/PPS
+   PICAM_RING_FRAME_END = 4,           /// Last buffer of a frame
+   PICAM_RING_FRAME_START = 8          /// First buffer of a frame (set by the ring)
+};
+
+/** One encoder buffer held in the ring */
+typedef struct
+{
+   uint64_t offset;                    /// Position of the first byte, counted from the start of the stream
+   long length;
+   int64_t pts;                        /// Presentation time (us), INT64_MIN if unknown
+   int flags;                          /// PICAM_RING_* values
+} PICAM_RING_ENTRY;
+
+/** Circular byte budget holding the most recent H264 stream, with an index
+ *  of the buffers in it so dumps can start on a keyframe. Everything is
+ *  allocated up front.
+ */
+typedef struct
+{
+   uint8_t *data;                      /// capacity bytes, stream offset o lives at data[o % capacity]
+   long capacity;
+   uint64_t head;                      /// Stream offset of the next byte to be written
+   uint64_t tail;                      /// Stream offset of the oldest byte still held
+   PICAM_RING_ENTRY *entries;          /// Index, oldest first starting at entry_first
+   int entry_capacity;
+   int entry_first;
+   int entry_count;
+   uint8_t *config;                    /// Latest SPS/PPS, written ahead of every dump
+   long config_length;
+   long config_capacity;
+   int last_flags;                     /// Flags of the last entry appended
+   int need_keyframe;                  /// Set after a drop, nothing is stored until the next keyframe
+   int pinned;                         /// Non-zero while a dump reads from pin onwards
+   uint64_t pin;
+   unsigned long dropped;              /// Buffers not stored (too large, or overlapping a dump)
+   pthread_mutex_t lock;
+   pthread_mutex_t dump_lock;          /// Serialises dumps, there is a single pin; taken before lock
+} PICAM_RING;
+
+int picam_ring_init(PICAM_RING *ring, long capacity, int entries);
+void picam_ring_free(PICAM_RING *ring);
+void picam_ring_reset(PICAM_RING *ring);
+void picam_ring_append(PICAM_RING *ring, const uint8_t *data, long length, int flags, int64_t pts);
+long picam_ring_dump(PICAM_RING *ring, int fd, double seconds);
+void picam_ring_stats(PICAM_RING *ring, long *bytes, double *seconds, int *keyframes, unsigned long *dropped);
+
+#endif // _PICAMRING_H
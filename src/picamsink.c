@@ -0,0 +1,81 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "picamsink.h"
+
+/// How often a write waiting on the reader checks whether to give up
+#define PICAM_SINK_POLL_MS 100
+
+/**
+ * Take on a descriptor to write the stream to
+ *
+ * @param sink Sink to set up
+ * @param fd Pipe, socket or file open for writing
+ * @return 0 if successful, errno otherwise
+ */
+int picam_sink_open(PICAM_SINK *sink, int fd)
+{
+   struct stat st;
+
+   memset(sink, 0, sizeof(*sink));
+   sink->fd = fd;
+   if (fstat(fd, &st) != 0 || (sink->saved_flags = fcntl(fd, F_GETFL)) < 0)
+      return errno;
+   sink->socket = S_ISSOCK(st.st_mode);
+   if (fcntl(fd, F_SETFL, sink->saved_flags | O_NONBLOCK) != 0)
+      return errno;
+   return 0;
+}
+
+/**
+ * Write all of a buffer, waiting for the reader as long as it takes unless
+ * stop is set
+ *
+ * @param sink Sink to write to
+ * @param data Bytes to write, not copied
+ * @param length Number of bytes
+ * @param stop Polled while waiting, the write is abandoned once it is non-zero
+ *             and the reader has taken nothing for PICAM_SINK_POLL_MS
+ * @return 0 if written, ECANCELED if abandoned, errno otherwise (EPIPE once the reader has gone)
+ */
+int picam_sink_write(PICAM_SINK *sink, const uint8_t *data, long length, const int *stop)
+{
+   long done = 0;
+
+   while (done < length) {
+      // No SIGPIPE for sockets, pipes rely on it being ignored as Python does
+      ssize_t n = sink->socket ? send(sink->fd, data + done, length - done, MSG_NOSIGNAL)
+                               : write(sink->fd, data + done, length - done);
+
+      if (n > 0) {
+         done += n;
+         sink->written += n;
+      } else if (n < 0 && errno == EINTR) {
+         continue;
+      } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+         struct pollfd ready = {sink->fd, POLLOUT, 0};
+
+         sink->waits++;
+         if (poll(&ready, 1, PICAM_SINK_POLL_MS) == 0 && stop && __atomic_load_n(stop, __ATOMIC_ACQUIRE))
+            return ECANCELED;
+      } else {
+         return n < 0 ? errno : EIO;
+      }
+   }
+   return 0;
+}
+
+/**
+ * Put the descriptor back the way it was handed over, it is left open
+ */
+void picam_sink_close(PICAM_SINK *sink)
+{
+   if (sink->fd >= 0)
+      fcntl(sink->fd, F_SETFL, sink->saved_flags);
+   sink->fd = -1;
+}
@@ -0,0 +1,23 @@
+#ifndef _PICAMSINK_H
+#define _PICAMSINK_H
+
+#include <stdint.h>
+
+/** A pipe or socket the H264 stream is written to in order, straight from
+ *  the encoder's buffers. The descriptor is made non-blocking while in use
+ *  so a stalled reader can be given up on.
+ */
+typedef struct
+{
+   int fd;                             /// Owned by the caller, never closed here
+   int socket;                         /// Non-zero if fd is a socket, written with send()
+   int saved_flags;                    /// File status flags to put back in picam_sink_close
+   uint64_t written;                   /// Bytes taken by the reader
+   unsigned long waits;                /// Times the reader was not keeping up and the sink had to wait
+} PICAM_SINK;
+
+int picam_sink_open(PICAM_SINK *sink, int fd);
+int picam_sink_write(PICAM_SINK *sink, const uint8_t *data, long length, const int *stop);
+void picam_sink_close(PICAM_SINK *sink);
+
+#endif // _PICAMSINK_H
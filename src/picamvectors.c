@@ -0,0 +1,181 @@
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "picamvectors.h"
+
+static void release_field(PICAM_VECTORS *vectors)
+{
+   free(vectors->field);
+   free(vectors->moving);
+   free(vectors->magnitude);
+   free(vectors->sad);
+   free(vectors->blocks);
+   vectors->field = NULL;
+   vectors->moving = NULL;
+   vectors->magnitude = NULL;
+   vectors->sad = NULL;
+   vectors->blocks = NULL;
+}
+
+/**
+ * Set up an analyser, nothing is sized until picam_vectors_configure
+ *
+ * @param vectors Analyser to set up
+ * @param columns Regions across the frame
+ * @param rows Regions down the frame
+ * @param threshold Vectors longer than this count as moving blocks
+ * @return 0 if successful
+ */
+int picam_vectors_init(PICAM_VECTORS *vectors, int columns, int rows, int threshold)
+{
+   memset(vectors, 0, sizeof(*vectors));
+   vectors->columns = columns < 1 ? 1 : columns;
+   vectors->rows = rows < 1 ? 1 : rows;
+   vectors->threshold = threshold < 0 ? 0 : threshold;
+   pthread_mutex_init(&vectors->lock, NULL);
+   pthread_cond_init(&vectors->cond, NULL);
+   return 0;
+}
+
+/**
+ * Size the analyser for a recording, clears the previous results
+ *
+ * @param vectors Analyser
+ * @param width Width of the encoded frames
+ * @param height Height of the encoded frames
+ * @return 0 if successful, non-zero if out of memory
+ */
+int picam_vectors_configure(PICAM_VECTORS *vectors, int width, int height)
+{
+   int regions;
+   int x, y;
+   int status = 0;
+
+   pthread_mutex_lock(&vectors->lock);
+   release_field(vectors);
+   vectors->mb_width = (width + 15) / 16;
+   vectors->mb_columns = vectors->mb_width + 1;
+   vectors->mb_rows = (height + 15) / 16;
+   if (vectors->columns > vectors->mb_width)
+      vectors->columns = vectors->mb_width;
+   if (vectors->rows > vectors->mb_rows)
+      vectors->rows = vectors->mb_rows;
+   regions = vectors->columns * vectors->rows;
+   vectors->field = calloc((size_t)vectors->mb_columns * vectors->mb_rows, sizeof(PICAM_MOTION_VECTOR));
+   vectors->moving = calloc(regions, sizeof(uint32_t));
+   vectors->magnitude = calloc(regions, sizeof(float));
+   vectors->sad = calloc(regions, sizeof(float));
+   vectors->blocks = calloc(regions, sizeof(uint32_t));
+   if (!vectors->field || !vectors->moving || !vectors->magnitude || !vectors->sad || !vectors->blocks) {
+      release_field(vectors);
+      status = 1;
+   } else {
+      for (y = 0; y < vectors->mb_rows; y++)
+         for (x = 0; x < vectors->mb_width; x++)
+            vectors->blocks[(y * vectors->rows / vectors->mb_rows) * vectors->columns + x * vectors->columns / vectors->mb_width]++;
+   }
+   vectors->frames = 0;
+   vectors->pts = 0;
+   pthread_mutex_unlock(&vectors->lock);
+   return status;
+}
+
+/**
+ * Summarise one vector field per region and wake anyone in picam_vectors_wait
+ *
+ * @param vectors Analyser, configured for the size being encoded
+ * @param data Vector field as emitted by the encoder
+ * @param length Bytes in data, only whole macroblock rows are used
+ * @param pts Presentation time of the frame the field belongs to
+ */
+void picam_vectors_analyse(PICAM_VECTORS *vectors, const uint8_t *data, long length, int64_t pts)
+{
+   long threshold;
+   long row_bytes;
+   int regions, rows, x, y, i;
+
+   pthread_mutex_lock(&vectors->lock);
+   if (!vectors->field) {
+      pthread_mutex_unlock(&vectors->lock);
+      return;
+   }
+   threshold = (long)vectors->threshold * vectors->threshold;
+   regions = vectors->columns * vectors->rows;
+   row_bytes = (long)vectors->mb_columns * sizeof(PICAM_MOTION_VECTOR);
+   rows = length / row_bytes;
+   if (rows > vectors->mb_rows)
+      rows = vectors->mb_rows;
+   memcpy(vectors->field, data, rows * row_bytes);
+   memset(vectors->moving, 0, regions * sizeof(uint32_t));
+   memset(vectors->magnitude, 0, regions * sizeof(float));
+   memset(vectors->sad, 0, regions * sizeof(float));
+
+   for (y = 0; y < rows; y++) {
+      const PICAM_MOTION_VECTOR *block = vectors->field + (long)y * vectors->mb_columns;
+      int region_row = (y * vectors->rows / vectors->mb_rows) * vectors->columns;
+      for (x = 0; x < vectors->mb_width; x++, block++) {
+         long length2 = (long)block->x * block->x + (long)block->y * block->y;
+         int region = region_row + x * vectors->columns / vectors->mb_width;
+         vectors->moving[region] += length2 > threshold;
+         vectors->magnitude[region] += sqrtf((float)length2);
+         vectors->sad[region] += block->sad;
+      }
+   }
+   for (i = 0; i < regions; i++) {
+      if (vectors->blocks[i]) {
+         vectors->magnitude[i] /= vectors->blocks[i];
+         vectors->sad[i] /= vectors->blocks[i];
+      }
+   }
+   vectors->frames++;
+   vectors->pts = pts;
+   pthread_cond_broadcast(&vectors->cond);
+   pthread_mutex_unlock(&vectors->lock);
+}
+
+/**
+ * Wait for a field newer than the one the caller has seen
+ *
+ * @param vectors Analyser
+ * @param seen Value of frames the caller last read
+ * @param timeout_ms Longest wait, negative to wait forever
+ * @return Non-zero if a newer field is available
+ */
+int picam_vectors_wait(PICAM_VECTORS *vectors, unsigned long seen, int timeout_ms)
+{
+   struct timeval now;
+   struct timespec until;
+   int newer;
+
+   gettimeofday(&now, NULL);
+   until.tv_sec = now.tv_sec + timeout_ms / 1000;
+   until.tv_nsec = (now.tv_usec + (timeout_ms % 1000) * 1000L) * 1000L;
+   if (until.tv_nsec >= 1000000000L) {
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000L;
+   }
+
+   pthread_mutex_lock(&vectors->lock);
+   while (vectors->frames == seen) {
+      if (timeout_ms < 0)
+         pthread_cond_wait(&vectors->cond, &vectors->lock);
+      else if (pthread_cond_timedwait(&vectors->cond, &vectors->lock, &until) == ETIMEDOUT)
+         break;
+   }
+   newer = vectors->frames != seen;
+   pthread_mutex_unlock(&vectors->lock);
+   return newer;
+}
+
+/**
+ * Release the field and results
+ */
+void picam_vectors_free(PICAM_VECTORS *vectors)
+{
+   release_field(vectors);
+   pthread_cond_destroy(&vectors->cond);
+   pthread_mutex_destroy(&vectors->lock);
+}
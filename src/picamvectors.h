@@ -0,0 +1,48 @@
+#ifndef _PICAMVECTORS_H
+#define _PICAMVECTORS_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/// Longest a vector of int8 components can be, a larger threshold never sees motion
+#define PICAM_VECTORS_MAX_THRESHOLD 181
+
+/** One macroblock of the inline motion vector data the H264 encoder emits
+ *  alongside each frame
+ */
+typedef struct
+{
+   int8_t x;                           /// Horizontal motion
+   int8_t y;                           /// Vertical motion
+   uint16_t sad;                       /// Sum of absolute differences of the block against its match
+} PICAM_MOTION_VECTOR;
+
+/** Summarises each frame's vector field per region of a columns x rows grid.
+ *  Written from the encoder callback, read from any thread.
+ */
+typedef struct
+{
+   int columns;                        /// Regions across
+   int rows;                           /// Regions down
+   int threshold;                      /// Vectors longer than this count as moving blocks, set under lock
+   int mb_columns;                     /// Macroblocks per row in the field, one more than cover the frame
+   int mb_width;                       /// Macroblocks per row that cover the frame
+   int mb_rows;                        /// Macroblock rows in the field
+   PICAM_MOTION_VECTOR *field;         /// Copy of the last vector field
+   uint32_t *moving;                   /// Moving blocks per region in the last frame
+   float *magnitude;                   /// Mean vector length per region in the last frame
+   float *sad;                         /// Mean SAD per region in the last frame
+   uint32_t *blocks;                   /// Macroblocks per region
+   unsigned long frames;               /// Vector fields analysed since configured
+   int64_t pts;                        /// Presentation time of the last field (us)
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+} PICAM_VECTORS;
+
+int picam_vectors_init(PICAM_VECTORS *vectors, int columns, int rows, int threshold);
+int picam_vectors_configure(PICAM_VECTORS *vectors, int width, int height);
+void picam_vectors_analyse(PICAM_VECTORS *vectors, const uint8_t *data, long length, int64_t pts);
+int picam_vectors_wait(PICAM_VECTORS *vectors, unsigned long seen, int timeout_ms);
+void picam_vectors_free(PICAM_VECTORS *vectors);
+
+#endif // _PICAMVECTORS_H
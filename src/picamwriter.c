@@ -0,0 +1,424 @@
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "picamwriter.h"
+
+/// Record kinds in the queue
+enum {
+   PICAM_WRITER_DATA = 1,              /// length bytes of stream follow
+   PICAM_WRITER_SWITCH,                /// Carry on in the file descriptor held in length
+   PICAM_WRITER_OPEN,                  /// Carry on in a new file, length bytes of path follow
+   PICAM_WRITER_PATCH                  /// An 8 byte file offset then length - 8 bytes to put there
+};
+
+typedef struct
+{
+   uint32_t kind;
+   uint32_t length;
+} PICAM_WRITER_RECORD;
+
+/// Room kept free by appends so a patch and a switch always fit
+#define PICAM_WRITER_RESERVE (4 * sizeof(PICAM_WRITER_RECORD))
+/// Size and alignment of the writes to the file
+#define PICAM_WRITER_CHUNK (256 * 1024)
+/// A partly filled chunk is written out after this long without new data
+#define PICAM_WRITER_IDLE_MS 1000
+
+static void *writer_thread(void *arg);
+
+/**
+ * Allocate the queue and staging chunk and start the writer thread
+ *
+ * @param writer Writer to set up
+ * @param capacity Bytes the queue holds, rounded up to a power of two
+ * @param fd File to write to, owned by the writer from now on, -1 to discard until a switch
+ * @param preallocate Bytes to reserve in each file as it is taken on, 0 for none
+ * @param frame_us Frame interval (us), used to count late frames
+ * @return 0 if successful, non-zero otherwise (fd is left open)
+ */
+int picam_writer_init(PICAM_WRITER *writer, long capacity, int fd, long preallocate, long frame_us)
+{
+   unsigned long size = 65536;
+
+   memset(writer, 0, sizeof(*writer));
+   while (size < (unsigned long)capacity)
+      size <<= 1;
+   writer->queue = malloc(size);
+   if (!writer->queue || posix_memalign((void **)&writer->chunk, 4096, PICAM_WRITER_CHUNK) != 0) {
+      free(writer->queue);
+      writer->queue = NULL;
+      return 1;
+   }
+   writer->capacity = size;
+   writer->chunk_size = PICAM_WRITER_CHUNK;
+   writer->fd = fd;
+   writer->preallocate = preallocate;
+   writer->frame_us = frame_us;
+   sem_init(&writer->ready, 0, 0);
+   if (pthread_create(&writer->thread, NULL, writer_thread, writer) != 0) {
+      sem_destroy(&writer->ready);
+      free(writer->queue);
+      free(writer->chunk);
+      memset(writer, 0, sizeof(*writer));
+      return 1;
+   }
+   writer->started = 1;
+   if (fd >= 0 && preallocate > 0)
+      fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, preallocate);
+   return 0;
+}
+
+/**
+ * Copy into the queue at position pos, wrapping at the end
+ */
+static void queue_put(PICAM_WRITER *writer, unsigned long pos, const void *data, unsigned long length)
+{
+   unsigned long at = pos & (writer->capacity - 1);
+   unsigned long first = writer->capacity - at < length ? writer->capacity - at : length;
+
+   memcpy(writer->queue + at, data, first);
+   memcpy(writer->queue, (const uint8_t *)data + first, length - first);
+}
+
+/**
+ * Copy out of the queue from position pos, wrapping at the end
+ */
+static void queue_get(PICAM_WRITER *writer, unsigned long pos, void *data, unsigned long length)
+{
+   unsigned long at = pos & (writer->capacity - 1);
+   unsigned long first = writer->capacity - at < length ? writer->capacity - at : length;
+
+   memcpy(data, writer->queue + at, first);
+   memcpy((uint8_t *)data + first, writer->queue, length - first);
+}
+
+/**
+ * Queue a record, producer side only
+ *
+ * @return 0 if queued, 1 if there was no room
+ */
+static int queue_record(PICAM_WRITER *writer, int kind, const uint8_t *data, unsigned long length, unsigned long reserve)
+{
+   PICAM_WRITER_RECORD record;
+   unsigned long head = writer->head;
+   unsigned long tail = __atomic_load_n(&writer->tail, __ATOMIC_ACQUIRE);
+   unsigned long needed = sizeof(record) + (data ? length : 0);
+   long queued;
+
+   if (writer->capacity - (head - tail) < needed + reserve)
+      return 1;
+   record.kind = kind;
+   record.length = length;
+   queue_put(writer, head, &record, sizeof(record));
+   if (data)
+      queue_put(writer, head + sizeof(record), data, length);
+   __atomic_store_n(&writer->head, head + needed, __ATOMIC_RELEASE);
+   sem_post(&writer->ready);
+
+   queued = head + needed - tail;
+   if (queued > __atomic_load_n(&writer->stats.peak_queued, __ATOMIC_RELAXED))
+      __atomic_store_n(&writer->stats.peak_queued, queued, __ATOMIC_RELAXED);
+   return 0;
+}
+
+/**
+ * Queue part of the stream for writing, never blocks. Called from one thread only.
+ *
+ * After a buffer is dropped nothing more is queued until the next boundary,
+ * so the file skips whole frames rather than holding half of one.
+ *
+ * @param writer Writer to hand the data to
+ * @param data Bytes to write, copied before returning
+ * @param length Number of bytes
+ * @param boundary Non-zero if a decoder can start at data (SPS/PPS or an IDR frame)
+ * @return 0 if queued, 1 if dropped
+ */
+int picam_writer_append(PICAM_WRITER *writer, const uint8_t *data, long length, int boundary)
+{
+   if (writer->need_boundary && !boundary) {
+      __atomic_add_fetch(&writer->stats.dropped, 1, __ATOMIC_RELAXED);
+      return 1;
+   }
+   if (queue_record(writer, PICAM_WRITER_DATA, data, length, PICAM_WRITER_RESERVE) != 0) {
+      writer->need_boundary = 1;
+      __atomic_add_fetch(&writer->stats.dropped, 1, __ATOMIC_RELAXED);
+      return 1;
+   }
+   writer->need_boundary = 0;
+   return 0;
+}
+
+/**
+ * Carry on in another file once everything queued so far is written, the
+ * previous file is closed by the writer thread. Called from the producer.
+ *
+ * @param writer Writer to switch
+ * @param fd File to take over, owned by the writer if this succeeds
+ * @return 0 if queued, 1 if there was no room
+ */
+int picam_writer_switch(PICAM_WRITER *writer, int fd)
+{
+   return queue_record(writer, PICAM_WRITER_SWITCH, NULL, (unsigned long)fd, 0);
+}
+
+/**
+ * Like picam_writer_switch, but the writer thread creates the file so the
+ * producer never waits on the file system. Called from the producer.
+ *
+ * @param writer Writer to switch
+ * @param path File to create or truncate, copied before returning
+ * @return 0 if queued, 1 if there was no room
+ */
+int picam_writer_open(PICAM_WRITER *writer, const char *path)
+{
+   long length = strlen(path);
+
+   if (length >= PATH_MAX)
+      return 1;
+   return queue_record(writer, PICAM_WRITER_OPEN, (const uint8_t *)path, length, 0);
+}
+
+/**
+ * Overwrite part of the current file that was queued earlier, such as a
+ * size in a header once it is known. Called from the producer.
+ *
+ * @param writer Writer holding the file
+ * @param offset Position in the current file
+ * @param data Bytes to put there, copied before returning
+ * @param length Number of bytes, at most 8 are guaranteed to fit
+ * @return 0 if queued, 1 if there was no room
+ */
+int picam_writer_patch(PICAM_WRITER *writer, uint64_t offset, const uint8_t *data, long length)
+{
+   uint8_t record[8 + 256];
+
+   if (length > 256)
+      return 1;
+   memcpy(record, &offset, 8);
+   memcpy(record + 8, data, length);
+   return queue_record(writer, PICAM_WRITER_PATCH, record, 8 + length, 0);
+}
+
+/**
+ * Check whether appends would be queued now, for producers that would
+ * rather not start something they cannot finish
+ *
+ * @param writer Writer to check
+ * @param length Bytes of stream
+ * @param pieces Number of appends the bytes are split across
+ * @return Non-zero if they all fit
+ */
+int picam_writer_room(PICAM_WRITER *writer, long length, int pieces)
+{
+   unsigned long used = writer->head - __atomic_load_n(&writer->tail, __ATOMIC_ACQUIRE);
+
+   return writer->capacity - used >= length + pieces * sizeof(PICAM_WRITER_RECORD) + PICAM_WRITER_RESERVE;
+}
+
+/**
+ * @return errno of the first failed write, 0 if all went well so far
+ */
+int picam_writer_error(PICAM_WRITER *writer)
+{
+   return __atomic_load_n(&writer->error, __ATOMIC_RELAXED);
+}
+
+void picam_writer_stats(PICAM_WRITER *writer, PICAM_WRITER_STATS *stats)
+{
+   stats->queued = __atomic_load_n(&writer->head, __ATOMIC_RELAXED) - __atomic_load_n(&writer->tail, __ATOMIC_RELAXED);
+   stats->peak_queued = __atomic_load_n(&writer->stats.peak_queued, __ATOMIC_RELAXED);
+   stats->worst_write_us = __atomic_load_n(&writer->stats.worst_write_us, __ATOMIC_RELAXED);
+   stats->late_frames = __atomic_load_n(&writer->stats.late_frames, __ATOMIC_RELAXED);
+   stats->dropped = __atomic_load_n(&writer->stats.dropped, __ATOMIC_RELAXED);
+   stats->written = __atomic_load_n(&writer->stats.written, __ATOMIC_RELAXED);
+}
+
+/**
+ * Wait for the writer thread to write out everything queued, close the
+ * file and free the writer. The producer must have stopped.
+ *
+ * @param writer Writer to finish
+ * @param stats Receives the final counters if not NULL
+ * @return errno of the first failed write, 0 if all was written
+ */
+int picam_writer_finish(PICAM_WRITER *writer, PICAM_WRITER_STATS *stats)
+{
+   int error;
+
+   if (!writer->started)
+      return 0;
+   __atomic_store_n(&writer->closing, 1, __ATOMIC_RELEASE);
+   sem_post(&writer->ready);
+   pthread_join(writer->thread, NULL);
+   if (stats)
+      picam_writer_stats(writer, stats);
+   error = writer->error;
+   sem_destroy(&writer->ready);
+   free(writer->queue);
+   free(writer->chunk);
+   memset(writer, 0, sizeof(*writer));
+   return error;
+}
+
+/**
+ * Write length bytes of the chunk at offset, timing the write
+ */
+static void writer_pwrite(PICAM_WRITER *writer, long length, uint64_t offset)
+{
+   struct timespec before, after;
+   long done = 0, us;
+
+   if (writer->fd < 0 || writer->error || length == 0)
+      return;
+   clock_gettime(CLOCK_MONOTONIC, &before);
+   while (done < length) {
+      ssize_t n = pwrite(writer->fd, writer->chunk + done, length - done, offset + done);
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n <= 0) {
+         __atomic_store_n(&writer->error, n < 0 ? errno : EIO, __ATOMIC_RELAXED);
+         return;
+      }
+      done += n;
+   }
+   clock_gettime(CLOCK_MONOTONIC, &after);
+
+   us = (after.tv_sec - before.tv_sec) * 1000000L + (after.tv_nsec - before.tv_nsec) / 1000;
+   if (us > writer->stats.worst_write_us)
+      __atomic_store_n(&writer->stats.worst_write_us, us, __ATOMIC_RELAXED);
+   if (writer->frame_us > 0 && us > writer->frame_us)
+      __atomic_add_fetch(&writer->stats.late_frames, us / writer->frame_us, __ATOMIC_RELAXED);
+}
+
+/**
+ * Write out the partly filled chunk and close the current file
+ */
+static void writer_close_file(PICAM_WRITER *writer)
+{
+   writer_pwrite(writer, writer->chunk_fill, writer->file_offset);
+   __atomic_add_fetch(&writer->stats.written, writer->chunk_fill, __ATOMIC_RELAXED);
+   if (writer->fd >= 0)
+      close(writer->fd);
+   writer->fd = -1;
+   writer->chunk_fill = 0;
+   writer->file_offset = 0;
+}
+
+/**
+ * Move length bytes of stream from the queue through the staging chunk,
+ * writing every chunk that fills up
+ */
+static void writer_take(PICAM_WRITER *writer, unsigned long pos, unsigned long length)
+{
+   while (length) {
+      unsigned long part = writer->chunk_size - writer->chunk_fill;
+
+      if (part > length)
+         part = length;
+      queue_get(writer, pos, writer->chunk + writer->chunk_fill, part);
+      writer->chunk_fill += part;
+      pos += part;
+      length -= part;
+      if (writer->chunk_fill == writer->chunk_size) {
+         writer_pwrite(writer, writer->chunk_size, writer->file_offset);
+         __atomic_add_fetch(&writer->stats.written, writer->chunk_size, __ATOMIC_RELAXED);
+         writer->file_offset += writer->chunk_size;
+         writer->chunk_fill = 0;
+      }
+   }
+}
+
+/**
+ * Put length bytes from the queue at offset in the current file, into the
+ * staging chunk for the part not yet written out
+ */
+static void writer_patch(PICAM_WRITER *writer, unsigned long pos, unsigned long length, uint64_t offset)
+{
+   uint8_t data[256];
+   uint64_t end = offset + length;
+
+   queue_get(writer, pos, data, length);
+   if (end > writer->file_offset + writer->chunk_fill)
+      return;
+   if (offset < writer->file_offset) {
+      unsigned long before = (end < writer->file_offset ? end : writer->file_offset) - offset;
+
+      if (writer->fd >= 0 && !writer->error && pwrite(writer->fd, data, before, offset) != (ssize_t)before)
+         __atomic_store_n(&writer->error, errno ? errno : EIO, __ATOMIC_RELAXED);
+      offset += before;
+   }
+   if (offset < end)
+      memcpy(writer->chunk + (offset - writer->file_offset), data + (length - (end - offset)), end - offset);
+}
+
+static void *writer_thread(void *arg)
+{
+   PICAM_WRITER *writer = arg;
+   PICAM_WRITER_RECORD record;
+
+   for (;;) {
+      unsigned long tail = writer->tail;
+
+      if (tail == __atomic_load_n(&writer->head, __ATOMIC_ACQUIRE)) {
+         if (__atomic_load_n(&writer->closing, __ATOMIC_ACQUIRE))
+            break;
+         if (writer->chunk_fill) {
+            struct timespec until;
+
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += PICAM_WRITER_IDLE_MS / 1000;
+            if (sem_timedwait(&writer->ready, &until) != 0 && errno == ETIMEDOUT) {
+               // Nothing new for a while, put what is staged on disk without
+               // moving on, the next full chunk overwrites it at the same offset
+               writer_pwrite(writer, writer->chunk_fill, writer->file_offset);
+               sem_wait(&writer->ready);
+            }
+         } else {
+            sem_wait(&writer->ready);
+         }
+         continue;
+      }
+
+      queue_get(writer, tail, &record, sizeof(record));
+      if (record.kind == PICAM_WRITER_DATA) {
+         writer_take(writer, tail + sizeof(record), record.length);
+         tail += sizeof(record) + record.length;
+      } else if (record.kind == PICAM_WRITER_OPEN) {
+         char path[PATH_MAX];
+
+         writer_close_file(writer);
+         queue_get(writer, tail + sizeof(record), path, record.length);
+         path[record.length] = 0;
+         writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+         if (writer->fd < 0)
+            __atomic_store_n(&writer->error, errno, __ATOMIC_RELAXED);
+         else if (writer->preallocate > 0)
+            fallocate(writer->fd, FALLOC_FL_KEEP_SIZE, 0, writer->preallocate);
+         tail += sizeof(record) + record.length;
+      } else if (record.kind == PICAM_WRITER_PATCH) {
+         uint64_t offset;
+
+         queue_get(writer, tail + sizeof(record), &offset, 8);
+         writer_patch(writer, tail + sizeof(record) + 8, record.length - 8, offset);
+         tail += sizeof(record) + record.length;
+      } else {
+         writer_close_file(writer);
+         writer->fd = (int)record.length;
+         if (writer->fd >= 0 && writer->preallocate > 0)
+            fallocate(writer->fd, FALLOC_FL_KEEP_SIZE, 0, writer->preallocate);
+         tail += sizeof(record);
+      }
+      __atomic_store_n(&writer->tail, tail, __ATOMIC_RELEASE);
+   }
+   writer_close_file(writer);
+   return NULL;
+}
@@ -0,0 +1,56 @@
+#ifndef _PICAMWRITER_H
+#define _PICAMWRITER_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+/// Counters kept by a writer, see picam_writer_stats
+typedef struct
+{
+   long queued;                        /// Bytes waiting for the writer thread now
+   long peak_queued;                   /// Most bytes ever waiting at once
+   long worst_write_us;                /// Longest single write to the file
+   unsigned long late_frames;          /// Frame intervals spent in writes that took longer than one,
+                                       /// frames a writer on the callback thread would have lost
+   unsigned long dropped;              /// Buffers thrown away because the queue was full
+   uint64_t written;                   /// Bytes handed to the file(s)
+} PICAM_WRITER_STATS;
+
+/** Hands a stream from a single producer (the encoder callback) to a thread
+ *  doing the file I/O, through a lock-free circular queue. The thread writes
+ *  whole chunks at chunk aligned offsets.
+ */
+typedef struct
+{
+   uint8_t *queue;                     /// Records of a header then the payload, capacity bytes
+   unsigned long capacity;             /// Power of two
+   unsigned long head;                 /// Next byte the producer writes, only the producer stores it
+   unsigned long tail;                 /// Next byte the thread reads, only the thread stores it
+   uint8_t *chunk;                     /// Staging for the next aligned write
+   long chunk_size;
+   long chunk_fill;
+   uint64_t file_offset;               /// Where chunk goes in the current file
+   int fd;                             /// Current file, -1 to discard the stream
+   long preallocate;                   /// Bytes reserved ahead in each new file, 0 for none
+   long frame_us;                      /// Frame interval, writes slower than this are late
+   int need_boundary;                  /// Set after a drop, nothing is queued until the next boundary
+   int closing;                        /// Set by picam_writer_finish, the thread exits once drained
+   int error;                          /// errno of the first failed write, 0 if none
+   PICAM_WRITER_STATS stats;           /// Counters, updated and read with atomics
+   sem_t ready;                        /// Posted for every record queued
+   pthread_t thread;
+   int started;
+} PICAM_WRITER;
+
+int picam_writer_init(PICAM_WRITER *writer, long capacity, int fd, long preallocate, long frame_us);
+int picam_writer_append(PICAM_WRITER *writer, const uint8_t *data, long length, int boundary);
+int picam_writer_switch(PICAM_WRITER *writer, int fd);
+int picam_writer_open(PICAM_WRITER *writer, const char *path);
+int picam_writer_patch(PICAM_WRITER *writer, uint64_t offset, const uint8_t *data, long length);
+int picam_writer_room(PICAM_WRITER *writer, long length, int pieces);
+int picam_writer_error(PICAM_WRITER *writer);
+void picam_writer_stats(PICAM_WRITER *writer, PICAM_WRITER_STATS *stats);
+int picam_writer_finish(PICAM_WRITER *writer, PICAM_WRITER_STATS *stats);
+
+#endif // _PICAMWRITER_H